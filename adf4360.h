@@ -0,0 +1,20 @@
+#pragma once
+
+/**
+ * Latches of the ADF4360-2 that clocks the ADC. The two control bits at the bottom of each write
+ * select the latch.
+ */
+#define ADF4360_LATCH_CONTROL               0x0
+#define ADF4360_LATCH_R_COUNTER             0x1
+#define ADF4360_LATCH_N_COUNTER             0x2
+#define ADF4360_LATCH_MASK                  0x3
+
+/**
+ * N counter latch: the VCO runs at (P * B + A) times the phase detector frequency, where P is the
+ * prescaler set in the control latch
+ */
+#define ADF4360_N_A_SHIFT                   2
+#define ADF4360_N_A_MASK                    0x1f
+#define ADF4360_N_B_SHIFT                   8
+#define ADF4360_N_B_MASK                    0x1fff
+
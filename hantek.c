@@ -1,18 +1,23 @@
 #include <hantek.h>
 #include <hantek_priv.h>
+#include <hantek_alloc.h>
 #include <hantek_usb.h>
 
 #include <hantek_hexdump.h>
-
-#include <libusb.h>
+#include <hantek_readback.h>
+#include <hantek_batch.h>
+#include <hantek_acquire.h>
+#include <hantek_transport.h>
 
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
+#include <time.h>
 
 #include <hmcad1511.h>
+#include <adf4360.h>
 
 /**
  * Table mapping volts/division to ADC coarse gain values for the HMCAD1511
@@ -60,113 +65,109 @@ uint8_t __hantek_device_nr_active_chans(struct hantek_device *dev)
 }
 
 static
-HRESULT _hantek_device_find(libusb_device **pdev)
+HRESULT _hantek_check_usb_1(struct hantek_transport *tp, bool *pready)
 {
-    HRESULT ret = H_OK;
-
-    libusb_device **devs = NULL;
-    libusb_device *dev = NULL;
-    ssize_t nr_devs = 0;
+	HRESULT ret = H_OK;
 
-    HASSERT_ARG(NULL != pdev);
+    size_t transferred = 0;
+    uint8_t raw[10] = { 0 };
 
-    *pdev = NULL;
+    HASSERT_ARG(NULL != tp);
+    HASSERT_ARG(NULL != pready);
 
-    libusb_init(NULL);
+    *pready = false;
 
-    if (0 >= (nr_devs = libusb_get_device_list(NULL, &devs))) {
-        DEBUG("Failed to get libusb device list, aborting (reason: %zd).", nr_devs);
-        ret = H_ERR_NOT_FOUND;
+    if (H_FAILED(ret = hantek_tp_control_in(tp, HT_REQUEST_CHECK_READY, 0x0, 0x0, raw, sizeof(raw), &transferred))) {
+        DEBUG("Failed to request if we are ready for commands, aborting.");
         goto done;
     }
 
-    DEBUG("There are %zd devices connected to the system, walking the list.", nr_devs);
+    if (transferred >= 1) {
+        if (raw[0] == 0x1) {
+            *pready = true;
+        }
+    }
 
-    for (size_t i = 0; i < (size_t)nr_devs; i++) {
-        libusb_device *ndev = devs[i];
-        struct libusb_device_descriptor desc;
+done:
+    return ret;
+}
 
-        if (0 != libusb_get_device_descriptor(ndev, &desc)) {
-            DEBUG("Failed to get device descriptor at device ID %zu, skipping", i);
-            continue;
-        }
+/**
+ * Perform the command handshake: the magical "start of transaction" control transfer, followed
+ * by the USB speed check. Inside a command session the result is cached.
+ */
+HRESULT _hantek_cmd_handshake(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
 
-        if (desc.idVendor != HANTEK_VID) {
-            continue;
-        }
+    uint8_t cmd_start[10] = { 0x0f, 0x03, 0x03, 0x03 };
+    bool ready = false;
 
-        if (desc.idProduct != HANTEK_PID_6254BD) {
-            DEBUG("Got a Hantek device, PID = %04x", desc.idProduct);
-            continue;
-        }
+    HASSERT_ARG(NULL != dev);
 
-        DEBUG("Found a candidate device, %p, breaking the loop", ndev);
-        dev = ndev;
-        break;
+    dev->session_ready = false;
+
+    /* Send the magical "start of transaction" command */
+    if (H_FAILED(ret = hantek_tp_control_out(dev->tp, HT_REQUEST_INITIALIZE, 0x0, 0x0, cmd_start, sizeof(cmd_start)))) {
+        DEBUG("Failed to request if data is ready, aborting.");
+        goto done;
     }
 
-    if (NULL == dev) {
-        DEBUG("No supported devices found, aborting.");
-        ret = H_ERR_NOT_FOUND;
+    /* Check if the device is in USB 1 mode */
+    if (H_FAILED(ret = _hantek_check_usb_1(dev->tp, &ready))) {
+        DEBUG("Was unable to check if in USB 1 mode, aborting.");
         goto done;
     }
 
-    libusb_ref_device(dev);
-    *pdev = dev;
+    dev->usb2 = ready;
 
-done:
-    if (NULL != devs) {
-        libusb_free_device_list(devs, 1);
+    if (false == ready) {
+        DEBUG("Device is not in USB 2.0 mode");
+        ret = H_ERR_CONTROL_FAIL;
+        goto done;
+    }
+
+    if (0 != dev->session_depth) {
+        dev->session_ready = true;
     }
+
+done:
     return ret;
 }
 
+/**
+ * Check whether the device is running at USB 2.0 speeds, using the cached result from the
+ * handshake if we are inside a command session.
+ */
 static
-HRESULT _hantek_check_usb_1(libusb_device_handle *dev, bool *pready)
+HRESULT _hantek_get_usb2(struct hantek_device *dev, bool *pusb2)
 {
-	HRESULT ret = H_OK;
-
-    int uret = 0;
-    uint8_t raw[10] = { 0 };
+    HRESULT ret = H_OK;
 
     HASSERT_ARG(NULL != dev);
-    HASSERT_ARG(NULL != pready);
-
-    *pready = false;
+    HASSERT_ARG(NULL != pusb2);
 
-    if (0 >= (uret = libusb_control_transfer(dev,
-                    LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-                    HT_REQUEST_CHECK_READY,
-                    0x0,
-                    0x0,
-                    raw,
-                    sizeof(raw),
-                    0)))
-    {
-        DEBUG("Failed to request if we are ready for commands, aborting. (reason = %d)", uret);
-        ret = H_ERR_CONTROL_FAIL;
+    if (0 != dev->session_depth && true == dev->session_ready) {
+        *pusb2 = dev->usb2;
         goto done;
     }
 
-    if (uret >= 1) {
-        if (raw[0] == 0x1) {
-            *pready = true;
-        }
+    if (H_FAILED(ret = _hantek_check_usb_1(dev->tp, pusb2))) {
+        goto done;
     }
 
+    dev->usb2 = *pusb2;
+
 done:
     return ret;
 }
 
 static
-HRESULT _hantek_bulk_cmd_out(libusb_device_handle *dev, uint8_t *data, size_t len, size_t *ptransferred)
+HRESULT _hantek_bulk_cmd_out(struct hantek_device *dev, uint8_t *data, size_t len, size_t *ptransferred)
 {
     HRESULT ret = H_OK;
 
-    uint8_t cmd_start[10] = { 0x0f, 0x03, 0x03, 0x03 };
-    int uret = -1,
-        transferred = 0;
-    bool ready = false;
+    bool cached = false;
 
     HASSERT_ARG(NULL != dev);
     HASSERT_ARG(NULL != data);
@@ -175,84 +176,131 @@ HRESULT _hantek_bulk_cmd_out(libusb_device_handle *dev, uint8_t *data, size_t le
 
     *ptransferred = 0;
 
-    /* Send the magical "start of transaction" command */
-    if (0 >= (uret = libusb_control_transfer(dev,
-                    LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-                    HT_REQUEST_INITIALIZE,
-                    0x0,
-                    0x0,
-                    cmd_start,
-                    sizeof(cmd_start),
-                    0)))
-    {
-        DEBUG("Failed to request if data is ready, aborting. (reason = %d)", uret);
-        ret = H_ERR_CONTROL_FAIL;
+    /* Anything still queued in a batch has to go out ahead of this command */
+    if (0 != dev->batch.nr_cmds && H_FAILED(ret = hantek_batch_flush(dev))) {
+        DEBUG("Failed to flush pending command batch, aborting.");
         goto done;
     }
 
-    /* Check if the device is in USB 1 mode */
-    if (H_FAILED(ret = _hantek_check_usb_1(dev, &ready))) {
-        DEBUG("Was unable to check if in USB 1 mode, aborting.");
+    cached = (0 != dev->session_depth && true == dev->session_ready);
+
+    if (false == cached && H_FAILED(ret = _hantek_cmd_handshake(dev))) {
         goto done;
     }
 
-    if (false == ready) {
-        DEBUG("Device is not in USB 2.0 mode");
-        ret = H_ERR_CONTROL_FAIL;
+    /* Send the actual bulk command */
+    while (H_FAILED(ret = hantek_tp_bulk_out(dev->tp, HT6000_EP_OUT, data, len, ptransferred, 0))) {
+        DEBUG("Failure during bulk OUT transfer");
+
+        if (false == cached) {
+            goto done;
+        }
+
+        /* The cached handshake may be stale, redo it and retry exactly once */
+        DEBUG("Retrying bulk OUT transfer with a fresh handshake");
+        cached = false;
+
+        if (H_FAILED(ret = _hantek_cmd_handshake(dev))) {
+            goto done;
+        }
+    }
+
+done:
+    return ret;
+}
+
+HRESULT hantek_cmd_session_begin(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+
+    if (0 == dev->session_depth++) {
+        /* Handshake lazily, on the first command of the session */
+        dev->session_ready = false;
+    }
+
+    return ret;
+}
+
+HRESULT hantek_cmd_session_end(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(0 != dev->session_depth);
+
+    if (0 == --dev->session_depth) {
+        dev->session_ready = false;
+    }
+
+    return ret;
+}
+
+/**
+ * Send a command that has no response. If a batch is open the command is queued, otherwise it
+ * is sent right away. settle_us is how long the hardware needs before the next command.
+ */
+static
+HRESULT _hantek_send_cmd(struct hantek_device *dev, uint8_t *msg, size_t len, unsigned settle_us)
+{
+    HRESULT ret = H_OK;
+
+    size_t transferred = 0;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != msg);
+    HASSERT_ARG(0 != len);
+
+    /* The saved state stops matching the device as soon as its configuration changes */
+    if (HT_MSG_SEND_START_CAPTURE != msg[0]) {
+        hantek_state_discard(dev);
+    }
+
+    if (0 != dev->batch.depth) {
+        ret = hantek_batch_queue(dev, msg, len, settle_us);
         goto done;
     }
 
-    /* Send the actual bulk command */
-    if (0 != (uret = libusb_bulk_transfer(dev,
-                                          HT6000_EP_OUT,
-                                          data,
-                                          len,
-                                          &transferred,
-                                          0)))
-    {
-        DEBUG("Failure during bulk OUT transfer: %d", uret);
+    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev, msg, len, &transferred))) {
+        goto done;
+    }
+
+    if (len != transferred) {
+        DEBUG("Transferred %zu bytes, expected %zu", transferred, len);
         ret = H_ERR_NOT_READY;
         goto done;
     }
 
-    *ptransferred = transferred;
+    if (0 != settle_us) {
+        usleep(settle_us);
+    }
 
 done:
     return ret;
 }
 
 static
-HRESULT _hantek_bulk_in(libusb_device_handle *hdl, uint8_t *data, size_t buf_len, size_t *ptransferred)
+HRESULT _hantek_bulk_in(struct hantek_device *dev, uint8_t *data, size_t buf_len, size_t *ptransferred)
 {
     HRESULT ret = H_OK;
 
-    int transferred = 0,
-        uret = 0;
-
-    HASSERT_ARG(NULL != hdl);
+    HASSERT_ARG(NULL != dev);
     HASSERT_ARG(NULL != data);
     HASSERT_ARG(0 != buf_len);
     HASSERT_ARG(NULL != ptransferred);
 
-    if (0 != (uret = libusb_bulk_transfer(hdl,
-                                          HT6000_EP_IN | (1 << 7),
-                                          data,
-                                          buf_len,
-                                          &transferred,
-                                          0)))
-    {
-        DEBUG("Failure during bulk IN transfer: %d", uret);
-        ret = H_ERR_NOT_READY;
+    if (H_FAILED(ret = hantek_tp_bulk_in(dev->tp, HT6000_EP_IN | (1 << 7), data, buf_len, ptransferred, 0))) {
+        DEBUG("Failure during bulk IN transfer");
         goto done;
     }
 
-    *ptransferred = transferred;
 done:
     return ret;
 }
 
 static
-HRESULT _hantek_bulk_read_in(libusb_device_handle *hdl, uint8_t *dst_buf, size_t dst_len)
+HRESULT _hantek_bulk_read_in(struct hantek_device *dev, uint8_t *dst_buf, size_t dst_len)
 {
     HRESULT ret = H_OK;
 
@@ -261,11 +309,11 @@ HRESULT _hantek_bulk_read_in(libusb_device_handle *hdl, uint8_t *dst_buf, size_t
     bool usb2 = false;
     uint8_t rx_buf[512];
 
-    HASSERT_ARG(NULL != hdl);
+    HASSERT_ARG(NULL != dev);
     HASSERT_ARG(NULL != dst_buf);
     HASSERT_ARG(0 != dst_len);
 
-    if (H_FAILED(ret = _hantek_check_usb_1(hdl, &usb2))) {
+    if (H_FAILED(ret = _hantek_get_usb2(dev, &usb2))) {
         DEBUG("Failed to check if device is in USB 1.0 mode");
         goto done;
     }
@@ -275,7 +323,8 @@ HRESULT _hantek_bulk_read_in(libusb_device_handle *hdl, uint8_t *dst_buf, size_t
         to_transfer = 512;
     }
 
-    if (H_FAILED(ret = _hantek_bulk_in(hdl, rx_buf, to_transfer, &transferred))) {
+    /* The device always sends a whole packet, so only bounce if the caller's buffer is smaller */
+    if (H_FAILED(ret = _hantek_bulk_in(dev, dst_len >= to_transfer ? dst_buf : rx_buf, to_transfer, &transferred))) {
         DEBUG("Failure to do bulk read, aborting.");
         goto done;
     }
@@ -285,52 +334,93 @@ HRESULT _hantek_bulk_read_in(libusb_device_handle *hdl, uint8_t *dst_buf, size_t
         goto done;
     }
 
-    memcpy(dst_buf, rx_buf, dst_len);
+    if (dst_len < to_transfer) {
+        memcpy(dst_buf, rx_buf, dst_len);
+    }
 
 done:
     return ret;
 }
 
+/**
+ * Read a device attribute from the EEPROM behind the FX2 in a single control transfer
+ */
 static
-HRESULT _hantek_read_config_attrs(libusb_device_handle *hdl, uint16_t value, void *dst, size_t len_bytes)
+HRESULT _hantek_read_config_attrs(struct hantek_transport *tp, uint16_t value, void *dst, size_t len_bytes)
 {
     HRESULT ret = H_OK;
 
-    int uret = 0;
+    size_t transferred = 0;
 
-    HASSERT_ARG(NULL != hdl);
+    HASSERT_ARG(NULL != tp);
     HASSERT_ARG(NULL != dst);
-    HASSERT_ARG(0 != len_bytes);
-
-    if (0 >= (uret = libusb_control_transfer(hdl,
-                    LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-                    HT_REQUEST_GET_INFO,
-                    value,
-                    0x0,
-                    dst,
-                    len_bytes,
-                    0)))
-    {
-        DEBUG("Failed to request device attribute %04x, (uret = %d), aborting.", value, uret);
-        ret = H_ERR_CONTROL_FAIL;
+    HASSERT_ARG(0 != len_bytes && UINT16_MAX >= len_bytes);
+
+    if (H_FAILED(ret = hantek_tp_control_in(tp, HT_REQUEST_GET_INFO, value, 0x0, dst, len_bytes, &transferred))) {
+        DEBUG("Failed to request device attribute %04x, aborting.", value);
         goto done;
     }
 
-    DEBUG("! Read back %04x: %d bytes (expected = %zu)", value, uret, len_bytes);
+    DEBUG("! Read back %04x: %zu bytes (expected = %zu)", value, transferred, len_bytes);
+
+done:
+    return ret;
+}
+
+/**
+ * Read a device attribute in chunks of HT_CONFIG_ATTR_CHUNK_LEN bytes.
+ *
+ * NOTE: this assumes the FX2 firmware takes wIndex as the byte offset into the attribute. That
+ * is unverified against real firmware, so callers have to check what comes back and fall back
+ * to _hantek_read_config_attrs.
+ */
+static
+HRESULT _hantek_read_config_attrs_chunked(struct hantek_transport *tp, uint16_t value, void *dst, size_t len_bytes)
+{
+    HRESULT ret = H_OK;
+
+    uint8_t *dst_buf = dst;
+    size_t offset = 0;
+
+    HASSERT_ARG(NULL != tp);
+    HASSERT_ARG(NULL != dst);
+    HASSERT_ARG(0 != len_bytes && UINT16_MAX >= len_bytes);
+
+    while (offset < len_bytes) {
+        size_t chunk = len_bytes - offset,
+               transferred = 0;
+
+        if (HT_CONFIG_ATTR_CHUNK_LEN < chunk) {
+            chunk = HT_CONFIG_ATTR_CHUNK_LEN;
+        }
+
+        if (H_FAILED(ret = hantek_tp_control_in(tp, HT_REQUEST_GET_INFO, value, offset, dst_buf + offset, chunk, &transferred))) {
+            DEBUG("Failed to request device attribute %04x at offset %zu, aborting.", value, offset);
+            goto done;
+        }
+
+        if (0 == transferred) {
+            DEBUG("Device attribute %04x ended after %zu bytes (expected = %zu), aborting.", value, offset, len_bytes);
+            ret = H_ERR_CONTROL_FAIL;
+            goto done;
+        }
+
+        offset += transferred;
+    }
 
 done:
     return ret;
 }
 
 static
-HRESULT _hantek_get_id_string(libusb_device_handle *dev, char *id_string, size_t len)
+HRESULT _hantek_get_id_string(struct hantek_transport *tp, char *id_string, size_t len)
 {
     HRESULT ret = H_OK;
 
     HASSERT_ARG(NULL != id_string);
     HASSERT_ARG(0 != len);
 
-    if (H_FAILED(ret = _hantek_read_config_attrs(dev, HT_VALUE_GET_INFO_STRING, id_string, len))) {
+    if (H_FAILED(ret = _hantek_read_config_attrs(tp, HT_VALUE_GET_INFO_STRING, id_string, len))) {
         DEBUG("Failed to read back ID string, aborting.");
         goto done;
     }
@@ -339,8 +429,126 @@ done:
     return ret;
 }
 
+HRESULT _hantek_read_identity(struct hantek_transport *tp, char *id_string, int *ppcb_revision, char *serial_number)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != tp);
+    HASSERT_ARG(NULL != id_string);
+    HASSERT_ARG(NULL != ppcb_revision);
+    HASSERT_ARG(NULL != serial_number);
+
+    if (H_FAILED(ret = _hantek_get_id_string(tp, id_string, HT_MAX_INFO_STRING_LEN))) {
+        goto done;
+    }
+
+    /* Parse out the PCB revision - this is bonkers but the only place we can get it */
+    *ppcb_revision = 0;
+    for (size_t i = 0; i < 5; i++) {
+        int norm = id_string[14 + i] - '0';
+
+        if (norm > 9 || norm < 0) {
+            continue;
+        }
+
+        *ppcb_revision *= 10;
+        *ppcb_revision += norm;
+    }
+
+    /* Parse out the device serial number */
+    memcpy(serial_number, &id_string[20], HT_SERIAL_NUMBER_LEN);
+    serial_number[HT_SERIAL_NUMBER_LEN] = '\0';
+
+done:
+    return ret;
+}
+
+void hantek_spi_shadow_invalidate(struct hantek_device *dev)
+{
+    memset(&dev->spi_shadow, 0, sizeof(dev->spi_shadow));
+}
+
+/**
+ * Send an SPI write, unless the shadow shows the target already holds that value. msg is an 8
+ * byte HT_MSG_SEND_SPI command. The ADC's output can't be trusted for a while after any of its
+ * registers change, which the next capture waits out.
+ */
+static
+HRESULT _hantek_spi_write(struct hantek_device *dev, uint8_t *msg)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_spi_shadow *shadow = NULL;
+    uint16_t value = 0;
+    uint32_t latch = 0;
+    uint8_t reg = 0;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != msg);
+
+    shadow = &dev->spi_shadow;
+    reg = msg[5];
+    value = (uint16_t)msg[4] << 8 | msg[3];
+    latch = (uint32_t)msg[5] << 16 | (uint32_t)msg[4] << 8 | msg[3];
+
+    switch (msg[6]) {
+    case HT_SPI_CS_HMCAD1511:
+        if (true == shadow->hmcad1511_valid[reg] && value == shadow->hmcad1511[reg]) {
+            goto done;
+        }
+        break;
+    case HT_SPI_CS_ADF4360:
+        if (true == shadow->adf4360_valid[latch & 0x3] && latch == shadow->adf4360[latch & 0x3]) {
+            goto done;
+        }
+        break;
+    }
+
+    if (H_FAILED(ret = _hantek_send_cmd(dev, msg, 8, 0))) {
+        goto done;
+    }
+
+    switch (msg[6]) {
+    case HT_SPI_CS_HMCAD1511:
+        hantek_settle_mark(dev, HT_SETTLE_ADC);
+
+        if (HMCAD1511_REG_RST == reg && 0 != (value & HMCAD1511_REG_RST_RST)) {
+            /* Everything is back to power-on defaults, which we don't track */
+            memset(shadow->hmcad1511_valid, 0, sizeof(shadow->hmcad1511_valid));
+            break;
+        }
+
+        shadow->hmcad1511[reg] = value;
+        shadow->hmcad1511_valid[reg] = true;
+        break;
+    case HT_SPI_CS_ADF4360:
+        /* The ADC loses its clock while the PLL relocks */
+        hantek_settle_mark(dev, HT_SETTLE_ADC);
+
+        shadow->adf4360[latch & 0x3] = latch;
+        shadow->adf4360_valid[latch & 0x3] = true;
+        break;
+    }
+
+done:
+    return ret;
+}
+
+HRESULT hantek_adf4360_write(struct hantek_device *dev, uint32_t latch)
+{
+    uint8_t message[8] = { HT_MSG_SEND_SPI, 0x00, 0x00, 0x00, 0x00, 0x00, HT_SPI_CS_ADF4360, 0x00 };
+
+    HASSERT_ARG(NULL != dev);
+
+    message[3] = latch & 0xff;
+    message[4] = (latch >> 8) & 0xff;
+    message[5] = (latch >> 16) & 0xff;
+
+    return _hantek_spi_write(dev, message);
+}
+
 static
-HRESULT _hantek_device_reset(libusb_device_handle *hdl)
+HRESULT _hantek_device_reset(struct hantek_device *dev)
 {
     HRESULT ret = H_OK;
 
@@ -349,9 +557,12 @@ HRESULT _hantek_device_reset(libusb_device_handle *hdl)
 
     DEBUG("----> Sending device reset");
 
-    HASSERT_ARG(NULL != hdl);
+    HASSERT_ARG(NULL != dev);
+
+    /* Whatever the reset does or doesn't get to, the shadow can't be trusted past this point */
+    hantek_spi_shadow_invalidate(dev);
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(hdl, reset_cmd, sizeof(reset_cmd), &transferred))) {
+    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev, reset_cmd, sizeof(reset_cmd), &transferred))) {
         DEBUG("Failed to send the reset command");
         goto done;
     }
@@ -366,7 +577,7 @@ done:
 }
 
 static
-HRESULT _hantek_wake_device(libusb_device_handle *hdl)
+HRESULT _hantek_wake_device(struct hantek_device *dev)
 {
     HRESULT ret = H_OK;
 
@@ -411,28 +622,23 @@ HRESULT _hantek_wake_device(libusb_device_handle *hdl)
         { HT_MSG_SEND_SPI, 0x00, 0x00, 0x12, 0x38, 0x01, HT_SPI_CS_ADF4360, 0x00 }
     };
 
-    HASSERT_ARG(NULL != hdl);
+    HASSERT_ARG(NULL != dev);
 
-    for (size_t i = 0; i < 5; i++) {
-        size_t transferred = 0;
+    hantek_cmd_batch_begin(dev);
 
-        if (H_FAILED(ret = _hantek_bulk_cmd_out(hdl, wake_cmds[i], 8, &transferred))) {
+    for (size_t i = 0; i < 5; i++) {
+        if (H_FAILED(ret = _hantek_spi_write(dev, wake_cmds[i]))) {
             DEBUG("Failure while transmitting wakeup command %zu", i);
             goto done;
         }
-
-        if (transferred != 8) {
-            DEBUG("Transferred %zu bytes, expected 8 for a wakeup command", transferred);
-            goto done;
-        }
     }
 
 done:
-    return ret;
+    return hantek_batch_end(dev, ret);
 }
 
 static
-HRESULT _hantek_get_fpga_version(libusb_device_handle *hdl, uint16_t *pfpga_ver)
+HRESULT _hantek_get_fpga_version(struct hantek_device *dev, uint16_t *pfpga_ver)
 {
     HRESULT ret = H_OK;
 
@@ -441,12 +647,12 @@ HRESULT _hantek_get_fpga_version(libusb_device_handle *hdl, uint16_t *pfpga_ver)
     bool ready = false;
     uint8_t rx_buf[512];
 
-    HASSERT_ARG(NULL != hdl);
+    HASSERT_ARG(NULL != dev);
     HASSERT_ARG(NULL != pfpga_ver);
 
     *pfpga_ver = 0;
 
-    if (H_FAILED(ret = _hantek_check_usb_1(hdl, &ready))) {
+    if (H_FAILED(ret = _hantek_get_usb2(dev, &ready))) {
         goto done;
     }
 
@@ -455,7 +661,7 @@ HRESULT _hantek_get_fpga_version(libusb_device_handle *hdl, uint16_t *pfpga_ver)
         to_transfer = 512;
     }
 
-    if (H_FAILED(ret = _hantek_bulk_in(hdl, rx_buf, to_transfer, &transferred))) {
+    if (H_FAILED(ret = _hantek_bulk_in(dev, rx_buf, to_transfer, &transferred))) {
         DEBUG("Failure while getting attributes from the oscilloscope, aborting.");
         goto done;
     }
@@ -475,7 +681,7 @@ done:
 }
 
 static
-HRESULT _hantek_get_hardware_rev(libusb_device_handle *hdl, uint32_t *phw_rev)
+HRESULT _hantek_get_hardware_rev(struct hantek_device *dev, uint32_t *phw_rev)
 {
     HRESULT ret = H_OK;
 
@@ -483,17 +689,17 @@ HRESULT _hantek_get_hardware_rev(libusb_device_handle *hdl, uint32_t *phw_rev)
     size_t transferred = 0;
     uint32_t version = 0;
 
-    HASSERT_ARG(NULL != hdl);
+    HASSERT_ARG(NULL != dev);
     HASSERT_ARG(NULL != phw_rev);
 
     *phw_rev = 0;
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(hdl, msg, sizeof(msg), &transferred))) {
+    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev, msg, sizeof(msg), &transferred))) {
         DEBUG("Failed to send get hardware revision command.");
         goto done;
     }
 
-    if (H_FAILED(ret = _hantek_bulk_read_in(hdl, (void *)&version, sizeof(version)))) {
+    if (H_FAILED(ret = _hantek_bulk_read_in(dev, (void *)&version, sizeof(version)))) {
         DEBUG("Failed to read back hardware revision code, aborting.");
         goto done;
     }
@@ -506,25 +712,116 @@ done:
     return ret;
 }
 
-static
-HRESULT _hantek_get_calibration_data(libusb_device_handle *hdl, uint16_t *cal_data, size_t nr_cal_vals)
-{
-    HRESULT ret = H_OK;
-
-    HASSERT_ARG(NULL != hdl);
-    HASSERT_ARG(NULL != cal_data);
-    HASSERT_ARG(HT_CALIBRATION_INFO_ENTRIES == nr_cal_vals);
-
-    if (H_FAILED(ret = _hantek_read_config_attrs(hdl, HT_VALUE_GET_CALIBRATION_DAT, cal_data, sizeof(uint16_t) * nr_cal_vals))) {
-        DEBUG("Failed to read back calibration values, aborting.");
-        goto done;
-    }
-
-    if (HT_CALIBRATION_NONZERO_FLAG != cal_data[nr_cal_vals - 1]) {
-        DEBUG("!!! Calibration data is not set. Flag: %04x.", (unsigned)cal_data[nr_cal_vals - 1]);
-        ret = H_ERR_NOT_READY;
-        goto done;
-    }
+static const
+double _hantek_vpd_to_scale[12] = {
+    [0] = 50.0,
+    [1] = 20.0,
+    [2] = 10.0,
+    [3] = 5.0,
+    [4] = 2.0,
+    [5] = 1.0,
+    [6] = 5.0,
+    [7] = 2.0,
+    [8] = 1.0,
+    [9] = 5.0,
+    [10] = 2.0,
+    [11] = 1.0,
+};
+
+/**
+ * Work out the position DAC value for a channel at the given level, from the calibration data.
+ * mode is 0, 1 or 2 for 1, 2 or 4 channels enabled.
+ */
+static
+uint16_t _hantek_calc_position(const uint16_t *cal_data, unsigned channel_num, unsigned mode, enum hantek_volts_per_div vpd, unsigned chan_level)
+{
+    uint16_t offset = 0;
+    uint16_t hi = 0,
+             lo = 0,
+             v = 0,
+             q = 0,
+             upper = 0,
+             lower = 0,
+             mode_map = mode * 2;
+    double x = 0.0;
+    const uint16_t *line = NULL;
+
+    switch (vpd) {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+    case 5:
+        offset = 60;
+        break;
+    case 6:
+    case 7:
+    case 8:
+        offset = 96;
+        break;
+    default:
+        offset = 132;
+        break;
+    }
+
+    line = &cal_data[channel_num * 144];
+
+    hi = line[offset + mode_map];
+    lo = line[offset + mode_map + 1];
+
+    v = (unsigned)((((double)(hi + lo))/2.0) + 0.5);
+    x = (double)(lo - v)/_hantek_vpd_to_scale[vpd];
+    q = (unsigned)(x + 0.5);
+    upper = v + q;
+    lower = v - q;
+
+    return ((double)(upper - lower)/255.0) * chan_level + lower;
+}
+
+/**
+ * Work out every position DAC value up front, so moving a channel is just a table lookup
+ */
+static
+void _hantek_build_position_table(struct hantek_device *dev)
+{
+    for (unsigned ch = 0; ch < HT_MAX_CHANNELS; ch++) {
+        for (unsigned mode = 0; mode < HT_POSITION_NR_MODES; mode++) {
+            for (unsigned vpd = 0; vpd < HT_POSITION_NR_VPD; vpd++) {
+                for (unsigned level = 0; level < HT_POSITION_NR_LEVELS; level++) {
+                    dev->position_table[ch][mode][vpd][level] = _hantek_calc_position(dev->cal_data, ch, mode, vpd, level);
+                }
+            }
+        }
+    }
+}
+
+static
+HRESULT _hantek_get_calibration_data(struct hantek_transport *tp, uint16_t *cal_data, size_t nr_cal_vals)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != tp);
+    HASSERT_ARG(NULL != cal_data);
+    HASSERT_ARG(HT_CALIBRATION_INFO_ENTRIES == nr_cal_vals);
+
+    if (H_FAILED(_hantek_read_config_attrs_chunked(tp, HT_VALUE_GET_CALIBRATION_DAT, cal_data, sizeof(uint16_t) * nr_cal_vals)) ||
+            HT_CALIBRATION_NONZERO_FLAG != cal_data[nr_cal_vals - 1])
+    {
+        /* The chunked read didn't give back a whole table, so read it the way the vendor does */
+        DEBUG("Chunked calibration read failed, retrying in one transfer.");
+
+        if (H_FAILED(ret = _hantek_read_config_attrs(tp, HT_VALUE_GET_CALIBRATION_DAT, cal_data, sizeof(uint16_t) * nr_cal_vals))) {
+            DEBUG("Failed to read back calibration values, aborting.");
+            goto done;
+        }
+    }
+
+    if (HT_CALIBRATION_NONZERO_FLAG != cal_data[nr_cal_vals - 1]) {
+        DEBUG("!!! Calibration data is not set. Flag: %04x.", (unsigned)cal_data[nr_cal_vals - 1]);
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
 
 done:
     return ret;
@@ -534,82 +831,123 @@ HRESULT hantek_open_device(struct hantek_device **pdev, uint32_t capture_buffer_
 {
     HRESULT ret = H_OK;
 
-    libusb_device *dev = NULL;
-    libusb_device_handle *hdl = NULL;
-    struct hantek_device *nhdev = NULL;
-    int uret = -1;
+    struct hantek_transport *tp = NULL;
 
     HASSERT_ARG(NULL != pdev);
-    HASSERT_ARG(0 < capture_buffer_len && (1 << 16) >= capture_buffer_len);
 
     *pdev = NULL;
 
-    if (H_FAILED(ret = _hantek_device_find(&dev))) {
-        DEBUG("Failed to find device, aborting.");
+    if (H_FAILED(ret = hantek_usb_transport_open(&tp))) {
+        DEBUG("Failed to open a USB device, aborting.");
         goto done;
     }
 
-    if (0 != (uret = libusb_open(dev, &hdl))) {
-        DEBUG("Failed to open USB device, aborting. Uret = %u)", (unsigned)uret);
-        ret = H_ERR_CANT_OPEN;
+    if (H_FAILED(ret = hantek_open_device_on(pdev, tp, capture_buffer_len))) {
+        hantek_transport_close(&tp);
         goto done;
     }
 
-    /* Claim interface 0 */
-    if (0 != (uret = libusb_claim_interface(hdl, 0))) {
-        DEBUG("Failed to claim interface 0, aborting. uret = %u", (unsigned)uret);
-        ret = H_ERR_CANT_OPEN;
+done:
+    return ret;
+}
+
+/**
+ * Carry on with a device as an earlier open left it, if it is still in that state. Nothing is
+ * restored unless everything checks out.
+ */
+static
+HRESULT _hantek_warm_attach(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_saved_state state;
+    struct hantek_status status;
+    uint32_t hardware_rev = 0;
+
+    if (H_FAILED(ret = hantek_state_load(dev, &state))) {
         goto done;
     }
 
-    if (NULL == (nhdev = calloc(1, sizeof(struct hantek_device)))) {
-        DEBUG("Out of memory");
-        ret = H_ERR_NO_MEM;
+    if (H_FAILED(_hantek_get_hardware_rev(dev, &hardware_rev)) || hardware_rev != state.hardware_rev) {
+        DEBUG("Hardware revision doesn't match the saved state, can't reattach.");
+        ret = H_ERR_NOT_FOUND;
         goto done;
     }
 
-    nhdev->dev = dev;
-    nhdev->hdl = hdl;
-    nhdev->capture_buffer_len = capture_buffer_len;
+    /* An FPGA that has lost its configuration hasn't initialized the capture SDRAM */
+    if (H_FAILED(hantek_read_status(dev, &status)) || false == status.sdram_init) {
+        DEBUG("Device doesn't look configured, can't reattach.");
+        ret = H_ERR_NOT_FOUND;
+        goto done;
+    }
+
+    dev->fpga_version = state.fpga_version;
+    dev->hardware_rev = hardware_rev;
+    memcpy(dev->channels, state.channels, sizeof(dev->channels));
+    dev->timebase = state.timebase;
+    dev->adc_clock_hz = state.adc_clock_hz;
+    dev->sample_spacing = state.sample_spacing;
+    dev->trigger_set = state.trigger_set;
+    dev->trigger = state.trigger;
+    memcpy(dev->adc_core_channel, state.adc_core_channel, sizeof(dev->adc_core_channel));
+    dev->adc_nr_streams = state.adc_nr_streams;
+    dev->spi_shadow = state.spi_shadow;
+    dev->state_on_disk = true;
+
+done:
+    return ret;
+}
+
+static
+HRESULT _hantek_open(struct hantek_device **pdev, struct hantek_transport *tp, uint32_t capture_buffer_len, bool try_warm, bool *pwarm)
+{
+    HRESULT ret = H_OK;
 
-    /* Send what looks to be a reset command */
-    if (H_FAILED(ret = _hantek_device_reset(hdl))) {
+    struct hantek_device *nhdev = NULL;
+    bool warm = false;
+
+    HASSERT_ARG(NULL != pdev);
+    HASSERT_ARG(NULL != tp);
+    HASSERT_ARG(0 < capture_buffer_len && HT_CAPTURE_MAX_LEN >= capture_buffer_len);
+
+    *pdev = NULL;
+
+    if (NULL == (nhdev = hantek_calloc(1, sizeof(struct hantek_device)))) {
+        DEBUG("Out of memory");
+        ret = H_ERR_NO_MEM;
         goto done;
     }
 
-    /* Read back the FPGA version */
-    if (H_FAILED(ret = _hantek_get_fpga_version(hdl, &nhdev->fpga_version))) {
-        DEBUG("Failed to get FPGA version, aborting.");
+    nhdev->tp = tp;
+    nhdev->capture_buffer_len = capture_buffer_len;
+    nhdev->timebase = HT_ST_MAX;
+    nhdev->adc_clock_hz = HT_ADC_CLOCK_HZ;
+
+    if (H_FAILED(ret = hantek_readback_init(nhdev))) {
         goto done;
     }
 
-    /* Send the wakeup sequence (seems to be all magical from static analysis) */
-    if (H_FAILED(ret = _hantek_wake_device(hdl))) {
-        DEBUG("Failure while trying to wake the device, aborting.");
+    if (H_FAILED(ret = hantek_batch_init(nhdev))) {
         goto done;
     }
 
-    /* Get the ID string */
-    if (H_FAILED(ret = _hantek_get_id_string(hdl, nhdev->id_string, HT_MAX_INFO_STRING_LEN))) {
+    if (H_FAILED(ret = hantek_acquire_init(nhdev))) {
         goto done;
     }
 
-    /* Parse out the PCB revision - this is bonkers but the only place we can get it */
-    for (size_t i = 0; i < 5; i++) {
-        int norm = nhdev->id_string[14 + i] - '0';
+    hantek_settle_init(nhdev);
 
-        if (norm > 9 || norm < 0) {
-            continue;
-        }
+    /* Bring-up is a long sequence of commands, only handshake once */
+    hantek_cmd_session_begin(nhdev);
 
-        nhdev->pcb_revision *= 10;
-        nhdev->pcb_revision += norm;
+    /*
+     * Get the ID string, and the PCB revision and serial number in it. This comes from the FX2,
+     * so it's safe before a reset.
+     */
+    if (H_FAILED(ret = _hantek_read_identity(tp, nhdev->id_string, &nhdev->pcb_revision, nhdev->serial_number))) {
+        goto done;
     }
 
-    /* Parse out the device serial number */
-    memcpy(nhdev->serial_number, &nhdev->id_string[20], 8);
-    nhdev->serial_number[8] = '\0';
-
     DEBUG("PCB Revision: %d", nhdev->pcb_revision);
     DEBUG("    Serial Number: %s", nhdev->serial_number);
 
@@ -617,43 +955,92 @@ HRESULT hantek_open_device(struct hantek_device **pdev, uint32_t capture_buffer_
     hexdump_dump_hex(nhdev->id_string, HT_MAX_INFO_STRING_LEN);
 #endif
 
-    /* Grab the calibration data for this device */
-    if (H_FAILED(ret = _hantek_get_calibration_data(hdl, nhdev->cal_data, HT_CALIBRATION_INFO_ENTRIES))) {
-        DEBUG("Failed to get device calibration data, aborting.");
-        goto done;
+    if (true == try_warm && !H_FAILED(_hantek_warm_attach(nhdev))) {
+        DEBUG("Reattached to a device left configured, skipping reset.");
+        warm = true;
+    } else {
+        /* Whatever was saved about this device is about to stop being true */
+        nhdev->state_on_disk = true;
+        hantek_state_discard(nhdev);
+
+        /* Send what looks to be a reset command */
+        if (H_FAILED(ret = _hantek_device_reset(nhdev))) {
+            goto done;
+        }
+
+        /* Read back the FPGA version */
+        if (H_FAILED(ret = _hantek_get_fpga_version(nhdev, &nhdev->fpga_version))) {
+            DEBUG("Failed to get FPGA version, aborting.");
+            goto done;
+        }
+
+        /* Send the wakeup sequence (seems to be all magical from static analysis) */
+        if (H_FAILED(ret = _hantek_wake_device(nhdev))) {
+            DEBUG("Failure while trying to wake the device, aborting.");
+            goto done;
+        }
     }
 
-    /* Get the hardware revision */
-    if (H_FAILED(ret = _hantek_get_hardware_rev(hdl, &nhdev->hardware_rev))) {
-        DEBUG("Failed to get hardware revision, aborting.");
-        goto done;
+    /* Reading the calibration data back is slow, so it's cached if we're allowed to */
+    if (H_FAILED(hantek_cache_load(nhdev->serial_number, nhdev->fpga_version, nhdev->cal_data, &nhdev->hardware_rev))) {
+        /* Grab the calibration data for this device */
+        if (H_FAILED(ret = _hantek_get_calibration_data(tp, nhdev->cal_data, HT_CALIBRATION_INFO_ENTRIES))) {
+            DEBUG("Failed to get device calibration data, aborting.");
+            goto done;
+        }
+
+        /* Get the hardware revision */
+        if (H_FAILED(ret = _hantek_get_hardware_rev(nhdev, &nhdev->hardware_rev))) {
+            DEBUG("Failed to get hardware revision, aborting.");
+            goto done;
+        }
+
+        hantek_cache_store(nhdev->serial_number, nhdev->fpga_version, nhdev->cal_data, nhdev->hardware_rev);
     }
 
+    _hantek_build_position_table(nhdev);
+
+    if (false == warm) {
+        hantek_state_save(nhdev);
+    }
 
 #ifdef HT_DEBUG
     printf("Calibration data:\n");
     hexdump_dump_hex(nhdev->cal_data, HT_CALIBRATION_INFO_ENTRIES * sizeof(uint16_t));
 #endif
 
+    if (NULL != pwarm) {
+        *pwarm = warm;
+    }
+
     *pdev = nhdev;
 done:
+    if (NULL != nhdev && 0 != nhdev->session_depth) {
+        hantek_cmd_session_end(nhdev);
+    }
+
     if (H_FAILED(ret)) {
         if (NULL != nhdev) {
-            free(nhdev);
+            hantek_acquire_cleanup(nhdev);
+            hantek_readback_cleanup(nhdev);
+            hantek_batch_cleanup(nhdev);
+            hantek_free(nhdev);
             nhdev = NULL;
         }
-
-        if (NULL != hdl) {
-            libusb_close(hdl);
-        }
-
-        if (NULL != dev) {
-            libusb_unref_device(dev);
-        }
     }
     return ret;
 }
 
+HRESULT hantek_open_device_on(struct hantek_device **pdev, struct hantek_transport *tp, uint32_t capture_buffer_len)
+{
+    return _hantek_open(pdev, tp, capture_buffer_len, false, NULL);
+}
+
+HRESULT hantek_reopen_device_on(struct hantek_device **pdev, struct hantek_transport *tp, uint32_t capture_buffer_len, bool *pwarm)
+{
+    return _hantek_open(pdev, tp, capture_buffer_len, true, pwarm);
+}
+
 HRESULT hantek_close_device(struct hantek_device **pdev)
 {
     HRESULT ret = H_OK;
@@ -665,30 +1052,69 @@ HRESULT hantek_close_device(struct hantek_device **pdev)
 
     hdev = *pdev;
 
-    if (NULL != hdev->hdl) {
-        libusb_close(hdev->hdl);
-        hdev->hdl = NULL;
+    /* Transfers still in flight point at the device, so nothing can be freed until they're done */
+    if (H_FAILED(ret = hantek_acquire_drain(hdev))) {
+        DEBUG("Acquisition won't stop, can't close the device.");
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_acquire_cleanup(hdev)) ||
+            H_FAILED(ret = hantek_readback_cleanup(hdev)) ||
+            H_FAILED(ret = hantek_batch_cleanup(hdev)))
+    {
+        DEBUG("Failed to release the device's transfers, aborting.");
+        goto done;
     }
 
-    if (NULL != hdev->dev) {
-        libusb_unref_device(hdev->dev);
-        hdev->dev = NULL;
+    if (NULL != hdev->tp) {
+        hantek_transport_close(&hdev->tp);
     }
 
+    hantek_free(hdev->raw_buf);
+    hantek_free(hdev);
+    *pdev = NULL;
+
+done:
     return ret;
 }
 
-HRESULT hantek_get_status(struct hantek_device *dev, bool *pdata_ready)
+HRESULT hantek_transport_close(struct hantek_transport **ptp)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != ptp);
+    HASSERT_ARG(NULL != *ptp);
+
+    (*ptp)->ops->close(*ptp);
+    *ptp = NULL;
+
+    return ret;
+}
+
+static
+void _hantek_sleep_ns(uint64_t ns)
+{
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+
+    if (0 == ns) {
+        return;
+    }
+
+    while (0 != nanosleep(&ts, &ts));
+}
+
+/**
+ * Send a status request and read back the status byte
+ */
+static
+HRESULT _hantek_read_status_byte(struct hantek_device *dev, uint8_t *pstatus)
 {
     HRESULT ret =  H_OK;
 
     uint8_t message[2] = { HT_MSG_GET_STATUS, 0x0 };
-    uint8_t status = 0;
     size_t transferred = 0;
 
-    HASSERT_ARG(NULL != dev);
-
-    if (H_FAILED(_hantek_bulk_cmd_out(dev->hdl, message, sizeof(message), &transferred))) {
+    if (H_FAILED(_hantek_bulk_cmd_out(dev, message, sizeof(message), &transferred))) {
         DEBUG("Failed to send status message, aborting.");
         ret = H_ERR_NOT_READY;
         goto done;
@@ -700,19 +1126,64 @@ HRESULT hantek_get_status(struct hantek_device *dev, bool *pdata_ready)
         goto done;
     }
 
-    if (H_FAILED(_hantek_bulk_read_in(dev->hdl, &status, 1))) {
+    if (H_FAILED(_hantek_bulk_read_in(dev, pstatus, 1))) {
         DEBUG("Failed ot read back status, aborting.");
         ret = H_ERR_NOT_READY;
         goto done;
     }
 
-    DEBUG("*** STATUS BYTE: 0x%02x ***", status);
+    DEBUG("*** STATUS BYTE: 0x%02x ***", *pstatus);
+
+done:
+    return ret;
+}
+
+HRESULT hantek_get_status(struct hantek_device *dev, bool *pdata_ready)
+{
+    HRESULT ret =  H_OK;
+
+    uint8_t status = 0;
+
+    HASSERT_ARG(NULL != dev);
+
+    hantek_cmd_session_begin(dev);
+
+    if (H_FAILED(ret = _hantek_read_status_byte(dev, &status))) {
+        goto done;
+    }
 
     if (NULL != pdata_ready) {
         *pdata_ready = !!(status & HT_STATUS_DATA_READY);
     }
 
 done:
+    hantek_cmd_session_end(dev);
+    return ret;
+}
+
+HRESULT hantek_read_status(struct hantek_device *dev, struct hantek_status *pstatus)
+{
+    HRESULT ret =  H_OK;
+
+    uint8_t status = 0;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != pstatus);
+
+    hantek_cmd_session_begin(dev);
+
+    if (H_FAILED(ret = _hantek_read_status_byte(dev, &status))) {
+        goto done;
+    }
+
+    pstatus->raw = status;
+    pstatus->triggered = !!(status & HT_STATUS_TRIGGERED);
+    pstatus->data_ready = !!(status & HT_STATUS_DATA_READY);
+    pstatus->pack_state = !!(status & HT_STATUS_PACK_STATE);
+    pstatus->sdram_init = !!(status & HT_STATUS_SDRAM_INIT);
+
+done:
+    hantek_cmd_session_end(dev);
     return ret;
 }
 
@@ -732,38 +1203,49 @@ uint8_t _hantek_channel_setup(enum hantek_volts_per_div volts_per_div, enum hant
     return state;
 }
 
+/**
+ * Work out the front-end shift register contents for the current channel settings, and whether
+ * they differ from what the relays are set to now
+ */
+static
+bool _hantek_frontend_setup(struct hantek_device *dev, uint8_t *setup)
+{
+    struct hantek_spi_shadow *shadow = &dev->spi_shadow;
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        struct hantek_channel *chan = &dev->channels[i];
+        setup[i] = _hantek_channel_setup(chan->vpd, chan->coupling, chan->bw_limit);
+    }
+
+    return false == shadow->frontend_valid || 0 != memcmp(shadow->frontend, setup, HT_MAX_CHANNELS);
+}
+
 static
 HRESULT _hantek_commit_frontend_config(struct hantek_device *dev)
 {
     HRESULT ret = H_OK;
 
-    uint8_t message[8] = { HT_MSG_SEND_SPI, 0x0, 0x0, 0x0, 0x0, 0x0, HT_SPI_CS_SHIFT_REG, 0x0 };
-    size_t transferred = 0;
+    uint8_t message[8] = { HT_MSG_SEND_SPI, 0x0, 0x0, 0x0, 0x0, 0x0, HT_SPI_CS_SHIFT_REG, 0x0 },
+            setup[HT_MAX_CHANNELS];
+    struct hantek_spi_shadow *shadow = NULL;
 
     HASSERT_ARG(NULL != dev);
 
-    /* Fill in the settings for each channel */
-    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
-        struct hantek_channel *chan = &dev->channels[i];
-        message[2 + i] = _hantek_channel_setup(chan->vpd, chan->coupling, chan->bw_limit);
-    }
+    shadow = &dev->spi_shadow;
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev->hdl, message, sizeof(message), &transferred))) {
-        DEBUG("Failed to send frontend configuration, aborting.");
+    /* The relays are already where we want them, skip the writes and their settling */
+    if (false == _hantek_frontend_setup(dev, setup)) {
         goto done;
     }
 
-    if (sizeof(message) != transferred) {
-        DEBUG("Failed to transfer frontend configuration, aborting.");
-        ret = H_ERR_NOT_READY;
+    memcpy(&message[2], setup, sizeof(setup));
+
+    /* The shift register has to have loaded before it can be latched */
+    if (H_FAILED(ret = _hantek_send_cmd(dev, message, sizeof(message), dev->settle.settle_us[HT_SETTLE_RELAY_LOAD]))) {
+        DEBUG("Failed to send frontend configuration, aborting.");
         goto done;
     }
 
-    transferred = 0;
-
-    /* This is what the SDK does */
-    usleep(4000);
-
     /* This seems to force latching */
     message[7] = 0x1;
 
@@ -773,19 +1255,16 @@ HRESULT _hantek_commit_frontend_config(struct hantek_device *dev)
                           (1 << 1);
     }
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev->hdl, message, sizeof(message), &transferred)))  {
+    if (H_FAILED(ret = _hantek_send_cmd(dev, message, sizeof(message), 0)))  {
         DEBUG("Failed to send second frontend configuration command, aborting.");
         goto done;
     }
 
-    if (sizeof(message) != transferred) {
-        DEBUG("Failed to send second stage of frontend configuration command, aborting.");
-        ret = H_ERR_NOT_READY;
-        goto done;
-    }
+    /* The relays are only switching now, and the next capture waits for them */
+    hantek_settle_mark(dev, HT_SETTLE_RELAY);
 
-    /* This is also what the SDK does */
-    usleep(50000);
+    memcpy(shadow->frontend, setup, sizeof(setup));
+    shadow->frontend_valid = true;
 
 done:
     return ret;
@@ -823,33 +1302,175 @@ uint32_t _hantek_tpd_to_spacing[HT_ST_MAX] = {
     [HT_ST_1S] = 500000,
 };
 
-HRESULT hantek_set_sampling_rate(struct hantek_device *dev, enum hantek_time_per_division sample_spacing)
+HRESULT hantek_sample_spacing_send(struct hantek_device *dev, uint32_t spacing)
 {
     HRESULT ret = H_OK;
 
     uint8_t message[6] = { HT_MSG_SET_TIME_DIVISION, 0x0 };
-    uint32_t spacing = 0;
-    size_t transferred = 0;
 
     HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(0 != spacing);
+
+    /* The FPGA counts from 0 */
+    message[2] = (spacing - 1) & 0xff;
+    message[3] = ((spacing - 1) >> 8) & 0xff;
+    message[4] = ((spacing - 1) >> 16) & 0xff;
+    message[5] = ((spacing - 1) >> 24) & 0xff;
+
+    if (H_FAILED(ret = _hantek_send_cmd(dev, message, sizeof(message), 0))) {
+        DEBUG("Failed to set sample spacing.");
+        ret = H_ERR_BAD_SAMPLE_RATE;
+        goto done;
+    }
+
+    dev->sample_spacing = spacing;
+
+done:
+    return ret;
+}
+
+HRESULT hantek_set_sampling_rate(struct hantek_device *dev, enum hantek_time_per_division sample_spacing)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(HT_ST_MAX > sample_spacing);
 
     static_assert((HT_ST_MAX * 4) == sizeof(_hantek_tpd_to_spacing),
             "You've added some time divisions but not updated the spacing array");
 
-    spacing = _hantek_tpd_to_spacing[sample_spacing] - 1;
+    hantek_cmd_batch_begin(dev);
 
-    message[2] = spacing & 0xff;
-    message[3] = (spacing >> 8) & 0xff;
-    message[4] = (spacing >> 16) & 0xff;
-    message[5] = (spacing >> 24) & 0xff;
+    /* The spacings assume the ADC runs at its usual clock */
+    if (H_FAILED(ret = hantek_adc_clock_set(dev, HT_ADF4360_N_DEFAULT))) {
+        DEBUG("Failed to restore the ADC clock.");
+        goto done;
+    }
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev->hdl, message, sizeof(message), &transferred))) {
+    if (H_FAILED(ret = hantek_sample_spacing_send(dev, _hantek_tpd_to_spacing[sample_spacing]))) {
         DEBUG("Failed to set sampling rate.");
-        ret = H_ERR_BAD_SAMPLE_RATE;
         goto done;
     }
 
+    dev->timebase = sample_spacing;
+
+done:
+    return hantek_batch_end(dev, ret);
+}
+
+/**
+ * Time between samples on each channel, in nanoseconds. The ADC clock is shared out between its
+ * streams by the clock divider, and slowed down by the sample spacing.
+ */
+static
+double _hantek_sample_period_ns(struct hantek_device *dev)
+{
+    uint64_t spacing = 0 != dev->sample_spacing ? dev->sample_spacing : 1,
+             nr_streams = 0 != dev->adc_nr_streams ? dev->adc_nr_streams : 1;
+
+    return (double)(spacing * nr_streams) * 1e9 / (double)dev->adc_clock_hz;
+}
+
+/**
+ * How long a capture takes once triggered, in nanoseconds
+ */
+static
+uint64_t _hantek_capture_duration_ns(struct hantek_device *dev)
+{
+    size_t nr_streams = 0 != dev->adc_nr_streams ? dev->adc_nr_streams : 1;
+
+    return (uint64_t)(_hantek_sample_period_ns(dev) * (double)(dev->capture_buffer_len / nr_streams));
+}
+
+HRESULT hantek_get_sample_rate(struct hantek_device *dev, double *prate)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != prate);
+
+    *prate = 1e9 / _hantek_sample_period_ns(dev);
+
+    return ret;
+}
+
+HRESULT hantek_wait_ready(struct hantek_device *dev, unsigned timeout_ms, struct hantek_status *pstatus)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_status status;
+    uint64_t now = hantek_now_ns(),
+             deadline = now + timeout_ms * 1000000ull,
+             duration = 0,
+             interval = HT_WAIT_POLL_MIN_US * 1000ull,
+             max_interval = 0,
+             wake = 0;
+    bool triggered = false;
+
+    HASSERT_ARG(NULL != dev);
+
+    memset(&status, 0, sizeof(status));
+
+    /* Hold the session, so only the first poll needs a handshake */
+    hantek_cmd_session_begin(dev);
+
+    /*
+     * Backing off further than the capture takes would add latency once the trigger fires, so
+     * the capture duration caps the poll interval
+     */
+    duration = _hantek_capture_duration_ns(dev);
+    max_interval = duration;
+
+    if (max_interval < HT_WAIT_POLL_MIN_US * 1000ull) {
+        max_interval = HT_WAIT_POLL_MIN_US * 1000ull;
+    } else if (max_interval > HT_WAIT_POLL_MAX_US * 1000ull) {
+        max_interval = HT_WAIT_POLL_MAX_US * 1000ull;
+    }
+
+    /* Nothing can be ready before a whole capture has been taken */
+    wake = dev->armed_ns + duration;
+
+    for (;;) {
+        if (wake > now) {
+            _hantek_sleep_ns((wake < deadline ? wake : deadline) - now);
+        }
+
+        if (H_FAILED(ret = hantek_read_status(dev, &status))) {
+            goto done;
+        }
+
+        if (true == status.data_ready) {
+            break;
+        }
+
+        now = hantek_now_ns();
+
+        if (now >= deadline) {
+            ret = H_ERR_NOT_READY;
+            goto done;
+        }
+
+        if (true == status.triggered && false == triggered) {
+            /* The capture now finishes within one capture duration, poll closely again */
+            triggered = true;
+            interval = HT_WAIT_POLL_MIN_US * 1000ull;
+        }
+
+        wake = now + interval;
+
+        interval <<= 1;
+
+        if (interval > max_interval) {
+            interval = max_interval;
+        }
+    }
+
 done:
+    if (NULL != pstatus) {
+        memcpy(pstatus, &status, sizeof(status));
+    }
+
+    hantek_cmd_session_end(dev);
     return ret;
 }
 
@@ -862,27 +1483,27 @@ HRESULT _hantek_hmcad1511_write_reg(struct hantek_device *dev, uint8_t reg, uint
     HRESULT ret = H_OK;
 
     uint8_t msg[8] = { HT_MSG_SEND_SPI, 0x00, 0x00, value & 0xff, (value >> 8) & 0xff, reg, HT_SPI_CS_HMCAD1511, 0x00 };
-    size_t transferred = 0;
 
     HASSERT_ARG(NULL != dev);
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev->hdl, msg, sizeof(msg), &transferred))) {
+    if (H_FAILED(ret = _hantek_spi_write(dev, msg))) {
         DEBUG("Failed to send HMCAD1511 SPI command (reg = %02x, value = %04x), aborting.", (unsigned)reg, (unsigned)value);
         goto done;
     }
 
-    if (8 != transferred) {
-        DEBUG("Failure: expected to transfer 8 bytes, sent %zu", transferred);
-        ret = H_ERR_CONTROL_FAIL;
-        goto done;
-    }
-
-    usleep(3000);
-
 done:
     return ret;
 }
 
+/**
+ * Whether the shadow shows an HMCAD1511 register already holds the given value
+ */
+static
+bool _hantek_hmcad1511_holds(struct hantek_device *dev, uint8_t reg, uint16_t value)
+{
+    return true == dev->spi_shadow.hmcad1511_valid[reg] && value == dev->spi_shadow.hmcad1511[reg];
+}
+
 /**
  * Set up the number of channels and clock divider. Requires we shut down the analog frontend,
  * per the HMCAD1511 manual.
@@ -898,11 +1519,6 @@ HRESULT _hantek_hmcad1511_set_channel_count(struct hantek_device *dev, size_t nr
     HASSERT_ARG(NULL != dev);
     HASSERT_ARG(0 != nr_chans && 5 > nr_chans);
 
-    /* Power down the front-end */
-    if (H_FAILED(ret = _hantek_hmcad1511_write_reg(dev, HMCAD1511_REG_SLEEP_PD, HMCAD1511_REG_SLEEP_PD_PD))) {
-        goto done;
-    }
-
     switch (nr_chans) {
     case 1:
         /* Divide by 1 */
@@ -925,6 +1541,18 @@ HRESULT _hantek_hmcad1511_set_channel_count(struct hantek_device *dev, size_t nr
         goto done;
     }
 
+    /* Already running in this mode, no need for the power cycle */
+    if (true == _hantek_hmcad1511_holds(dev, HMCAD1511_REG_CHAN_NUM_CLK_DIV, (clk_div << 8) | chan_mask) &&
+            true == _hantek_hmcad1511_holds(dev, HMCAD1511_REG_SLEEP_PD, 0x0))
+    {
+        goto done;
+    }
+
+    /* Power down the front-end */
+    if (H_FAILED(ret = _hantek_hmcad1511_write_reg(dev, HMCAD1511_REG_SLEEP_PD, HMCAD1511_REG_SLEEP_PD_PD))) {
+        goto done;
+    }
+
     if (H_FAILED(ret = _hantek_hmcad1511_write_reg(dev, HMCAD1511_REG_CHAN_NUM_CLK_DIV, (clk_div << 8) | chan_mask))) {
         goto done;
     }
@@ -948,6 +1576,7 @@ HRESULT _hantek_hmcad1511_set_channel_mappings(struct hantek_device *dev, size_t
     HRESULT ret = H_OK;
 
     uint16_t chan_map[HT_MAX_CHANNELS] = { 0x1, 0x2, 0x4, 0x8 };
+    int core_channel[HT_ADC_NR_CORES] = { -1, -1, -1, -1 };
     size_t chan_id = 0;
 
     HASSERT_ARG(NULL != dev);
@@ -959,16 +1588,19 @@ HRESULT _hantek_hmcad1511_set_channel_mappings(struct hantek_device *dev, size_t
             case 1:
                 /* One channel maps to all ADC channels (since the HMCAD1511 interleaves the ADCs) */
                 chan_map[0] = chan_map[1] = chan_map[2] = chan_map[3] = 0x2 << i;
+                core_channel[0] = core_channel[1] = core_channel[2] = core_channel[3] = i;
                 chan_id = 4;
                 break;
             case 2:
                 /* A pair of channels (high or low) maps to an ADC channel */
                 chan_map[chan_id] = chan_map[chan_id + 1] = 0x2 << i;
+                core_channel[chan_id] = core_channel[chan_id + 1] = i;
                 chan_id += 2;
                 break;
             case 3:
             case 4:
                 chan_map[i] = 0x2 << i;
+                core_channel[i] = i;
                 break;
             }
         }
@@ -985,6 +1617,10 @@ HRESULT _hantek_hmcad1511_set_channel_mappings(struct hantek_device *dev, size_t
         goto done;
     }
 
+    /* Remember the routing, so captures can be split back out into channels */
+    memcpy(dev->adc_core_channel, core_channel, sizeof(core_channel));
+    dev->adc_nr_streams = 3 == nr_chans ? 4 : nr_chans;
+
 done:
     return ret;
 }
@@ -1050,8 +1686,7 @@ HRESULT _hantek_configure_adc_range_scaling(struct hantek_device *dev)
     HRESULT ret = H_OK;
 
     uint8_t message[8] = { HT_MSG_SEND_SPI, 0x00, 0x00, 0x00, 0x00, HMCAD1511_REG_FS_CNTRL, HT_SPI_CS_HMCAD1511, 0x00 };
-    size_t transferred = 0,
-           nr_chans = 0;
+    size_t nr_chans = 0;
 
     HASSERT_ARG(NULL != dev);
 
@@ -1086,14 +1721,12 @@ HRESULT _hantek_configure_adc_range_scaling(struct hantek_device *dev)
         goto done;
     }
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev->hdl, message, sizeof(message), &transferred))) {
+    if (H_FAILED(ret = _hantek_spi_write(dev, message))) {
         DEBUG("Failed to set scaling control");
         ret = H_ERR_INVAL_CHANNELS;
         goto done;
     }
 
-    usleep(3000);
-
 done:
     return ret;
 }
@@ -1106,6 +1739,8 @@ HRESULT hantek_configure_adc_routing(struct hantek_device *dev)
 
     HASSERT_ARG(NULL != dev);
 
+    hantek_cmd_batch_begin(dev);
+
     for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
         if (dev->channels[i].enabled == true) {
             nr_chans++;
@@ -1133,58 +1768,21 @@ HRESULT hantek_configure_adc_routing(struct hantek_device *dev)
     }
 
 done:
-    return ret;
+    return hantek_batch_end(dev, ret);
 }
 
-static const
-double _hantek_vpd_to_scale[12] = {
-    [0] = 50.0,
-    [1] = 20.0,
-    [2] = 10.0,
-    [3] = 5.0,
-    [4] = 2.0,
-    [5] = 1.0,
-    [6] = 5.0,
-    [7] = 2.0,
-    [8] = 1.0,
-    [9] = 5.0,
-    [10] = 2.0,
-    [11] = 1.0,
-};
-
-static
-HRESULT _hantek_set_frontend_level(struct hantek_device *dev, unsigned channel_num, unsigned chan_level)
+HRESULT hantek_position_lookup(struct hantek_device *dev, unsigned channel_num, unsigned chan_level, uint16_t *poffset)
 {
     HRESULT ret = H_OK;
 
-    uint8_t message[4] = { 0x0 };
-    uint16_t offset = 0;
-    uint16_t hi = 0,
-             lo = 0,
-             v = 0,
-             q = 0,
-             upper = 0,
-             lower = 0,
-             mode_map = 0;
-    double x = 0.0;
-    const uint16_t *line = NULL;
-    size_t transferred = 0,
-           nr_chans = 0;
+    enum hantek_volts_per_div vpd = HT_VPD_2MV;
+    unsigned mode = 0;
+    size_t nr_chans = 0;
 
-    switch (channel_num) {
-    case 0:
-        message[0] = HT_MSG_POSITION_CH0;
-        break;
-    case 1:
-        message[0] = HT_MSG_POSITION_CH1;
-        break;
-    case 2:
-        message[0] = HT_MSG_POSITION_CH2;
-        break;
-    case 3:
-        message[0] = HT_MSG_POSITION_CH3;
-        break;
-    default:
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != poffset);
+
+    if (HT_MAX_CHANNELS <= channel_num) {
         DEBUG("Invalid channel ID %u, aborting.", channel_num);
         ret = H_ERR_INVAL_CHANNELS;
         goto done;
@@ -1198,13 +1796,13 @@ HRESULT _hantek_set_frontend_level(struct hantek_device *dev, unsigned channel_n
 
     switch (nr_chans) {
     case 1:
-        mode_map = 0;
+        mode = 0;
         break;
     case 2:
-        mode_map = 2;
+        mode = 1;
         break;
     case 4:
-        mode_map = 4;
+        mode = 2;
         break;
     default:
         DEBUG("Weird number of channels enabled (%zu), aborting.", nr_chans);
@@ -1212,59 +1810,94 @@ HRESULT _hantek_set_frontend_level(struct hantek_device *dev, unsigned channel_n
         goto done;
     }
 
-    switch (dev->channels[channel_num].vpd) {
-    case 0:
-    case 1:
-    case 2:
-    case 3:
-    case 4:
-    case 5:
-        offset = 60;
-        break;
-    case 6:
-    case 7:
-    case 8:
-        offset = 96;
-        break;
-    case 9:
-    case 10:
-    case 11:
-        offset = 132;
-        break;
-    default:
-        DEBUG("Invalid Volts/Division: %u", dev->channels[channel_num].vpd);
+    vpd = dev->channels[channel_num].vpd;
+
+    if (HT_POSITION_NR_VPD <= vpd) {
+        DEBUG("Invalid Volts/Division: %u", vpd);
         ret = H_ERR_INVAL_VOLTS_PER_DIV;
         goto done;
     }
 
-    line = &dev->cal_data[channel_num * 144];
+    if (HT_POSITION_NR_LEVELS <= chan_level) {
+        /* Off the end of the table, extrapolate */
+        *poffset = _hantek_calc_position(dev->cal_data, channel_num, mode, vpd, chan_level);
+        goto done;
+    }
+
+    *poffset = dev->position_table[channel_num][mode][vpd][chan_level];
 
-    hi = line[offset + mode_map];
-    lo = line[offset + mode_map + 1];
+done:
+    return ret;
+}
 
-    v = (unsigned)((((double)(hi + lo))/2.0) + 0.5);
-    x = (double)(lo - v)/_hantek_vpd_to_scale[dev->channels[channel_num].vpd];
-    q = (unsigned)(x + 0.5);
-    upper = v + q;
-    lower = v - q;
+HRESULT hantek_position_send(struct hantek_device *dev, unsigned channel_num, uint16_t offset, unsigned settle_us)
+{
+    HRESULT ret = H_OK;
+
+    static const
+    uint8_t position_msgs[HT_MAX_CHANNELS] = {
+        HT_MSG_POSITION_CH0,
+        HT_MSG_POSITION_CH1,
+        HT_MSG_POSITION_CH2,
+        HT_MSG_POSITION_CH3,
+    };
+
+    uint8_t message[4] = { 0x0 };
 
-    offset = ((double)(upper - lower)/255.0) * chan_level + lower;
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(HT_MAX_CHANNELS > channel_num);
 
+    message[0] = position_msgs[channel_num];
     message[2] = offset & 0xff;
     message[3] = (offset >> 8) & 0xff;
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev->hdl, message, sizeof(message), &transferred))) {
-        DEBUG("Failed to send frontend configuration, aborting.");
+    if (H_FAILED(ret = _hantek_send_cmd(dev, message, sizeof(message), settle_us))) {
+        DEBUG("Failed to send channel position, aborting.");
         goto done;
     }
 
-    if (transferred != sizeof(message)) {
-        DEBUG("Failed to transfer message to set channel position, aborting.");
-        ret = H_ERR_CONTROL_FAIL;
+    dev->spi_shadow.position[channel_num] = offset;
+    dev->spi_shadow.position_valid[channel_num] = true;
+
+done:
+    return ret;
+}
+
+/**
+ * Write a channel's position DAC, unless it already holds the value. The next capture waits for
+ * the front-end to settle at the new position.
+ */
+static
+HRESULT _hantek_write_position(struct hantek_device *dev, unsigned channel_num, uint16_t offset)
+{
+    HRESULT ret = H_OK;
+
+    if (true == dev->spi_shadow.position_valid[channel_num] && offset == dev->spi_shadow.position[channel_num]) {
         goto done;
     }
 
-    usleep(10000);
+    if (H_FAILED(ret = hantek_position_send(dev, channel_num, offset, 0))) {
+        goto done;
+    }
+
+    hantek_settle_mark(dev, HT_SETTLE_POSITION);
+
+done:
+    return ret;
+}
+
+static
+HRESULT _hantek_set_frontend_level(struct hantek_device *dev, unsigned channel_num, unsigned chan_level)
+{
+    HRESULT ret = H_OK;
+
+    uint16_t offset = 0;
+
+    if (H_FAILED(ret = hantek_position_lookup(dev, channel_num, chan_level, &offset))) {
+        goto done;
+    }
+
+    ret = _hantek_write_position(dev, channel_num, offset);
 
 done:
     return ret;
@@ -1287,6 +1920,8 @@ HRESULT hantek_configure_channel_frontend(struct hantek_device *dev, unsigned ch
     this_chan->enabled = enable;
     this_chan->level = chan_level;
 
+    hantek_cmd_batch_begin(dev);
+
     /* Commit the frontend configuration */
     if (H_FAILED(ret = _hantek_commit_frontend_config(dev))) {
         DEBUG("Failed to configure frontend, aborting.");
@@ -1300,25 +1935,24 @@ HRESULT hantek_configure_channel_frontend(struct hantek_device *dev, unsigned ch
     }
 
 done:
-    return ret;
+    return hantek_batch_end(dev, ret);
 }
 
 static
-HRESULT _hantek_set_trigger_mode(libusb_device_handle *hdl, enum hantek_trigger_mode mode, enum hantek_trigger_slope slope, enum hantek_coupling coupling)
+HRESULT _hantek_set_trigger_mode(struct hantek_device *dev, enum hantek_trigger_mode mode, enum hantek_trigger_slope slope, enum hantek_coupling coupling)
 {
     HRESULT ret = H_OK;
 
     uint8_t message[6] = { HT_MSG_CONFIGURE_TRIGGER, 0x0 };
-    size_t transferred = 0;
 
-    HASSERT_ARG(NULL != hdl);
+    HASSERT_ARG(NULL != dev);
 
     message[2] = (uint8_t)mode;
     message[3] = (uint8_t)slope;
     message[4] = (uint8_t)coupling;
     message[5] = 0x0;
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(hdl, message, sizeof(message), &transferred))) {
+    if (H_FAILED(ret = _hantek_send_cmd(dev, message, sizeof(message), 0))) {
         DEBUG("Failed to send set trigger mode command, aborting.");
         goto done;
     }
@@ -1337,7 +1971,6 @@ HRESULT _hantek_set_trigger_level(struct hantek_device *dev, uint8_t trig_vertic
             round = 0,
             high = 0,
             low = 0;
-    size_t transferred = 0;
 
     HASSERT_ARG(NULL != dev);
 
@@ -1391,7 +2024,7 @@ HRESULT _hantek_set_trigger_level(struct hantek_device *dev, uint8_t trig_vertic
     message[24] = pos;
     message[25] = pos;
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev->hdl, message, sizeof(message), &transferred))) {
+    if (H_FAILED(ret = _hantek_send_cmd(dev, message, sizeof(message), 0))) {
         DEBUG("Failed to send set trigger level message, aborting.");
         goto done;
     }
@@ -1406,7 +2039,6 @@ HRESULT _hantek_set_trigger_horizontal_offset(struct hantek_device *dev, uint32_
     HRESULT ret = H_OK;
 
     uint8_t message[14] = { HT_MSG_SET_TRIG_HORIZ_POS, 0x0 };
-    size_t transferred = 0;
     uint64_t leading = 0x831c4,
              trailing = 0x7d7d0;
 
@@ -1430,7 +2062,7 @@ HRESULT _hantek_set_trigger_horizontal_offset(struct hantek_device *dev, uint32_
     message[12] = (trailing >> 32) & 0xff;
     message[13] = (trailing >> 40) & 0xff;
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev->hdl, message, sizeof(message), &transferred))) {
+    if (H_FAILED(ret = _hantek_send_cmd(dev, message, sizeof(message), 0))) {
         DEBUG("Failed to set horizontal offset, aborting.");
         goto done;
     }
@@ -1447,7 +2079,6 @@ HRESULT _hantek_set_trigger_source(struct hantek_device *dev, uint8_t channel, u
     uint8_t message[6] = { HT_MSG_SET_TRIGGER_SOURCE, 0x0 };
     bool is_ch_not_enabled = false;
     uint8_t mask = 0;
-    size_t transferred = 0;
 
     HASSERT_ARG(NULL != dev);
     HASSERT_ARG(channel < 4);
@@ -1478,7 +2109,7 @@ HRESULT _hantek_set_trigger_source(struct hantek_device *dev, uint8_t channel, u
     message[4] = 0; /* FIXME: only valid for sampling rates 250MSPS and below */
     message[5] = (is_ch_not_enabled << 2) | (channel & 0x3);
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev->hdl, message, sizeof(message), &transferred))) {
+    if (H_FAILED(ret = _hantek_send_cmd(dev, message, sizeof(message), 0))) {
         DEBUG("Failed to send set trigger level message, aborting.");
         goto done;
     }
@@ -1495,6 +2126,8 @@ HRESULT hantek_configure_trigger(struct hantek_device *dev, unsigned channel_num
     HASSERT_ARG(4 > channel_num);
     HASSERT_ARG(trig_horiz_offset <= 100);
 
+    hantek_cmd_batch_begin(dev);
+
     /* Set trigger horizontal offset, with hard-coded slop for now */
     if (H_FAILED(ret = _hantek_set_trigger_horizontal_offset(dev, trig_horiz_offset, 4))) {
         goto done;
@@ -1509,11 +2142,188 @@ HRESULT hantek_configure_trigger(struct hantek_device *dev, unsigned channel_num
         goto done;
     }
 
-    if (H_FAILED(ret = _hantek_set_trigger_mode(dev->hdl, mode, slope, coupling))) {
+    if (H_FAILED(ret = _hantek_set_trigger_mode(dev, mode, slope, coupling))) {
+        goto done;
+    }
+
+    dev->trigger.channel = channel_num;
+    dev->trigger.mode = mode;
+    dev->trigger.slope = slope;
+    dev->trigger.coupling = coupling;
+    dev->trigger.level = trig_vertical_level;
+    dev->trigger.slop = trig_vertical_slop;
+    dev->trigger.horiz_offset = trig_horiz_offset;
+    dev->trigger_set = true;
+
+done:
+    return hantek_batch_end(dev, ret);
+}
+
+HRESULT hantek_get_capture_config(struct hantek_device *dev, struct hantek_capture_config *pconfig)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != pconfig);
+
+    memset(pconfig, 0, sizeof(*pconfig));
+
+    pconfig->timebase = dev->timebase;
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        pconfig->channels[i].enabled = dev->channels[i].enabled;
+        pconfig->channels[i].bw_limit = dev->channels[i].bw_limit;
+        pconfig->channels[i].vpd = dev->channels[i].vpd;
+        pconfig->channels[i].coupling = dev->channels[i].coupling;
+        pconfig->channels[i].level = dev->channels[i].level;
+    }
+
+    pconfig->trigger_set = dev->trigger_set;
+    pconfig->trigger = dev->trigger;
+    pconfig->capture_buffer_len = dev->capture_buffer_len;
+
+    return ret;
+}
+
+HRESULT hantek_apply_config(struct hantek_device *dev, const struct hantek_capture_config *config)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_channel old_channels[HT_MAX_CHANNELS];
+    struct hantek_trigger_config *trig = NULL;
+    uint16_t positions[HT_MAX_CHANNELS] = { 0 };
+    uint8_t setup[HT_MAX_CHANNELS];
+    bool relays_changed = false,
+         sent = false;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != config);
+    HASSERT_ARG(HT_ST_MAX >= config->timebase);
+    HASSERT_ARG(HT_CAPTURE_MAX_LEN >= config->capture_buffer_len);
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        HASSERT_ARG(HT_VPD_10V >= config->channels[i].vpd);
+    }
+
+    if (true == config->trigger_set) {
+        HASSERT_ARG(HT_MAX_CHANNELS > config->trigger.channel);
+        HASSERT_ARG(100 >= config->trigger.horiz_offset);
+    }
+
+    if (0 != config->capture_buffer_len && config->capture_buffer_len != dev->capture_buffer_len &&
+            HT_ACQ_IDLE != dev->acq.state)
+    {
+        DEBUG("Can't change the capture length while acquiring, aborting.");
+        ret = H_ERR_BUSY;
+        goto done;
+    }
+
+    memcpy(old_channels, dev->channels, sizeof(old_channels));
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        struct hantek_channel *chan = &dev->channels[i];
+
+        chan->enabled = config->channels[i].enabled;
+        chan->bw_limit = config->channels[i].bw_limit;
+        chan->vpd = config->channels[i].vpd;
+        chan->coupling = config->channels[i].coupling;
+        chan->level = config->channels[i].level;
+    }
+
+    /* Work out everything before sending anything, so a bad config leaves the scope alone */
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        if (H_FAILED(ret = hantek_position_lookup(dev, i, dev->channels[i].level, &positions[i]))) {
+            DEBUG("Can't work out the position of channel %zu, aborting.", i);
+            memcpy(dev->channels, old_channels, sizeof(old_channels));
+            goto done;
+        }
+    }
+
+    relays_changed = _hantek_frontend_setup(dev, setup);
+
+    sent = true;
+    hantek_cmd_batch_begin(dev);
+
+    /*
+     * Nothing here waits for the analog side to settle; the next capture waits once for whatever
+     * takes longest.
+     */
+    if (true == config->trigger_set) {
+        trig = &dev->trigger;
+
+        if (false == dev->trigger_set || config->trigger.horiz_offset != trig->horiz_offset) {
+            if (H_FAILED(ret = _hantek_set_trigger_horizontal_offset(dev, config->trigger.horiz_offset, 4))) {
+                goto done;
+            }
+        }
+
+        if (false == dev->trigger_set || config->trigger.channel != trig->channel) {
+            if (H_FAILED(ret = _hantek_set_trigger_source(dev, config->trigger.channel, 0))) {
+                goto done;
+            }
+        }
+
+        if (false == dev->trigger_set || config->trigger.level != trig->level || config->trigger.slop != trig->slop) {
+            if (H_FAILED(ret = _hantek_set_trigger_level(dev, config->trigger.level, config->trigger.slop))) {
+                goto done;
+            }
+        }
+
+        if (false == dev->trigger_set || config->trigger.mode != trig->mode || config->trigger.slope != trig->slope ||
+                config->trigger.coupling != trig->coupling)
+        {
+            if (H_FAILED(ret = _hantek_set_trigger_mode(dev, config->trigger.mode, config->trigger.slope, config->trigger.coupling))) {
+                goto done;
+            }
+        }
+
+        dev->trigger = config->trigger;
+        dev->trigger_set = true;
+    }
+
+    if (HT_ST_MAX != config->timebase && config->timebase != dev->timebase) {
+        if (H_FAILED(ret = hantek_set_sampling_rate(dev, config->timebase))) {
+            goto done;
+        }
+    }
+
+    /* Goes through the SPI shadow, so only registers that change are written */
+    if (H_FAILED(ret = hantek_configure_adc_routing(dev))) {
+        goto done;
+    }
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        if (H_FAILED(ret = _hantek_write_position(dev, i, positions[i]))) {
+            goto done;
+        }
+    }
+
+    if (true == relays_changed && H_FAILED(ret = _hantek_commit_frontend_config(dev))) {
         goto done;
     }
 
+    if (0 != config->capture_buffer_len && config->capture_buffer_len != dev->capture_buffer_len) {
+        dev->capture_buffer_len = config->capture_buffer_len;
+
+        /* Reallocated at the new size on next use */
+        hantek_free(dev->raw_buf);
+        dev->raw_buf = NULL;
+    }
+
 done:
+    if (true == sent) {
+        ret = hantek_batch_end(dev, ret);
+
+        if (H_FAILED(ret)) {
+            /* We can't tell what made it out, so make sure the next apply sends it all again */
+            dev->timebase = HT_ST_MAX;
+            dev->trigger_set = false;
+            hantek_spi_shadow_invalidate(dev);
+        } else if (0 == dev->batch.depth && false == dev->state_on_disk) {
+            /* A known good configuration, for a warm reopen to carry on from */
+            hantek_state_save(dev);
+        }
+    }
     return ret;
 }
 
@@ -1528,7 +2338,7 @@ HRESULT _hantek_capture_read_status(struct hantek_device *dev, uint64_t *pstatus
 
     HASSERT_ARG(NULL != dev);
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev->hdl, message, sizeof(message), &transferred))) {
+    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev, message, sizeof(message), &transferred))) {
         DEBUG("Failed to send buffer status request command, aborting.");
         goto done;
     }
@@ -1539,7 +2349,7 @@ HRESULT _hantek_capture_read_status(struct hantek_device *dev, uint64_t *pstatus
         goto done;
     }
 
-    if (H_FAILED(ret = _hantek_bulk_read_in(dev->hdl, result, sizeof(result)))) {
+    if (H_FAILED(ret = _hantek_bulk_read_in(dev, result, sizeof(result)))) {
         DEBUG("Failed to read in status word, aborting.");
         goto done;
     }
@@ -1562,16 +2372,25 @@ HRESULT __hantek_send_prepare_readback_req(struct hantek_device *dev)
     HRESULT ret = H_OK;
 
     uint8_t message[4] = { HT_MSG_BUFFER_PREPARE_TRANSFER, 0x00 };
+    size_t transferred = 0;
 
     HASSERT_ARG(NULL != dev);
 
+    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev, message, sizeof(message), &transferred))) {
+        DEBUG("Failed to send prepare transfer message, aborting.");
+        goto done;
+    }
 
-
+done:
     return ret;
 }
 
+/**
+ * Ask for the next len bytes of the capture. The length is in 16-bit words, and each request
+ * continues where the last one left off, so deep captures are read with one request per chunk.
+ */
 static
-HRESULT __hantek_request_read_buffer(struct hantek_device *dev)
+HRESULT __hantek_request_read_buffer(struct hantek_device *dev, size_t len)
 {
     HRESULT ret = H_OK;
 
@@ -1580,14 +2399,15 @@ HRESULT __hantek_request_read_buffer(struct hantek_device *dev)
     size_t cap_buf_len = 0;
 
     HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(HT_CAPTURE_CHUNK_LEN >= len);
 
-    cap_buf_len = dev->capture_buffer_len >> 1;
+    cap_buf_len = len >> 1;
 
     message[2] = cap_buf_len & 0xff;
     message[3] = (cap_buf_len >> 8) & 0xff;
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev->hdl, message, sizeof(message), &transferred))) {
-        DEBUG("Failed to send set trigger level message, aborting.");
+    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev, message, sizeof(message), &transferred))) {
+        DEBUG("Failed to send read buffer message, aborting.");
         goto done;
     }
 
@@ -1596,23 +2416,45 @@ done:
 }
 
 static
-HRESULT _hantek_read_capture_buffer(struct hantek_device *dev, uint8_t *ch1, uint8_t *ch2, uint8_t *ch3, uint8_t *ch4)
+HRESULT _hantek_read_capture_buffer(struct hantek_device *dev, uint8_t *raw, size_t *preceived)
 {
     HRESULT ret = H_OK;
 
     HASSERT_ARG(NULL != dev);
 
-    if (H_FAILED(ret = __hantek_send_readback_req(dev))) {
+    if (H_FAILED(ret = __hantek_send_prepare_readback_req(dev))) {
         DEBUG("Failed to send readback request, aborting.");
         goto done;
     }
 
-    if (H_FAILED(ret = __hantek_request_read_buffer(dev))) {
-        DEBUG("Failed to send request to initiate buffer read, aborting.");
-        goto done;
-    }
+    *preceived = 0;
+
+    while (*preceived < dev->capture_buffer_len) {
+        size_t chunk_len = dev->capture_buffer_len - *preceived,
+               received = 0;
+
+        if (chunk_len > HT_CAPTURE_CHUNK_LEN) {
+            chunk_len = HT_CAPTURE_CHUNK_LEN;
+        }
+
+        if (H_FAILED(ret = __hantek_request_read_buffer(dev, chunk_len))) {
+            DEBUG("Failed to send request to initiate buffer read, aborting.");
+            goto done;
+        }
+
+        /* Read back the chunk, until there is an empty result */
+        if (H_FAILED(ret = hantek_readback_bulk_in(dev, raw + *preceived, chunk_len, &received))) {
+            DEBUG("Failed to read back capture buffer, aborting.");
+            goto done;
+        }
+
+        *preceived += received;
 
-    /* TODO: read back the buffer, until there is an empty result */
+        if (received != chunk_len) {
+            /* The capture ended early, the caller reports the short read */
+            break;
+        }
+    }
 
 done:
     return ret;
@@ -1623,15 +2465,54 @@ HRESULT hantek_retrieve_buffer(struct hantek_device *dev, uint8_t *ch1, uint8_t
     HRESULT ret = H_OK;
 
     uint64_t cap_status = 0;
+    bool data_ready = false;
+    size_t received = 0;
 
     HASSERT_ARG(NULL != dev);
 
+    hantek_cmd_session_begin(dev);
+
+    if (0 == dev->adc_nr_streams) {
+        DEBUG("ADC routing has not been configured, can't split the capture into channels.");
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    if (NULL == dev->raw_buf && NULL == (dev->raw_buf = hantek_malloc(dev->capture_buffer_len))) {
+        DEBUG("Failed to allocate raw capture buffer, aborting.");
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_get_status(dev, &data_ready))) {
+        DEBUG("Failed to get capture status, aborting.");
+        goto done;
+    }
+
+    if (false == data_ready) {
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
     if (H_FAILED(ret = _hantek_capture_read_status(dev, &cap_status))) {
         DEBUG("Failed to get capture readback status, aborting.");
         goto done;
     }
 
+    if (H_FAILED(ret = _hantek_read_capture_buffer(dev, dev->raw_buf, &received))) {
+        goto done;
+    }
+
+    if (received != dev->capture_buffer_len) {
+        DEBUG("Short capture: %zu of %zu bytes", received, dev->capture_buffer_len);
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    ret = hantek_split_channels(dev, dev->raw_buf, received, ch1, ch2, ch3, ch4);
+
 done:
+    hantek_cmd_session_end(dev);
     return ret;
 }
 
@@ -1640,19 +2521,18 @@ HRESULT hantek_start_capture(struct hantek_device *dev, enum hantek_capture_mode
     HRESULT ret = H_OK;
 
     uint8_t message[4] = { HT_MSG_SEND_START_CAPTURE, 0x00, mode, 0x00 };
-    size_t transferred = 0;
 
     HASSERT_ARG(NULL != dev);
 
-    if (H_FAILED(ret = _hantek_bulk_cmd_out(dev->hdl, message, sizeof(message), &transferred))) {
+    /* Don't capture the front-end or ADC while they are still settling */
+    hantek_wait_settled(dev);
+
+    if (H_FAILED(ret = _hantek_send_cmd(dev, message, sizeof(message), 0))) {
         DEBUG("Failed to send start capture command, aborting.");
         goto done;
     }
 
-    if (transferred != sizeof(message)) {
-        DEBUG("Failed to transfer message for some reason, aborting.");
-        goto done;
-    }
+    dev->armed_ns = hantek_now_ns();
 
 done:
     return ret;
@@ -5,14 +5,26 @@
 #include <stdlib.h>
 
 struct hantek_device;
+struct hantek_transport;
+struct hantek_buffer;
+struct hantek_segments;
 
 typedef int32_t HRESULT;
 
+#define HT_SERIAL_NUMBER_LEN        8
+
+/**
+ * Deepest capture the scope's SDRAM holds, and the chunks deep captures are read back in, in bytes
+ */
+#define HT_CAPTURE_MAX_LEN          (64 * 1024 * 1024)
+#define HT_CAPTURE_CHUNK_LEN        (64 * 1024)
+
 #define H_ERR(s, x)                 (0x80000000 | ((s) << 16) | (x))
 #define H_FAILED(x)                 ((x) & 0x80000000)
 
 #define H_SUB_NONE                  0x0
 #define H_SUB_LIBUSB                0x2
+#define H_SUB_RECORD                0x3
 
 #define H_OK                        0x0
 #define H_ERR_BAD_ARGS              H_ERR(H_SUB_NONE, 1)
@@ -21,11 +33,17 @@ typedef int32_t HRESULT;
 #define H_ERR_BAD_SAMPLE_RATE       H_ERR(H_SUB_NONE, 4)
 #define H_ERR_INVAL_CHANNELS        H_ERR(H_SUB_NONE, 5)
 #define H_ERR_INVAL_VOLTS_PER_DIV   H_ERR(H_SUB_NONE, 6)
+#define H_ERR_BUSY                  H_ERR(H_SUB_NONE, 7)
+#define H_ERR_CANCELLED             H_ERR(H_SUB_NONE, 8)
 
 #define H_ERR_NOT_FOUND             H_ERR(H_SUB_LIBUSB, 1)
 #define H_ERR_CONTROL_FAIL          H_ERR(H_SUB_LIBUSB, 2)
 #define H_ERR_CANT_OPEN             H_ERR(H_SUB_LIBUSB, 3)
 
+#define H_ERR_RECORD_IO             H_ERR(H_SUB_RECORD, 1)
+#define H_ERR_RECORD_BAD_FORMAT     H_ERR(H_SUB_RECORD, 2)
+#define H_ERR_RECORD_DIVERGED       H_ERR(H_SUB_RECORD, 3)
+
 
 /**
  * Supported time-per-dvision (for the virtical graticule)
@@ -100,12 +118,274 @@ enum hantek_capture_mode {
 };
 
 /**
- * Open a Hantek 6xx4 device.
+ * Trigger settings, as passed to hantek_configure_trigger
+ */
+struct hantek_trigger_config {
+    unsigned channel;
+    enum hantek_trigger_mode mode;
+    enum hantek_trigger_slope slope;
+    enum hantek_coupling coupling;
+    uint8_t level;
+    uint8_t slop;
+    uint32_t horiz_offset;
+};
+
+/**
+ * Operations that leave the hardware needing time to settle
+ */
+enum hantek_settle_op {
+    /**
+     * Front-end shift register load, before it can be latched onto the relays
+     */
+    HT_SETTLE_RELAY_LOAD = 0,
+
+    /**
+     * Front-end relays switching, once latched
+     */
+    HT_SETTLE_RELAY = 1,
+
+    /**
+     * Channel position DACs
+     */
+    HT_SETTLE_POSITION = 2,
+
+    /**
+     * HMCAD1511 register writes, including powering the ADC back up, and changes to its clock
+     */
+    HT_SETTLE_ADC = 3,
+
+    HT_SETTLE_MAX,
+};
+
+/**
+ * Decoded status byte
+ */
+struct hantek_status {
+    /**
+     * The status byte, as read from the scope
+     */
+    uint8_t raw;
+
+    /**
+     * The trigger has fired, the capture is complete and ready to read back, the FPGA has
+     * finished packing it, and the capture SDRAM has been initialized
+     */
+    bool triggered;
+    bool data_ready;
+    bool pack_state;
+    bool sdram_init;
+};
+
+/**
+ * The whole acquisition setup: a snapshot of the settings as last configured, or the settings
+ * hantek_apply_config should bring the scope to
+ */
+struct hantek_capture_config {
+    /**
+     * Time per division, or HT_ST_MAX if it has not been set (or should be left alone)
+     */
+    enum hantek_time_per_division timebase;
+
+    /**
+     * Front-end settings per channel
+     */
+    struct {
+        bool enabled;
+        bool bw_limit;
+        enum hantek_volts_per_div vpd;
+        enum hantek_coupling coupling;
+        uint16_t level;
+    } channels[4];
+
+    /**
+     * Trigger settings, only meaningful (or applied) if trigger_set
+     */
+    bool trigger_set;
+    struct hantek_trigger_config trigger;
+
+    /**
+     * Length of each capture, in bytes. 0 leaves it alone when applying.
+     */
+    size_t capture_buffer_len;
+};
+
+/**
+ * Where one segment of a segmented acquisition is, and what was known about it when it was read
+ * back
+ */
+struct hantek_segment_info {
+    /**
+     * Offset of the segment's raw capture data in the segment region, and its length
+     */
+    size_t offset;
+    size_t len;
+
+    /**
+     * When the capture was seen to complete, in CLOCK_MONOTONIC nanoseconds
+     */
+    uint64_t timestamp_ns;
+
+    /**
+     * Buffer status word read back with the capture, which holds the trigger position
+     */
+    uint64_t trigger_status;
+};
+
+/**
+ * A file descriptor to wait on, with the poll(2) events of interest
+ */
+struct hantek_pollfd {
+    int fd;
+    short events;
+};
+
+/**
+ * States of the non-blocking acquisition state machine
+ */
+enum hantek_acquire_state {
+    HT_ACQ_IDLE = 0,
+    HT_ACQ_ARMING = 1,
+    HT_ACQ_WAITING = 2,
+    HT_ACQ_READING = 3,
+};
+
+/**
+ * Statistics from the capture readback engine
+ */
+struct hantek_readback_stats {
+    /**
+     * Length of each bulk IN transfer, and how many were kept in flight, for the last readback
+     */
+    size_t transfer_len;
+    unsigned nr_transfers;
+
+    /**
+     * The last readback: transfers submitted, short and zero length transfers seen, bytes
+     * received and how long it took
+     */
+    uint64_t nr_submitted;
+    uint64_t nr_short;
+    uint64_t nr_zlp;
+    uint64_t bytes;
+    uint64_t duration_ns;
+
+    /**
+     * Whether the last readback saw the device end the capture, and whether the device had
+     * more data than fit in the destination
+     */
+    bool terminated;
+    bool overrun;
+
+    /**
+     * Totals since the device was opened
+     */
+    uint64_t total_readbacks;
+    uint64_t total_submitted;
+    uint64_t total_bytes;
+};
+
+/**
+ * Flags for hantek_pipeline_start
+ */
+#define HT_PIPELINE_OVERLAP_READBACK        (1 << 0)
+
+/**
+ * Statistics from pipelined acquisition
+ */
+struct hantek_pipeline_stats {
+    /**
+     * Captures delivered, and captures lost while falling back from overlapped readback
+     */
+    uint64_t nr_frames;
+    uint64_t nr_failed;
+
+    /**
+     * Captures delivered per second, since the pipeline started
+     */
+    double waveforms_per_sec;
+
+    /**
+     * Blind time: from seeing a capture complete to the next capture being armed, in nanoseconds
+     */
+    uint64_t blind_ns_avg;
+    uint64_t blind_ns_max;
+
+    /**
+     * Whether the next capture is being armed while the previous one is read back
+     */
+    bool overlapped;
+};
+
+/**
+ * Called from hantek_handle_events when a pipelined capture is ready in buffer buf_index, which
+ * then belongs to the caller until it is handed back with hantek_pipeline_release. A buf_index
+ * of -1 means the pipeline has stopped, and result says why.
+ */
+typedef void (*hantek_pipeline_cb_t)(struct hantek_device *dev, HRESULT result, int buf_index, size_t nr_bytes, void *priv);
+
+/**
+ * Called from hantek_handle_events when a segmented acquisition finishes. On success every
+ * segment has been captured, otherwise segs holds the ones captured before the failure or stop.
+ */
+typedef void (*hantek_segments_cb_t)(struct hantek_device *dev, HRESULT result, struct hantek_segments *segs, void *priv);
+
+/**
+ * Called from hantek_handle_events when an acquisition finishes. On success, nr_bytes of raw
+ * capture data are in the buffer handed to hantek_acquire_start.
+ */
+typedef void (*hantek_acquire_cb_t)(struct hantek_device *dev, HRESULT result, size_t nr_bytes, void *priv);
+
+/**
+ * Called from hantek_handle_events with each chunk of a capture started with
+ * hantek_acquire_chunked_start, in order, as soon as it has been read back. data is only valid
+ * until the callback returns.
+ */
+typedef void (*hantek_chunk_cb_t)(struct hantek_device *dev, const uint8_t *data, size_t offset, size_t len, void *priv);
+
+/**
+ * Open a Hantek 6xx4 device. Captures are capture_buffer_len bytes long, up to
+ * HT_CAPTURE_MAX_LEN; anything over HT_CAPTURE_CHUNK_LEN is read back in chunks.
  */
 HRESULT hantek_open_device(struct hantek_device **pdev, uint32_t capture_buffer_len);
 
 /**
- * Close an open Hantek 6xx4 device.
+ * Open a Hantek 6xx4 device over the given transport. On success the device owns the transport,
+ * otherwise it remains the caller's to close.
+ */
+HRESULT hantek_open_device_on(struct hantek_device **pdev, struct hantek_transport *tp, uint32_t capture_buffer_len);
+
+/**
+ * Open a device like hantek_open_device_on, but if an earlier open left it configured, and it has
+ * been neither reset nor reattached since, carry on with it as it is instead of resetting it.
+ * *pwarm says which happened. The configuration is saved in the device cache directory after a
+ * cold open, and each time hantek_apply_config or hantek_apply_rate_plan succeeds, so this needs
+ * hantek_set_cache_dir. Any other command that changes the configuration drops what was saved,
+ * until the next apply.
+ */
+HRESULT hantek_reopen_device_on(struct hantek_device **pdev, struct hantek_transport *tp, uint32_t capture_buffer_len, bool *pwarm);
+
+/**
+ * Keep each device's calibration data and hardware revision in a file in the given directory,
+ * keyed by serial number and FPGA version, so opening the same device again doesn't read them
+ * back from its EEPROM. Pass NULL to turn the cache off, which is the default. Set this before
+ * opening any devices.
+ */
+HRESULT hantek_set_cache_dir(const char *path);
+
+/**
+ * Open a transport to the first supported Hantek device attached over USB.
+ */
+HRESULT hantek_usb_transport_open(struct hantek_transport **ptp);
+
+/**
+ * Close a transport that is not owned by a device.
+ */
+HRESULT hantek_transport_close(struct hantek_transport **ptp);
+
+/**
+ * Close an open Hantek 6xx4 device. Any acquisition still in progress is cancelled, and its
+ * callback called with H_ERR_CANCELLED, first. If it doesn't stop, this fails with H_ERR_BUSY and
+ * the device is left open.
  */
 HRESULT hantek_close_device(struct hantek_device **pdev);
 
@@ -134,12 +414,364 @@ HRESULT hantek_start_capture(struct hantek_device *dev, enum hantek_capture_mode
  */
 HRESULT hantek_get_status(struct hantek_device *dev, bool *pdata_ready);
 
+/**
+ * Get the decoded status from the oscilloscope
+ */
+HRESULT hantek_read_status(struct hantek_device *dev, struct hantek_status *pstatus);
+
+/**
+ * Wait up to timeout_ms for the capture started with hantek_start_capture to be ready. Sleeps
+ * for as long as the capture has to take at the current time base, then polls the status with
+ * backoff, starting over quickly once the trigger has fired. Returns H_ERR_NOT_READY on timeout.
+ * The last status read is returned in pstatus, if not NULL.
+ */
+HRESULT hantek_wait_ready(struct hantek_device *dev, unsigned timeout_ms, struct hantek_status *pstatus);
+
 /**
  * Configure the ADC's routing, based on the current channel setup
  */
 HRESULT hantek_configure_adc_routing(struct hantek_device *dev);
 
 /**
- * Retrieve sample buffer, if one is ready
+ * Retrieve sample buffer, if one is ready. Returns H_ERR_NOT_READY if not. The samples of each
+ * enabled channel are written to its buffer, which must hold hantek_get_channel_buffer_len
+ * bytes; buffers for disabled channels may be NULL.
  */
 HRESULT hantek_retrieve_buffer(struct hantek_device *dev, uint8_t *ch1, uint8_t *ch2, uint8_t *ch3, uint8_t *ch4);
+
+/**
+ * Get the number of samples each enabled channel gets from a capture, with the current ADC
+ * routing
+ */
+HRESULT hantek_get_channel_buffer_len(struct hantek_device *dev, size_t *plen);
+
+/**
+ * Split raw_len bytes of raw capture data, as delivered by hantek_acquire_start, into the
+ * per-channel buffers, as for hantek_retrieve_buffer. The ADC routing must not have changed
+ * since the capture was taken. A NULL buffer skips that channel.
+ */
+HRESULT hantek_split_channels(struct hantek_device *dev, const uint8_t *raw, size_t raw_len, uint8_t *ch1, uint8_t *ch2, uint8_t *ch3, uint8_t *ch4);
+
+/**
+ * Begin a command session. Until the matching hantek_cmd_session_end, the command handshake and
+ * USB speed check are done once and cached, rather than before every command. The handshake is
+ * redone if a command fails. Sessions may be nested.
+ */
+HRESULT hantek_cmd_session_begin(struct hantek_device *dev);
+
+/**
+ * End a command session.
+ */
+HRESULT hantek_cmd_session_end(struct hantek_device *dev);
+
+/**
+ * Begin a command batch. Until the matching hantek_cmd_batch_commit, configuration commands are
+ * queued rather than sent. Batches may be nested, only the outermost commit sends anything.
+ */
+HRESULT hantek_cmd_batch_begin(struct hantek_device *dev);
+
+/**
+ * Commit a command batch. Queued commands are submitted back-to-back, only pausing where the
+ * hardware needs time to settle. Returns the first failure of any command in the batch.
+ */
+HRESULT hantek_cmd_batch_commit(struct hantek_device *dev);
+
+/**
+ * Configure the capture readback engine: how many bulk IN transfers to keep in flight, and the
+ * length of each transfer in bytes (a multiple of 512). Pass 0 for both to have them planned
+ * from the length of each readback, which is the default.
+ */
+HRESULT hantek_set_readback_params(struct hantek_device *dev, unsigned nr_transfers, size_t transfer_len);
+
+/**
+ * Get statistics from the capture readback engine
+ */
+HRESULT hantek_get_readback_stats(struct hantek_device *dev, struct hantek_readback_stats *pstats);
+
+/**
+ * Get the file descriptors an event loop should wait on for this device. Up to max_fds are
+ * filled in, the number the device has is returned in pnr_fds. Whenever one becomes ready, or
+ * the timeout from hantek_get_timeout expires, call hantek_handle_events.
+ */
+HRESULT hantek_get_pollfds(struct hantek_device *dev, struct hantek_pollfd *fds, size_t max_fds, size_t *pnr_fds);
+
+/**
+ * Get how long, in milliseconds, the event loop may wait before calling hantek_handle_events
+ * regardless of file descriptor activity. -1 means no limit.
+ */
+HRESULT hantek_get_timeout(struct hantek_device *dev, int *ptimeout_ms);
+
+/**
+ * Process pending device events and advance the acquisition state machine. Never blocks.
+ */
+HRESULT hantek_handle_events(struct hantek_device *dev);
+
+/**
+ * Start a non-blocking acquisition: arm the capture, poll until data is ready, then read up to
+ * len bytes of raw capture data into buf. The capture is transferred straight into buf, which is
+ * best allocated with hantek_buffer_alloc. Only the command handshake is done before returning,
+ * everything else happens from hantek_handle_events, and cb is called from there at the end.
+ * No other commands may be issued until the acquisition has finished.
+ */
+HRESULT hantek_acquire_start(struct hantek_device *dev, enum hantek_capture_mode mode, uint8_t *buf, size_t len, hantek_acquire_cb_t cb, void *priv);
+
+/**
+ * Start a non-blocking acquisition that hands the capture over chunk by chunk, rather than
+ * all at once, so a deep capture never has to fit in memory. Each chunk is read back into buf,
+ * which must hold at least HT_CAPTURE_CHUNK_LEN bytes, and passed to chunk_cb while the next is
+ * requested. cb is called at the end with the total number of bytes delivered.
+ */
+HRESULT hantek_acquire_chunked_start(struct hantek_device *dev, enum hantek_capture_mode mode, uint8_t *buf, size_t len, hantek_chunk_cb_t chunk_cb, hantek_acquire_cb_t cb, void *priv);
+
+/**
+ * Cancel the acquisition in progress. The callback is still called, with H_ERR_CANCELLED, once
+ * the transfer currently in flight has completed.
+ */
+HRESULT hantek_acquire_cancel(struct hantek_device *dev);
+
+/**
+ * Start pipelined acquisition, rotating through nr_bufs buffers of len bytes each. Each capture
+ * is rearmed as soon as the previous one has been read back, before it is handed to cb, so the
+ * scope waits for the next trigger while the caller processes the last one. With
+ * HT_PIPELINE_OVERLAP_READBACK, the next capture is armed as soon as the readback of the
+ * previous one has been requested; if the FPGA turns out not to cope, the pipeline falls back
+ * to rearming after readback. Runs until hantek_pipeline_stop, or an error.
+ */
+HRESULT hantek_pipeline_start(struct hantek_device *dev, enum hantek_capture_mode mode, uint8_t *const *bufs, size_t nr_bufs, size_t len, unsigned flags, hantek_pipeline_cb_t cb, void *priv);
+
+/**
+ * Hand a buffer delivered by the pipeline back, so it can be captured into again
+ */
+HRESULT hantek_pipeline_release(struct hantek_device *dev, int buf_index);
+
+/**
+ * Stop pipelined acquisition. The callback is called with a buf_index of -1 once the pipeline
+ * has stopped.
+ */
+HRESULT hantek_pipeline_stop(struct hantek_device *dev);
+
+/**
+ * Get statistics from pipelined acquisition
+ */
+HRESULT hantek_get_pipeline_stats(struct hantek_device *dev, struct hantek_pipeline_stats *pstats);
+
+/**
+ * Allocate room for nr_segments captures, back to back in one region, plus their index
+ */
+HRESULT hantek_segments_alloc(struct hantek_device *dev, size_t nr_segments, struct hantek_segments **psegs);
+
+/**
+ * Free segments allocated with hantek_segments_alloc
+ */
+HRESULT hantek_segments_free(struct hantek_device *dev, struct hantek_segments **psegs);
+
+/**
+ * Get the captured segments: the region holding their raw capture data, their index, how many
+ * were captured, and the acquisition settings they were captured with. Any of the out
+ * parameters may be NULL.
+ */
+HRESULT hantek_segments_get(struct hantek_segments *segs, const uint8_t **pdata, const struct hantek_segment_info **pinfo, size_t *pnr_segments, struct hantek_capture_config *pconfig);
+
+/**
+ * Start a segmented acquisition: capture every segment of segs in turn, rearming right after
+ * each readback (or during it, with HT_PIPELINE_OVERLAP_READBACK), and call cb once at the end.
+ * Pipeline statistics apply, and hantek_pipeline_stop ends the acquisition early.
+ */
+HRESULT hantek_segmented_start(struct hantek_device *dev, enum hantek_capture_mode mode, struct hantek_segments *segs, unsigned flags, hantek_segments_cb_t cb, void *priv);
+
+/**
+ * Get the number of samples per second each channel gets, with the current ADC clock, sample
+ * spacing and ADC routing
+ */
+HRESULT hantek_get_sample_rate(struct hantek_device *dev, double *prate);
+
+struct hantek_alloc_stats {
+    /**
+     * Heap allocations and frees the library has made, and the bytes it has asked for
+     */
+    uint64_t nr_allocs;
+    uint64_t nr_frees;
+    uint64_t bytes;
+};
+
+/**
+ * Set or get how long the hardware takes to settle after the given operation, in microseconds.
+ * Settling only holds up whatever depends on the settled state: arming a capture, or the next
+ * step of the operation itself.
+ */
+HRESULT hantek_set_settle_time(struct hantek_device *dev, enum hantek_settle_op op, unsigned settle_us);
+HRESULT hantek_get_settle_time(struct hantek_device *dev, enum hantek_settle_op op, unsigned *psettle_us);
+
+/**
+ * Block until everything written so far has settled
+ */
+HRESULT hantek_wait_settled(struct hantek_device *dev);
+
+/**
+ * Measure the shortest settle time that gives the same capture as a fully settled one, by
+ * toggling the given operation on the first enabled channel and capturing after shorter and
+ * shorter delays. The channels and ADC routing must be configured, and the current settle time
+ * must be long enough to be safe. The result, with some margin, becomes the new settle time.
+ * HT_SETTLE_RELAY_LOAD can't be seen in a capture, so it can't be calibrated.
+ */
+HRESULT hantek_settle_calibrate(struct hantek_device *dev, enum hantek_settle_op op, unsigned *psettle_us);
+
+/**
+ * Get the library's heap allocation counters, e.g. to check that a running acquisition is not
+ * allocating. Allocations made inside libusb are not counted.
+ */
+HRESULT hantek_get_alloc_stats(struct hantek_alloc_stats *pstats);
+
+/**
+ * Get the acquisition settings as last configured
+ */
+HRESULT hantek_get_capture_config(struct hantek_device *dev, struct hantek_capture_config *pconfig);
+
+/**
+ * Bring the scope to the given configuration in one go. Only the settings that differ from the
+ * current state are sent, in one batch, ordered so each settling delay is paid at most once.
+ * Nothing is sent if the configuration can't be applied.
+ */
+HRESULT hantek_apply_config(struct hantek_device *dev, const struct hantek_capture_config *config);
+
+/**
+ * Flags for hantek_position_sweep
+ */
+#define HT_SWEEP_CAPTURE                    (1 << 0)
+
+struct hantek_sweep_config {
+    /**
+     * Channel to move, and the levels to move it through, in order
+     */
+    unsigned channel;
+    const uint16_t *levels;
+    size_t nr_levels;
+
+    /**
+     * Time between moving to a level and the next step, in microseconds. When capturing, this is
+     * the time before arming, and 0 means the position settle time.
+     */
+    unsigned dwell_us;
+
+    /**
+     * Capture mode and timeout, when capturing at each step (HT_SWEEP_CAPTURE)
+     */
+    enum hantek_capture_mode mode;
+    unsigned timeout_ms;
+
+    unsigned flags;
+};
+
+/**
+ * One step of a position sweep, as handed to the sweep callback
+ */
+struct hantek_sweep_step {
+    size_t index;
+    uint16_t level;
+
+    /**
+     * The position DAC value the level translated to
+     */
+    uint16_t offset;
+
+    /**
+     * Samples captured at this step, nr_samples per enabled channel, NULL for disabled channels.
+     * Only valid during the callback.
+     */
+    const uint8_t *samples[4];
+    size_t nr_samples;
+};
+
+typedef void (*hantek_sweep_cb_t)(struct hantek_device *dev, const struct hantek_sweep_step *step, void *priv);
+
+/**
+ * Move a channel's position through a sequence of levels. Positions come from a table built from
+ * the calibration data at open. Without HT_SWEEP_CAPTURE, the whole sweep goes out as one batch,
+ * holding each level for dwell_us, and cb may be NULL. With it, each step moves the position and
+ * arms a capture in one batch, then hands the capture to cb. The channel's level is left at the
+ * last level of the sweep.
+ */
+HRESULT hantek_position_sweep(struct hantek_device *dev, const struct hantek_sweep_config *cfg, hantek_sweep_cb_t cb, void *priv);
+
+/**
+ * Sample rate to plan for to get the fastest the channels allow
+ */
+#define HT_RATE_MAX                         0.0
+
+/**
+ * How to run the scope at a sample rate, as worked out by hantek_plan_sample_rate
+ */
+struct hantek_rate_plan {
+    /**
+     * Channels to capture, one bit per channel
+     */
+    unsigned channel_mask;
+
+    /**
+     * ADC streams the channels take (1, 2 or 4), and the ADC clock divider mode that gives each
+     * stream its share of the clock (log2 of the number of streams)
+     */
+    size_t nr_streams;
+    unsigned clk_div;
+
+    /**
+     * ADC clock, the ADF4360 N counter that makes it, and how many ADC clocks apart the samples
+     * kept from each stream are
+     */
+    uint64_t adc_clock_hz;
+    unsigned pll_n;
+    uint32_t spacing;
+
+    /**
+     * Length of each capture in bytes, rounded up to whole readback packets, and the samples each
+     * channel gets from it
+     */
+    size_t capture_buffer_len;
+    size_t nr_samples;
+
+    /**
+     * Sample rate each channel gets, and the fastest these channels could be sampled at
+     */
+    double rate;
+    double max_rate;
+};
+
+/**
+ * Work out how to sample the channels in channel_mask at rate samples per second, or as fast as
+ * they allow for HT_RATE_MAX. The planned rate never goes above rate, and planning fails with
+ * H_ERR_BAD_SAMPLE_RATE if it would be more than tolerance (a fraction of rate, 0 for exactly)
+ * below it. Rates the sample spacing alone can't get that close to are made up by retuning the
+ * ADC clock as little as it takes, down to about 7% below its usual 1 GHz. Captures hold at least nr_samples per channel, or keep their
+ * current length for 0. One, two or four channels can be sampled, not three. Nothing is sent to
+ * the device.
+ */
+HRESULT hantek_plan_sample_rate(struct hantek_device *dev, double rate, double tolerance, size_t nr_samples, unsigned channel_mask, struct hantek_rate_plan *pplan);
+
+/**
+ * Bring the scope to a planned sample rate: enable the planned channels, route them through the
+ * ADC, set the ADC clock and sample spacing, and set the capture length. The time base reads back
+ * as HT_ST_MAX afterwards, since the rate need not be one of the time bases.
+ */
+HRESULT hantek_apply_rate_plan(struct hantek_device *dev, const struct hantek_rate_plan *plan);
+
+/**
+ * Get the state of the acquisition state machine
+ */
+HRESULT hantek_get_acquire_state(struct hantek_device *dev, enum hantek_acquire_state *pstate);
+
+/**
+ * Allocate a capture buffer of len bytes. Where the platform allows it, this is memory the USB
+ * host controller transfers into directly, otherwise it is page aligned memory. Buffers must be
+ * freed before the device is closed.
+ */
+HRESULT hantek_buffer_alloc(struct hantek_device *dev, size_t len, struct hantek_buffer **pbuf);
+
+/**
+ * Free a capture buffer
+ */
+HRESULT hantek_buffer_free(struct hantek_device *dev, struct hantek_buffer **pbuf);
+
+/**
+ * Get the memory behind a capture buffer, and its length in bytes
+ */
+HRESULT hantek_buffer_get_data(struct hantek_buffer *buf, uint8_t **pdata, size_t *plen);
@@ -0,0 +1,1168 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_usb.h>
+#include <hantek_acquire.h>
+#include <hantek_readback.h>
+#include <hantek_transport.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Non-blocking acquisition. Each step submits one asynchronous transfer, and the completion of
+ * that transfer moves the state machine on to the next step:
+ *
+ *  arm:     START_CAPTURE out
+ *  wait:    GET_STATUS out, status packet in, repeated every HT_ACQ_POLL_INTERVAL_US until
+ *           the data ready bit is set
+ *  read:    PREPARE_TRANSFER out, then for each chunk of up to HT_CAPTURE_CHUNK_LEN bytes,
+ *           READBACK_BUFFER out and the readback engine, which also consumes the packet that
+ *           terminates the chunk
+ *
+ * Segmented acquisitions also send BUFFER_STATUS and read the status word back, between the
+ * wait and the read.
+ */
+
+static
+void _hantek_acq_finish(struct hantek_device *dev, HRESULT result)
+{
+    struct hantek_acq *acq = &dev->acq;
+    hantek_acquire_cb_t cb = acq->cb;
+    hantek_pipeline_cb_t pipe_cb = acq->pipe_cb;
+    hantek_segments_cb_t seg_cb = acq->seg_cb;
+    bool pipelined = acq->pipelined;
+    bool segmented = acq->segmented;
+
+    DEBUG("Acquisition finished, result = %08x, %zu bytes", (unsigned)result, acq->received);
+
+    acq->state = HT_ACQ_IDLE;
+    acq->step = HT_ACQ_STEP_NONE;
+    acq->cb = NULL;
+    acq->chunk_cb = NULL;
+    acq->pipe_cb = NULL;
+    acq->seg_cb = NULL;
+    acq->pipelined = false;
+    acq->segmented = false;
+
+    if (true == pipelined) {
+        acq->end_ns = hantek_now_ns();
+    }
+
+    if (H_FAILED(result)) {
+        /* Whatever went wrong, start the next session with a fresh handshake */
+        dev->session_ready = false;
+    }
+
+    hantek_cmd_session_end(dev);
+
+    if (true == segmented) {
+        seg_cb(dev, result, acq->segs, acq->priv);
+    } else if (true == pipelined) {
+        pipe_cb(dev, result, -1, 0, acq->priv);
+    } else {
+        cb(dev, result, H_FAILED(result) ? 0 : acq->received, acq->priv);
+    }
+}
+
+static
+HRESULT _hantek_acq_send(struct hantek_device *dev, const uint8_t *msg, size_t len, enum hantek_acq_step next)
+{
+    struct hantek_acq *acq = &dev->acq;
+
+    memcpy(acq->cmd, msg, len);
+    acq->cmd_xfer.len = len;
+    acq->step = next;
+
+    return hantek_tp_submit(dev->tp, &acq->cmd_xfer);
+}
+
+static
+HRESULT _hantek_acq_recv(struct hantek_device *dev, enum hantek_acq_step next)
+{
+    struct hantek_acq *acq = &dev->acq;
+
+    acq->step = next;
+
+    return hantek_tp_submit(dev->tp, &acq->rsp_xfer);
+}
+
+static
+HRESULT _hantek_acq_send_status_req(struct hantek_device *dev)
+{
+    uint8_t message[2] = { HT_MSG_GET_STATUS, 0x00 };
+
+    return _hantek_acq_send(dev, message, sizeof(message), HT_ACQ_STEP_STATUS_SENT);
+}
+
+/**
+ * Arm the capture, or if the front-end or ADC are still settling, hold the command back for
+ * hantek_handle_events to send once they have
+ */
+static
+HRESULT _hantek_acq_arm(struct hantek_device *dev)
+{
+    struct hantek_acq *acq = &dev->acq;
+    uint8_t message[4] = { HT_MSG_SEND_START_CAPTURE, 0x00, acq->mode, 0x00 };
+
+    acq->next_poll_ns = hantek_settle_deadline(dev);
+
+    if (acq->next_poll_ns > hantek_now_ns()) {
+        acq->step = HT_ACQ_STEP_SETTLE_WAIT;
+        return H_OK;
+    }
+
+    return _hantek_acq_send(dev, message, sizeof(message), HT_ACQ_STEP_START_SENT);
+}
+
+/**
+ * Ask for the next chunk of the capture
+ */
+static
+HRESULT _hantek_acq_send_readback_req(struct hantek_device *dev)
+{
+    struct hantek_acq *acq = &dev->acq;
+    uint8_t message[4] = { HT_MSG_READBACK_BUFFER, 0x00 };
+    size_t nr_words = 0;
+
+    acq->chunk_len = acq->dst_len - acq->chunk_off;
+
+    if (acq->chunk_len > HT_CAPTURE_CHUNK_LEN) {
+        acq->chunk_len = HT_CAPTURE_CHUNK_LEN;
+    }
+
+    nr_words = acq->chunk_len >> 1;
+    message[2] = nr_words & 0xff;
+    message[3] = (nr_words >> 8) & 0xff;
+
+    return _hantek_acq_send(dev, message, sizeof(message), HT_ACQ_STEP_READBACK_SENT);
+}
+
+/**
+ * A pipelined capture has just been armed. Account for the time the scope was blind since the
+ * last capture completed.
+ */
+static
+void _hantek_acq_pipe_armed(struct hantek_device *dev)
+{
+    struct hantek_acq *acq = &dev->acq;
+    uint64_t blind = 0;
+
+    if (0 == acq->ready_ns) {
+        return;
+    }
+
+    blind = hantek_now_ns() - acq->ready_ns;
+
+    acq->blind_total_ns += blind;
+    acq->nr_blind++;
+
+    if (blind > acq->blind_max_ns) {
+        acq->blind_max_ns = blind;
+    }
+}
+
+/**
+ * Find a pipeline buffer that is neither held by the caller nor being captured into, or -1
+ */
+static
+int _hantek_acq_pipe_free_buf(struct hantek_acq *acq)
+{
+    if (true == acq->segmented) {
+        /* Segments are captured in order, so there is room as long as one is left to arm */
+        return acq->seg_armed < acq->segs->nr_segments ? 0 : -1;
+    }
+
+    for (size_t i = 0; i < acq->nr_bufs; i++) {
+        int idx = (acq->cur_buf + 1 + i) % acq->nr_bufs;
+
+        if (false == acq->buf_held[idx] && idx != acq->cur_buf) {
+            return idx;
+        }
+    }
+
+    /* The current buffer is free again once its capture has been delivered or dropped */
+    return (false == acq->buf_held[acq->cur_buf] && HT_ACQ_STEP_READBACK != acq->step) ? acq->cur_buf : -1;
+}
+
+/**
+ * Move the pipeline on to the next capture, once the last one has been read back and any
+ * START_CAPTURE sent meanwhile has completed. The capture just read back is delivered only after
+ * the next one has been armed, so the caller's processing overlaps the wait for the trigger.
+ * A segmented acquisition ends here once its last segment is in.
+ */
+static
+void _hantek_acq_pipe_advance(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = &dev->acq;
+    uint8_t message[4] = { HT_MSG_SEND_START_CAPTURE, 0x00, acq->mode, 0x00 };
+    int deliver = acq->deliver_buf;
+    size_t nr_bytes = acq->received;
+    hantek_pipeline_cb_t pipe_cb = acq->pipe_cb;
+    void *priv = acq->priv;
+    int idx = -1;
+
+    if ((HT_ACQ_STEP_PIPE_NEXT != acq->step && HT_ACQ_STEP_PIPE_STALLED != acq->step) ||
+            true == acq->rearm_sent)
+    {
+        return;
+    }
+
+    acq->deliver_buf = -1;
+
+    if (true == acq->cancel) {
+        ret = H_ERR_CANCELLED;
+    } else if (H_FAILED(acq->pipe_result)) {
+        ret = acq->pipe_result;
+    } else if (true == acq->rearmed) {
+        /* The next capture was armed during readback, go straight to waiting for it */
+        acq->rearmed = false;
+
+        if (false == acq->segmented) {
+            acq->cur_buf = acq->next_buf;
+            acq->dst = acq->bufs[acq->cur_buf];
+        }
+
+        acq->state = HT_ACQ_WAITING;
+        ret = _hantek_acq_send_status_req(dev);
+    } else if (true == acq->segmented && acq->segs->nr_captured == acq->segs->nr_segments) {
+        _hantek_acq_finish(dev, H_OK);
+    } else if (0 > (idx = _hantek_acq_pipe_free_buf(acq))) {
+        /* Every buffer is with the caller, wait for one to come back */
+        DEBUG("Pipeline stalled, no free buffers");
+        acq->step = HT_ACQ_STEP_PIPE_STALLED;
+    } else if (true == acq->segmented) {
+        acq->seg_armed++;
+        acq->state = HT_ACQ_ARMING;
+        ret = _hantek_acq_send(dev, message, sizeof(message), HT_ACQ_STEP_START_SENT);
+    } else {
+        acq->cur_buf = idx;
+        acq->dst = acq->bufs[idx];
+        acq->state = HT_ACQ_ARMING;
+        ret = _hantek_acq_send(dev, message, sizeof(message), HT_ACQ_STEP_START_SENT);
+    }
+
+    if (0 <= deliver) {
+        pipe_cb(dev, H_OK, deliver, nr_bytes, priv);
+    }
+
+    if (H_FAILED(ret) && HT_ACQ_IDLE != acq->state) {
+        _hantek_acq_finish(dev, ret);
+    }
+}
+
+/**
+ * Arm the next pipelined capture while the current one is read back, if allowed and there is
+ * a buffer for it
+ */
+static
+void _hantek_acq_pipe_rearm(struct hantek_device *dev)
+{
+    struct hantek_acq *acq = &dev->acq;
+    uint8_t message[4] = { HT_MSG_SEND_START_CAPTURE, 0x00, acq->mode, 0x00 };
+    int idx = -1;
+
+    if (false == acq->pipelined || false == acq->overlap || true == acq->cancel ||
+            0 > (idx = _hantek_acq_pipe_free_buf(acq)))
+    {
+        return;
+    }
+
+    /* Sent on the command transfer, without disturbing the readback step */
+    memcpy(acq->cmd, message, sizeof(message));
+    acq->cmd_xfer.len = sizeof(message);
+
+    if (H_FAILED(hantek_tp_submit(dev->tp, &acq->cmd_xfer))) {
+        DEBUG("Failed to submit overlapped start capture, rearming after readback instead");
+        return;
+    }
+
+    acq->next_buf = idx;
+    acq->rearm_sent = true;
+
+    if (true == acq->segmented) {
+        acq->seg_armed++;
+    }
+}
+
+/**
+ * The START_CAPTURE sent during readback has completed
+ */
+static
+void _hantek_acq_pipe_rearm_done(struct hantek_device *dev, struct hantek_xfer *xfer)
+{
+    struct hantek_acq *acq = &dev->acq;
+
+    acq->rearm_sent = false;
+
+    if (HT_XFER_COMPLETED != xfer->status || xfer->actual != xfer->len) {
+        DEBUG("Overlapped start capture failed, status = %d", xfer->status);
+        acq->pipe_result = H_ERR_NOT_READY;
+    } else {
+        acq->rearmed = true;
+        _hantek_acq_pipe_armed(dev);
+    }
+
+    _hantek_acq_pipe_advance(dev);
+}
+
+/**
+ * Record a segment that has been read back in full
+ */
+static
+void _hantek_acq_seg_done(struct hantek_device *dev)
+{
+    struct hantek_acq *acq = &dev->acq;
+    struct hantek_segments *segs = acq->segs;
+    struct hantek_segment_info *info = &segs->info[segs->nr_captured];
+
+    info->offset = segs->nr_captured * segs->seg_len;
+    info->len = acq->received;
+    info->timestamp_ns = acq->ready_ns;
+    info->trigger_status = acq->buf_status;
+
+    segs->nr_captured++;
+}
+
+static
+void _hantek_acq_pipe_readback_done(struct hantek_device *dev, HRESULT result, size_t received)
+{
+    struct hantek_acq *acq = &dev->acq;
+    bool overlapped = (true == acq->rearm_sent || true == acq->rearmed);
+
+    acq->received = received;
+    acq->step = HT_ACQ_STEP_PIPE_NEXT;
+
+    if (!H_FAILED(result) && received == acq->dst_len) {
+        if (true == acq->segmented) {
+            _hantek_acq_seg_done(dev);
+        } else {
+            acq->buf_held[acq->cur_buf] = true;
+            acq->deliver_buf = acq->cur_buf;
+        }
+        acq->nr_frames++;
+    } else if (true == overlapped && false == acq->cancel) {
+        /* Most likely the FPGA dropped the readback when it was rearmed, so stop doing that */
+        DEBUG("Readback failed while rearmed (%zu of %zu bytes), no longer overlapping", received, acq->dst_len);
+        acq->overlap = false;
+        acq->nr_failed++;
+
+        if (true == acq->segmented) {
+            /* The segment is captured again, into the same place */
+            acq->seg_armed--;
+        }
+    } else if (H_FAILED(result)) {
+        acq->pipe_result = result;
+    } else if (false == acq->cancel) {
+        DEBUG("Short capture: %zu of %zu bytes", received, acq->dst_len);
+        acq->pipe_result = H_ERR_NOT_READY;
+    }
+
+    _hantek_acq_pipe_advance(dev);
+}
+
+static
+void _hantek_acq_readback_done(struct hantek_device *dev, HRESULT result, size_t received)
+{
+    struct hantek_acq *acq = &dev->acq;
+    size_t chunk_off = acq->chunk_off;
+
+    if (!H_FAILED(result) && received == acq->chunk_len && chunk_off + received < acq->dst_len &&
+            false == acq->cancel)
+    {
+        /* Ask for the next chunk before handing this one over, so the device stays busy */
+        acq->chunk_off += received;
+
+        if (!H_FAILED(result = _hantek_acq_send_readback_req(dev))) {
+            if (NULL != acq->chunk_cb) {
+                acq->chunk_cb(dev, acq->chunk_dst, chunk_off, received, acq->priv);
+            }
+            return;
+        }
+
+        DEBUG("Failed to request the next chunk, aborting.");
+    } else if (NULL != acq->chunk_cb && !H_FAILED(result) && 0 != received) {
+        acq->chunk_cb(dev, acq->chunk_dst, chunk_off, received, acq->priv);
+    }
+
+    received += chunk_off;
+
+    if (true == acq->pipelined) {
+        _hantek_acq_pipe_readback_done(dev, result, received);
+        return;
+    }
+
+    acq->received = received;
+
+    if (H_FAILED(result)) {
+        _hantek_acq_finish(dev, result);
+        return;
+    }
+
+    _hantek_acq_finish(dev, true == acq->cancel ? H_ERR_CANCELLED : H_OK);
+}
+
+/**
+ * Move on from the step whose transfer just completed
+ */
+static
+void _hantek_acq_advance(struct hantek_device *dev, struct hantek_xfer *xfer)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = &dev->acq;
+    uint8_t message[4] = { 0x0 };
+
+    if (&acq->cmd_xfer == xfer && true == acq->rearm_sent) {
+        _hantek_acq_pipe_rearm_done(dev, xfer);
+        return;
+    }
+
+    if (HT_XFER_COMPLETED != xfer->status ||
+            (&acq->cmd_xfer == xfer && xfer->actual != xfer->len))
+    {
+        DEBUG("Acquisition transfer failed at step %d, status = %d", acq->step, xfer->status);
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    if (true == acq->cancel) {
+        ret = H_ERR_CANCELLED;
+        goto done;
+    }
+
+    switch (acq->step) {
+    case HT_ACQ_STEP_START_SENT:
+        if (true == acq->pipelined) {
+            _hantek_acq_pipe_armed(dev);
+        }
+
+        acq->armed_ns = hantek_now_ns();
+        acq->state = HT_ACQ_WAITING;
+        ret = _hantek_acq_send_status_req(dev);
+        break;
+    case HT_ACQ_STEP_STATUS_SENT:
+        ret = _hantek_acq_recv(dev, HT_ACQ_STEP_STATUS_RECEIVED);
+        break;
+    case HT_ACQ_STEP_STATUS_RECEIVED:
+        if (0 == xfer->actual) {
+            DEBUG("Empty status response, aborting.");
+            ret = H_ERR_NOT_READY;
+            break;
+        }
+
+        if (0 == (acq->rsp[0] & HT_STATUS_DATA_READY)) {
+            /* Not there yet, hantek_handle_events sends the next poll */
+            acq->next_poll_ns = hantek_now_ns() + HT_ACQ_POLL_INTERVAL_US * 1000ull;
+            acq->step = HT_ACQ_STEP_POLL_WAIT;
+            break;
+        }
+
+        acq->ready_ns = hantek_now_ns();
+        acq->state = HT_ACQ_READING;
+        acq->chunk_off = 0;
+
+        if (true == acq->segmented) {
+            /* Pick up where the trigger landed before reading the capture back */
+            message[0] = HT_MSG_BUFFER_STATUS;
+            ret = _hantek_acq_send(dev, message, 2, HT_ACQ_STEP_BUF_STATUS_SENT);
+            break;
+        }
+
+        message[0] = HT_MSG_BUFFER_PREPARE_TRANSFER;
+        ret = _hantek_acq_send(dev, message, sizeof(message), HT_ACQ_STEP_PREPARE_SENT);
+        break;
+    case HT_ACQ_STEP_BUF_STATUS_SENT:
+        ret = _hantek_acq_recv(dev, HT_ACQ_STEP_BUF_STATUS_RECEIVED);
+        break;
+    case HT_ACQ_STEP_BUF_STATUS_RECEIVED:
+        if (5 > xfer->actual) {
+            DEBUG("Short buffer status response (%zu bytes), aborting.", xfer->actual);
+            ret = H_ERR_NOT_READY;
+            break;
+        }
+
+        acq->buf_status = ((uint64_t)acq->rsp[4] << 32) |
+                ((uint64_t)acq->rsp[3] << 24) |
+                ((uint64_t)acq->rsp[2] << 16) |
+                ((uint64_t)acq->rsp[1] << 8) |
+                ((uint64_t)acq->rsp[0]);
+
+        message[0] = HT_MSG_BUFFER_PREPARE_TRANSFER;
+        ret = _hantek_acq_send(dev, message, sizeof(message), HT_ACQ_STEP_PREPARE_SENT);
+        break;
+    case HT_ACQ_STEP_PREPARE_SENT:
+        ret = _hantek_acq_send_readback_req(dev);
+        break;
+    case HT_ACQ_STEP_READBACK_SENT:
+        acq->step = HT_ACQ_STEP_READBACK;
+
+        if (true == acq->segmented) {
+            acq->dst = acq->segs->data + acq->segs->nr_captured * acq->segs->seg_len;
+        }
+
+        acq->chunk_dst = NULL != acq->chunk_cb ? acq->dst : acq->dst + acq->chunk_off;
+
+        if (H_FAILED(ret = hantek_readback_start(dev, acq->chunk_dst, acq->chunk_len, _hantek_acq_readback_done))) {
+            break;
+        }
+
+        /* Rearming resets the capture memory, so only once the last chunk is on its way */
+        if (acq->chunk_off + acq->chunk_len >= acq->dst_len) {
+            _hantek_acq_pipe_rearm(dev);
+        }
+        break;
+    default:
+        DEBUG("Unexpected transfer completion at step %d", acq->step);
+        ret = H_ERR_NOT_READY;
+        break;
+    }
+
+done:
+    if (H_FAILED(ret)) {
+        _hantek_acq_finish(dev, ret);
+    }
+}
+
+static
+void _hantek_acq_xfer_cb(struct hantek_xfer *xfer)
+{
+    _hantek_acq_advance(xfer->priv, xfer);
+}
+
+HRESULT hantek_acquire_init(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+
+    memset(&dev->acq, 0, sizeof(dev->acq));
+
+    return ret;
+}
+
+HRESULT hantek_run_until_idle(struct hantek_device *dev, int wake_fd, _Atomic bool *stop)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = NULL;
+    bool cancelled = false;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(0 <= wake_fd);
+    HASSERT_ARG(NULL != stop);
+
+    acq = &dev->acq;
+
+    while (HT_ACQ_IDLE != acq->state) {
+        struct pollfd pfds[HT_ACQ_MAX_POLLFDS + 1];
+        struct hantek_pollfd hfds[HT_ACQ_MAX_POLLFDS];
+        size_t nr_fds = 0;
+        int timeout_ms = -1;
+        uint64_t count = 0;
+
+        if (false == cancelled && true == atomic_load(stop)) {
+            hantek_acquire_cancel(dev);
+            cancelled = true;
+
+            /* With nothing in flight the acquisition is already done, and nothing would wake the poll */
+            continue;
+        }
+
+        if (H_FAILED(ret = hantek_get_pollfds(dev, hfds, HT_ACQ_MAX_POLLFDS, &nr_fds)) ||
+                H_FAILED(ret = hantek_get_timeout(dev, &timeout_ms)))
+        {
+            DEBUG("Failed to get device events to wait on");
+            hantek_acquire_cancel(dev);
+            cancelled = true;
+            timeout_ms = 0;
+            nr_fds = 0;
+        }
+
+        if (nr_fds > HT_ACQ_MAX_POLLFDS) {
+            nr_fds = HT_ACQ_MAX_POLLFDS;
+        }
+
+        for (size_t i = 0; i < nr_fds; i++) {
+            pfds[i].fd = hfds[i].fd;
+            pfds[i].events = hfds[i].events;
+            pfds[i].revents = 0;
+        }
+
+        pfds[nr_fds].fd = wake_fd;
+        pfds[nr_fds].events = POLLIN;
+        pfds[nr_fds].revents = 0;
+
+        if (0 > poll(pfds, nr_fds + 1, timeout_ms) && EINTR != errno) {
+            DEBUG("Failed to poll: %s (%d)", strerror(errno), errno);
+        }
+
+        /* Non-blocking, so this just fails with EAGAIN if nothing was signalled */
+        if (0 != (pfds[nr_fds].revents & POLLIN) &&
+                sizeof(count) != read(wake_fd, &count, sizeof(count)) && EAGAIN != errno)
+        {
+            DEBUG("Failed to drain wakeup: %s (%d)", strerror(errno), errno);
+        }
+
+        if (H_FAILED(ret = hantek_handle_events(dev)) && false == cancelled) {
+            DEBUG("Failed to handle device events, cancelling acquisition");
+            hantek_acquire_cancel(dev);
+            cancelled = true;
+        }
+    }
+
+    return ret;
+}
+
+HRESULT hantek_acquire_drain(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = NULL;
+    uint64_t deadline = 0,
+             now = 0;
+
+    HASSERT_ARG(NULL != dev);
+
+    acq = &dev->acq;
+
+    if (HT_ACQ_IDLE == acq->state) {
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_acquire_cancel(dev))) {
+        goto done;
+    }
+
+    deadline = hantek_now_ns() + (uint64_t)HT_ACQ_DRAIN_MS * 1000000ull;
+
+    while (HT_ACQ_IDLE != acq->state) {
+        now = hantek_now_ns();
+
+        if (now >= deadline) {
+            DEBUG("Acquisition still has transfers in flight, giving up.");
+            ret = H_ERR_BUSY;
+            goto done;
+        }
+
+        if (H_FAILED(ret = hantek_tp_handle_events(dev->tp, (unsigned)((deadline - now + 999999) / 1000000)))) {
+            DEBUG("Failure while handling transfer events");
+            goto done;
+        }
+    }
+
+done:
+    return ret;
+}
+
+HRESULT hantek_acquire_cleanup(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = NULL;
+
+    HASSERT_ARG(NULL != dev);
+
+    acq = &dev->acq;
+
+    HASSERT_ARG(HT_ACQ_IDLE == acq->state);
+
+    if (true == acq->xfers_ready) {
+        hantek_tp_xfer_release(dev->tp, &acq->cmd_xfer);
+        hantek_tp_xfer_release(dev->tp, &acq->rsp_xfer);
+        acq->xfers_ready = false;
+    }
+
+    return ret;
+}
+
+/**
+ * Set up the command and response transfers, on first use
+ */
+static
+HRESULT _hantek_acq_setup_xfers(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = &dev->acq;
+
+    if (true == acq->xfers_ready) {
+        goto done;
+    }
+
+    acq->cmd_xfer.endpoint = HT6000_EP_OUT;
+    acq->cmd_xfer.buf = acq->cmd;
+    acq->cmd_xfer.timeout_ms = HT_BATCH_TIMEOUT_MS;
+    acq->cmd_xfer.cb = _hantek_acq_xfer_cb;
+    acq->cmd_xfer.priv = dev;
+
+    acq->rsp_xfer.endpoint = HT6000_EP_IN | (1 << 7);
+    acq->rsp_xfer.buf = acq->rsp;
+    acq->rsp_xfer.len = sizeof(acq->rsp);
+    acq->rsp_xfer.timeout_ms = HT_READBACK_TIMEOUT_MS;
+    acq->rsp_xfer.cb = _hantek_acq_xfer_cb;
+    acq->rsp_xfer.priv = dev;
+
+    if (H_FAILED(ret = hantek_tp_xfer_init(dev->tp, &acq->cmd_xfer))) {
+        DEBUG("Failed to set up acquisition command transfer, aborting.");
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_tp_xfer_init(dev->tp, &acq->rsp_xfer))) {
+        DEBUG("Failed to set up acquisition response transfer, aborting.");
+        hantek_tp_xfer_release(dev->tp, &acq->cmd_xfer);
+        goto done;
+    }
+
+    acq->xfers_ready = true;
+
+done:
+    return ret;
+}
+
+/**
+ * Start a single acquisition, once the caller has checked where the capture goes
+ */
+static
+HRESULT _hantek_acq_start(struct hantek_device *dev, enum hantek_capture_mode mode, uint8_t *buf, hantek_chunk_cb_t chunk_cb, hantek_acquire_cb_t cb, void *priv)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = &dev->acq;
+    bool in_session = false;
+
+    if (H_FAILED(ret = _hantek_acq_setup_xfers(dev))) {
+        goto done;
+    }
+
+    /* The session is held until the acquisition finishes, so we only handshake here */
+    hantek_cmd_session_begin(dev);
+    in_session = true;
+
+    if (false == dev->session_ready && H_FAILED(ret = _hantek_cmd_handshake(dev))) {
+        DEBUG("Failed to handshake before acquisition, aborting.");
+        goto done;
+    }
+
+    acq->mode = mode;
+    acq->dst = buf;
+    acq->dst_len = dev->capture_buffer_len;
+    acq->received = 0;
+    acq->cb = cb;
+    acq->chunk_cb = chunk_cb;
+    acq->priv = priv;
+    acq->cancel = false;
+    acq->armed_ns = 0;
+    acq->ready_ns = 0;
+    acq->state = HT_ACQ_ARMING;
+
+    /* Don't capture the front-end or ADC while they are still settling */
+    if (H_FAILED(ret = _hantek_acq_arm(dev))) {
+        DEBUG("Failed to submit start capture command, aborting.");
+        acq->state = HT_ACQ_IDLE;
+        acq->step = HT_ACQ_STEP_NONE;
+        acq->cb = NULL;
+        acq->chunk_cb = NULL;
+        goto done;
+    }
+
+    in_session = false;
+
+done:
+    if (true == in_session) {
+        dev->session_ready = false;
+        hantek_cmd_session_end(dev);
+    }
+    return ret;
+}
+
+HRESULT hantek_acquire_start(struct hantek_device *dev, enum hantek_capture_mode mode, uint8_t *buf, size_t len, hantek_acquire_cb_t cb, void *priv)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != buf);
+    HASSERT_ARG(NULL != cb);
+
+    if (HT_ACQ_IDLE != dev->acq.state) {
+        DEBUG("An acquisition is already in progress");
+        ret = H_ERR_BUSY;
+        goto done;
+    }
+
+    /* The whole capture has to fit, so the terminating short packet is seen */
+    HASSERT_ARG(len >= dev->capture_buffer_len);
+
+    ret = _hantek_acq_start(dev, mode, buf, NULL, cb, priv);
+
+done:
+    return ret;
+}
+
+HRESULT hantek_acquire_chunked_start(struct hantek_device *dev, enum hantek_capture_mode mode, uint8_t *buf, size_t len, hantek_chunk_cb_t chunk_cb, hantek_acquire_cb_t cb, void *priv)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != buf);
+    HASSERT_ARG(NULL != chunk_cb);
+    HASSERT_ARG(NULL != cb);
+
+    if (HT_ACQ_IDLE != dev->acq.state) {
+        DEBUG("An acquisition is already in progress");
+        ret = H_ERR_BUSY;
+        goto done;
+    }
+
+    /* A whole chunk has to fit, so the packet terminating it is seen */
+    HASSERT_ARG(len >= HT_CAPTURE_CHUNK_LEN || len >= dev->capture_buffer_len);
+
+    ret = _hantek_acq_start(dev, mode, buf, chunk_cb, cb, priv);
+
+done:
+    return ret;
+}
+
+HRESULT hantek_acquire_cancel(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = NULL;
+
+    HASSERT_ARG(NULL != dev);
+
+    acq = &dev->acq;
+
+    if (HT_ACQ_IDLE == acq->state) {
+        goto done;
+    }
+
+    acq->cancel = true;
+
+    if (HT_ACQ_STEP_SETTLE_WAIT == acq->step || HT_ACQ_STEP_POLL_WAIT == acq->step ||
+            HT_ACQ_STEP_PIPE_STALLED == acq->step)
+    {
+        /* Nothing in flight, so we can stop right away */
+        _hantek_acq_finish(dev, H_ERR_CANCELLED);
+    }
+
+done:
+    return ret;
+}
+
+/**
+ * Start a pipelined or segmented acquisition, once the caller has checked no other acquisition is
+ * in progress and set up where the captures go
+ */
+static
+HRESULT _hantek_acq_pipe_start(struct hantek_device *dev, enum hantek_capture_mode mode, bool overlap, void *priv)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = &dev->acq;
+    bool in_session = false;
+
+    if (H_FAILED(ret = _hantek_acq_setup_xfers(dev))) {
+        goto done;
+    }
+
+    hantek_cmd_session_begin(dev);
+    in_session = true;
+
+    if (false == dev->session_ready && H_FAILED(ret = _hantek_cmd_handshake(dev))) {
+        DEBUG("Failed to handshake before acquisition, aborting.");
+        goto done;
+    }
+
+    acq->cur_buf = 0;
+    acq->next_buf = -1;
+    acq->deliver_buf = -1;
+    acq->overlap = overlap;
+    acq->rearm_sent = false;
+    acq->rearmed = false;
+    acq->pipe_result = H_OK;
+
+    acq->ready_ns = 0;
+    acq->start_ns = hantek_now_ns();
+    acq->end_ns = 0;
+    acq->nr_frames = 0;
+    acq->nr_failed = 0;
+    acq->nr_blind = 0;
+    acq->blind_total_ns = 0;
+    acq->blind_max_ns = 0;
+
+    acq->mode = mode;
+    acq->dst_len = dev->capture_buffer_len;
+    acq->received = 0;
+    acq->cb = NULL;
+    acq->chunk_cb = NULL;
+    acq->priv = priv;
+    acq->cancel = false;
+    acq->pipelined = true;
+    acq->state = HT_ACQ_ARMING;
+
+    /* Don't capture the front-end or ADC while they are still settling */
+    if (H_FAILED(ret = _hantek_acq_arm(dev))) {
+        DEBUG("Failed to submit start capture command, aborting.");
+        acq->state = HT_ACQ_IDLE;
+        acq->step = HT_ACQ_STEP_NONE;
+        acq->pipe_cb = NULL;
+        acq->seg_cb = NULL;
+        acq->pipelined = false;
+        acq->segmented = false;
+        goto done;
+    }
+
+    in_session = false;
+
+done:
+    if (true == in_session) {
+        dev->session_ready = false;
+        hantek_cmd_session_end(dev);
+    }
+    return ret;
+}
+
+HRESULT hantek_pipeline_start(struct hantek_device *dev, enum hantek_capture_mode mode, uint8_t *const *bufs, size_t nr_bufs, size_t len, unsigned flags, hantek_pipeline_cb_t cb, void *priv)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = NULL;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != bufs);
+    HASSERT_ARG(0 != nr_bufs && HT_PIPELINE_MAX_BUFFERS >= nr_bufs);
+    HASSERT_ARG(NULL != cb);
+
+    acq = &dev->acq;
+
+    if (HT_ACQ_IDLE != acq->state) {
+        DEBUG("An acquisition is already in progress");
+        ret = H_ERR_BUSY;
+        goto done;
+    }
+
+    HASSERT_ARG(len >= dev->capture_buffer_len);
+
+    for (size_t i = 0; i < nr_bufs; i++) {
+        HASSERT_ARG(NULL != bufs[i]);
+    }
+
+    memcpy(acq->bufs, bufs, nr_bufs * sizeof(*bufs));
+    memset(acq->buf_held, 0, sizeof(acq->buf_held));
+    acq->nr_bufs = nr_bufs;
+    acq->dst = bufs[0];
+    acq->pipe_cb = cb;
+    acq->segmented = false;
+
+    ret = _hantek_acq_pipe_start(dev, mode, !!(flags & HT_PIPELINE_OVERLAP_READBACK) && 1 < nr_bufs, priv);
+
+done:
+    return ret;
+}
+
+HRESULT hantek_segmented_start(struct hantek_device *dev, enum hantek_capture_mode mode, struct hantek_segments *segs, unsigned flags, hantek_segments_cb_t cb, void *priv)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = NULL;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != segs);
+    HASSERT_ARG(NULL != cb);
+
+    acq = &dev->acq;
+
+    if (HT_ACQ_IDLE != acq->state) {
+        DEBUG("An acquisition is already in progress");
+        ret = H_ERR_BUSY;
+        goto done;
+    }
+
+    if (segs->seg_len != dev->capture_buffer_len) {
+        DEBUG("Segments hold %zu bytes each, but captures are %zu bytes, aborting.", segs->seg_len, dev->capture_buffer_len);
+        ret = H_ERR_BAD_ARGS;
+        goto done;
+    }
+
+    /* The settings can't change while the acquisition holds the device, so one copy covers every segment */
+    if (H_FAILED(ret = hantek_get_capture_config(dev, &segs->config))) {
+        goto done;
+    }
+
+    memset(segs->info, 0, segs->nr_segments * sizeof(*segs->info));
+    segs->nr_captured = 0;
+
+    acq->nr_bufs = 0;
+    acq->segs = segs;
+    acq->seg_armed = 1;
+    acq->dst = segs->data;
+    acq->pipe_cb = NULL;
+    acq->seg_cb = cb;
+    acq->segmented = true;
+
+    ret = _hantek_acq_pipe_start(dev, mode, !!(flags & HT_PIPELINE_OVERLAP_READBACK) && 1 < segs->nr_segments, priv);
+
+done:
+    return ret;
+}
+
+HRESULT hantek_pipeline_release(struct hantek_device *dev, int buf_index)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = NULL;
+
+    HASSERT_ARG(NULL != dev);
+
+    acq = &dev->acq;
+
+    HASSERT_ARG(0 <= buf_index && (size_t)buf_index < acq->nr_bufs);
+
+    acq->buf_held[buf_index] = false;
+
+    if (true == acq->pipelined && HT_ACQ_STEP_PIPE_STALLED == acq->step) {
+        _hantek_acq_pipe_advance(dev);
+    }
+
+    return ret;
+}
+
+HRESULT hantek_pipeline_stop(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+
+    if (false == dev->acq.pipelined) {
+        goto done;
+    }
+
+    ret = hantek_acquire_cancel(dev);
+
+done:
+    return ret;
+}
+
+HRESULT hantek_get_pipeline_stats(struct hantek_device *dev, struct hantek_pipeline_stats *pstats)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = NULL;
+    uint64_t elapsed = 0;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != pstats);
+
+    acq = &dev->acq;
+
+    elapsed = (0 != acq->end_ns ? acq->end_ns : hantek_now_ns()) - acq->start_ns;
+
+    pstats->nr_frames = acq->nr_frames;
+    pstats->nr_failed = acq->nr_failed;
+    pstats->waveforms_per_sec = 0 != acq->start_ns && 0 != elapsed ? (double)acq->nr_frames * 1e9 / elapsed : 0.0;
+    pstats->blind_ns_avg = 0 != acq->nr_blind ? acq->blind_total_ns / acq->nr_blind : 0;
+    pstats->blind_ns_max = acq->blind_max_ns;
+    pstats->overlapped = acq->overlap;
+
+    return ret;
+}
+
+HRESULT hantek_get_acquire_state(struct hantek_device *dev, enum hantek_acquire_state *pstate)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != pstate);
+
+    *pstate = dev->acq.state;
+
+    return ret;
+}
+
+HRESULT hantek_get_pollfds(struct hantek_device *dev, struct hantek_pollfd *fds, size_t max_fds, size_t *pnr_fds)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != fds || 0 == max_fds);
+    HASSERT_ARG(NULL != pnr_fds);
+
+    ret = hantek_tp_get_pollfds(dev->tp, fds, max_fds, pnr_fds);
+
+    return ret;
+}
+
+HRESULT hantek_get_timeout(struct hantek_device *dev, int *ptimeout_ms)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = NULL;
+    uint64_t now = 0;
+    int poll_ms = 0;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != ptimeout_ms);
+
+    acq = &dev->acq;
+
+    if (H_FAILED(ret = hantek_tp_get_timeout(dev->tp, ptimeout_ms))) {
+        goto done;
+    }
+
+    if (HT_ACQ_STEP_SETTLE_WAIT != acq->step && HT_ACQ_STEP_POLL_WAIT != acq->step) {
+        goto done;
+    }
+
+    /* Round up, so we don't wake up just before the next poll is due */
+    now = hantek_now_ns();
+    poll_ms = acq->next_poll_ns > now ? (int)((acq->next_poll_ns - now + 999999) / 1000000) : 0;
+
+    if (0 > *ptimeout_ms || poll_ms < *ptimeout_ms) {
+        *ptimeout_ms = poll_ms;
+    }
+
+done:
+    return ret;
+}
+
+HRESULT hantek_handle_events(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_acq *acq = NULL;
+
+    HASSERT_ARG(NULL != dev);
+
+    acq = &dev->acq;
+
+    if (H_FAILED(ret = hantek_tp_handle_events(dev->tp, 0))) {
+        DEBUG("Failure while handling transfer events");
+        goto done;
+    }
+
+    if (HT_ACQ_STEP_SETTLE_WAIT == acq->step && hantek_now_ns() >= acq->next_poll_ns) {
+        HRESULT arm_ret = H_OK;
+
+        if (H_FAILED(arm_ret = _hantek_acq_arm(dev))) {
+            DEBUG("Failed to submit start capture command, aborting acquisition.");
+            _hantek_acq_finish(dev, arm_ret);
+        }
+    }
+
+    if (HT_ACQ_STEP_POLL_WAIT == acq->step && hantek_now_ns() >= acq->next_poll_ns) {
+        HRESULT poll_ret = H_OK;
+
+        if (H_FAILED(poll_ret = _hantek_acq_send_status_req(dev))) {
+            DEBUG("Failed to submit status poll, aborting acquisition.");
+            _hantek_acq_finish(dev, poll_ret);
+        }
+    }
+
+done:
+    return ret;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <hantek.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+struct hantek_device;
+
+/**
+ * Set up the acquisition state machine for a freshly opened device.
+ */
+HRESULT hantek_acquire_init(struct hantek_device *dev);
+
+/**
+ * Cancel any acquisition in progress and handle transfer events until it has finished, so
+ * nothing is left in flight. Fails with H_ERR_BUSY if it hasn't finished within
+ * HT_ACQ_DRAIN_MS.
+ */
+HRESULT hantek_acquire_drain(struct hantek_device *dev);
+
+/**
+ * Handle the device's events until its acquisition has finished, waiting on its file descriptors
+ * and on wake_fd, an eventfd that is drained when it wakes us. Once *stop is set, or the device's
+ * events can't be handled, the acquisition is cancelled.
+ */
+HRESULT hantek_run_until_idle(struct hantek_device *dev, int wake_fd, _Atomic bool *stop);
+
+/**
+ * Release all resources held by the acquisition state machine. No acquisition may be in
+ * progress.
+ */
+HRESULT hantek_acquire_cleanup(struct hantek_device *dev);
@@ -0,0 +1,80 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+static
+_Atomic uint64_t _hantek_nr_allocs = 0;
+
+static
+_Atomic uint64_t _hantek_nr_frees = 0;
+
+static
+_Atomic uint64_t _hantek_alloc_bytes = 0;
+
+static
+void _hantek_alloc_count(void *ptr, size_t len)
+{
+    if (NULL == ptr) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&_hantek_nr_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&_hantek_alloc_bytes, len, memory_order_relaxed);
+}
+
+void *hantek_malloc(size_t len)
+{
+    void *ptr = malloc(len);
+
+    _hantek_alloc_count(ptr, len);
+
+    return ptr;
+}
+
+void *hantek_calloc(size_t nr, size_t len)
+{
+    void *ptr = calloc(nr, len);
+
+    _hantek_alloc_count(ptr, nr * len);
+
+    return ptr;
+}
+
+int hantek_memalign(void **pptr, size_t align, size_t len)
+{
+    int ret = posix_memalign(pptr, align, len);
+
+    if (0 == ret) {
+        _hantek_alloc_count(*pptr, len);
+    }
+
+    return ret;
+}
+
+void hantek_free(void *ptr)
+{
+    if (NULL == ptr) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&_hantek_nr_frees, 1, memory_order_relaxed);
+
+    free(ptr);
+}
+
+HRESULT hantek_get_alloc_stats(struct hantek_alloc_stats *pstats)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != pstats);
+
+    pstats->nr_allocs = atomic_load(&_hantek_nr_allocs);
+    pstats->nr_frees = atomic_load(&_hantek_nr_frees);
+    pstats->bytes = atomic_load(&_hantek_alloc_bytes);
+
+    return ret;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <hantek.h>
+
+#include <stdlib.h>
+
+/**
+ * Heap allocation for the library. Everything the library allocates goes through here, so
+ * hantek_get_alloc_stats can account for it.
+ */
+void *hantek_malloc(size_t len);
+void *hantek_calloc(size_t nr, size_t len);
+int hantek_memalign(void **pptr, size_t align, size_t len);
+void hantek_free(void *ptr);
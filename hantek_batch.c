@@ -0,0 +1,267 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_usb.h>
+#include <hantek_batch.h>
+#include <hantek_transport.h>
+
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+HRESULT hantek_batch_init(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+
+    memset(&dev->batch, 0, sizeof(dev->batch));
+
+    return ret;
+}
+
+HRESULT hantek_batch_cleanup(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_batch *batch = NULL;
+
+    HASSERT_ARG(NULL != dev);
+
+    batch = &dev->batch;
+
+    for (size_t i = 0; i < HT_BATCH_MAX_CMDS; i++) {
+        if (true == batch->xfers_ready[i]) {
+            hantek_tp_xfer_release(dev->tp, &batch->xfers[i]);
+            batch->xfers_ready[i] = false;
+        }
+    }
+
+    return ret;
+}
+
+static
+void _hantek_batch_xfer_cb(struct hantek_xfer *xfer)
+{
+    struct hantek_batch *batch = xfer->priv;
+
+    batch->nr_active--;
+
+    if (HT_XFER_COMPLETED != xfer->status || xfer->actual != xfer->len) {
+        DEBUG("Batched command failed, status = %d, sent %zu of %zu bytes",
+                xfer->status, xfer->actual, xfer->len);
+        batch->xfer_result = H_ERR_NOT_READY;
+    }
+}
+
+/**
+ * Submit commands [first, last] back-to-back, and wait for all of them to complete.
+ */
+static
+HRESULT _hantek_batch_send_group(struct hantek_device *dev, size_t first, size_t last)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_batch *batch = &dev->batch;
+
+    batch->nr_active = 0;
+    batch->xfer_result = H_OK;
+
+    for (size_t i = first; i <= last; i++) {
+        struct hantek_xfer *xfer = &batch->xfers[i];
+
+        if (false == batch->xfers_ready[i]) {
+            xfer->endpoint = HT6000_EP_OUT;
+            xfer->timeout_ms = HT_BATCH_TIMEOUT_MS;
+            xfer->cb = _hantek_batch_xfer_cb;
+            xfer->priv = batch;
+
+            if (H_FAILED(batch->xfer_result = hantek_tp_xfer_init(dev->tp, xfer))) {
+                DEBUG("Failed to set up transfer for batched command %zu, aborting.", i);
+                break;
+            }
+
+            batch->xfers_ready[i] = true;
+        }
+
+        xfer->buf = batch->cmds[i].msg;
+        xfer->len = batch->cmds[i].len;
+
+        if (H_FAILED(hantek_tp_submit(dev->tp, xfer))) {
+            DEBUG("Failed to submit batched command %zu", i);
+            batch->xfer_result = H_ERR_NOT_READY;
+            break;
+        }
+
+        batch->nr_active++;
+    }
+
+    /* Always reap everything we submitted, the transfers point into the batch */
+    while (0 != batch->nr_active) {
+        if (H_FAILED(hantek_tp_handle_events(dev->tp, HT_BATCH_TIMEOUT_MS))) {
+            DEBUG("Failure while handling transfer events");
+            batch->xfer_result = H_ERR_NOT_READY;
+        }
+    }
+
+    ret = batch->xfer_result;
+
+    return ret;
+}
+
+HRESULT hantek_batch_flush(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_batch *batch = NULL;
+    size_t first = 0;
+
+    HASSERT_ARG(NULL != dev);
+
+    batch = &dev->batch;
+
+    if (H_FAILED(batch->result)) {
+        /* Dropped, so none of the queued SPI writes happened */
+        if (0 != batch->nr_cmds) {
+            hantek_spi_shadow_invalidate(dev);
+        }
+        goto done;
+    }
+
+    if (0 == batch->nr_cmds) {
+        goto done;
+    }
+
+    hantek_cmd_session_begin(dev);
+
+    if (false == dev->session_ready && H_FAILED(batch->result = _hantek_cmd_handshake(dev))) {
+        DEBUG("Failed to handshake before sending command batch, aborting.");
+        goto end_session;
+    }
+
+    DEBUG("Sending batch of %zu commands", batch->nr_cmds);
+
+    /* Send runs of commands, only stopping where the hardware needs to settle */
+    for (size_t i = 0; i < batch->nr_cmds; i++) {
+        if (0 == batch->cmds[i].settle_us && i + 1 != batch->nr_cmds) {
+            continue;
+        }
+
+        if (H_FAILED(batch->result = _hantek_batch_send_group(dev, first, i))) {
+            DEBUG("Failure while sending batched commands %zu to %zu, aborting.", first, i);
+            /* Force a fresh handshake for whatever comes next */
+            dev->session_ready = false;
+            /* Some of the queued SPI writes may not have happened */
+            hantek_spi_shadow_invalidate(dev);
+            goto end_session;
+        }
+
+        if (0 != batch->cmds[i].settle_us) {
+            usleep(batch->cmds[i].settle_us);
+        }
+
+        first = i + 1;
+    }
+
+end_session:
+    hantek_cmd_session_end(dev);
+
+done:
+    /* Anything that has to settle after what was just sent starts settling now */
+    hantek_settle_batch_sent(dev);
+
+    if (!H_FAILED(batch->result) && 0 != dev->adc_clock_pending_hz) {
+        dev->adc_clock_hz = dev->adc_clock_pending_hz;
+    }
+
+    dev->adc_clock_pending_hz = 0;
+
+    batch->nr_cmds = 0;
+    ret = batch->result;
+    return ret;
+}
+
+HRESULT hantek_batch_queue(struct hantek_device *dev, const uint8_t *msg, size_t len, unsigned settle_us)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_batch *batch = NULL;
+    struct hantek_batch_cmd *cmd = NULL;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != msg);
+    HASSERT_ARG(0 != len && HT_BATCH_MAX_CMD_LEN >= len);
+    HASSERT_ARG(0 != dev->batch.depth);
+
+    batch = &dev->batch;
+
+    /* Once something in the batch failed, the rest of the batch is dropped */
+    if (H_FAILED(ret = batch->result)) {
+        goto done;
+    }
+
+    if (HT_BATCH_MAX_CMDS == batch->nr_cmds && H_FAILED(ret = hantek_batch_flush(dev))) {
+        goto done;
+    }
+
+    cmd = &batch->cmds[batch->nr_cmds++];
+
+    memcpy(cmd->msg, msg, len);
+    cmd->len = len;
+    cmd->settle_us = settle_us;
+
+done:
+    return ret;
+}
+
+HRESULT hantek_cmd_batch_begin(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+
+    if (0 == dev->batch.depth++) {
+        dev->batch.nr_cmds = 0;
+        dev->batch.result = H_OK;
+    }
+
+    return ret;
+}
+
+HRESULT hantek_batch_end(struct hantek_device *dev, HRESULT ret)
+{
+    HRESULT cret = H_OK;
+
+    /* Whatever failed, the outermost commit drops the whole batch rather than send half of it */
+    if (H_FAILED(ret)) {
+        dev->batch.result = ret;
+    }
+
+    cret = hantek_cmd_batch_commit(dev);
+
+    return H_FAILED(ret) ? ret : cret;
+}
+
+HRESULT hantek_cmd_batch_commit(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_batch *batch = NULL;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(0 != dev->batch.depth);
+
+    batch = &dev->batch;
+
+    if (0 != --batch->depth) {
+        /* Nested batch, the outermost commit does the work */
+        ret = batch->result;
+        goto done;
+    }
+
+    ret = hantek_batch_flush(dev);
+
+    batch->result = H_OK;
+
+done:
+    return ret;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <hantek.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct hantek_device;
+
+/**
+ * Set up the command batch state for a freshly opened device.
+ */
+HRESULT hantek_batch_init(struct hantek_device *dev);
+
+/**
+ * Release all resources held by the command batch.
+ */
+HRESULT hantek_batch_cleanup(struct hantek_device *dev);
+
+/**
+ * Queue a command in the open batch. settle_us is the time the hardware needs after this
+ * command before the next one may be sent.
+ */
+HRESULT hantek_batch_queue(struct hantek_device *dev, const uint8_t *msg, size_t len, unsigned settle_us);
+
+/**
+ * Send all queued commands now, without closing the batch. Returns the aggregated result of the
+ * batch so far.
+ */
+HRESULT hantek_batch_flush(struct hantek_device *dev);
+
+/**
+ * Commit a batch opened by an internal caller, merging the batch result into the caller's own
+ * result. The caller's failure takes precedence, and drops the whole batch, including whatever
+ * enclosing batches queued, so nothing half done is sent.
+ */
+HRESULT hantek_batch_end(struct hantek_device *dev, HRESULT ret);
@@ -0,0 +1,98 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+#include <hantek_transport.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct hantek_buffer {
+    uint8_t *data;
+    size_t len;
+
+    /**
+     * Whether the memory came from the transport, rather than from the heap
+     */
+    bool dev_mem;
+};
+
+HRESULT hantek_buffer_alloc(struct hantek_device *dev, size_t len, struct hantek_buffer **pbuf)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_buffer *buf = NULL;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(0 != len);
+    HASSERT_ARG(NULL != pbuf);
+
+    *pbuf = NULL;
+
+    if (NULL == (buf = hantek_calloc(1, sizeof(*buf)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    buf->len = len;
+
+    if (!H_FAILED(hantek_tp_dev_mem_alloc(dev->tp, len, &buf->data))) {
+        DEBUG("Capture buffer of %zu bytes in device memory", len);
+        buf->dev_mem = true;
+    } else if (0 != hantek_memalign((void **)&buf->data, 0 < page_size ? (size_t)page_size : 4096, len)) {
+        DEBUG("Failed to allocate capture buffer of %zu bytes", len);
+        buf->data = NULL;
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    *pbuf = buf;
+
+done:
+    if (H_FAILED(ret)) {
+        hantek_free(buf);
+    }
+    return ret;
+}
+
+HRESULT hantek_buffer_free(struct hantek_device *dev, struct hantek_buffer **pbuf)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_buffer *buf = NULL;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != pbuf);
+    HASSERT_ARG(NULL != *pbuf);
+
+    buf = *pbuf;
+
+    if (true == buf->dev_mem) {
+        hantek_tp_dev_mem_free(dev->tp, buf->data, buf->len);
+    } else {
+        hantek_free(buf->data);
+    }
+
+    hantek_free(buf);
+    *pbuf = NULL;
+
+    return ret;
+}
+
+HRESULT hantek_buffer_get_data(struct hantek_buffer *buf, uint8_t **pdata, size_t *plen)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != buf);
+    HASSERT_ARG(NULL != pdata);
+
+    *pdata = buf->data;
+
+    if (NULL != plen) {
+        *plen = buf->len;
+    }
+
+    return ret;
+}
@@ -0,0 +1,667 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+#include <hantek_usb.h>
+#include <hantek_transport.h>
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Device cache file layout, one file per device and FPGA version. All values are little endian.
+ *  - 8 bytes: magic, "HTDCACHE"
+ *  - 4 bytes: format version
+ *  - 8 bytes: serial number, NUL padded
+ *  - 2 bytes: FPGA version
+ *  - 2 bytes: SBZ
+ *  - 4 bytes: hardware revision
+ *  - HT_CALIBRATION_INFO_ENTRIES * 2 bytes: calibration data
+ *  - 4 bytes: FNV-1a hash of everything before it
+ */
+#define HT_CACHE_MAGIC              "HTDCACHE"
+#define HT_CACHE_VERSION            1
+#define HT_CACHE_HDR_LEN            28
+#define HT_CACHE_FILE_LEN           (HT_CACHE_HDR_LEN + HT_CALIBRATION_INFO_ENTRIES * 2 + 4)
+
+/**
+ * Device state file layout, one file per device. All values are little endian.
+ *  - 8 bytes: magic, "HTDSTATE"
+ *  - 4 bytes: format version
+ *  - 4 bytes: length of the state
+ *  - HT_STATE_LEN bytes: the state, a struct hantek_saved_state a field at a time:
+ *     - HT_STATE_TOKEN_LEN bytes: token, NUL padded
+ *     - 2 bytes: FPGA version
+ *     - 2 bytes: SBZ
+ *     - 4 bytes: hardware revision
+ *     - 12 bytes per channel: enabled, bandwidth limit, level (2 bytes), volts per division
+ *       (4 bytes), coupling (4 bytes)
+ *     - 4 bytes: time per division
+ *     - 8 bytes: ADC clock, in Hz
+ *     - 4 bytes: sample spacing
+ *     - 1 byte: trigger set, then 3 bytes SBZ
+ *     - 24 bytes: trigger channel, mode, slope and coupling (4 bytes each), level, slop, 2 bytes
+ *       SBZ, horizontal offset (4 bytes)
+ *     - 4 bytes per ADC core: the channel it samples
+ *     - 4 bytes: number of ADC streams
+ *     - the SPI shadow: HMCAD1511 registers (2 bytes each) then whether each is valid, ADF4360
+ *       latches (4 bytes each) then whether each is valid, the front-end setup bytes then whether
+ *       they are valid, channel positions (2 bytes each) then whether each is valid
+ *  - 4 bytes: FNV-1a hash of everything before it
+ */
+#define HT_STATE_MAGIC              "HTDSTATE"
+#define HT_STATE_VERSION            3
+#define HT_STATE_HDR_LEN            16
+#define HT_STATE_LEN                (HT_STATE_TOKEN_LEN + 8 + HT_MAX_CHANNELS * 12 + 44 + HT_ADC_NR_CORES * 4 + 4 + \
+                                     HT_HMCAD1511_NR_REGS * 3 + HT_ADF4360_NR_LATCHES * 5 + HT_MAX_CHANNELS * 4 + 1)
+#define HT_STATE_FILE_LEN           (HT_STATE_HDR_LEN + HT_STATE_LEN + 4)
+
+#define HT_CACHE_MAX_PATH_LEN       4096
+
+/**
+ * Directory holding the cache files, empty when caching is off
+ */
+static
+char _hantek_cache_dir[HT_CACHE_MAX_PATH_LEN];
+
+static inline
+void __hantek_cache_put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static inline
+void __hantek_cache_put32(uint8_t *p, uint32_t v)
+{
+    __hantek_cache_put16(p, v & 0xffff);
+    __hantek_cache_put16(p + 2, v >> 16);
+}
+
+static inline
+uint16_t __hantek_cache_get16(const uint8_t *p)
+{
+    return (uint16_t)p[0] | (uint16_t)p[1] << 8;
+}
+
+static inline
+uint32_t __hantek_cache_get32(const uint8_t *p)
+{
+    return (uint32_t)__hantek_cache_get16(p) | (uint32_t)__hantek_cache_get16(p + 2) << 16;
+}
+
+static
+uint32_t _hantek_cache_hash(const uint8_t *p, size_t len)
+{
+    uint32_t hash = 0x811c9dc5;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+/**
+ * Work out the path of a file in the cache, named for the device. Fails if caching is off. The
+ * path is allocated, and freed by the caller.
+ */
+static
+HRESULT _hantek_cache_path(const char *serial_number, const char *suffix, char **ppath)
+{
+    HRESULT ret = H_OK;
+
+    size_t len = 0;
+
+    *ppath = NULL;
+
+    if ('\0' == _hantek_cache_dir[0]) {
+        ret = H_ERR_NOT_FOUND;
+        goto done;
+    }
+
+    /* The serial number comes from the device, don't let it wander out of the cache directory */
+    for (const char *c = serial_number; '\0' != *c; c++) {
+        if (!isalnum((unsigned char)*c)) {
+            DEBUG("Serial number '%s' can't be used as a device cache key", serial_number);
+            ret = H_ERR_NOT_FOUND;
+            goto done;
+        }
+    }
+
+    len = strlen(_hantek_cache_dir) + strlen(serial_number) + strlen(suffix) + 2;
+
+    if (NULL == (*ppath = hantek_malloc(len))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    snprintf(*ppath, len, "%s/%s%s", _hantek_cache_dir, serial_number, suffix);
+
+done:
+    return ret;
+}
+
+/**
+ * Write a cache file under another name first, so another process opening the same device never
+ * sees half a file
+ */
+static
+HRESULT _hantek_cache_write(const char *path, const uint8_t *data, size_t len)
+{
+    HRESULT ret = H_OK;
+
+    char *tmp_path = NULL;
+    size_t tmp_len = strlen(path) + 24;
+    FILE *fp = NULL;
+    bool written = false;
+
+    if (NULL == (tmp_path = hantek_malloc(tmp_len))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    snprintf(tmp_path, tmp_len, "%s.%ld", path, (long)getpid());
+
+    if (NULL == (fp = fopen(tmp_path, "wb"))) {
+        DEBUG("Failed to open device cache '%s' for writing", tmp_path);
+        ret = H_ERR_RECORD_IO;
+        goto done;
+    }
+
+    written = 1 == fwrite(data, len, 1, fp);
+
+    if (0 != fclose(fp) || false == written || 0 != rename(tmp_path, path)) {
+        DEBUG("Failed to write device cache '%s'", path);
+        unlink(tmp_path);
+        ret = H_ERR_RECORD_IO;
+        goto done;
+    }
+
+    DEBUG("Wrote device cache '%s'", path);
+
+done:
+    hantek_free(tmp_path);
+    return ret;
+}
+
+/**
+ * Read a whole cache file, failing unless it is exactly len bytes long
+ */
+static
+HRESULT _hantek_cache_read(const char *path, uint8_t *data, size_t len)
+{
+    HRESULT ret = H_OK;
+
+    FILE *fp = NULL;
+    uint8_t extra = 0;
+
+    if (NULL == (fp = fopen(path, "rb"))) {
+        ret = H_ERR_NOT_FOUND;
+        goto done;
+    }
+
+    if (1 != fread(data, len, 1, fp) || 0 != fread(&extra, 1, 1, fp)) {
+        DEBUG("Device cache '%s' is the wrong size, ignoring it", path);
+        ret = H_ERR_NOT_FOUND;
+        goto done;
+    }
+
+done:
+    if (NULL != fp) {
+        fclose(fp);
+    }
+    return ret;
+}
+
+HRESULT hantek_set_cache_dir(const char *path)
+{
+    HRESULT ret = H_OK;
+
+    if (NULL == path) {
+        _hantek_cache_dir[0] = '\0';
+        goto done;
+    }
+
+    HASSERT_ARG('\0' != path[0] && HT_CACHE_MAX_PATH_LEN > strlen(path));
+
+    strcpy(_hantek_cache_dir, path);
+
+done:
+    return ret;
+}
+
+HRESULT hantek_cache_load(const char *serial_number, uint16_t fpga_version, uint16_t *cal_data, uint32_t *phardware_rev)
+{
+    HRESULT ret = H_OK;
+
+    char *path = NULL,
+         suffix[16];
+    uint8_t *file = NULL;
+    char serial[HT_SERIAL_NUMBER_LEN] = { 0 };
+
+    HASSERT_ARG(NULL != serial_number);
+    HASSERT_ARG(NULL != cal_data);
+    HASSERT_ARG(NULL != phardware_rev);
+
+    snprintf(suffix, sizeof(suffix), "-%04x.htcache", (unsigned)fpga_version);
+
+    if (H_FAILED(ret = _hantek_cache_path(serial_number, suffix, &path))) {
+        goto done;
+    }
+
+    if (NULL == (file = hantek_malloc(HT_CACHE_FILE_LEN))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    if (H_FAILED(ret = _hantek_cache_read(path, file, HT_CACHE_FILE_LEN))) {
+        goto done;
+    }
+
+    memcpy(serial, serial_number, strnlen(serial_number, sizeof(serial)));
+
+    if (0 != memcmp(file, HT_CACHE_MAGIC, 8) ||
+            HT_CACHE_VERSION != __hantek_cache_get32(&file[8]) ||
+            0 != memcmp(&file[12], serial, sizeof(serial)) ||
+            fpga_version != __hantek_cache_get16(&file[20]) ||
+            _hantek_cache_hash(file, HT_CACHE_FILE_LEN - 4) != __hantek_cache_get32(&file[HT_CACHE_FILE_LEN - 4]))
+    {
+        DEBUG("Device cache '%s' is stale or damaged, ignoring it", path);
+        ret = H_ERR_NOT_FOUND;
+        goto done;
+    }
+
+    if (HT_CALIBRATION_NONZERO_FLAG != __hantek_cache_get16(&file[HT_CACHE_HDR_LEN + (HT_CALIBRATION_INFO_ENTRIES - 1) * 2])) {
+        DEBUG("Device cache '%s' holds unset calibration data, ignoring it", path);
+        ret = H_ERR_NOT_FOUND;
+        goto done;
+    }
+
+    *phardware_rev = __hantek_cache_get32(&file[24]);
+
+    for (size_t i = 0; i < HT_CALIBRATION_INFO_ENTRIES; i++) {
+        cal_data[i] = __hantek_cache_get16(&file[HT_CACHE_HDR_LEN + i * 2]);
+    }
+
+    DEBUG("Loaded device cache '%s'", path);
+
+done:
+    hantek_free(file);
+    hantek_free(path);
+    return ret;
+}
+
+HRESULT hantek_cache_store(const char *serial_number, uint16_t fpga_version, const uint16_t *cal_data, uint32_t hardware_rev)
+{
+    HRESULT ret = H_OK;
+
+    char *path = NULL,
+         suffix[16];
+    uint8_t *file = NULL;
+
+    HASSERT_ARG(NULL != serial_number);
+    HASSERT_ARG(NULL != cal_data);
+
+    if (HT_CALIBRATION_NONZERO_FLAG != cal_data[HT_CALIBRATION_INFO_ENTRIES - 1]) {
+        /* Nothing worth keeping */
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    snprintf(suffix, sizeof(suffix), "-%04x.htcache", (unsigned)fpga_version);
+
+    if (H_FAILED(ret = _hantek_cache_path(serial_number, suffix, &path))) {
+        goto done;
+    }
+
+    if (NULL == (file = hantek_calloc(1, HT_CACHE_FILE_LEN))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    memcpy(file, HT_CACHE_MAGIC, 8);
+    __hantek_cache_put32(&file[8], HT_CACHE_VERSION);
+    memcpy(&file[12], serial_number, strnlen(serial_number, HT_SERIAL_NUMBER_LEN));
+    __hantek_cache_put16(&file[20], fpga_version);
+    __hantek_cache_put32(&file[24], hardware_rev);
+
+    for (size_t i = 0; i < HT_CALIBRATION_INFO_ENTRIES; i++) {
+        __hantek_cache_put16(&file[HT_CACHE_HDR_LEN + i * 2], cal_data[i]);
+    }
+
+    __hantek_cache_put32(&file[HT_CACHE_FILE_LEN - 4], _hantek_cache_hash(file, HT_CACHE_FILE_LEN - 4));
+
+    ret = _hantek_cache_write(path, file, HT_CACHE_FILE_LEN);
+
+done:
+    hantek_free(file);
+    hantek_free(path);
+    return ret;
+}
+
+/**
+ * Build the token saying where the device is attached, and since which boot of this machine. The
+ * location changes when the device is reattached, which a power cycle of the scope implies.
+ */
+static
+HRESULT _hantek_state_token(struct hantek_device *dev, char *token, size_t len)
+{
+    HRESULT ret = H_OK;
+
+    char location[64] = { 0 },
+         boot_id[40] = { 0 };
+    FILE *fp = NULL;
+
+    if (H_FAILED(ret = hantek_tp_get_location(dev->tp, location, sizeof(location)))) {
+        DEBUG("Transport can't say where the device is attached, so its state can't be saved");
+        goto done;
+    }
+
+    /* USB addresses are handed out again after a reboot */
+    if (NULL != (fp = fopen("/proc/sys/kernel/random/boot_id", "r"))) {
+        if (NULL == fgets(boot_id, sizeof(boot_id), fp)) {
+            boot_id[0] = '\0';
+        }
+        fclose(fp);
+    }
+
+    memset(token, 0, len);
+    snprintf(token, len, "%s/%s/%s", dev->serial_number, location, boot_id);
+
+done:
+    return ret;
+}
+
+/**
+ * Lay the saved state out as the state file holds it, in HT_STATE_LEN bytes at p
+ */
+static
+void _hantek_state_encode(const struct hantek_saved_state *state, uint8_t *p)
+{
+    const struct hantek_spi_shadow *shadow = &state->spi_shadow;
+
+    memset(p, 0, HT_STATE_LEN);
+
+    memcpy(p, state->token, HT_STATE_TOKEN_LEN);
+    p += HT_STATE_TOKEN_LEN;
+
+    __hantek_cache_put16(p, state->fpga_version);
+    __hantek_cache_put32(p + 4, state->hardware_rev);
+    p += 8;
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        const struct hantek_channel *chan = &state->channels[i];
+
+        p[0] = chan->enabled;
+        p[1] = chan->bw_limit;
+        __hantek_cache_put16(p + 2, chan->level);
+        __hantek_cache_put32(p + 4, chan->vpd);
+        __hantek_cache_put32(p + 8, chan->coupling);
+        p += 12;
+    }
+
+    __hantek_cache_put32(p, state->timebase);
+    __hantek_cache_put32(p + 4, (uint32_t)state->adc_clock_hz);
+    __hantek_cache_put32(p + 8, (uint32_t)(state->adc_clock_hz >> 32));
+    __hantek_cache_put32(p + 12, state->sample_spacing);
+    p[16] = state->trigger_set;
+    __hantek_cache_put32(p + 20, state->trigger.channel);
+    __hantek_cache_put32(p + 24, state->trigger.mode);
+    __hantek_cache_put32(p + 28, state->trigger.slope);
+    __hantek_cache_put32(p + 32, state->trigger.coupling);
+    p[36] = state->trigger.level;
+    p[37] = state->trigger.slop;
+    __hantek_cache_put32(p + 40, state->trigger.horiz_offset);
+    p += 44;
+
+    for (size_t i = 0; i < HT_ADC_NR_CORES; i++) {
+        __hantek_cache_put32(p, (uint32_t)state->adc_core_channel[i]);
+        p += 4;
+    }
+
+    __hantek_cache_put32(p, (uint32_t)state->adc_nr_streams);
+    p += 4;
+
+    for (size_t i = 0; i < HT_HMCAD1511_NR_REGS; i++) {
+        __hantek_cache_put16(p, shadow->hmcad1511[i]);
+        p += 2;
+    }
+
+    for (size_t i = 0; i < HT_HMCAD1511_NR_REGS; i++) {
+        *p++ = shadow->hmcad1511_valid[i];
+    }
+
+    for (size_t i = 0; i < HT_ADF4360_NR_LATCHES; i++) {
+        __hantek_cache_put32(p, shadow->adf4360[i]);
+        p += 4;
+    }
+
+    for (size_t i = 0; i < HT_ADF4360_NR_LATCHES; i++) {
+        *p++ = shadow->adf4360_valid[i];
+    }
+
+    memcpy(p, shadow->frontend, HT_MAX_CHANNELS);
+    p += HT_MAX_CHANNELS;
+    *p++ = shadow->frontend_valid;
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        __hantek_cache_put16(p, shadow->position[i]);
+        p += 2;
+    }
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        *p++ = shadow->position_valid[i];
+    }
+}
+
+/**
+ * Read back a saved state laid out by _hantek_state_encode
+ */
+static
+void _hantek_state_decode(const uint8_t *p, struct hantek_saved_state *state)
+{
+    struct hantek_spi_shadow *shadow = &state->spi_shadow;
+
+    memset(state, 0, sizeof(*state));
+
+    memcpy(state->token, p, HT_STATE_TOKEN_LEN);
+    state->token[HT_STATE_TOKEN_LEN - 1] = '\0';
+    p += HT_STATE_TOKEN_LEN;
+
+    state->fpga_version = __hantek_cache_get16(p);
+    state->hardware_rev = __hantek_cache_get32(p + 4);
+    p += 8;
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        struct hantek_channel *chan = &state->channels[i];
+
+        chan->enabled = 0 != p[0];
+        chan->bw_limit = 0 != p[1];
+        chan->level = __hantek_cache_get16(p + 2);
+        chan->vpd = __hantek_cache_get32(p + 4);
+        chan->coupling = __hantek_cache_get32(p + 8);
+        p += 12;
+    }
+
+    state->timebase = __hantek_cache_get32(p);
+    state->adc_clock_hz = (uint64_t)__hantek_cache_get32(p + 4) | (uint64_t)__hantek_cache_get32(p + 8) << 32;
+    state->sample_spacing = __hantek_cache_get32(p + 12);
+    state->trigger_set = 0 != p[16];
+    state->trigger.channel = __hantek_cache_get32(p + 20);
+    state->trigger.mode = __hantek_cache_get32(p + 24);
+    state->trigger.slope = __hantek_cache_get32(p + 28);
+    state->trigger.coupling = __hantek_cache_get32(p + 32);
+    state->trigger.level = p[36];
+    state->trigger.slop = p[37];
+    state->trigger.horiz_offset = __hantek_cache_get32(p + 40);
+    p += 44;
+
+    for (size_t i = 0; i < HT_ADC_NR_CORES; i++) {
+        state->adc_core_channel[i] = (int32_t)__hantek_cache_get32(p);
+        p += 4;
+    }
+
+    state->adc_nr_streams = __hantek_cache_get32(p);
+    p += 4;
+
+    for (size_t i = 0; i < HT_HMCAD1511_NR_REGS; i++) {
+        shadow->hmcad1511[i] = __hantek_cache_get16(p);
+        p += 2;
+    }
+
+    for (size_t i = 0; i < HT_HMCAD1511_NR_REGS; i++) {
+        shadow->hmcad1511_valid[i] = 0 != *p++;
+    }
+
+    for (size_t i = 0; i < HT_ADF4360_NR_LATCHES; i++) {
+        shadow->adf4360[i] = __hantek_cache_get32(p);
+        p += 4;
+    }
+
+    for (size_t i = 0; i < HT_ADF4360_NR_LATCHES; i++) {
+        shadow->adf4360_valid[i] = 0 != *p++;
+    }
+
+    memcpy(shadow->frontend, p, HT_MAX_CHANNELS);
+    p += HT_MAX_CHANNELS;
+    shadow->frontend_valid = 0 != *p++;
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        shadow->position[i] = __hantek_cache_get16(p);
+        p += 2;
+    }
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        shadow->position_valid[i] = 0 != *p++;
+    }
+}
+
+HRESULT hantek_state_save(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    char *path = NULL;
+    uint8_t *file = NULL;
+    struct hantek_saved_state *state = NULL;
+
+    HASSERT_ARG(NULL != dev);
+
+    if (H_FAILED(ret = _hantek_cache_path(dev->serial_number, ".htstate", &path))) {
+        goto done;
+    }
+
+    if (NULL == (state = hantek_calloc(1, sizeof(*state))) ||
+            NULL == (file = hantek_malloc(HT_STATE_FILE_LEN)))
+    {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    if (H_FAILED(ret = _hantek_state_token(dev, state->token, sizeof(state->token)))) {
+        goto done;
+    }
+
+    state->fpga_version = dev->fpga_version;
+    state->hardware_rev = dev->hardware_rev;
+    memcpy(state->channels, dev->channels, sizeof(state->channels));
+    state->timebase = dev->timebase;
+    state->adc_clock_hz = dev->adc_clock_hz;
+    state->sample_spacing = dev->sample_spacing;
+    state->trigger_set = dev->trigger_set;
+    state->trigger = dev->trigger;
+    memcpy(state->adc_core_channel, dev->adc_core_channel, sizeof(state->adc_core_channel));
+    state->adc_nr_streams = dev->adc_nr_streams;
+    state->spi_shadow = dev->spi_shadow;
+
+    memcpy(file, HT_STATE_MAGIC, 8);
+    __hantek_cache_put32(&file[8], HT_STATE_VERSION);
+    __hantek_cache_put32(&file[12], HT_STATE_LEN);
+    _hantek_state_encode(state, &file[HT_STATE_HDR_LEN]);
+    __hantek_cache_put32(&file[HT_STATE_FILE_LEN - 4], _hantek_cache_hash(file, HT_STATE_FILE_LEN - 4));
+
+    if (H_FAILED(ret = _hantek_cache_write(path, file, HT_STATE_FILE_LEN))) {
+        goto done;
+    }
+
+    dev->state_on_disk = true;
+
+done:
+    hantek_free(state);
+    hantek_free(file);
+    hantek_free(path);
+    return ret;
+}
+
+HRESULT hantek_state_load(struct hantek_device *dev, struct hantek_saved_state *state)
+{
+    HRESULT ret = H_OK;
+
+    char *path = NULL,
+         token[HT_STATE_TOKEN_LEN];
+    uint8_t *file = NULL;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != state);
+
+    if (H_FAILED(ret = _hantek_cache_path(dev->serial_number, ".htstate", &path))) {
+        goto done;
+    }
+
+    if (H_FAILED(ret = _hantek_state_token(dev, token, sizeof(token)))) {
+        goto done;
+    }
+
+    if (NULL == (file = hantek_malloc(HT_STATE_FILE_LEN))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    if (H_FAILED(ret = _hantek_cache_read(path, file, HT_STATE_FILE_LEN))) {
+        goto done;
+    }
+
+    if (0 != memcmp(file, HT_STATE_MAGIC, 8) ||
+            HT_STATE_VERSION != __hantek_cache_get32(&file[8]) ||
+            HT_STATE_LEN != __hantek_cache_get32(&file[12]) ||
+            _hantek_cache_hash(file, HT_STATE_FILE_LEN - 4) != __hantek_cache_get32(&file[HT_STATE_FILE_LEN - 4]))
+    {
+        DEBUG("Device state '%s' is damaged, ignoring it", path);
+        ret = H_ERR_NOT_FOUND;
+        goto done;
+    }
+
+    _hantek_state_decode(&file[HT_STATE_HDR_LEN], state);
+
+    if (0 != memcmp(state->token, token, sizeof(token))) {
+        DEBUG("Device has been reattached since its state was saved, ignoring it");
+        ret = H_ERR_NOT_FOUND;
+        goto done;
+    }
+
+done:
+    hantek_free(file);
+    hantek_free(path);
+    return ret;
+}
+
+void hantek_state_discard(struct hantek_device *dev)
+{
+    char *path = NULL;
+
+    if (false == dev->state_on_disk) {
+        return;
+    }
+
+    dev->state_on_disk = false;
+
+    if (H_FAILED(_hantek_cache_path(dev->serial_number, ".htstate", &path))) {
+        return;
+    }
+
+    unlink(path);
+    hantek_free(path);
+}
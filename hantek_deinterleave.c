@@ -0,0 +1,317 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_deinterleave.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HT_DEINTERLEAVE_X86
+#endif
+
+/**
+ * De-interleaving raw capture data. The HMCAD1511 emits one byte per ADC core per frame, and
+ * hantek_configure_adc_routing shares the cores out between the enabled channels:
+ *
+ *  1 channel:   all four cores sample it, so the raw data already is the channel
+ *  2 channels:  cores 0 and 1 sample the first channel, cores 2 and 3 the second, so every
+ *               frame holds two consecutive samples of each
+ *  3 channels:  as for 4, with the core of the disabled channel discarded
+ *  4 channels:  core n samples channel n
+ *
+ * Each layout gets its own kernel per instruction set, picked at runtime by the CPU features
+ * available, so the inner loops carry no mode or feature checks.
+ */
+
+static
+void _hantek_deinterleave_1(const uint8_t *src, size_t nr_frames, uint8_t *const *dst)
+{
+    /* A plain copy, which libc already does as fast as this CPU allows */
+    if (NULL != dst[0]) {
+        memcpy(dst[0], src, nr_frames * HT_ADC_NR_CORES);
+    }
+}
+
+static
+void _hantek_deinterleave_2_scalar(const uint8_t *src, size_t nr_frames, uint8_t *const *dst)
+{
+    uint8_t *d0 = dst[0],
+            *d1 = dst[1];
+
+    for (size_t i = 0; i < nr_frames; i++) {
+        const uint8_t *f = src + i * HT_ADC_NR_CORES;
+
+        if (NULL != d0) {
+            d0[2 * i] = f[0];
+            d0[2 * i + 1] = f[1];
+        }
+
+        if (NULL != d1) {
+            d1[2 * i] = f[2];
+            d1[2 * i + 1] = f[3];
+        }
+    }
+}
+
+static
+void _hantek_deinterleave_4_scalar(const uint8_t *src, size_t nr_frames, uint8_t *const *dst)
+{
+    for (size_t c = 0; c < HT_ADC_NR_CORES; c++) {
+        uint8_t *d = dst[c];
+
+        if (NULL == d) {
+            continue;
+        }
+
+        for (size_t i = 0; i < nr_frames; i++) {
+            d[i] = src[i * HT_ADC_NR_CORES + c];
+        }
+    }
+}
+
+#ifdef HT_DEINTERLEAVE_X86
+
+/*
+ * The SSE2 and AVX2 kernels treat each frame as a 32-bit lane. For two streams the low and high
+ * halves of each lane are narrowed to 16 bits with a signed pack, which keeps the bit pattern
+ * intact once the half has been sign extended. For four streams each core's byte is shifted
+ * down, masked and narrowed to 8 bits with two packs. The AVX2 packs work within 128-bit halves, so
+ * their output is put back in order with a cross-lane permute.
+ */
+
+__attribute__((target("sse2")))
+static
+void _hantek_deinterleave_2_sse2(const uint8_t *src, size_t nr_frames, uint8_t *const *dst)
+{
+    uint8_t *d0 = dst[0],
+            *d1 = dst[1];
+    size_t nr_blocks = nr_frames / 8;
+    uint8_t *tail[2] = { NULL, NULL };
+
+    for (size_t i = 0; i < nr_blocks; i++) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(src + 32 * i)),
+                v1 = _mm_loadu_si128((const __m128i *)(src + 32 * i + 16));
+
+        if (NULL != d0) {
+            __m128i lo = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(v0, 16), 16),
+                                         _mm_srai_epi32(_mm_slli_epi32(v1, 16), 16));
+            _mm_storeu_si128((__m128i *)(d0 + 16 * i), lo);
+        }
+
+        if (NULL != d1) {
+            __m128i hi = _mm_packs_epi32(_mm_srai_epi32(v0, 16), _mm_srai_epi32(v1, 16));
+            _mm_storeu_si128((__m128i *)(d1 + 16 * i), hi);
+        }
+    }
+
+    tail[0] = NULL != d0 ? d0 + 16 * nr_blocks : NULL;
+    tail[1] = NULL != d1 ? d1 + 16 * nr_blocks : NULL;
+    _hantek_deinterleave_2_scalar(src + 32 * nr_blocks, nr_frames - 8 * nr_blocks, tail);
+}
+
+/**
+ * Pick out the byte of the given core from four vectors of frames, and narrow them down into
+ * one vector of samples
+ */
+__attribute__((target("sse2")))
+static inline
+__m128i __hantek_core_sse2(__m128i v0, __m128i v1, __m128i v2, __m128i v3, int core)
+{
+    const __m128i m = _mm_set1_epi32(0xff);
+    __m128i cnt = _mm_cvtsi32_si128(8 * core);
+
+    v0 = _mm_and_si128(_mm_srl_epi32(v0, cnt), m);
+    v1 = _mm_and_si128(_mm_srl_epi32(v1, cnt), m);
+    v2 = _mm_and_si128(_mm_srl_epi32(v2, cnt), m);
+    v3 = _mm_and_si128(_mm_srl_epi32(v3, cnt), m);
+
+    return _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3));
+}
+
+__attribute__((target("sse2")))
+static
+void _hantek_deinterleave_4_sse2(const uint8_t *src, size_t nr_frames, uint8_t *const *dst)
+{
+    size_t nr_blocks = nr_frames / 16;
+    uint8_t *tail[HT_ADC_NR_CORES] = { NULL };
+
+    for (size_t i = 0; i < nr_blocks; i++) {
+        const uint8_t *s = src + 64 * i;
+        __m128i v0 = _mm_loadu_si128((const __m128i *)s),
+                v1 = _mm_loadu_si128((const __m128i *)(s + 16)),
+                v2 = _mm_loadu_si128((const __m128i *)(s + 32)),
+                v3 = _mm_loadu_si128((const __m128i *)(s + 48));
+
+        for (int c = 0; c < HT_ADC_NR_CORES; c++) {
+            if (NULL != dst[c]) {
+                _mm_storeu_si128((__m128i *)(dst[c] + 16 * i), __hantek_core_sse2(v0, v1, v2, v3, c));
+            }
+        }
+    }
+
+    for (size_t c = 0; c < HT_ADC_NR_CORES; c++) {
+        tail[c] = NULL != dst[c] ? dst[c] + 16 * nr_blocks : NULL;
+    }
+    _hantek_deinterleave_4_scalar(src + 64 * nr_blocks, nr_frames - 16 * nr_blocks, tail);
+}
+
+__attribute__((target("avx2")))
+static
+void _hantek_deinterleave_2_avx2(const uint8_t *src, size_t nr_frames, uint8_t *const *dst)
+{
+    uint8_t *d0 = dst[0],
+            *d1 = dst[1];
+    size_t nr_blocks = nr_frames / 16;
+    uint8_t *tail[2] = { NULL, NULL };
+
+    for (size_t i = 0; i < nr_blocks; i++) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(src + 64 * i)),
+                v1 = _mm256_loadu_si256((const __m256i *)(src + 64 * i + 32));
+
+        if (NULL != d0) {
+            __m256i lo = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_slli_epi32(v0, 16), 16),
+                                            _mm256_srai_epi32(_mm256_slli_epi32(v1, 16), 16));
+            _mm256_storeu_si256((__m256i *)(d0 + 32 * i), _mm256_permute4x64_epi64(lo, _MM_SHUFFLE(3, 1, 2, 0)));
+        }
+
+        if (NULL != d1) {
+            __m256i hi = _mm256_packs_epi32(_mm256_srai_epi32(v0, 16), _mm256_srai_epi32(v1, 16));
+            _mm256_storeu_si256((__m256i *)(d1 + 32 * i), _mm256_permute4x64_epi64(hi, _MM_SHUFFLE(3, 1, 2, 0)));
+        }
+    }
+
+    tail[0] = NULL != d0 ? d0 + 32 * nr_blocks : NULL;
+    tail[1] = NULL != d1 ? d1 + 32 * nr_blocks : NULL;
+    _hantek_deinterleave_2_sse2(src + 64 * nr_blocks, nr_frames - 16 * nr_blocks, tail);
+}
+
+/**
+ * As __hantek_core_sse2, also putting the 128-bit halves back in order
+ */
+__attribute__((target("avx2")))
+static inline
+__m256i __hantek_core_avx2(__m256i v0, __m256i v1, __m256i v2, __m256i v3, int core)
+{
+    const __m256i m = _mm256_set1_epi32(0xff);
+    __m128i cnt = _mm_cvtsi32_si128(8 * core);
+    __m256i r;
+
+    v0 = _mm256_and_si256(_mm256_srl_epi32(v0, cnt), m);
+    v1 = _mm256_and_si256(_mm256_srl_epi32(v1, cnt), m);
+    v2 = _mm256_and_si256(_mm256_srl_epi32(v2, cnt), m);
+    v3 = _mm256_and_si256(_mm256_srl_epi32(v3, cnt), m);
+
+    r = _mm256_packus_epi16(_mm256_packs_epi32(v0, v1), _mm256_packs_epi32(v2, v3));
+
+    return _mm256_permutevar8x32_epi32(r, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+__attribute__((target("avx2")))
+static
+void _hantek_deinterleave_4_avx2(const uint8_t *src, size_t nr_frames, uint8_t *const *dst)
+{
+    size_t nr_blocks = nr_frames / 32;
+    uint8_t *tail[HT_ADC_NR_CORES] = { NULL };
+
+    for (size_t i = 0; i < nr_blocks; i++) {
+        const uint8_t *s = src + 128 * i;
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)s),
+                v1 = _mm256_loadu_si256((const __m256i *)(s + 32)),
+                v2 = _mm256_loadu_si256((const __m256i *)(s + 64)),
+                v3 = _mm256_loadu_si256((const __m256i *)(s + 96));
+
+        for (int c = 0; c < HT_ADC_NR_CORES; c++) {
+            if (NULL != dst[c]) {
+                _mm256_storeu_si256((__m256i *)(dst[c] + 32 * i), __hantek_core_avx2(v0, v1, v2, v3, c));
+            }
+        }
+    }
+
+    for (size_t c = 0; c < HT_ADC_NR_CORES; c++) {
+        tail[c] = NULL != dst[c] ? dst[c] + 32 * nr_blocks : NULL;
+    }
+    _hantek_deinterleave_4_sse2(src + 128 * nr_blocks, nr_frames - 32 * nr_blocks, tail);
+}
+
+#endif /* defined(HT_DEINTERLEAVE_X86) */
+
+hantek_deinterleave_fn_t hantek_deinterleave_get(size_t nr_streams)
+{
+    bool four = (4 == nr_streams);
+
+    if (1 == nr_streams) {
+        return _hantek_deinterleave_1;
+    }
+
+#ifdef HT_DEINTERLEAVE_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return true == four ? _hantek_deinterleave_4_avx2 : _hantek_deinterleave_2_avx2;
+    }
+
+    if (__builtin_cpu_supports("sse2")) {
+        return true == four ? _hantek_deinterleave_4_sse2 : _hantek_deinterleave_2_sse2;
+    }
+#endif
+
+    return true == four ? _hantek_deinterleave_4_scalar : _hantek_deinterleave_2_scalar;
+}
+
+HRESULT hantek_get_channel_buffer_len(struct hantek_device *dev, size_t *plen)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != plen);
+
+    *plen = 0;
+
+    if (0 == dev->adc_nr_streams) {
+        DEBUG("ADC routing has not been configured yet");
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    *plen = dev->capture_buffer_len / dev->adc_nr_streams;
+
+done:
+    return ret;
+}
+
+HRESULT hantek_split_channels(struct hantek_device *dev, const uint8_t *raw, size_t raw_len, uint8_t *ch1, uint8_t *ch2, uint8_t *ch3, uint8_t *ch4)
+{
+    HRESULT ret = H_OK;
+
+    uint8_t *chans[HT_MAX_CHANNELS] = { ch1, ch2, ch3, ch4 };
+    uint8_t *streams[HT_ADC_NR_CORES] = { NULL };
+    size_t nr_streams = 0,
+           cores_per_stream = 0;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != raw);
+
+    nr_streams = dev->adc_nr_streams;
+
+    if (0 == nr_streams) {
+        DEBUG("ADC routing has not been configured yet");
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    cores_per_stream = HT_ADC_NR_CORES / nr_streams;
+
+    /* Each stream comes from a run of cores sampling the same channel */
+    for (size_t i = 0; i < nr_streams; i++) {
+        int chan = dev->adc_core_channel[i * cores_per_stream];
+
+        if (0 <= chan) {
+            streams[i] = chans[chan];
+        }
+    }
+
+    hantek_deinterleave_get(nr_streams)(raw, raw_len / HT_ADC_NR_CORES, streams);
+
+done:
+    return ret;
+}
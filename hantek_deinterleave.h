@@ -0,0 +1,18 @@
+#pragma once
+
+#include <hantek.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Split nr_frames frames of raw capture data (HT_ADC_NR_CORES bytes each) into per-channel
+ * streams. The cores are shared out evenly in order, so each stream receives
+ * HT_ADC_NR_CORES / nr_streams bytes per frame. A NULL stream is skipped.
+ */
+typedef void (*hantek_deinterleave_fn_t)(const uint8_t *src, size_t nr_frames, uint8_t *const *dst);
+
+/**
+ * Get the fastest de-interleave kernel this CPU supports, for 1, 2 or 4 streams.
+ */
+hantek_deinterleave_fn_t hantek_deinterleave_get(size_t nr_streams);
@@ -0,0 +1,395 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+#include <hantek_frame.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+/**
+ * Huge page size the arena is rounded up to when huge pages are asked for
+ */
+#define HT_FRAME_POOL_HUGEPAGE_LEN          (2 * 1024 * 1024)
+
+/**
+ * A frame, and its place in the pool. The public frame comes first, so a released frame can be
+ * turned back into its pool entry.
+ */
+struct hantek_pool_frame {
+    struct hantek_frame frame;
+    struct hantek_frame_pool *pool;
+    struct hantek_pool_frame *next;
+    _Atomic unsigned refs;
+    uint8_t *channels[HT_MAX_CHANNELS];
+};
+
+struct hantek_frame_pool {
+    /**
+     * The arena holding every frame's samples, frame_len bytes per frame
+     */
+    uint8_t *arena;
+    size_t arena_len;
+    size_t frame_len;
+
+    /**
+     * Samples each frame has room for, per channel
+     */
+    size_t nr_samples;
+    bool hugepages;
+    bool locked;
+
+    /**
+     * The frames, and the free list, which is shared with whoever releases frames
+     */
+    struct hantek_pool_frame *frames;
+    size_t nr_frames;
+    struct hantek_pool_frame *free_frames;
+    size_t nr_free;
+    pthread_mutex_t free_lock;
+
+    /**
+     * Set once the pool has been destroyed while frames were still held
+     */
+    bool destroyed;
+};
+
+/**
+ * Map the arena, on huge pages if asked for and available, and fault it all in up front
+ */
+static
+HRESULT _hantek_frame_pool_map(struct hantek_frame_pool *pool, size_t len, unsigned flags)
+{
+    HRESULT ret = H_OK;
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t align = 0 < page_size ? (size_t)page_size : 4096;
+    void *arena = MAP_FAILED;
+
+    if (0 != (flags & HT_FRAME_POOL_HUGEPAGES)) {
+        size_t huge_len = (len + HT_FRAME_POOL_HUGEPAGE_LEN - 1) & ~((size_t)HT_FRAME_POOL_HUGEPAGE_LEN - 1);
+
+        arena = mmap(NULL, huge_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (MAP_FAILED != arena) {
+            pool->hugepages = true;
+            len = huge_len;
+        } else {
+            DEBUG("No huge pages for a %zu byte frame arena: %s (%d)", huge_len, strerror(errno), errno);
+        }
+    }
+
+    if (MAP_FAILED == arena) {
+        len = (len + align - 1) & ~(align - 1);
+
+        if (MAP_FAILED == (arena = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))) {
+            DEBUG("Failed to map %zu byte frame arena: %s (%d)", len, strerror(errno), errno);
+            ret = H_ERR_NO_MEM;
+            goto done;
+        }
+
+#ifdef MADV_HUGEPAGE
+        if (0 != (flags & HT_FRAME_POOL_HUGEPAGES)) {
+            /* Transparent huge pages are the next best thing */
+            madvise(arena, len, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    pool->arena = arena;
+    pool->arena_len = len;
+
+    if (0 != (flags & HT_FRAME_POOL_MLOCK)) {
+        if (0 == mlock(arena, len)) {
+            pool->locked = true;
+        } else {
+            DEBUG("Failed to lock %zu byte frame arena: %s (%d)", len, strerror(errno), errno);
+        }
+    }
+
+    /* Touch every page now, rather than fault them in during acquisition */
+    memset(arena, 0, len);
+
+done:
+    return ret;
+}
+
+static
+void _hantek_frame_pool_free(struct hantek_frame_pool *pool)
+{
+    if (NULL != pool->arena) {
+        if (true == pool->locked) {
+            munlock(pool->arena, pool->arena_len);
+        }
+
+        munmap(pool->arena, pool->arena_len);
+    }
+
+    hantek_free(pool->frames);
+    pthread_mutex_destroy(&pool->free_lock);
+    hantek_free(pool);
+}
+
+HRESULT hantek_frame_pool_create(struct hantek_device *dev, size_t nr_frames, unsigned flags, struct hantek_frame_pool **ppool)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_frame_pool *pool = NULL;
+    bool routed[HT_MAX_CHANNELS] = { false };
+    size_t chan_len = 0,
+           nr_routed = 0;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(0 != nr_frames);
+    HASSERT_ARG(NULL != ppool);
+
+    *ppool = NULL;
+
+    if (H_FAILED(ret = hantek_get_channel_buffer_len(dev, &chan_len))) {
+        DEBUG("ADC routing must be configured before creating a frame pool");
+        goto done;
+    }
+
+    for (size_t i = 0; i < HT_ADC_NR_CORES; i++) {
+        int chan = dev->adc_core_channel[i];
+
+        if (0 <= chan && false == routed[chan]) {
+            routed[chan] = true;
+            nr_routed++;
+        }
+    }
+
+    if (NULL == (pool = hantek_calloc(1, sizeof(*pool)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    pthread_mutex_init(&pool->free_lock, NULL);
+
+    /* Cache line aligned, so the de-interleave kernels get aligned stores */
+    pool->frame_len = (nr_routed * chan_len + 63) & ~(size_t)63;
+    pool->nr_frames = nr_frames;
+    pool->nr_samples = chan_len;
+
+    if (NULL == (pool->frames = hantek_calloc(nr_frames, sizeof(*pool->frames)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    if (H_FAILED(ret = _hantek_frame_pool_map(pool, nr_frames * pool->frame_len, flags))) {
+        goto done;
+    }
+
+    for (size_t i = 0; i < nr_frames; i++) {
+        struct hantek_pool_frame *pf = &pool->frames[i];
+        uint8_t *data = pool->arena + i * pool->frame_len;
+        size_t next = 0;
+
+        pf->pool = pool;
+        atomic_init(&pf->refs, 0);
+
+        for (size_t c = 0; c < HT_MAX_CHANNELS; c++) {
+            if (true == routed[c]) {
+                pf->channels[c] = data + next++ * chan_len;
+            }
+
+            pf->frame.channels[c] = pf->channels[c];
+        }
+
+        pf->frame.nr_samples = chan_len;
+        hantek_frame_set_config(&pf->frame, dev);
+
+        pf->next = pool->free_frames;
+        pool->free_frames = pf;
+        pool->nr_free++;
+    }
+
+    *ppool = pool;
+
+done:
+    if (H_FAILED(ret) && NULL != pool) {
+        _hantek_frame_pool_free(pool);
+    }
+    return ret;
+}
+
+HRESULT hantek_frame_pool_destroy(struct hantek_frame_pool **ppool)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_frame_pool *pool = NULL;
+    bool idle = false;
+
+    HASSERT_ARG(NULL != ppool);
+    HASSERT_ARG(NULL != *ppool);
+
+    pool = *ppool;
+
+    pthread_mutex_lock(&pool->free_lock);
+    idle = (pool->nr_free == pool->nr_frames);
+    pool->destroyed = true;
+    pthread_mutex_unlock(&pool->free_lock);
+
+    if (true == idle) {
+        _hantek_frame_pool_free(pool);
+    } else {
+        DEBUG("Frames are still held, the pool goes once they have all been released");
+    }
+
+    *ppool = NULL;
+
+    return ret;
+}
+
+HRESULT hantek_frame_pool_get(struct hantek_frame_pool *pool, struct hantek_frame **pframe)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_pool_frame *pf = NULL;
+
+    HASSERT_ARG(NULL != pool);
+    HASSERT_ARG(NULL != pframe);
+
+    pthread_mutex_lock(&pool->free_lock);
+
+    if (NULL != (pf = pool->free_frames)) {
+        pool->free_frames = pf->next;
+        pool->nr_free--;
+        pf->next = NULL;
+    }
+
+    pthread_mutex_unlock(&pool->free_lock);
+
+    if (NULL == pf) {
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    atomic_store_explicit(&pf->refs, 1, memory_order_relaxed);
+    *pframe = &pf->frame;
+
+done:
+    return ret;
+}
+
+HRESULT hantek_frame_pool_get_stats(struct hantek_frame_pool *pool, struct hantek_frame_pool_stats *pstats)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != pool);
+    HASSERT_ARG(NULL != pstats);
+
+    pthread_mutex_lock(&pool->free_lock);
+    pstats->nr_free = pool->nr_free;
+    pthread_mutex_unlock(&pool->free_lock);
+
+    pstats->nr_frames = pool->nr_frames;
+    pstats->frame_len = pool->frame_len;
+    pstats->arena_len = pool->arena_len;
+    pstats->hugepages = pool->hugepages;
+    pstats->locked = pool->locked;
+
+    return ret;
+}
+
+HRESULT hantek_frame_ref(struct hantek_frame *frame)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_pool_frame *pf = (struct hantek_pool_frame *)frame;
+
+    HASSERT_ARG(NULL != frame);
+    HASSERT_ARG(0 != atomic_load_explicit(&pf->refs, memory_order_relaxed));
+
+    atomic_fetch_add_explicit(&pf->refs, 1, memory_order_relaxed);
+
+    return ret;
+}
+
+HRESULT hantek_frame_release(struct hantek_frame *frame)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_pool_frame *pf = (struct hantek_pool_frame *)frame;
+    struct hantek_frame_pool *pool = NULL;
+    bool last = false;
+
+    HASSERT_ARG(NULL != frame);
+
+    pool = pf->pool;
+
+    /* Everyone's reads of the samples happen before the frame is reused */
+    if (1 != atomic_fetch_sub_explicit(&pf->refs, 1, memory_order_acq_rel)) {
+        goto done;
+    }
+
+    pthread_mutex_lock(&pool->free_lock);
+
+    /* Most recently used first, so the next capture lands in memory that is still cache-warm */
+    pf->next = pool->free_frames;
+    pool->free_frames = pf;
+    pool->nr_free++;
+    last = (true == pool->destroyed && pool->nr_free == pool->nr_frames);
+
+    pthread_mutex_unlock(&pool->free_lock);
+
+    if (true == last) {
+        _hantek_frame_pool_free(pool);
+    }
+
+done:
+    return ret;
+}
+
+uint8_t *const *hantek_frame_channels(struct hantek_frame *frame)
+{
+    return ((struct hantek_pool_frame *)frame)->channels;
+}
+
+void hantek_frame_set_config(struct hantek_frame *frame, struct hantek_device *dev)
+{
+    hantek_get_sample_rate(dev, &frame->sample_rate);
+
+    for (size_t c = 0; c < HT_MAX_CHANNELS; c++) {
+        frame->vpd[c] = dev->channels[c].vpd;
+    }
+}
+
+HRESULT hantek_frame_pool_check(struct hantek_frame_pool *pool, struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    size_t chan_len = 0;
+
+    HASSERT_ARG(NULL != pool);
+    HASSERT_ARG(NULL != dev);
+
+    if (H_FAILED(ret = hantek_get_channel_buffer_len(dev, &chan_len))) {
+        goto done;
+    }
+
+    if (pool->nr_samples < chan_len) {
+        DEBUG("Pool frames hold %zu samples per channel, captures need %zu", pool->nr_samples, chan_len);
+        ret = H_ERR_BAD_ARGS;
+        goto done;
+    }
+
+    for (size_t i = 0; i < HT_ADC_NR_CORES; i++) {
+        int chan = dev->adc_core_channel[i];
+
+        if (0 <= chan && NULL == pool->frames[0].channels[chan]) {
+            DEBUG("Pool frames have no room for channel %d", chan);
+            ret = H_ERR_BAD_ARGS;
+            goto done;
+        }
+    }
+
+done:
+    return ret;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <hantek.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Frame pools. A pool carves a fixed number of frames out of one arena, each with room for the
+ * samples of every channel the ADC is routed to, so nothing is allocated while acquiring. Frames
+ * are reference counted: a capture can be handed to several consumers, and goes back to the pool
+ * when the last of them releases it. References may be taken and dropped from any thread.
+ */
+
+struct hantek_frame_pool;
+
+/**
+ * Back the arena with huge pages, if the system has any to spare
+ */
+#define HT_FRAME_POOL_HUGEPAGES             (1 << 0)
+
+/**
+ * Lock the arena into memory, if the memory lock limit allows
+ */
+#define HT_FRAME_POOL_MLOCK                 (1 << 1)
+
+/**
+ * One capture, split into channels
+ */
+struct hantek_frame {
+    /**
+     * Samples for each channel, or NULL for channels the ADC is not routed to, and the number of
+     * samples each channel has
+     */
+    const uint8_t *channels[4];
+    size_t nr_samples;
+
+    /**
+     * Samples per second on each channel, and the volts per division each channel was set to
+     */
+    double sample_rate;
+    enum hantek_volts_per_div vpd[4];
+
+    /**
+     * Sequence number, counting lost captures too, and the number of captures lost immediately
+     * before this one
+     */
+    uint64_t seq;
+    uint64_t nr_dropped;
+
+    /**
+     * When the capture was seen to complete, and when it had been read back, in CLOCK_MONOTONIC
+     * nanoseconds
+     */
+    uint64_t ready_ns;
+    uint64_t done_ns;
+};
+
+struct hantek_frame_pool_stats {
+    /**
+     * Frames in the pool, and how many of them are free
+     */
+    size_t nr_frames;
+    size_t nr_free;
+
+    /**
+     * Bytes of samples per frame, and the size of the arena holding them
+     */
+    size_t frame_len;
+    size_t arena_len;
+
+    /**
+     * Whether the arena ended up on huge pages, and locked into memory
+     */
+    bool hugepages;
+    bool locked;
+};
+
+/**
+ * Create a pool of nr_frames frames, sized for the device's capture length and ADC routing,
+ * which must not change while the pool is in use. flags are HT_FRAME_POOL_*.
+ */
+HRESULT hantek_frame_pool_create(struct hantek_device *dev, size_t nr_frames, unsigned flags, struct hantek_frame_pool **ppool);
+
+/**
+ * Destroy a pool. If frames are still held, the pool goes away when the last one is released.
+ */
+HRESULT hantek_frame_pool_destroy(struct hantek_frame_pool **ppool);
+
+/**
+ * Take a free frame from the pool, holding one reference. Returns H_ERR_NOT_READY if every frame
+ * is in use.
+ */
+HRESULT hantek_frame_pool_get(struct hantek_frame_pool *pool, struct hantek_frame **pframe);
+
+/**
+ * Get the pool's statistics
+ */
+HRESULT hantek_frame_pool_get_stats(struct hantek_frame_pool *pool, struct hantek_frame_pool_stats *pstats);
+
+/**
+ * Take another reference to a frame, for another consumer
+ */
+HRESULT hantek_frame_ref(struct hantek_frame *frame);
+
+/**
+ * Drop a reference to a frame. The frame goes back to its pool when the last one is dropped.
+ */
+HRESULT hantek_frame_release(struct hantek_frame *frame);
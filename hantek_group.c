@@ -0,0 +1,514 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+#include <hantek_frame.h>
+#include <hantek_group.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Group captures in a row that may fail before the group gives up
+ */
+#define HT_GROUP_MAX_FAILURES               8
+
+/**
+ * Defaults for the capture timeout and the size of each device's frame pool
+ */
+#define HT_GROUP_DEFAULT_TIMEOUT_MS         1000
+#define HT_GROUP_DEFAULT_FRAMES             4
+
+/**
+ * How long to back off when a device has no free frame to capture into
+ */
+#define HT_GROUP_STALL_NS                   1000000ull
+
+/**
+ * One device in the group, and its thread
+ */
+struct hantek_group_worker {
+    struct hantek_group *group;
+    struct hantek_device *dev;
+    size_t index;
+    struct hantek_frame_pool *pool;
+
+    pthread_t thread;
+    bool started;
+
+    /**
+     * The capture in progress. Only touched by this worker's thread, except between the second
+     * and third meeting of a round, when the lead thread collects it.
+     */
+    struct hantek_frame *frame;
+    struct hantek_group_timing timing;
+    HRESULT result;
+    bool timed_out;
+};
+
+struct hantek_group {
+    struct hantek_group_config cfg;
+    hantek_group_cb_t cb;
+    void *priv;
+
+    struct hantek_group_worker workers[HT_GROUP_MAX_DEVICES];
+    size_t nr_devices;
+
+    /**
+     * Every worker meets here three times a round: before arming, once all captures are in,
+     * and once the lead thread has handed them over
+     */
+    pthread_barrier_t barrier;
+    bool barrier_init;
+
+    /**
+     * Held while the threads are being created, so none of them start until all of them exist
+     */
+    pthread_mutex_t start_lock;
+    bool start_lock_init;
+    bool abort;
+
+    _Atomic bool stop;
+
+    /**
+     * Whether this round is the last, decided by the lead thread before the first meeting
+     */
+    bool stopping;
+
+    /**
+     * Only touched by the lead thread
+     */
+    struct hantek_group_frame frame;
+    uint64_t seq;
+    uint64_t pending_dropped;
+    unsigned nr_failures;
+
+    /**
+     * Statistics, updated by the lead thread
+     */
+    _Atomic uint64_t nr_delivered;
+    _Atomic uint64_t nr_dropped;
+    _Atomic uint64_t nr_errors;
+    _Atomic uint64_t skew_ns_max;
+    _Atomic HRESULT result;
+    _Atomic bool running;
+};
+
+/**
+ * Arm this worker's device, wait for it, and read the capture back into its frame
+ */
+static
+void _hantek_group_capture(struct hantek_group *group, struct hantek_group_worker *w)
+{
+    struct hantek_group_timing *timing = &w->timing;
+    uint8_t *const *channels = hantek_frame_channels(w->frame);
+    unsigned timeout_ms = 0 != group->cfg.timeout_ms ? group->cfg.timeout_ms : HT_GROUP_DEFAULT_TIMEOUT_MS;
+
+    memset(timing, 0, sizeof(*timing));
+    w->timed_out = false;
+
+    timing->arm_ns = hantek_now_ns();
+
+    if (H_FAILED(w->result = hantek_start_capture(w->dev, group->cfg.mode))) {
+        DEBUG("Failed to arm group device %zu", w->index);
+        return;
+    }
+
+    timing->armed_ns = hantek_now_ns();
+
+    if (H_FAILED(w->result = hantek_wait_ready(w->dev, timeout_ms, &timing->status))) {
+        w->timed_out = (hantek_now_ns() - timing->armed_ns >= timeout_ms * 1000000ull);
+        return;
+    }
+
+    timing->ready_ns = hantek_now_ns();
+
+    if (H_FAILED(w->result = hantek_retrieve_buffer(w->dev, channels[0], channels[1], channels[2], channels[3]))) {
+        DEBUG("Failed to read back group device %zu", w->index);
+        return;
+    }
+
+    hantek_get_channel_buffer_len(w->dev, &w->frame->nr_samples);
+    hantek_frame_set_config(w->frame, w->dev);
+    w->frame->ready_ns = timing->ready_ns;
+    w->frame->done_ns = hantek_now_ns();
+}
+
+static
+void _hantek_group_release_frames(struct hantek_group *group)
+{
+    for (size_t i = 0; i < group->nr_devices; i++) {
+        struct hantek_group_worker *w = &group->workers[i];
+
+        if (NULL != w->frame) {
+            hantek_frame_release(w->frame);
+            w->frame = NULL;
+        }
+    }
+}
+
+/**
+ * On the lead thread, once every worker is done with the round: merge the captures into a group
+ * frame, with the skew estimate, and hand it over
+ */
+static
+void _hantek_group_deliver(struct hantek_group *group, bool all_frames)
+{
+    struct hantek_group_frame *gframe = &group->frame;
+    uint64_t seq = group->seq++,
+             max_half = 0,
+             skew = 0;
+    int64_t first_mid = 0,
+            min_skew = 0,
+            max_skew = 0;
+    bool failed = false,
+         timed_out = false;
+    HRESULT result = H_OK;
+
+    if (false == all_frames) {
+        /* Consumers are holding every frame from one of the pools, skip this capture */
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = HT_GROUP_STALL_NS };
+
+        _hantek_group_release_frames(group);
+        atomic_fetch_add(&group->nr_dropped, 1);
+        group->pending_dropped++;
+        nanosleep(&ts, NULL);
+        return;
+    }
+
+    for (size_t i = 0; i < group->nr_devices; i++) {
+        struct hantek_group_worker *w = &group->workers[i];
+
+        if (H_FAILED(w->result)) {
+            if (true == w->timed_out) {
+                timed_out = true;
+            } else {
+                failed = true;
+                result = w->result;
+            }
+        }
+    }
+
+    if (true == failed || true == timed_out) {
+        _hantek_group_release_frames(group);
+        atomic_fetch_add(&group->nr_dropped, 1);
+        group->pending_dropped++;
+
+        if (true == failed) {
+            DEBUG("Group capture %lu failed, result = %08x", (unsigned long)seq, (unsigned)result);
+            atomic_fetch_add(&group->nr_errors, 1);
+
+            if (HT_GROUP_MAX_FAILURES <= ++group->nr_failures) {
+                DEBUG("Too many failed group captures in a row, stopping");
+                atomic_store(&group->result, result);
+                atomic_store(&group->stop, true);
+            }
+        }
+
+        return;
+    }
+
+    group->nr_failures = 0;
+
+    /*
+     * A device starts capturing somewhere between sending the arm command and that command
+     * completing, so take the midpoint, give or take half the time the command took
+     */
+    for (size_t i = 0; i < group->nr_devices; i++) {
+        struct hantek_group_worker *w = &group->workers[i];
+        uint64_t half = (w->timing.armed_ns - w->timing.arm_ns) / 2;
+        int64_t mid = (int64_t)(w->timing.arm_ns + half);
+
+        if (0 == i) {
+            first_mid = mid;
+        }
+
+        w->timing.skew_ns = mid - first_mid;
+
+        if (w->timing.skew_ns < min_skew) {
+            min_skew = w->timing.skew_ns;
+        }
+
+        if (w->timing.skew_ns > max_skew) {
+            max_skew = w->timing.skew_ns;
+        }
+
+        if (half > max_half) {
+            max_half = half;
+        }
+
+        w->frame->seq = seq;
+        w->frame->nr_dropped = group->pending_dropped;
+
+        gframe->frames[i] = w->frame;
+        gframe->timing[i] = w->timing;
+
+        /* The frame's reference goes to the callback */
+        w->frame = NULL;
+    }
+
+    skew = (uint64_t)(max_skew - min_skew);
+
+    gframe->nr_devices = group->nr_devices;
+    gframe->seq = seq;
+    gframe->nr_dropped = group->pending_dropped;
+    gframe->skew_ns = skew;
+    gframe->skew_error_ns = 2 * max_half;
+    group->pending_dropped = 0;
+
+    if (skew > atomic_load(&group->skew_ns_max)) {
+        atomic_store(&group->skew_ns_max, skew);
+    }
+
+    atomic_fetch_add(&group->nr_delivered, 1);
+
+    group->cb(group, gframe, group->priv);
+}
+
+static
+void *_hantek_group_thread(void *arg)
+{
+    struct hantek_group_worker *w = arg;
+    struct hantek_group *group = w->group;
+    bool lead = (0 == w->index);
+
+    /* Wait until every thread has been created, or the start has been called off */
+    pthread_mutex_lock(&group->start_lock);
+    pthread_mutex_unlock(&group->start_lock);
+
+    if (true == group->abort) {
+        return NULL;
+    }
+
+    for (;;) {
+        bool all_frames = true;
+
+        w->frame = NULL;
+
+        if (H_FAILED(hantek_frame_pool_get(w->pool, &w->frame))) {
+            w->frame = NULL;
+        }
+
+        if (true == lead) {
+            group->stopping = atomic_load(&group->stop);
+        }
+
+        pthread_barrier_wait(&group->barrier);
+
+        if (true == group->stopping) {
+            if (NULL != w->frame) {
+                hantek_frame_release(w->frame);
+                w->frame = NULL;
+            }
+            break;
+        }
+
+        for (size_t i = 0; i < group->nr_devices; i++) {
+            if (NULL == group->workers[i].frame) {
+                all_frames = false;
+            }
+        }
+
+        /* Every device is armed straight after leaving the barrier, as close together as we can */
+        if (true == all_frames) {
+            _hantek_group_capture(group, w);
+        }
+
+        pthread_barrier_wait(&group->barrier);
+
+        if (true == lead) {
+            _hantek_group_deliver(group, all_frames);
+        }
+
+        pthread_barrier_wait(&group->barrier);
+    }
+
+    if (true == lead) {
+        atomic_store(&group->running, false);
+    }
+
+    return NULL;
+}
+
+/**
+ * Release everything a group holds. The group's threads must not be running.
+ */
+static
+void _hantek_group_free(struct hantek_group *group)
+{
+    for (size_t i = 0; i < group->nr_devices; i++) {
+        if (NULL != group->workers[i].pool) {
+            hantek_frame_pool_destroy(&group->workers[i].pool);
+        }
+    }
+
+    if (true == group->barrier_init) {
+        pthread_barrier_destroy(&group->barrier);
+    }
+
+    if (true == group->start_lock_init) {
+        pthread_mutex_destroy(&group->start_lock);
+    }
+
+    hantek_free(group);
+}
+
+HRESULT hantek_group_start(struct hantek_device *const *devs, size_t nr_devices, const struct hantek_group_config *cfg, hantek_group_cb_t cb, void *priv, struct hantek_group **pgroup)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_group *group = NULL;
+
+    HASSERT_ARG(NULL != devs);
+    HASSERT_ARG(0 != nr_devices);
+    HASSERT_ARG(nr_devices <= HT_GROUP_MAX_DEVICES);
+    HASSERT_ARG(NULL != cfg);
+    HASSERT_ARG(NULL != cb);
+    HASSERT_ARG(NULL != pgroup);
+
+    *pgroup = NULL;
+
+    for (size_t i = 0; i < nr_devices; i++) {
+        HASSERT_ARG(NULL != devs[i]);
+
+        for (size_t j = 0; j < i; j++) {
+            if (devs[i] == devs[j]) {
+                DEBUG("Device %zu is in the group twice", i);
+                ret = H_ERR_BAD_ARGS;
+                goto done;
+            }
+        }
+    }
+
+    if (NULL == (group = hantek_calloc(1, sizeof(*group)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    group->cfg = *cfg;
+    group->cb = cb;
+    group->priv = priv;
+    group->nr_devices = nr_devices;
+
+    atomic_init(&group->stop, false);
+    atomic_init(&group->nr_delivered, 0);
+    atomic_init(&group->nr_dropped, 0);
+    atomic_init(&group->nr_errors, 0);
+    atomic_init(&group->skew_ns_max, 0);
+    atomic_init(&group->result, H_OK);
+    atomic_init(&group->running, false);
+
+    for (size_t i = 0; i < nr_devices; i++) {
+        struct hantek_group_worker *w = &group->workers[i];
+
+        w->group = group;
+        w->dev = devs[i];
+        w->index = i;
+
+        if (H_FAILED(ret = hantek_frame_pool_create(w->dev, 0 != cfg->nr_frames ? cfg->nr_frames : HT_GROUP_DEFAULT_FRAMES,
+                        cfg->pool_flags, &w->pool)))
+        {
+            DEBUG("Failed to create frame pool for group device %zu", i);
+            goto done;
+        }
+    }
+
+    if (0 != pthread_barrier_init(&group->barrier, NULL, nr_devices)) {
+        DEBUG("Failed to create group barrier");
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    group->barrier_init = true;
+
+    pthread_mutex_init(&group->start_lock, NULL);
+    group->start_lock_init = true;
+
+    atomic_store(&group->running, true);
+
+    pthread_mutex_lock(&group->start_lock);
+
+    for (size_t i = 0; i < nr_devices; i++) {
+        struct hantek_group_worker *w = &group->workers[i];
+
+        if (0 != pthread_create(&w->thread, NULL, _hantek_group_thread, w)) {
+            DEBUG("Failed to create thread for group device %zu", i);
+            group->abort = true;
+            ret = H_ERR_NO_MEM;
+            break;
+        }
+
+        w->started = true;
+    }
+
+    pthread_mutex_unlock(&group->start_lock);
+
+    if (H_FAILED(ret)) {
+        atomic_store(&group->running, false);
+
+        for (size_t i = 0; i < nr_devices; i++) {
+            if (true == group->workers[i].started) {
+                pthread_join(group->workers[i].thread, NULL);
+            }
+        }
+
+        goto done;
+    }
+
+    *pgroup = group;
+
+done:
+    if (H_FAILED(ret) && NULL != group) {
+        _hantek_group_free(group);
+    }
+    return ret;
+}
+
+HRESULT hantek_group_stop(struct hantek_group **pgroup)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_group *group = NULL;
+
+    HASSERT_ARG(NULL != pgroup);
+    HASSERT_ARG(NULL != *pgroup);
+
+    group = *pgroup;
+
+    /* The threads notice at the start of the next round, so this waits out a capture at most */
+    atomic_store(&group->stop, true);
+
+    for (size_t i = 0; i < group->nr_devices; i++) {
+        if (true == group->workers[i].started) {
+            pthread_join(group->workers[i].thread, NULL);
+            group->workers[i].started = false;
+        }
+    }
+
+    ret = atomic_load(&group->result);
+
+    _hantek_group_free(group);
+    *pgroup = NULL;
+
+    return ret;
+}
+
+HRESULT hantek_group_get_stats(struct hantek_group *group, struct hantek_group_stats *pstats)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != group);
+    HASSERT_ARG(NULL != pstats);
+
+    pstats->nr_frames = atomic_load(&group->nr_delivered);
+    pstats->nr_dropped = atomic_load(&group->nr_dropped);
+    pstats->nr_errors = atomic_load(&group->nr_errors);
+    pstats->skew_ns_max = atomic_load(&group->skew_ns_max);
+    pstats->result = atomic_load(&group->result);
+    pstats->running = atomic_load(&group->running);
+
+    return ret;
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <hantek.h>
+#include <hantek_frame.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Capture groups, for acquiring from several scopes together. Each device gets a thread of its
+ * own, which arms it, waits for the capture and reads it back, so readback throughput grows with
+ * the number of devices. The threads meet before every capture and arm their devices at the same
+ * moment, then meet again once all of them have their capture, which is delivered as one group
+ * frame.
+ *
+ * The devices are not clocked together, so the host can only estimate how far apart their
+ * captures started, from when each device was armed. Devices triggering from a shared signal
+ * line up to within a sample regardless.
+ *
+ * While the group is running, its threads own the devices: nothing else may use them until
+ * hantek_group_stop returns.
+ */
+
+struct hantek_group;
+
+/**
+ * Most devices a group can hold
+ */
+#define HT_GROUP_MAX_DEVICES                8
+
+struct hantek_group_config {
+    enum hantek_capture_mode mode;
+
+    /**
+     * How long to wait for a device to capture before giving up on a group frame, or 0 for the
+     * default
+     */
+    unsigned timeout_ms;
+
+    /**
+     * Frames in each device's pool (0 for the default), and HT_FRAME_POOL_* flags for the pools
+     */
+    size_t nr_frames;
+    unsigned pool_flags;
+};
+
+/**
+ * Timing of one device's part of a group frame. Times are CLOCK_MONOTONIC nanoseconds.
+ */
+struct hantek_group_timing {
+    /**
+     * When the arm command was sent, and when it had completed
+     */
+    uint64_t arm_ns;
+    uint64_t armed_ns;
+
+    /**
+     * When the device was first seen with its capture ready, and the status it reported then
+     */
+    uint64_t ready_ns;
+    struct hantek_status status;
+
+    /**
+     * Estimated start of this device's capture, relative to the first device's
+     */
+    int64_t skew_ns;
+};
+
+struct hantek_group_frame {
+    /**
+     * One frame per device, in the order the devices were given in
+     */
+    size_t nr_devices;
+    struct hantek_frame *frames[HT_GROUP_MAX_DEVICES];
+    struct hantek_group_timing timing[HT_GROUP_MAX_DEVICES];
+
+    /**
+     * Sequence number, counting lost group captures too, and the number lost immediately before
+     * this one
+     */
+    uint64_t seq;
+    uint64_t nr_dropped;
+
+    /**
+     * Estimated spread between the earliest and latest capture start, and how far off that
+     * estimate could be
+     */
+    uint64_t skew_ns;
+    uint64_t skew_error_ns;
+};
+
+struct hantek_group_stats {
+    /**
+     * Group frames delivered, group captures lost, and failed captures
+     */
+    uint64_t nr_frames;
+    uint64_t nr_dropped;
+    uint64_t nr_errors;
+
+    /**
+     * Largest skew estimate seen so far
+     */
+    uint64_t skew_ns_max;
+
+    /**
+     * The result the group stopped with, if it has, and whether it is still running
+     */
+    HRESULT result;
+    bool running;
+};
+
+/**
+ * Called on one of the group's threads with each group frame. The group frame itself is only
+ * valid during the call, but the callee holds one reference to each of its frames, which it
+ * drops with hantek_frame_release once done.
+ */
+typedef void (*hantek_group_cb_t)(struct hantek_group *group, const struct hantek_group_frame *frame, void *priv);
+
+/**
+ * Start acquiring from nr_devices devices together. Each device's ADC routing and trigger
+ * should be configured beforehand, and may not change until the group is stopped.
+ */
+HRESULT hantek_group_start(struct hantek_device *const *devs, size_t nr_devices, const struct hantek_group_config *cfg, hantek_group_cb_t cb, void *priv, struct hantek_group **pgroup);
+
+/**
+ * Stop a group and free it. The devices are left open. Frame pools last until the frames still
+ * held from them are released.
+ */
+HRESULT hantek_group_stop(struct hantek_group **pgroup);
+
+/**
+ * Get the group's statistics. Safe to call while the group is running.
+ */
+HRESULT hantek_group_get_stats(struct hantek_group *group, struct hantek_group_stats *pstats);
@@ -0,0 +1,321 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+#include <hantek_acquire.h>
+#include <hantek_frame.h>
+#include <hantek_loop.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+/**
+ * Number of pipeline runs in a row that may fail before the loop thread gives up
+ */
+#define HT_LOOP_MAX_FAILURES                8
+
+/**
+ * Raw capture buffers the pipeline rotates through, and the default size of the frame pool
+ */
+#define HT_LOOP_NR_BUFS                     4
+#define HT_LOOP_DEFAULT_FRAMES              8
+
+struct hantek_loop {
+    struct hantek_device *dev;
+    struct hantek_loop_config cfg;
+    hantek_frame_cb_t cb;
+    void *priv;
+
+    /**
+     * Raw capture buffers for the pipeline
+     */
+    struct hantek_buffer *raw_bufs[HT_LOOP_NR_BUFS];
+    uint8_t *raw[HT_LOOP_NR_BUFS];
+    size_t raw_len;
+
+    /**
+     * Where frames come from, and whether the loop created the pool itself
+     */
+    struct hantek_frame_pool *pool;
+    bool own_pool;
+
+    /**
+     * Signalled by hantek_acquire_loop_stop to wake the loop thread
+     */
+    int wake_fd;
+
+    pthread_t thread;
+    bool started;
+    _Atomic bool stop;
+
+    /**
+     * The pipeline run in progress, only touched by the loop thread
+     */
+    HRESULT pipe_result;
+    uint64_t seq;
+    uint64_t pending_dropped;
+    unsigned nr_failures;
+
+    /**
+     * Statistics, updated by the loop thread
+     */
+    _Atomic uint64_t nr_delivered;
+    _Atomic uint64_t nr_dropped;
+    _Atomic uint64_t nr_errors;
+    _Atomic HRESULT result;
+    _Atomic bool running;
+};
+
+/**
+ * Pipeline callback, on the loop thread: split each capture into a frame from the pool, give
+ * the raw buffer straight back to the pipeline, then hand the frame over.
+ */
+static
+void _hantek_loop_capture(struct hantek_device *dev, HRESULT result, int buf_index, size_t nr_bytes, void *priv)
+{
+    struct hantek_loop *loop = priv;
+    struct hantek_frame *frame = NULL;
+    uint8_t *const *channels = NULL;
+    uint64_t seq = 0;
+
+    if (0 > buf_index) {
+        loop->pipe_result = result;
+        return;
+    }
+
+    seq = loop->seq++;
+    loop->nr_failures = 0;
+
+    if (H_FAILED(hantek_frame_pool_get(loop->pool, &frame))) {
+        /* The consumers are holding every frame, this capture is lost */
+        hantek_pipeline_release(dev, buf_index);
+        atomic_fetch_add(&loop->nr_dropped, 1);
+        loop->pending_dropped++;
+        return;
+    }
+
+    channels = hantek_frame_channels(frame);
+
+    hantek_split_channels(dev, loop->raw[buf_index], nr_bytes, channels[0], channels[1],
+            channels[2], channels[3]);
+
+    hantek_pipeline_release(dev, buf_index);
+
+    frame->nr_samples = nr_bytes / dev->adc_nr_streams;
+    hantek_frame_set_config(frame, dev);
+    frame->seq = seq;
+    frame->nr_dropped = loop->pending_dropped;
+    frame->ready_ns = dev->acq.ready_ns;
+    frame->done_ns = hantek_now_ns();
+    loop->pending_dropped = 0;
+
+    atomic_fetch_add(&loop->nr_delivered, 1);
+
+    loop->cb(loop, frame, loop->priv);
+}
+
+static
+void *_hantek_loop_thread(void *arg)
+{
+    struct hantek_loop *loop = arg;
+    HRESULT ret = H_OK;
+
+    while (false == atomic_load(&loop->stop)) {
+        loop->pipe_result = H_OK;
+
+        if (H_FAILED(ret = hantek_pipeline_start(loop->dev, loop->cfg.mode, loop->raw, HT_LOOP_NR_BUFS,
+                        loop->raw_len, loop->cfg.flags, _hantek_loop_capture, loop)))
+        {
+            DEBUG("Failed to start acquisition loop pipeline");
+            break;
+        }
+
+        /* A stop request stops the pipeline */
+        hantek_run_until_idle(loop->dev, loop->wake_fd, &loop->stop);
+
+        ret = loop->pipe_result;
+
+        if (H_FAILED(ret) && true == atomic_load(&loop->stop)) {
+            /* Stopped on purpose */
+            ret = H_OK;
+            break;
+        }
+
+        if (H_FAILED(ret)) {
+            DEBUG("Acquisition loop capture %lu failed, result = %08x", (unsigned long)loop->seq, (unsigned)ret);
+            atomic_fetch_add(&loop->nr_errors, 1);
+            atomic_fetch_add(&loop->nr_dropped, 1);
+            loop->pending_dropped++;
+            loop->seq++;
+
+            if (HT_LOOP_MAX_FAILURES <= ++loop->nr_failures) {
+                DEBUG("Too many failed captures in a row, stopping acquisition loop");
+                break;
+            }
+        }
+    }
+
+    atomic_store(&loop->result, ret);
+    atomic_store(&loop->running, false);
+
+    return NULL;
+}
+
+/**
+ * Release everything a loop holds. The loop thread must not be running.
+ */
+static
+void _hantek_loop_free(struct hantek_loop *loop)
+{
+    if (0 <= loop->wake_fd) {
+        close(loop->wake_fd);
+    }
+
+    for (size_t i = 0; i < HT_LOOP_NR_BUFS; i++) {
+        if (NULL != loop->raw_bufs[i]) {
+            hantek_buffer_free(loop->dev, &loop->raw_bufs[i]);
+        }
+    }
+
+    if (true == loop->own_pool && NULL != loop->pool) {
+        hantek_frame_pool_destroy(&loop->pool);
+    }
+
+    hantek_free(loop);
+}
+
+HRESULT hantek_acquire_loop(struct hantek_device *dev, const struct hantek_loop_config *cfg, hantek_frame_cb_t cb, void *priv, struct hantek_loop **ploop)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_loop *loop = NULL;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != cfg);
+    HASSERT_ARG(NULL != cb);
+    HASSERT_ARG(NULL != ploop);
+
+    *ploop = NULL;
+
+    if (NULL != cfg->pool && H_FAILED(ret = hantek_frame_pool_check(cfg->pool, dev))) {
+        DEBUG("Frame pool doesn't fit the device's captures");
+        goto done;
+    }
+
+    if (NULL == (loop = hantek_calloc(1, sizeof(*loop)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    loop->dev = dev;
+    loop->cfg = *cfg;
+    loop->cb = cb;
+    loop->priv = priv;
+    loop->raw_len = dev->capture_buffer_len;
+    loop->pool = cfg->pool;
+    loop->wake_fd = -1;
+
+    atomic_init(&loop->stop, false);
+    atomic_init(&loop->nr_delivered, 0);
+    atomic_init(&loop->nr_dropped, 0);
+    atomic_init(&loop->nr_errors, 0);
+    atomic_init(&loop->result, H_OK);
+    atomic_init(&loop->running, false);
+
+    for (size_t i = 0; i < HT_LOOP_NR_BUFS; i++) {
+        if (H_FAILED(ret = hantek_buffer_alloc(dev, loop->raw_len, &loop->raw_bufs[i]))) {
+            DEBUG("Failed to allocate acquisition loop capture buffers");
+            goto done;
+        }
+
+        hantek_buffer_get_data(loop->raw_bufs[i], &loop->raw[i], NULL);
+    }
+
+    if (NULL == loop->pool) {
+        if (H_FAILED(ret = hantek_frame_pool_create(dev, 0 != cfg->nr_frames ? cfg->nr_frames : HT_LOOP_DEFAULT_FRAMES,
+                        cfg->pool_flags, &loop->pool)))
+        {
+            DEBUG("Failed to create acquisition loop frame pool");
+            goto done;
+        }
+
+        loop->own_pool = true;
+    }
+
+    if (0 > (loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) {
+        DEBUG("Failed to create loop eventfd: %s (%d)", strerror(errno), errno);
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    atomic_store(&loop->running, true);
+
+    if (0 != pthread_create(&loop->thread, NULL, _hantek_loop_thread, loop)) {
+        DEBUG("Failed to create acquisition loop thread");
+        atomic_store(&loop->running, false);
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    loop->started = true;
+    *ploop = loop;
+
+done:
+    if (H_FAILED(ret) && NULL != loop) {
+        _hantek_loop_free(loop);
+    }
+    return ret;
+}
+
+HRESULT hantek_acquire_loop_stop(struct hantek_loop **ploop)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_loop *loop = NULL;
+    uint64_t one = 1;
+
+    HASSERT_ARG(NULL != ploop);
+    HASSERT_ARG(NULL != *ploop);
+
+    loop = *ploop;
+
+    if (true == loop->started) {
+        atomic_store(&loop->stop, true);
+
+        if (sizeof(one) != write(loop->wake_fd, &one, sizeof(one))) {
+            DEBUG("Failed to wake acquisition loop: %s (%d)", strerror(errno), errno);
+        }
+
+        pthread_join(loop->thread, NULL);
+        loop->started = false;
+    }
+
+    ret = atomic_load(&loop->result);
+
+    _hantek_loop_free(loop);
+    *ploop = NULL;
+
+    return ret;
+}
+
+HRESULT hantek_acquire_loop_get_stats(struct hantek_loop *loop, struct hantek_loop_stats *pstats)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != loop);
+    HASSERT_ARG(NULL != pstats);
+
+    pstats->nr_frames = atomic_load(&loop->nr_delivered);
+    pstats->nr_dropped = atomic_load(&loop->nr_dropped);
+    pstats->nr_errors = atomic_load(&loop->nr_errors);
+    pstats->result = atomic_load(&loop->result);
+    pstats->running = atomic_load(&loop->running);
+
+    return ret;
+}
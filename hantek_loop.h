@@ -0,0 +1,77 @@
+#pragma once
+
+#include <hantek.h>
+#include <hantek_frame.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Continuous acquisition loop. A library-owned thread runs a pipelined acquisition, splits each
+ * capture into per-channel samples in a frame taken from a frame pool, and hands the frame to a
+ * callback. Frames go back to the pool once every reference to them is released, so nothing is
+ * allocated once the loop is running. If the pool runs dry, captures are dropped until a frame
+ * comes back, and the next frame delivered reports how many were lost before it.
+ *
+ * While the loop is running, its thread owns the device: nothing else may use it until
+ * hantek_acquire_loop_stop returns.
+ */
+
+struct hantek_loop;
+
+struct hantek_loop_config {
+    enum hantek_capture_mode mode;
+
+    /**
+     * Pool to take frames from, or NULL for the loop to create its own, of nr_frames frames (0 for
+     * the default) with HT_FRAME_POOL_* pool_flags. A pool given here must have room for the
+     * current capture length and every channel the ADC is routed to.
+     */
+    struct hantek_frame_pool *pool;
+    size_t nr_frames;
+    unsigned pool_flags;
+
+    /**
+     * Pipeline flags (HT_PIPELINE_*)
+     */
+    unsigned flags;
+};
+
+struct hantek_loop_stats {
+    /**
+     * Frames delivered, captures lost, and failed captures
+     */
+    uint64_t nr_frames;
+    uint64_t nr_dropped;
+    uint64_t nr_errors;
+
+    /**
+     * The result the loop thread stopped with, if it has, and whether it is still running
+     */
+    HRESULT result;
+    bool running;
+};
+
+/**
+ * Called on the loop thread with each new frame, holding one reference, which the caller drops
+ * with hantek_frame_release once done
+ */
+typedef void (*hantek_frame_cb_t)(struct hantek_loop *loop, struct hantek_frame *frame, void *priv);
+
+/**
+ * Start an acquisition loop on the given device. The ADC routing and trigger should be
+ * configured beforehand, and may not change until the loop is stopped.
+ */
+HRESULT hantek_acquire_loop(struct hantek_device *dev, const struct hantek_loop_config *cfg, hantek_frame_cb_t cb, void *priv, struct hantek_loop **ploop);
+
+/**
+ * Stop an acquisition loop and free it. A pool the loop created itself lasts until the frames
+ * still held from it are released.
+ */
+HRESULT hantek_acquire_loop_stop(struct hantek_loop **ploop);
+
+/**
+ * Get the loop's statistics. Safe to call while the loop is running.
+ */
+HRESULT hantek_acquire_loop_get_stats(struct hantek_loop *loop, struct hantek_loop_stats *pstats);
@@ -1,5 +1,10 @@
 #include <hantek.h>
 #include <hantek_flash.h>
+#include <hantek_sim.h>
+#include <hantek_record.h>
+#include <hantek_manager.h>
+#include <hantek_stream.h>
+#include <hantek_loop.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +12,8 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
+#include <stdatomic.h>
 
 static
 bool dump_bitstream_flash = false;
@@ -17,6 +24,66 @@ const char *bitstream_flash_filename = NULL;
 static
 uint8_t _trig_level = 128;
 
+static
+bool _use_sim = false;
+
+static
+const char *_record_filename = NULL;
+
+static
+const char *_replay_filename = NULL;
+
+static
+bool _replay_realtime = true;
+
+static
+unsigned long _stream_count = 0;
+
+static
+unsigned long _pipeline_count = 0;
+
+static
+unsigned long _segment_count = 0;
+
+static
+bool _calibrate_settling = false;
+
+static
+bool _warm_reopen = false;
+
+static
+bool _plan_rate = false;
+
+static
+double _sample_rate = HT_RATE_MAX;
+
+static
+double _rate_tolerance = 0.0;
+
+#define HT_MAX_POLLFDS 16
+#define HT_MAX_LIST_DEVICES 32
+#define HT_STREAM_BLOCKS 64
+
+static
+bool _acquire_finished = false;
+
+static
+HRESULT _acquire_result = H_OK;
+
+static
+size_t _acquire_bytes = 0;
+
+static
+void _acquire_done(struct hantek_device *dev, HRESULT result, size_t nr_bytes, void *priv)
+{
+    (void)dev;
+    (void)priv;
+
+    _acquire_result = result;
+    _acquire_bytes = nr_bytes;
+    _acquire_finished = true;
+}
+
 static
 void _dump_bitstream_flash(struct hantek_device *dev, const char *filename)
 {
@@ -48,12 +115,275 @@ void _dump_bitstream_flash(struct hantek_device *dev, const char *filename)
     fclose(fp);
 }
 
+static
+void _list_devices(void)
+{
+    struct hantek_manager *mgr = NULL;
+    struct hantek_device_info infos[HT_MAX_LIST_DEVICES];
+    size_t nr_infos = 0;
+
+    if (H_FAILED(hantek_manager_create(&mgr))) {
+        fprintf(stderr, "Failed to create device manager, aborting.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (H_FAILED(hantek_manager_get_devices(mgr, infos, HT_MAX_LIST_DEVICES, &nr_infos))) {
+        fprintf(stderr, "Failed to get list of devices, aborting.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%zu device(s) attached\n", nr_infos);
+
+    for (size_t i = 0; i < nr_infos && i < HT_MAX_LIST_DEVICES; i++) {
+        printf("  %s: PCB revision %d, bus %u address %u\n", infos[i].serial_number,
+                infos[i].pcb_revision, infos[i].bus, infos[i].address);
+    }
+
+    hantek_manager_destroy(&mgr);
+}
+
+/**
+ * Wait for the device's next events, and handle them
+ */
+static
+HRESULT _wait_device_events(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    struct pollfd pfds[HT_MAX_POLLFDS];
+    struct hantek_pollfd hfds[HT_MAX_POLLFDS];
+    size_t nr_fds = 0;
+    int timeout_ms = -1;
+
+    if (H_FAILED(ret = hantek_get_pollfds(dev, hfds, HT_MAX_POLLFDS, &nr_fds)) ||
+            H_FAILED(ret = hantek_get_timeout(dev, &timeout_ms)))
+    {
+        fprintf(stderr, "Failed to get device events to wait on, aborting.\n");
+        goto done;
+    }
+
+    if (nr_fds > HT_MAX_POLLFDS) {
+        nr_fds = HT_MAX_POLLFDS;
+    }
+
+    for (size_t i = 0; i < nr_fds; i++) {
+        pfds[i].fd = hfds[i].fd;
+        pfds[i].events = hfds[i].events;
+    }
+
+    poll(pfds, nr_fds, timeout_ms);
+
+    if (H_FAILED(ret = hantek_handle_events(dev))) {
+        fprintf(stderr, "Failed to handle device events, aborting.\n");
+        goto done;
+    }
+
+done:
+    return ret;
+}
+
+static
+_Atomic unsigned long _pipeline_frames = 0;
+
+static
+void _pipeline_frame(struct hantek_loop *loop, struct hantek_frame *frame, void *priv)
+{
+    (void)loop;
+    (void)priv;
+
+    /* A real consumer would process the frame here, or hand it to another thread */
+    hantek_frame_release(frame);
+
+    atomic_fetch_add(&_pipeline_frames, 1);
+}
+
+static
+void _pipeline_captures(struct hantek_device *dev)
+{
+    struct hantek_loop_config cfg = { .mode = HT_CAPTURE_ROLL, .flags = HT_PIPELINE_OVERLAP_READBACK };
+    struct hantek_loop *loop = NULL;
+    struct hantek_loop_stats loop_stats;
+    struct hantek_pipeline_stats stats;
+    struct hantek_alloc_stats start_allocs,
+                              end_allocs;
+
+    if (H_FAILED(hantek_acquire_loop(dev, &cfg, _pipeline_frame, NULL, &loop))) {
+        fprintf(stderr, "Failed to start acquisition loop, aborting.\n");
+        return;
+    }
+
+    /* Everything the loop needs is allocated by now */
+    hantek_get_alloc_stats(&start_allocs);
+
+    do {
+        usleep(1000);
+        hantek_acquire_loop_get_stats(loop, &loop_stats);
+    } while (atomic_load(&_pipeline_frames) < _pipeline_count && true == loop_stats.running);
+
+    if (false == loop_stats.running) {
+        fprintf(stderr, "Acquisition loop stopped, result = %08x\n", (unsigned)loop_stats.result);
+    }
+
+    hantek_get_alloc_stats(&end_allocs);
+    hantek_acquire_loop_stop(&loop);
+    hantek_get_pipeline_stats(dev, &stats);
+
+    printf("Captured %lu waveforms, %.1f waveforms/s, blind time avg %lu us max %lu us, %s, %lu lost\n",
+            (unsigned long)stats.nr_frames, stats.waveforms_per_sec,
+            (unsigned long)(stats.blind_ns_avg / 1000), (unsigned long)(stats.blind_ns_max / 1000),
+            true == stats.overlapped ? "rearming during readback" : "rearming after readback",
+            (unsigned long)loop_stats.nr_dropped);
+    printf("%lu heap allocations while acquiring\n",
+            (unsigned long)(end_allocs.nr_allocs - start_allocs.nr_allocs));
+}
+
+static
+bool _segments_done = false;
+
+static
+void _segments_finished(struct hantek_device *dev, HRESULT result, struct hantek_segments *segs, void *priv)
+{
+    (void)dev;
+    (void)segs;
+    (void)priv;
+
+    if (H_FAILED(result)) {
+        fprintf(stderr, "Segmented capture failed, result = %08x\n", (unsigned)result);
+    }
+
+    _segments_done = true;
+}
+
+static
+void _segment_captures(struct hantek_device *dev, unsigned long count)
+{
+    struct hantek_segments *segs = NULL;
+    const struct hantek_segment_info *info = NULL;
+    struct hantek_capture_config config;
+    size_t nr_segs = 0;
+
+    if (H_FAILED(hantek_segments_alloc(dev, count, &segs))) {
+        fprintf(stderr, "Failed to allocate %lu segments, aborting.\n", count);
+        goto done;
+    }
+
+    if (H_FAILED(hantek_segmented_start(dev, HT_CAPTURE_ROLL, segs, HT_PIPELINE_OVERLAP_READBACK, _segments_finished, NULL))) {
+        fprintf(stderr, "Failed to start segmented capture, aborting.\n");
+        goto done;
+    }
+
+    while (false == _segments_done) {
+        if (H_FAILED(_wait_device_events(dev))) {
+            goto done;
+        }
+    }
+
+    hantek_segments_get(segs, NULL, &info, &nr_segs, &config);
+
+    printf("Captured %zu of %lu segments of %zu bytes, time/div setting %d\n", nr_segs, count,
+            config.capture_buffer_len, (int)config.timebase);
+
+    for (size_t i = 0; i < nr_segs; i++) {
+        printf("Segment %zu: +%lu us, trigger status 0x%010llx\n", i,
+                (unsigned long)((info[i].timestamp_ns - info[0].timestamp_ns) / 1000),
+                (unsigned long long)info[i].trigger_status);
+    }
+
+done:
+    if (NULL != segs) {
+        hantek_segments_free(dev, &segs);
+    }
+}
+
+static
+void _calibrate_settle_times(struct hantek_device *dev)
+{
+    static const
+    struct {
+        enum hantek_settle_op op;
+        const char *name;
+    } ops[] = {
+        { HT_SETTLE_RELAY, "relays" },
+        { HT_SETTLE_POSITION, "position" },
+        { HT_SETTLE_ADC, "ADC" },
+    };
+
+    for (size_t i = 0; i < sizeof(ops)/sizeof(ops[0]); i++) {
+        unsigned was_us = 0,
+                 settle_us = 0;
+
+        hantek_get_settle_time(dev, ops[i].op, &was_us);
+
+        if (H_FAILED(hantek_settle_calibrate(dev, ops[i].op, &settle_us))) {
+            fprintf(stderr, "Failed to calibrate %s settle time\n", ops[i].name);
+            continue;
+        }
+
+        printf("Settle time for %s: %u us (was %u us)\n", ops[i].name, settle_us, was_us);
+    }
+}
+
+static
+void _stream_captures(struct hantek_device *dev, unsigned long count)
+{
+    struct hantek_stream *stream = NULL;
+    struct hantek_stream_stats stats;
+    unsigned long nr_received = 0;
+    uint64_t nr_bytes = 0;
+    int fd = -1;
+
+    if (H_FAILED(hantek_stream_create(dev, HT_CAPTURE_ROLL, HT_STREAM_BLOCKS, &stream)) ||
+            H_FAILED(hantek_stream_get_fd(stream, &fd)) ||
+            H_FAILED(hantek_stream_start(stream)))
+    {
+        fprintf(stderr, "Failed to start streaming, aborting.\n");
+        goto done;
+    }
+
+    while (nr_received < count) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        struct hantek_stream_span span;
+
+        if (H_FAILED(hantek_stream_get_span(stream, &span))) {
+            hantek_stream_get_stats(stream, &stats);
+
+            if (false == stats.running) {
+                fprintf(stderr, "Streaming stopped, result = %08x\n", (unsigned)stats.result);
+                break;
+            }
+
+            poll(&pfd, 1, -1);
+            continue;
+        }
+
+        if (0 != span.nr_dropped) {
+            printf("Lost %lu captures before capture %lu\n", (unsigned long)span.nr_dropped, (unsigned long)span.seq);
+        }
+
+        nr_received += span.nr_blocks;
+        nr_bytes += span.len;
+
+        hantek_stream_release(stream, span.nr_blocks);
+    }
+
+    hantek_stream_stop(stream);
+    hantek_stream_get_stats(stream, &stats);
+
+    printf("Streamed %lu captures (%lu bytes), %lu lost, %lu failed\n", nr_received, (unsigned long)nr_bytes,
+            (unsigned long)stats.nr_dropped, (unsigned long)stats.nr_errors);
+
+done:
+    if (NULL != stream) {
+        hantek_stream_destroy(&stream);
+    }
+}
+
 static
 void _parse_args(int argc, char *const *argv)
 {
     int c = -1;
 
-    while (0 < (c = getopt(argc, argv, "hB:t:"))) {
+    while (0 < (c = getopt(argc, argv, "hB:t:SR:P:fls:w:g:cC:Wr:T:"))) {
         switch (c) {
         case 'h':
             fprintf(stderr, "No help here, yet\n");
@@ -68,47 +398,161 @@ void _parse_args(int argc, char *const *argv)
             _trig_level = atoi(optarg);
             printf("Setting trigger level to %u\n", (unsigned)_trig_level);
             break;
+        case 'S':
+            printf("Using a simulated device\n");
+            _use_sim = true;
+            break;
+        case 'R':
+            printf("Recording device traffic to '%s'\n", optarg);
+            _record_filename = optarg;
+            break;
+        case 'P':
+            printf("Replaying device traffic from '%s'\n", optarg);
+            _replay_filename = optarg;
+            break;
+        case 'f':
+            _replay_realtime = false;
+            break;
+        case 's':
+            _stream_count = strtoul(optarg, NULL, 0);
+            printf("Streaming %lu captures\n", _stream_count);
+            break;
+        case 'w':
+            _pipeline_count = strtoul(optarg, NULL, 0);
+            printf("Capturing %lu waveforms, pipelined\n", _pipeline_count);
+            break;
+        case 'g':
+            _segment_count = strtoul(optarg, NULL, 0);
+            printf("Capturing %lu segments\n", _segment_count);
+            break;
+        case 'c':
+            _calibrate_settling = true;
+            break;
+        case 'C':
+            printf("Caching device data in '%s'\n", optarg);
+            hantek_set_cache_dir(optarg);
+            break;
+        case 'W':
+            _warm_reopen = true;
+            break;
+        case 'r':
+            _plan_rate = true;
+            _sample_rate = 0 == strcmp(optarg, "max") ? HT_RATE_MAX : strtod(optarg, NULL);
+            break;
+        case 'T':
+            _rate_tolerance = strtod(optarg, NULL);
+            break;
+        case 'l':
+            _list_devices();
+            exit(EXIT_SUCCESS);
+            break;
         default:
             fprintf(stderr, "Unknown argument: -%c\n", c);
         }
     }
 }
 
+static
+HRESULT _open_transport(struct hantek_transport **ptp)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_transport *tp = NULL,
+                            *rec = NULL;
+
+    if (NULL != _replay_filename) {
+        ret = hantek_replay_transport_create(&tp, _replay_filename, _replay_realtime);
+    } else if (true == _use_sim) {
+        ret = hantek_sim_transport_create(&tp, NULL);
+    } else {
+        ret = hantek_usb_transport_open(&tp);
+    }
+
+    if (H_FAILED(ret)) {
+        goto done;
+    }
+
+    if (NULL != _record_filename) {
+        if (H_FAILED(ret = hantek_record_transport_create(&rec, tp, _record_filename))) {
+            hantek_transport_close(&tp);
+            goto done;
+        }
+        tp = rec;
+    }
+
+    *ptp = tp;
+
+done:
+    return ret;
+}
+
 int main(int argc, char * const *argv)
 {
     printf("Hantek Device Test Tool\n");
 
     struct hantek_device *dev = NULL;
+    struct hantek_transport *tp = NULL;
+    struct hantek_buffer *capture_buf = NULL;
+    struct hantek_capture_config config = { 0 };
+    uint8_t *capture_data = NULL,
+            *chan_data = NULL;
+    size_t capture_len = 0,
+           chan_len = 0;
+    bool warm = false;
 
     _parse_args(argc, argv);
 
-    if (H_FAILED(hantek_open_device(&dev, 4096))) {
+    if (H_FAILED(_open_transport(&tp))) {
         printf("Failed to open device. Aborting.\n");
         goto done;
     }
 
-    for (size_t i = 0; i < 4; i++) {
-        if (H_FAILED(hantek_configure_channel_frontend(dev, i, HT_VPD_50MV, HT_COUPLING_AC, false, true, 128))) {
-            printf("Failed to set up channel %zu\n", i);
-            goto done;
-        }
+    if (H_FAILED(true == _warm_reopen ? hantek_reopen_device_on(&dev, tp, 4096, &warm) : hantek_open_device_on(&dev, tp, 4096))) {
+        printf("Failed to open device. Aborting.\n");
+        hantek_transport_close(&tp);
+        goto done;
     }
 
-    if (H_FAILED(hantek_configure_adc_routing(dev))) {
-        printf("Failed to set up ADC routing, aborting.\n");
-        goto done;
+    if (true == warm) {
+        printf("Reattached to a configured device\n");
     }
 
-    if (H_FAILED(hantek_set_sampling_rate(dev, HT_ST_500US))) {
-        printf("Failed to set sampling rate, aborting.\n");
-        goto done;
+    for (size_t i = 0; i < 4; i++) {
+        config.channels[i].enabled = true;
+        config.channels[i].vpd = HT_VPD_50MV;
+        config.channels[i].coupling = HT_COUPLING_AC;
+        config.channels[i].level = 128;
     }
 
-    if (H_FAILED(hantek_configure_trigger(dev, 0, HT_TRIGGER_EDGE, HT_TRIGGER_SLOPE_RISE, HT_COUPLING_AC, _trig_level, 1, 50))) {
-        printf("Failed to set triggering, aborting.\n");
+    config.timebase = HT_ST_500US;
+    config.trigger_set = true;
+    config.trigger.channel = 0;
+    config.trigger.mode = HT_TRIGGER_EDGE;
+    config.trigger.slope = HT_TRIGGER_SLOPE_RISE;
+    config.trigger.coupling = HT_COUPLING_AC;
+    config.trigger.level = _trig_level;
+    config.trigger.slop = 1;
+    config.trigger.horiz_offset = 50;
+
+    if (H_FAILED(hantek_apply_config(dev, &config))) {
+        printf("Failed to configure the scope, aborting.\n");
         goto done;
     }
 
+    if (true == _plan_rate) {
+        struct hantek_rate_plan plan;
+
+        if (H_FAILED(hantek_plan_sample_rate(dev, _sample_rate, _rate_tolerance, 0, 0xf, &plan)) ||
+                H_FAILED(hantek_apply_rate_plan(dev, &plan)))
+        {
+            printf("Failed to set the sample rate, aborting.\n");
+            goto done;
+        }
+
+        printf("Sampling at %.3f S/s per channel (at most %.3f), ADC clock %llu Hz, spacing %u\n",
+                plan.rate, plan.max_rate, (unsigned long long)plan.adc_clock_hz, (unsigned)plan.spacing);
+    }
+
     /*
     if (H_FAILED(hantek_get_status(dev, NULL))) {
         printf("Failed to get status, aborting.\n");
@@ -120,29 +564,101 @@ int main(int argc, char * const *argv)
         _dump_bitstream_flash(dev, bitstream_flash_filename);
     }
 
-    if (H_FAILED(hantek_start_capture(dev, HT_CAPTURE_ROLL))) {
+    if (true == _calibrate_settling) {
+        _calibrate_settle_times(dev);
+    }
+
+    if (H_FAILED(hantek_buffer_alloc(dev, 4096, &capture_buf)) ||
+            H_FAILED(hantek_buffer_get_data(capture_buf, &capture_data, &capture_len)))
+    {
+        printf("Failed to allocate capture buffer, aborting.\n");
+        goto done;
+    }
+
+    if (H_FAILED(hantek_acquire_start(dev, HT_CAPTURE_ROLL, capture_data, capture_len, _acquire_done, NULL))) {
         printf("Failed to start capture, aborting.\n");
         goto done;
     }
 
-    printf("Waiting for ready flag to fire.\n");
+    printf("Waiting for the capture to complete.\n");
+
+    while (false == _acquire_finished) {
+        struct pollfd pfds[HT_MAX_POLLFDS];
+        struct hantek_pollfd hfds[HT_MAX_POLLFDS];
+        size_t nr_fds = 0;
+        int timeout_ms = -1;
 
-    bool ready = false;
-    while (false == ready) {
-        if (H_FAILED(hantek_get_status(dev, &ready))) {
-            printf("Failed to get status, aborting.\n");
+        if (H_FAILED(hantek_get_pollfds(dev, hfds, HT_MAX_POLLFDS, &nr_fds)) ||
+                H_FAILED(hantek_get_timeout(dev, &timeout_ms)))
+        {
+            printf("Failed to get device events to wait on, aborting.\n");
+            goto done;
+        }
+
+        if (nr_fds > HT_MAX_POLLFDS) {
+            nr_fds = HT_MAX_POLLFDS;
+        }
+
+        for (size_t i = 0; i < nr_fds; i++) {
+            pfds[i].fd = hfds[i].fd;
+            pfds[i].events = hfds[i].events;
+        }
+
+        if (0 > poll(pfds, nr_fds, timeout_ms) && EINTR != errno) {
+            printf("Failed to poll: %s (%d)\n", strerror(errno), errno);
+            goto done;
+        }
+
+        if (H_FAILED(hantek_handle_events(dev))) {
+            printf("Failed to handle device events, aborting.\n");
             goto done;
         }
     }
 
-    printf("Got ready flag, reading back the buffer\n");
+    if (H_FAILED(_acquire_result)) {
+        printf("Capture failed, aborting.\n");
+        goto done;
+    }
+
+    printf("Captured %zu bytes\n", _acquire_bytes);
+
+    if (H_FAILED(hantek_get_channel_buffer_len(dev, &chan_len)) ||
+            NULL == (chan_data = malloc(4 * chan_len)))
+    {
+        printf("Failed to allocate channel buffers, aborting.\n");
+        goto done;
+    }
 
-    if (H_FAILED(hantek_retrieve_buffer(dev, NULL, NULL, NULL, NULL))) {
-        printf("Failed to retrieve buffer, aborting.\n");
+    if (H_FAILED(hantek_split_channels(dev, capture_data, _acquire_bytes, chan_data, chan_data + chan_len,
+                    chan_data + 2 * chan_len, chan_data + 3 * chan_len)))
+    {
+        printf("Failed to split capture into channels, aborting.\n");
         goto done;
     }
 
+    for (size_t i = 0; i < 4; i++) {
+        printf("Channel %zu: %zu samples, first sample 0x%02x\n", i, chan_len, chan_data[i * chan_len]);
+    }
+
+    if (0 != _stream_count) {
+        _stream_captures(dev, _stream_count);
+    }
+
+    if (0 != _pipeline_count) {
+        _pipeline_captures(dev);
+    }
+
+    if (0 != _segment_count) {
+        _segment_captures(dev, _segment_count);
+    }
+
 done:
+    free(chan_data);
+
+    if (NULL != capture_buf) {
+        hantek_buffer_free(dev, &capture_buf);
+    }
+
     if (NULL != dev && H_FAILED(hantek_close_device(&dev))) {
         printf("Failed to close device, aborting.\n");
         goto done;
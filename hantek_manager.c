@@ -0,0 +1,508 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+#include <hantek_transport.h>
+#include <hantek_transport_usb.h>
+#include <hantek_manager.h>
+
+#include <libusb.h>
+
+#include <stdbool.h>
+#include <string.h>
+#include <sys/time.h>
+
+/**
+ * A device the manager knows about
+ */
+struct hantek_manager_entry {
+    struct hantek_manager_entry *next;
+
+    libusb_device *udev;
+    struct hantek_device_info info;
+
+    /**
+     * Whether the ID string has been read yet
+     */
+    bool identified;
+
+    /**
+     * Whether the device is still attached. Stale entries are kept until the removal has been
+     * reported.
+     */
+    bool present;
+
+    /**
+     * Whether the hotplug callback still needs to hear about this device
+     */
+    bool notify;
+
+    /**
+     * Scratch, for rescans
+     */
+    bool seen;
+};
+
+struct hantek_manager {
+    libusb_context *ctx;
+
+    struct hantek_manager_entry *entries;
+
+    bool has_hotplug;
+    libusb_hotplug_callback_handle hotplug_hdl;
+
+    hantek_hotplug_cb_t cb;
+    void *priv;
+};
+
+static
+struct hantek_manager_entry *_hantek_manager_find_udev(struct hantek_manager *mgr, libusb_device *udev)
+{
+    for (struct hantek_manager_entry *ent = mgr->entries; NULL != ent; ent = ent->next) {
+        if (udev == ent->udev && true == ent->present) {
+            return ent;
+        }
+    }
+
+    return NULL;
+}
+
+static
+void _hantek_manager_arrived(struct hantek_manager *mgr, libusb_device *udev)
+{
+    struct hantek_manager_entry *ent = NULL;
+
+    if (NULL != _hantek_manager_find_udev(mgr, udev)) {
+        return;
+    }
+
+    if (NULL == (ent = hantek_calloc(1, sizeof(*ent)))) {
+        DEBUG("Out of memory tracking a new device, ignoring it.");
+        return;
+    }
+
+    ent->udev = libusb_ref_device(udev);
+    ent->info.bus = libusb_get_bus_number(udev);
+    ent->info.address = libusb_get_device_address(udev);
+    ent->present = true;
+    ent->notify = true;
+
+    ent->next = mgr->entries;
+    mgr->entries = ent;
+
+    DEBUG("Device arrived at %u:%u", ent->info.bus, ent->info.address);
+}
+
+static
+void _hantek_manager_left(struct hantek_manager *mgr, libusb_device *udev)
+{
+    struct hantek_manager_entry *ent = NULL;
+
+    if (NULL == (ent = _hantek_manager_find_udev(mgr, udev))) {
+        return;
+    }
+
+    DEBUG("Device %s left %u:%u", ent->info.serial_number, ent->info.bus, ent->info.address);
+
+    ent->present = false;
+    ent->notify = true;
+}
+
+/**
+ * libusb may not do synchronous I/O from here, so identifying the device and telling the
+ * application about it is left to _hantek_manager_process.
+ */
+static
+int LIBUSB_CALL _hantek_manager_hotplug_cb(libusb_context *ctx, libusb_device *udev, libusb_hotplug_event event, void *user_data)
+{
+    struct hantek_manager *mgr = user_data;
+
+    (void)ctx;
+
+    if (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED == event) {
+        _hantek_manager_arrived(mgr, udev);
+    } else if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event) {
+        _hantek_manager_left(mgr, udev);
+    }
+
+    return 0;
+}
+
+/**
+ * Read the serial number of a newly arrived device, without claiming it
+ */
+static
+HRESULT _hantek_manager_identify(struct hantek_manager *mgr, struct hantek_manager_entry *ent)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_transport *tp = NULL;
+    char id_string[HT_MAX_INFO_STRING_LEN];
+
+    if (H_FAILED(ret = hantek_usb_transport_create(&tp, mgr->ctx, ent->udev, false))) {
+        DEBUG("Failed to open device at %u:%u to identify it", ent->info.bus, ent->info.address);
+        goto done;
+    }
+
+    if (H_FAILED(ret = _hantek_read_identity(tp, id_string, &ent->info.pcb_revision, ent->info.serial_number))) {
+        DEBUG("Failed to read ID string of device at %u:%u", ent->info.bus, ent->info.address);
+        goto done;
+    }
+
+    DEBUG("Device at %u:%u is serial number %s, PCB revision %d", ent->info.bus, ent->info.address,
+            ent->info.serial_number, ent->info.pcb_revision);
+
+    ent->identified = true;
+
+done:
+    if (NULL != tp) {
+        hantek_transport_close(&tp);
+    }
+    return ret;
+}
+
+/**
+ * Identify new arrivals, deliver hotplug notifications and drop departed devices
+ */
+static
+void _hantek_manager_process(struct hantek_manager *mgr)
+{
+    struct hantek_manager_entry **pent = &mgr->entries;
+
+    while (NULL != *pent) {
+        struct hantek_manager_entry *ent = *pent;
+
+        if (true == ent->present && false == ent->identified) {
+            /* Devices that can't be identified yet are retried next time around */
+            if (H_FAILED(_hantek_manager_identify(mgr, ent))) {
+                pent = &ent->next;
+                continue;
+            }
+        }
+
+        if (true == ent->notify) {
+            ent->notify = false;
+
+            /* Nobody heard about a device we never managed to identify, so don't report it leaving */
+            if (NULL != mgr->cb && true == ent->identified) {
+                mgr->cb(mgr, &ent->info, ent->present, mgr->priv);
+            }
+        }
+
+        if (false == ent->present) {
+            *pent = ent->next;
+            libusb_unref_device(ent->udev);
+            hantek_free(ent);
+            continue;
+        }
+
+        pent = &ent->next;
+    }
+}
+
+HRESULT hantek_manager_rescan(struct hantek_manager *mgr)
+{
+    HRESULT ret = H_OK;
+
+    libusb_device **devs = NULL;
+    ssize_t nr_devs = 0;
+
+    HASSERT_ARG(NULL != mgr);
+
+    if (0 > (nr_devs = libusb_get_device_list(mgr->ctx, &devs))) {
+        DEBUG("Failed to get libusb device list, aborting (reason: %zd).", nr_devs);
+        ret = H_ERR_NOT_FOUND;
+        goto done;
+    }
+
+    for (struct hantek_manager_entry *ent = mgr->entries; NULL != ent; ent = ent->next) {
+        ent->seen = false;
+    }
+
+    for (size_t i = 0; i < (size_t)nr_devs; i++) {
+        struct libusb_device_descriptor desc;
+        struct hantek_manager_entry *ent = NULL;
+
+        if (0 != libusb_get_device_descriptor(devs[i], &desc)) {
+            DEBUG("Failed to get device descriptor at device ID %zu, skipping", i);
+            continue;
+        }
+
+        if (HANTEK_VID != desc.idVendor || HANTEK_PID_6254BD != desc.idProduct) {
+            continue;
+        }
+
+        _hantek_manager_arrived(mgr, devs[i]);
+
+        if (NULL != (ent = _hantek_manager_find_udev(mgr, devs[i]))) {
+            ent->seen = true;
+        }
+    }
+
+    for (struct hantek_manager_entry *ent = mgr->entries; NULL != ent; ent = ent->next) {
+        if (true == ent->present && false == ent->seen) {
+            _hantek_manager_left(mgr, ent->udev);
+        }
+    }
+
+    _hantek_manager_process(mgr);
+
+done:
+    if (NULL != devs) {
+        libusb_free_device_list(devs, 1);
+    }
+    return ret;
+}
+
+HRESULT hantek_manager_create(struct hantek_manager **pmgr)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_manager *mgr = NULL;
+    int uret = 0;
+
+    HASSERT_ARG(NULL != pmgr);
+
+    *pmgr = NULL;
+
+    if (NULL == (mgr = hantek_calloc(1, sizeof(*mgr)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    if (0 != (uret = libusb_init(&mgr->ctx))) {
+        DEBUG("Failed to initialize libusb, aborting (reason: %d).", uret);
+        mgr->ctx = NULL;
+        ret = H_ERR_CANT_OPEN;
+        goto done;
+    }
+
+    if (0 != libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        /* Enumerating makes libusb report everything already attached, right now */
+        if (0 != (uret = libusb_hotplug_register_callback(mgr->ctx,
+                        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                        LIBUSB_HOTPLUG_ENUMERATE,
+                        HANTEK_VID,
+                        HANTEK_PID_6254BD,
+                        LIBUSB_HOTPLUG_MATCH_ANY,
+                        _hantek_manager_hotplug_cb,
+                        mgr,
+                        &mgr->hotplug_hdl)))
+        {
+            DEBUG("Failed to register for hotplug events, aborting (reason: %d).", uret);
+            ret = H_ERR_CANT_OPEN;
+            goto done;
+        }
+
+        mgr->has_hotplug = true;
+        _hantek_manager_process(mgr);
+    } else {
+        DEBUG("No hotplug support, devices are only found by rescanning");
+
+        if (H_FAILED(ret = hantek_manager_rescan(mgr))) {
+            goto done;
+        }
+    }
+
+    *pmgr = mgr;
+
+done:
+    if (H_FAILED(ret) && NULL != mgr) {
+        hantek_manager_destroy(&mgr);
+    }
+    return ret;
+}
+
+HRESULT hantek_manager_destroy(struct hantek_manager **pmgr)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_manager *mgr = NULL;
+
+    HASSERT_ARG(NULL != pmgr);
+    HASSERT_ARG(NULL != *pmgr);
+
+    mgr = *pmgr;
+
+    if (true == mgr->has_hotplug) {
+        libusb_hotplug_deregister_callback(mgr->ctx, mgr->hotplug_hdl);
+    }
+
+    while (NULL != mgr->entries) {
+        struct hantek_manager_entry *ent = mgr->entries;
+
+        mgr->entries = ent->next;
+        libusb_unref_device(ent->udev);
+        hantek_free(ent);
+    }
+
+    if (NULL != mgr->ctx) {
+        libusb_exit(mgr->ctx);
+    }
+
+    hantek_free(mgr);
+    *pmgr = NULL;
+
+    return ret;
+}
+
+HRESULT hantek_manager_get_devices(struct hantek_manager *mgr, struct hantek_device_info *infos, size_t max_infos, size_t *pnr_infos)
+{
+    HRESULT ret = H_OK;
+
+    size_t nr_infos = 0;
+
+    HASSERT_ARG(NULL != mgr);
+    HASSERT_ARG(NULL != infos || 0 == max_infos);
+    HASSERT_ARG(NULL != pnr_infos);
+
+    for (struct hantek_manager_entry *ent = mgr->entries; NULL != ent; ent = ent->next) {
+        if (false == ent->present || false == ent->identified) {
+            continue;
+        }
+
+        if (nr_infos < max_infos) {
+            infos[nr_infos] = ent->info;
+        }
+
+        nr_infos++;
+    }
+
+    *pnr_infos = nr_infos;
+
+    return ret;
+}
+
+HRESULT hantek_manager_open(struct hantek_manager *mgr, const char *serial_number, uint32_t capture_buffer_len, struct hantek_device **pdev)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_manager_entry *found = NULL;
+    struct hantek_transport *tp = NULL;
+
+    HASSERT_ARG(NULL != mgr);
+    HASSERT_ARG(NULL != pdev);
+
+    *pdev = NULL;
+
+    for (struct hantek_manager_entry *ent = mgr->entries; NULL != ent; ent = ent->next) {
+        if (false == ent->present || false == ent->identified) {
+            continue;
+        }
+
+        if (NULL == serial_number || 0 == strncmp(serial_number, ent->info.serial_number, HT_SERIAL_NUMBER_LEN)) {
+            found = ent;
+            break;
+        }
+    }
+
+    if (NULL == found) {
+        DEBUG("No device with serial number %s attached", NULL != serial_number ? serial_number : "(any)");
+        ret = H_ERR_NOT_FOUND;
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_usb_transport_create(&tp, mgr->ctx, found->udev, true))) {
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_open_device_on(pdev, tp, capture_buffer_len))) {
+        hantek_transport_close(&tp);
+        goto done;
+    }
+
+done:
+    return ret;
+}
+
+HRESULT hantek_manager_set_hotplug_cb(struct hantek_manager *mgr, hantek_hotplug_cb_t cb, void *priv)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != mgr);
+
+    mgr->cb = cb;
+    mgr->priv = priv;
+
+    return ret;
+}
+
+HRESULT hantek_manager_get_pollfds(struct hantek_manager *mgr, struct hantek_pollfd *fds, size_t max_fds, size_t *pnr_fds)
+{
+    HRESULT ret = H_OK;
+
+    const struct libusb_pollfd **ufds = NULL;
+    size_t nr_fds = 0;
+
+    HASSERT_ARG(NULL != mgr);
+    HASSERT_ARG(NULL != fds || 0 == max_fds);
+    HASSERT_ARG(NULL != pnr_fds);
+
+    if (NULL == (ufds = libusb_get_pollfds(mgr->ctx))) {
+        DEBUG("Failed to get libusb pollfds, aborting.");
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    for (nr_fds = 0; NULL != ufds[nr_fds]; nr_fds++) {
+        if (nr_fds < max_fds) {
+            fds[nr_fds].fd = ufds[nr_fds]->fd;
+            fds[nr_fds].events = ufds[nr_fds]->events;
+        }
+    }
+
+    *pnr_fds = nr_fds;
+
+done:
+    if (NULL != ufds) {
+        libusb_free_pollfds(ufds);
+    }
+    return ret;
+}
+
+HRESULT hantek_manager_get_timeout(struct hantek_manager *mgr, int *ptimeout_ms)
+{
+    HRESULT ret = H_OK;
+
+    struct timeval tv = { 0 };
+    int uret = 0;
+
+    HASSERT_ARG(NULL != mgr);
+    HASSERT_ARG(NULL != ptimeout_ms);
+
+    *ptimeout_ms = -1;
+
+    if (0 > (uret = libusb_get_next_timeout(mgr->ctx, &tv))) {
+        DEBUG("Failed to get next libusb timeout (reason: %d)", uret);
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    if (1 == uret) {
+        *ptimeout_ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+    }
+
+done:
+    return ret;
+}
+
+HRESULT hantek_manager_handle_events(struct hantek_manager *mgr)
+{
+    HRESULT ret = H_OK;
+
+    struct timeval tv = { 0 };
+    int uret = 0;
+
+    HASSERT_ARG(NULL != mgr);
+
+    if (0 != (uret = libusb_handle_events_timeout(mgr->ctx, &tv)) && LIBUSB_ERROR_INTERRUPTED != uret) {
+        DEBUG("Failure while handling USB events (reason: %d)", uret);
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    /* Hotplug events may also have been picked up while a device was handling its events */
+    _hantek_manager_process(mgr);
+
+done:
+    return ret;
+}
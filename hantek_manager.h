@@ -0,0 +1,79 @@
+#pragma once
+
+#include <hantek.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Device manager. Owns a private libusb context, keeps track of every attached 6xx4 and its
+ * serial number, and opens devices by serial number without walking the bus again. Devices
+ * opened through a manager share its context, so the manager must outlive them.
+ */
+
+struct hantek_manager;
+
+/**
+ * An attached device, as known to the manager
+ */
+struct hantek_device_info {
+    char serial_number[HT_SERIAL_NUMBER_LEN + 1];
+    int pcb_revision;
+
+    /**
+     * Where the device is attached
+     */
+    uint8_t bus;
+    uint8_t address;
+};
+
+/**
+ * Called from hantek_manager_handle_events when a device arrives (arrived is true) or leaves.
+ */
+typedef void (*hantek_hotplug_cb_t)(struct hantek_manager *mgr, const struct hantek_device_info *info, bool arrived, void *priv);
+
+/**
+ * Create a manager, and enumerate the devices attached right now.
+ */
+HRESULT hantek_manager_create(struct hantek_manager **pmgr);
+
+/**
+ * Destroy a manager. All devices opened through it must have been closed.
+ */
+HRESULT hantek_manager_destroy(struct hantek_manager **pmgr);
+
+/**
+ * Get the attached devices. Up to max_infos are filled in, the number attached is returned in
+ * pnr_infos.
+ */
+HRESULT hantek_manager_get_devices(struct hantek_manager *mgr, struct hantek_device_info *infos, size_t max_infos, size_t *pnr_infos);
+
+/**
+ * Open the attached device with the given serial number, or the first one if serial_number is
+ * NULL.
+ */
+HRESULT hantek_manager_open(struct hantek_manager *mgr, const char *serial_number, uint32_t capture_buffer_len, struct hantek_device **pdev);
+
+/**
+ * Set the callback for device arrival and removal. Pass NULL to clear it.
+ */
+HRESULT hantek_manager_set_hotplug_cb(struct hantek_manager *mgr, hantek_hotplug_cb_t cb, void *priv);
+
+/**
+ * Walk the bus for arrivals and removals. Only needed where libusb has no hotplug support,
+ * otherwise this happens by itself.
+ */
+HRESULT hantek_manager_rescan(struct hantek_manager *mgr);
+
+/**
+ * Get the file descriptors and timeout an event loop should wait on for the manager. These
+ * also cover every device opened through it.
+ */
+HRESULT hantek_manager_get_pollfds(struct hantek_manager *mgr, struct hantek_pollfd *fds, size_t max_fds, size_t *pnr_fds);
+HRESULT hantek_manager_get_timeout(struct hantek_manager *mgr, int *ptimeout_ms);
+
+/**
+ * Process pending USB events without blocking, and deliver hotplug callbacks.
+ */
+HRESULT hantek_manager_handle_events(struct hantek_manager *mgr);
@@ -2,14 +2,14 @@
 
 #include <hantek.h>
 #include <hantek_usb.h>
-#include <libusb.h>
+#include <hantek_transport.h>
 #include <stdint.h>
+#include <time.h>
 
 #define HANTEK_VID              0x04b5
 
 #define HANTEK_PID_6254BD       0x6cde
 
-#define HT_SERIAL_NUMBER_LEN    8
 
 #ifdef HT_DEBUG
 #include  <stdio.h>
@@ -20,8 +20,86 @@
 
 #define HASSERT_ARG(x) do { if (!((x))) { DEBUG("Bad Argument"); return H_ERR_BAD_ARGS; } } while (0)
 
+/**
+ * The time, in CLOCK_MONOTONIC nanoseconds, that every deadline and timestamp is kept in
+ */
+static inline
+uint64_t hantek_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 #define HT_MAX_CHANNELS     4
 
+/**
+ * Number of ADC cores in the HMCAD1511. Every frame of raw capture data holds one sample from
+ * each core, in core order.
+ */
+#define HT_ADC_NR_CORES     4
+
+/**
+ * Limits and defaults for the asynchronous readback engine
+ */
+#define HT_READBACK_MAX_TRANSFERS           32
+#define HT_READBACK_PACKET_LEN              512
+#define HT_READBACK_TIMEOUT_MS              1000
+
+/**
+ * Limits for transfer size planning. Readbacks are split into at least HT_READBACK_PLAN_SPLIT
+ * transfers so they pipeline, but transfers never go below HT_READBACK_PLAN_MIN_LEN (unless
+ * the whole readback is smaller) or above HT_READBACK_PLAN_MAX_LEN.
+ */
+#define HT_READBACK_PLAN_SPLIT              4
+#define HT_READBACK_PLAN_MIN_LEN            (16 * 1024)
+#define HT_READBACK_PLAN_MAX_LEN            (256 * 1024)
+#define HT_READBACK_PLAN_MAX_TRANSFERS      8
+
+/**
+ * Limits for command batches. The longest message we send is the 26 byte trigger level.
+ */
+#define HT_BATCH_MAX_CMDS                   64
+#define HT_BATCH_MAX_CMD_LEN                32
+#define HT_BATCH_TIMEOUT_MS                 1000
+
+/**
+ * Interval between status polls while waiting for a capture to complete, in microseconds
+ */
+#define HT_ACQ_POLL_INTERVAL_US             500
+
+/**
+ * Most device file descriptors hantek_run_until_idle will wait on
+ */
+#define HT_ACQ_MAX_POLLFDS                  16
+
+/**
+ * How long closing a device waits for a cancelled acquisition's transfers to complete. Longer
+ * than any one of them can take to time out.
+ */
+#define HT_ACQ_DRAIN_MS                     (2 * HT_READBACK_TIMEOUT_MS)
+
+/**
+ * Most buffers a pipelined acquisition can rotate through
+ */
+#define HT_PIPELINE_MAX_BUFFERS             16
+
+/**
+ * Status poll interval bounds for hantek_wait_ready, in microseconds
+ */
+#define HT_WAIT_POLL_MIN_US                 100
+#define HT_WAIT_POLL_MAX_US                 5000
+
+/**
+ * Dimensions of the position DAC table: channel counts the calibration data covers (1, 2 and 4),
+ * volts/div settings, and channel levels
+ */
+#define HT_POSITION_NR_MODES                3
+#define HT_POSITION_NR_VPD                  (HT_VPD_10V + 1)
+#define HT_POSITION_NR_LEVELS               256
+
 struct hantek_channel {
     /**
      * Whether or not this channel is enabled
@@ -49,9 +127,321 @@ struct hantek_channel {
     enum hantek_coupling coupling;
 };
 
+struct hantek_device;
+
+/**
+ * Called when an asynchronous readback has finished
+ */
+typedef void (*hantek_readback_done_cb_t)(struct hantek_device *dev, HRESULT result, size_t received);
+
+struct hantek_readback {
+    /**
+     * Requested number of transfers in flight and transfer length, 0 to plan them from the
+     * length of each readback
+     */
+    unsigned req_nr_transfers;
+    size_t req_transfer_len;
+
+    /**
+     * Number of bulk IN transfers kept in flight, and their length, for this readback
+     */
+    unsigned nr_transfers;
+    size_t transfer_len;
+
+    /**
+     * Transfers, set up lazily on first use
+     */
+    struct hantek_xfer xfers[HT_READBACK_MAX_TRANSFERS];
+    bool xfers_ready[HT_READBACK_MAX_TRANSFERS];
+
+    /**
+     * Final single-packet transfer, which picks up whatever does not fill a whole packet at
+     * the end of the destination, and the short or zero length packet ending the capture
+     */
+    struct hantek_xfer tail_xfer;
+    bool tail_ready;
+    bool tail_submitted;
+    uint8_t tail_buf[HT_READBACK_PACKET_LEN];
+
+    /**
+     * State for the readback currently in progress
+     */
+    uint8_t *dst;
+    size_t dst_len;
+    size_t aligned_len;
+    size_t next_offset;
+    size_t received;
+    unsigned nr_active;
+    bool stop;
+    HRESULT result;
+    uint64_t start_ns;
+
+    /**
+     * Completion callback for asynchronous readbacks, NULL otherwise
+     */
+    hantek_readback_done_cb_t done_cb;
+
+    struct hantek_readback_stats stats;
+};
+
+struct hantek_batch_cmd {
+    /**
+     * The raw message
+     */
+    uint8_t msg[HT_BATCH_MAX_CMD_LEN];
+
+    /**
+     * Length of the message, in bytes
+     */
+    size_t len;
+
+    /**
+     * Time the hardware needs after this command, before the next command, in microseconds
+     */
+    unsigned settle_us;
+};
+
+struct hantek_batch {
+    /**
+     * Batch nesting depth. Commands are queued while non-zero.
+     */
+    unsigned depth;
+
+    /**
+     * Queued commands
+     */
+    size_t nr_cmds;
+    struct hantek_batch_cmd cmds[HT_BATCH_MAX_CMDS];
+
+    /**
+     * Transfers, set up lazily on first use
+     */
+    struct hantek_xfer xfers[HT_BATCH_MAX_CMDS];
+    bool xfers_ready[HT_BATCH_MAX_CMDS];
+
+    /**
+     * State for the flush currently in progress
+     */
+    unsigned nr_active;
+    HRESULT xfer_result;
+
+    /**
+     * Aggregated result of the batch, reported on commit
+     */
+    HRESULT result;
+};
+
+/**
+ * Steps of the acquisition state machine, within the public states
+ */
+enum hantek_acq_step {
+    HT_ACQ_STEP_NONE = 0,
+    HT_ACQ_STEP_SETTLE_WAIT,
+    HT_ACQ_STEP_START_SENT,
+    HT_ACQ_STEP_STATUS_SENT,
+    HT_ACQ_STEP_STATUS_RECEIVED,
+    HT_ACQ_STEP_POLL_WAIT,
+    HT_ACQ_STEP_BUF_STATUS_SENT,
+    HT_ACQ_STEP_BUF_STATUS_RECEIVED,
+    HT_ACQ_STEP_PREPARE_SENT,
+    HT_ACQ_STEP_READBACK_SENT,
+    HT_ACQ_STEP_READBACK,
+    HT_ACQ_STEP_PIPE_NEXT,
+    HT_ACQ_STEP_PIPE_STALLED,
+};
+
+struct hantek_acq {
+    enum hantek_acquire_state state;
+    enum hantek_acq_step step;
+
+    /**
+     * Transfers for commands, and for single-packet responses
+     */
+    struct hantek_xfer cmd_xfer;
+    struct hantek_xfer rsp_xfer;
+    bool xfers_ready;
+    uint8_t cmd[HT_BATCH_MAX_CMD_LEN];
+    uint8_t rsp[HT_READBACK_PACKET_LEN];
+
+    /**
+     * The acquisition in progress
+     */
+    enum hantek_capture_mode mode;
+    uint8_t *dst;
+    size_t dst_len;
+    size_t received;
+    hantek_acquire_cb_t cb;
+    void *priv;
+    bool cancel;
+
+    /**
+     * The chunk being read back: its offset in the capture, where it goes, and its length. A
+     * chunked acquisition reads every chunk into the start of dst, and hands it to chunk_cb.
+     */
+    size_t chunk_off;
+    uint8_t *chunk_dst;
+    size_t chunk_len;
+    hantek_chunk_cb_t chunk_cb;
+
+    /**
+     * When to send the next status poll, or the start capture command held back until the
+     * hardware has settled, in CLOCK_MONOTONIC nanoseconds
+     */
+    uint64_t next_poll_ns;
+
+    /**
+     * Pipelined acquisition: the buffers captures rotate through, which of them the caller
+     * holds, the one being captured into, and the one the next capture goes to once armed
+     */
+    bool pipelined;
+    uint8_t *bufs[HT_PIPELINE_MAX_BUFFERS];
+    bool buf_held[HT_PIPELINE_MAX_BUFFERS];
+    size_t nr_bufs;
+    int cur_buf;
+    int next_buf;
+    hantek_pipeline_cb_t pipe_cb;
+
+    /**
+     * Whether to arm the next capture while the last is read back, whether that START_CAPTURE
+     * is in flight or done, the capture waiting to be delivered, and any error that ends the
+     * pipeline once nothing is in flight
+     */
+    bool overlap;
+    bool rearm_sent;
+    bool rearmed;
+    int deliver_buf;
+    HRESULT pipe_result;
+
+    /**
+     * Segmented acquisition: where the segments go, how many captures have been armed that are
+     * still expected to produce one, and the buffer status word of the capture being read
+     */
+    bool segmented;
+    struct hantek_segments *segs;
+    hantek_segments_cb_t seg_cb;
+    size_t seg_armed;
+    uint64_t buf_status;
+
+    /**
+     * When the START_CAPTURE of the capture in progress completed, for single acquisitions
+     */
+    uint64_t armed_ns;
+
+    /**
+     * Pipeline statistics
+     */
+    uint64_t ready_ns;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t nr_frames;
+    uint64_t nr_failed;
+    uint64_t nr_blind;
+    uint64_t blind_total_ns;
+    uint64_t blind_max_ns;
+};
+
+/**
+ * Register space of the HMCAD1511, and the number of ADF4360 latches (selected by the two
+ * control bits at the bottom of each write)
+ */
+#define HT_HMCAD1511_NR_REGS                256
+#define HT_ADF4360_NR_LATCHES               4
+
+/**
+ * The ADC clock as the wake sequence sets up the ADF4360: a 400 kHz phase detector and an N
+ * counter of 2500 make 1 GHz. Every step of N moves the clock by the phase detector frequency.
+ */
+#define HT_ADC_CLOCK_HZ                     1000000000ull
+#define HT_ADF4360_PFD_HZ                   400000ull
+#define HT_ADF4360_N_DEFAULT                2500
+
+/**
+ * What the SPI devices on the board were last set to, so writes that would change nothing can be
+ * skipped. Entries only count once marked valid. Everything is invalidated when the device is
+ * reset, or when a command batch fails, since we can't tell what made it to the hardware.
+ */
+struct hantek_spi_shadow {
+    uint16_t hmcad1511[HT_HMCAD1511_NR_REGS];
+    bool hmcad1511_valid[HT_HMCAD1511_NR_REGS];
+
+    uint32_t adf4360[HT_ADF4360_NR_LATCHES];
+    bool adf4360_valid[HT_ADF4360_NR_LATCHES];
+
+    /**
+     * Front-end shift register, one setup byte per channel
+     */
+    uint8_t frontend[HT_MAX_CHANNELS];
+    bool frontend_valid;
+
+    /**
+     * Channel position DACs. These aren't on the SPI bus, but settle just as slowly.
+     */
+    uint16_t position[HT_MAX_CHANNELS];
+    bool position_valid[HT_MAX_CHANNELS];
+};
+
+/**
+ * When each kind of operation written to the device will have settled. Operations written inside
+ * an open command batch are pending until the batch is sent, since that's when they reach the
+ * hardware.
+ */
+struct hantek_settle {
+    unsigned settle_us[HT_SETTLE_MAX];
+    uint64_t deadline_ns[HT_SETTLE_MAX];
+    unsigned pending;
+};
+
+struct hantek_segments {
+    /**
+     * The segment region, nr_segments captures of seg_len bytes back to back
+     */
+    struct hantek_buffer *buf;
+    uint8_t *data;
+    size_t seg_len;
+    size_t nr_segments;
+
+    /**
+     * Segments captured so far, their index, and the settings they were captured with
+     */
+    size_t nr_captured;
+    struct hantek_segment_info *info;
+    struct hantek_capture_config config;
+};
+
+/**
+ * Longest token identifying where, and since when, a device has been attached
+ */
+#define HT_STATE_TOKEN_LEN                  128
+
+/**
+ * What a warm reopen needs to know to carry on with a device as an earlier open left it
+ */
+struct hantek_saved_state {
+    /**
+     * Where the device was attached, and since which boot of this machine
+     */
+    char token[HT_STATE_TOKEN_LEN];
+
+    uint16_t fpga_version;
+    uint32_t hardware_rev;
+
+    struct hantek_channel channels[HT_MAX_CHANNELS];
+    enum hantek_time_per_division timebase;
+    uint64_t adc_clock_hz;
+    uint32_t sample_spacing;
+    bool trigger_set;
+    struct hantek_trigger_config trigger;
+    int adc_core_channel[HT_ADC_NR_CORES];
+    size_t adc_nr_streams;
+
+    struct hantek_spi_shadow spi_shadow;
+};
+
 struct hantek_device {
-    struct libusb_device *dev;
-    struct libusb_device_handle *hdl;
+    /**
+     * How we talk to the device
+     */
+    struct hantek_transport *tp;
 
     /**
      * The PCB revision
@@ -83,6 +473,44 @@ struct hantek_device {
      */
     struct hantek_channel channels[HT_MAX_CHANNELS];
 
+    /**
+     * Time per division and trigger settings, as last configured
+     */
+    enum hantek_time_per_division timebase;
+    bool trigger_set;
+    struct hantek_trigger_config trigger;
+
+    /**
+     * ADC clock the ADF4360 is set to, and how many ADC clocks apart the samples kept from each
+     * ADC stream are (0 if that has not been set yet)
+     */
+    uint64_t adc_clock_hz;
+    uint32_t sample_spacing;
+
+    /**
+     * ADC clock queued in the open command batch, taken on once the batch has been sent, 0 if
+     * there is none
+     */
+    uint64_t adc_clock_pending_hz;
+
+    /**
+     * When hantek_start_capture last armed the scope, in CLOCK_MONOTONIC nanoseconds
+     */
+    uint64_t armed_ns;
+
+    /**
+     * Channel feeding each ADC core, as routed by the last hantek_configure_adc_routing, or -1
+     * for a core whose samples are not wanted. adc_nr_streams is 1, 2 or 4, or 0 if the ADC
+     * routing has not been configured yet.
+     */
+    int adc_core_channel[HT_ADC_NR_CORES];
+    size_t adc_nr_streams;
+
+    /**
+     * Raw capture data for hantek_retrieve_buffer, allocated on first use
+     */
+    uint8_t *raw_buf;
+
     /**
      * ID string read back from the device
      */
@@ -92,5 +520,169 @@ struct hantek_device {
      * Calibration data for this device
      */
     uint16_t cal_data[HT_CALIBRATION_INFO_ENTRIES];
+
+    /**
+     * Position DAC value for every channel level, worked out from the calibration data at open
+     */
+    uint16_t position_table[HT_MAX_CHANNELS][HT_POSITION_NR_MODES][HT_POSITION_NR_VPD][HT_POSITION_NR_LEVELS];
+
+    /**
+     * Command session nesting depth. While non-zero, the command handshake is only done once.
+     */
+    unsigned session_depth;
+
+    /**
+     * Whether the handshake has been done for the current command session
+     */
+    bool session_ready;
+
+    /**
+     * Whether the device reported USB 2.0 mode during the last handshake
+     */
+    bool usb2;
+
+    /**
+     * Shadow of the SPI device registers
+     */
+    struct hantek_spi_shadow spi_shadow;
+
+    /**
+     * Settling deadlines
+     */
+    struct hantek_settle settle;
+
+    /**
+     * Whether there may be a state file for this device in the device cache. The first command
+     * that changes the device's configuration removes it, so a process that dies part way through
+     * can't leave a stale one behind. It is saved again once hantek_apply_config or
+     * hantek_apply_rate_plan succeeds.
+     */
+    bool state_on_disk;
+
+    /**
+     * Asynchronous capture readback engine
+     */
+    struct hantek_readback readback;
+
+    /**
+     * Command batch
+     */
+    struct hantek_batch batch;
+
+    /**
+     * Non-blocking acquisition state machine
+     */
+    struct hantek_acq acq;
 };
 
+/**
+ * Perform the command handshake (start of transaction + USB speed check)
+ */
+HRESULT _hantek_cmd_handshake(struct hantek_device *dev);
+
+/**
+ * Read the ID string over the given transport, and parse the PCB revision and serial number
+ * (HT_SERIAL_NUMBER_LEN + 1 bytes) out of it.
+ */
+HRESULT _hantek_read_identity(struct hantek_transport *tp, char *id_string, int *ppcb_revision, char *serial_number);
+
+/**
+ * Forget everything the SPI shadow knows, so the next write to each register goes out
+ */
+void hantek_spi_shadow_invalidate(struct hantek_device *dev);
+
+/**
+ * Set up the default settle times for a freshly opened device
+ */
+void hantek_settle_init(struct hantek_device *dev);
+
+/**
+ * Note that an operation needing op's settle time was just written. Inside a batch, the deadline
+ * starts once the batch has been sent.
+ */
+void hantek_settle_mark(struct hantek_device *dev, enum hantek_settle_op op);
+
+/**
+ * Start the deadlines of everything marked while the batch was open, now that it has been sent
+ */
+void hantek_settle_batch_sent(struct hantek_device *dev);
+
+/**
+ * When everything written so far will have settled, in CLOCK_MONOTONIC nanoseconds
+ */
+uint64_t hantek_settle_deadline(struct hantek_device *dev);
+
+/**
+ * Write an ADF4360 latch, unless the SPI shadow shows it already holds the value. The next
+ * capture waits for the ADC to settle on the new clock.
+ */
+HRESULT hantek_adf4360_write(struct hantek_device *dev, uint32_t latch);
+
+/**
+ * Run the ADC clock at pll_n times the ADF4360's phase detector frequency
+ */
+HRESULT hantek_adc_clock_set(struct hantek_device *dev, unsigned pll_n);
+
+/**
+ * Send the spacing between the samples kept from each ADC stream, in ADC clocks
+ */
+HRESULT hantek_sample_spacing_send(struct hantek_device *dev, uint32_t spacing);
+
+/**
+ * Look up the position DAC value for a channel at the given level, for the current channel count
+ * and the channel's volts/div
+ */
+HRESULT hantek_position_lookup(struct hantek_device *dev, unsigned channel_num, unsigned chan_level, uint16_t *poffset);
+
+/**
+ * Send a channel's position DAC value, whether or not it changed, holding off the command after it
+ * for settle_us. Leaves settle tracking to the caller.
+ */
+HRESULT hantek_position_send(struct hantek_device *dev, unsigned channel_num, uint16_t offset, unsigned settle_us);
+
+/**
+ * Look up a device's calibration data and hardware revision in the device cache. Fails with
+ * H_ERR_NOT_FOUND if caching is off, or there's no valid entry for this serial number and FPGA
+ * version.
+ */
+HRESULT hantek_cache_load(const char *serial_number, uint16_t fpga_version, uint16_t *cal_data, uint32_t *phardware_rev);
+
+/**
+ * Save a device's calibration data and hardware revision to the device cache, if caching is on
+ */
+HRESULT hantek_cache_store(const char *serial_number, uint16_t fpga_version, const uint16_t *cal_data, uint32_t hardware_rev);
+
+/**
+ * Save the device's configuration to the device cache, so a warm reopen can carry on from it
+ */
+HRESULT hantek_state_save(struct hantek_device *dev);
+
+/**
+ * Load the configuration saved for this device, if it was saved while the device was attached
+ * where it is now. Fails with H_ERR_NOT_FOUND otherwise.
+ */
+HRESULT hantek_state_load(struct hantek_device *dev, struct hantek_saved_state *state);
+
+/**
+ * Remove the device's saved configuration, if there may be one, as it no longer matches the
+ * device
+ */
+void hantek_state_discard(struct hantek_device *dev);
+
+/**
+ * Get the writable channel sample pointers behind a pool frame
+ */
+struct hantek_frame;
+uint8_t *const *hantek_frame_channels(struct hantek_frame *frame);
+
+/**
+ * Check that a pool's frames have room for the device's captures, as currently routed
+ */
+struct hantek_frame_pool;
+HRESULT hantek_frame_pool_check(struct hantek_frame_pool *pool, struct hantek_device *dev);
+
+/**
+ * Stamp a frame with the device's current sample rate and volts per division, as a capture is
+ * put into it
+ */
+void hantek_frame_set_config(struct hantek_frame *frame, struct hantek_device *dev);
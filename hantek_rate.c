@@ -0,0 +1,271 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_batch.h>
+
+#include <adf4360.h>
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * ADF4360 prescaler, as the wake sequence sets up the control latch (8/9)
+ */
+#define HT_ADF4360_PRESCALER                8
+
+/**
+ * Lowest N counter the ADC clock is retuned to. The ADC can't be clocked faster than the usual
+ * 1 GHz, and the ADF4360-2's VCO only tunes about 8% either side of its centre, so this stays
+ * inside that range with some margin.
+ */
+#define HT_RATE_PLL_N_MIN                   2320
+
+/**
+ * Planned rates within this fraction of the rate asked for count as exact, to allow for rounding
+ */
+#define HT_RATE_EXACT                       1e-12
+
+HRESULT hantek_adc_clock_set(struct hantek_device *dev, unsigned pll_n)
+{
+    HRESULT ret = H_OK;
+
+    uint32_t latch = 0;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(HT_RATE_PLL_N_MIN <= pll_n && HT_ADF4360_N_DEFAULT >= pll_n);
+
+    latch = ((pll_n / HT_ADF4360_PRESCALER) & ADF4360_N_B_MASK) << ADF4360_N_B_SHIFT |
+            ((pll_n % HT_ADF4360_PRESCALER) & ADF4360_N_A_MASK) << ADF4360_N_A_SHIFT |
+            ADF4360_LATCH_N_COUNTER;
+
+    if (H_FAILED(ret = hantek_adf4360_write(dev, latch))) {
+        DEBUG("Failed to set the ADC clock");
+        goto done;
+    }
+
+    /* A queued latch only takes effect once the batch makes it out */
+    if (0 != dev->batch.depth) {
+        dev->adc_clock_pending_hz = (uint64_t)pll_n * HT_ADF4360_PFD_HZ;
+    } else {
+        dev->adc_clock_hz = (uint64_t)pll_n * HT_ADF4360_PFD_HZ;
+    }
+
+done:
+    return ret;
+}
+
+/**
+ * Find the ADC clock and sample spacing that get within tolerance of rate without going over it,
+ * retuning the clock as little as that takes. If no clock gets that close, the closest rate found
+ * is returned.
+ */
+static
+void _hantek_rate_search(double rate, double tolerance, size_t nr_streams, unsigned *ppll_n, uint32_t *pspacing, double *pachieved)
+{
+    double best_err = INFINITY;
+
+    for (unsigned n = HT_ADF4360_N_DEFAULT; n >= HT_RATE_PLL_N_MIN; n--) {
+        double clock = (double)(n * HT_ADF4360_PFD_HZ),
+               spacing = ceil(clock * (1.0 - HT_RATE_EXACT) / ((double)nr_streams * rate)),
+               achieved = 0.0,
+               err = 0.0;
+
+        if (1.0 > spacing) {
+            spacing = 1.0;
+        } else if ((double)UINT32_MAX < spacing) {
+            spacing = (double)UINT32_MAX;
+        }
+
+        achieved = clock / ((double)nr_streams * spacing);
+        err = fabs(achieved - rate);
+
+        if (err < best_err) {
+            best_err = err;
+            *ppll_n = n;
+            *pspacing = (uint32_t)spacing;
+            *pachieved = achieved;
+        }
+
+        if (best_err <= rate * (tolerance + HT_RATE_EXACT)) {
+            break;
+        }
+    }
+}
+
+/**
+ * Count the channels in a mask. The position calibration only covers one, two or four channels,
+ * so three can't be configured.
+ */
+static
+HRESULT _hantek_rate_count_channels(unsigned channel_mask, size_t *pnr_chans)
+{
+    HRESULT ret = H_OK;
+
+    size_t nr_chans = 0;
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        if (0 != (channel_mask & (1u << i))) {
+            nr_chans++;
+        }
+    }
+
+    if (0 == nr_chans) {
+        DEBUG("No channels to sample");
+        ret = H_ERR_INVAL_CHANNELS;
+        goto done;
+    }
+
+    if (3 == nr_chans) {
+        DEBUG("Can't sample three channels, enable one, two or four");
+        ret = H_ERR_INVAL_CHANNELS;
+        goto done;
+    }
+
+    *pnr_chans = nr_chans;
+
+done:
+    return ret;
+}
+
+HRESULT hantek_plan_sample_rate(struct hantek_device *dev, double rate, double tolerance, size_t nr_samples, unsigned channel_mask, struct hantek_rate_plan *pplan)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_rate_plan plan;
+    size_t nr_chans = 0;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != pplan);
+    HASSERT_ARG(0.0 <= rate);
+    HASSERT_ARG(0.0 <= tolerance);
+    HASSERT_ARG(HT_CAPTURE_MAX_LEN >= nr_samples);
+    HASSERT_ARG(0 == (channel_mask & ~((1u << HT_MAX_CHANNELS) - 1)));
+
+    memset(&plan, 0, sizeof(plan));
+
+    if (H_FAILED(ret = _hantek_rate_count_channels(channel_mask, &nr_chans))) {
+        goto done;
+    }
+
+    plan.channel_mask = channel_mask;
+    plan.nr_streams = nr_chans;
+    plan.clk_div = 4 == plan.nr_streams ? 2 : plan.nr_streams - 1;
+    plan.max_rate = (double)HT_ADC_CLOCK_HZ / (double)plan.nr_streams;
+
+    if (HT_RATE_MAX == rate || plan.max_rate <= rate) {
+        plan.pll_n = HT_ADF4360_N_DEFAULT;
+        plan.spacing = 1;
+        plan.rate = plan.max_rate;
+    } else {
+        _hantek_rate_search(rate, tolerance, plan.nr_streams, &plan.pll_n, &plan.spacing, &plan.rate);
+    }
+
+    if (HT_RATE_MAX != rate && fabs(plan.rate - rate) > rate * (tolerance + HT_RATE_EXACT)) {
+        DEBUG("Closest rate to %.3f S/s is %.3f S/s, further off than allowed", rate, plan.rate);
+        ret = H_ERR_BAD_SAMPLE_RATE;
+        goto done;
+    }
+
+    plan.adc_clock_hz = (uint64_t)plan.pll_n * HT_ADF4360_PFD_HZ;
+
+    if (0 == nr_samples) {
+        plan.capture_buffer_len = dev->capture_buffer_len;
+    } else {
+        /* Whole packets read back without a short transfer at the end */
+        plan.capture_buffer_len = (nr_samples * plan.nr_streams + HT_READBACK_PACKET_LEN - 1) &
+            ~(size_t)(HT_READBACK_PACKET_LEN - 1);
+
+        if (HT_CAPTURE_MAX_LEN < plan.capture_buffer_len) {
+            DEBUG("%zu samples per channel won't fit in a capture", nr_samples);
+            ret = H_ERR_BAD_ARGS;
+            goto done;
+        }
+    }
+
+    plan.nr_samples = plan.capture_buffer_len / plan.nr_streams;
+
+    DEBUG("Planned %.3f S/s (asked for %.3f): %zu streams, ADC clock %llu Hz, spacing %u, %zu bytes",
+            plan.rate, rate, plan.nr_streams, (unsigned long long)plan.adc_clock_hz, (unsigned)plan.spacing,
+            plan.capture_buffer_len);
+
+    *pplan = plan;
+
+done:
+    return ret;
+}
+
+HRESULT hantek_apply_rate_plan(struct hantek_device *dev, const struct hantek_rate_plan *plan)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_capture_config config;
+    size_t nr_chans = 0;
+    bool sent = false;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != plan);
+    HASSERT_ARG(0 != plan->channel_mask && 0 == (plan->channel_mask & ~((1u << HT_MAX_CHANNELS) - 1)));
+    HASSERT_ARG(HT_RATE_PLL_N_MIN <= plan->pll_n && HT_ADF4360_N_DEFAULT >= plan->pll_n);
+    HASSERT_ARG(0 != plan->spacing);
+    HASSERT_ARG(0 != plan->capture_buffer_len && HT_CAPTURE_MAX_LEN >= plan->capture_buffer_len);
+
+    if (HT_ACQ_IDLE != dev->acq.state) {
+        DEBUG("Can't change the sample rate while acquiring, aborting.");
+        ret = H_ERR_BUSY;
+        goto done;
+    }
+
+    /* Check the plan before retuning anything, so a bad one leaves the scope alone */
+    if (H_FAILED(ret = _hantek_rate_count_channels(plan->channel_mask, &nr_chans)) ||
+            nr_chans != plan->nr_streams)
+    {
+        DEBUG("Plan doesn't fit its channels, aborting.");
+        ret = H_ERR_INVAL_CHANNELS;
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_get_capture_config(dev, &config))) {
+        goto done;
+    }
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        config.channels[i].enabled = 0 != (plan->channel_mask & (1u << i));
+    }
+
+    /* The rate is set here rather than from a time base, and the trigger is left alone */
+    config.timebase = HT_ST_MAX;
+    config.trigger_set = false;
+    config.capture_buffer_len = plan->capture_buffer_len;
+
+    sent = true;
+    hantek_cmd_batch_begin(dev);
+
+    if (H_FAILED(ret = hantek_adc_clock_set(dev, plan->pll_n))) {
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_sample_spacing_send(dev, plan->spacing))) {
+        goto done;
+    }
+
+    dev->timebase = HT_ST_MAX;
+
+    /* Routes the channels through the ADC, which sets up the clock divider for them */
+    if (H_FAILED(ret = hantek_apply_config(dev, &config))) {
+        goto done;
+    }
+
+done:
+    if (true == sent) {
+        ret = hantek_batch_end(dev, ret);
+
+        if (H_FAILED(ret)) {
+            /* We can't tell what made it out */
+            hantek_spi_shadow_invalidate(dev);
+        } else if (0 == dev->batch.depth && false == dev->state_on_disk) {
+            hantek_state_save(dev);
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,475 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_usb.h>
+#include <hantek_readback.h>
+#include <hantek_transport.h>
+
+#include <stdbool.h>
+#include <string.h>
+
+/**
+ * Readback engine. The destination is split in two: the whole packets at the start are read
+ * straight into place by up to nr_transfers bulk IN transfers, and a final single-packet
+ * transfer into tail_buf picks up the partial packet at the end, if any, along with the short
+ * or zero length packet the device ends every capture with. Seeing that terminator here means
+ * nothing is left behind on the endpoint for the next command to trip over.
+ */
+
+HRESULT hantek_readback_init(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+
+    /* Transfer sizes are planned for each readback, unless the caller asks otherwise */
+    memset(&dev->readback, 0, sizeof(dev->readback));
+
+    return ret;
+}
+
+HRESULT hantek_readback_cleanup(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_readback *rb = NULL;
+
+    HASSERT_ARG(NULL != dev);
+
+    rb = &dev->readback;
+
+    /* Blocking readbacks run to completion, and hantek_close_device drains any acquisition first */
+    for (size_t i = 0; i < HT_READBACK_MAX_TRANSFERS; i++) {
+        if (true == rb->xfers_ready[i]) {
+            hantek_tp_xfer_release(dev->tp, &rb->xfers[i]);
+            rb->xfers_ready[i] = false;
+        }
+    }
+
+    if (true == rb->tail_ready) {
+        hantek_tp_xfer_release(dev->tp, &rb->tail_xfer);
+        rb->tail_ready = false;
+    }
+
+    return ret;
+}
+
+HRESULT hantek_set_readback_params(struct hantek_device *dev, unsigned nr_transfers, size_t transfer_len)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(HT_READBACK_MAX_TRANSFERS >= nr_transfers);
+    HASSERT_ARG(0 == (transfer_len % HT_READBACK_PACKET_LEN));
+    HASSERT_ARG(INT32_MAX >= transfer_len);
+    HASSERT_ARG((0 == nr_transfers) == (0 == transfer_len));
+
+    dev->readback.req_nr_transfers = nr_transfers;
+    dev->readback.req_transfer_len = transfer_len;
+
+    if (0 == nr_transfers) {
+        DEBUG("Readback engine: transfer sizes planned per readback");
+    } else {
+        DEBUG("Readback engine: %u transfers of %zu bytes in flight", nr_transfers, transfer_len);
+    }
+
+    return ret;
+}
+
+HRESULT hantek_get_readback_stats(struct hantek_device *dev, struct hantek_readback_stats *pstats)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != pstats);
+
+    *pstats = dev->readback.stats;
+
+    return ret;
+}
+
+/**
+ * Pick the transfer length and number of transfers in flight for reading aligned_len bytes.
+ * Large readbacks get few, long transfers to keep per-transfer overhead down, but always enough
+ * of them that the host is never left waiting on a single transfer to be resubmitted.
+ */
+static
+void _hantek_readback_plan(struct hantek_readback *rb, size_t aligned_len)
+{
+    size_t len = 0;
+    size_t nr = 0;
+
+    if (0 != rb->req_nr_transfers) {
+        rb->nr_transfers = rb->req_nr_transfers;
+        rb->transfer_len = rb->req_transfer_len;
+        return;
+    }
+
+    len = aligned_len / HT_READBACK_PLAN_SPLIT;
+    len = (len + HT_READBACK_PACKET_LEN - 1) & ~(size_t)(HT_READBACK_PACKET_LEN - 1);
+
+    if (len < HT_READBACK_PLAN_MIN_LEN) {
+        len = HT_READBACK_PLAN_MIN_LEN;
+    } else if (len > HT_READBACK_PLAN_MAX_LEN) {
+        len = HT_READBACK_PLAN_MAX_LEN;
+    }
+
+    if (0 != aligned_len && len > aligned_len) {
+        len = aligned_len;
+    }
+
+    nr = 0 != aligned_len ? (aligned_len + len - 1) / len : 1;
+    if (nr > HT_READBACK_PLAN_MAX_TRANSFERS) {
+        nr = HT_READBACK_PLAN_MAX_TRANSFERS;
+    }
+
+    rb->nr_transfers = nr;
+    rb->transfer_len = len;
+}
+
+static
+void _hantek_readback_cancel_all(struct hantek_device *dev, struct hantek_xfer *except)
+{
+    struct hantek_readback *rb = &dev->readback;
+
+    for (size_t i = 0; i < rb->nr_transfers; i++) {
+        if (true == rb->xfers_ready[i] && except != &rb->xfers[i]) {
+            /* Transfers that already completed are simply not found */
+            hantek_tp_cancel(dev->tp, &rb->xfers[i]);
+        }
+    }
+
+    if (true == rb->tail_submitted && except != &rb->tail_xfer) {
+        hantek_tp_cancel(dev->tp, &rb->tail_xfer);
+    }
+}
+
+/**
+ * Submit the final single-packet transfer. Returns false if it could not be submitted.
+ */
+static
+bool _hantek_readback_submit_tail(struct hantek_device *dev)
+{
+    struct hantek_readback *rb = &dev->readback;
+
+    rb->tail_xfer.buf = rb->tail_buf;
+    rb->tail_xfer.len = HT_READBACK_PACKET_LEN;
+
+    if (H_FAILED(hantek_tp_submit(dev->tp, &rb->tail_xfer))) {
+        DEBUG("Failed to submit final bulk IN transfer");
+        rb->result = H_ERR_NOT_READY;
+        rb->stop = true;
+        return false;
+    }
+
+    rb->tail_submitted = true;
+    rb->nr_active++;
+    rb->stats.nr_submitted++;
+
+    return true;
+}
+
+/**
+ * Fill in and submit the next slice of the destination buffer on the given transfer. Once the
+ * whole packets are all spoken for, the final transfer goes out instead. Returns false if
+ * nothing more was submitted on this transfer.
+ */
+static
+bool _hantek_readback_submit_next(struct hantek_device *dev, struct hantek_xfer *xfer)
+{
+    struct hantek_readback *rb = &dev->readback;
+    size_t len = 0;
+
+    if (true == rb->stop) {
+        return false;
+    }
+
+    if (rb->next_offset >= rb->aligned_len) {
+        if (false == rb->tail_submitted) {
+            _hantek_readback_submit_tail(dev);
+        }
+        return false;
+    }
+
+    len = rb->aligned_len - rb->next_offset;
+    if (len > rb->transfer_len) {
+        len = rb->transfer_len;
+    }
+
+    xfer->buf = rb->dst + rb->next_offset;
+    xfer->len = len;
+
+    if (H_FAILED(hantek_tp_submit(dev->tp, xfer))) {
+        DEBUG("Failed to submit bulk IN transfer at offset %zu", rb->next_offset);
+        rb->result = H_ERR_NOT_READY;
+        rb->stop = true;
+        return false;
+    }
+
+    rb->next_offset += len;
+    rb->nr_active++;
+    rb->stats.nr_submitted++;
+
+    return true;
+}
+
+/**
+ * Once nothing is in flight any more, the readback is over
+ */
+static
+void _hantek_readback_check_done(struct hantek_device *dev)
+{
+    struct hantek_readback *rb = &dev->readback;
+    hantek_readback_done_cb_t done_cb = rb->done_cb;
+
+    if (0 != rb->nr_active) {
+        return;
+    }
+
+    DEBUG("Readback complete: %zu of %zu bytes", rb->received, rb->dst_len);
+
+    rb->stats.bytes = rb->received;
+    rb->stats.duration_ns = hantek_now_ns() - rb->start_ns;
+    rb->stats.total_readbacks++;
+    rb->stats.total_submitted += rb->stats.nr_submitted;
+    rb->stats.total_bytes += rb->received;
+
+    if (NULL != done_cb) {
+        rb->done_cb = NULL;
+        done_cb(dev, rb->result, rb->received);
+    }
+}
+
+static
+void _hantek_readback_xfer_cb(struct hantek_xfer *xfer)
+{
+    struct hantek_device *dev = xfer->priv;
+    struct hantek_readback *rb = &dev->readback;
+
+    rb->nr_active--;
+
+    switch (xfer->status) {
+    case HT_XFER_COMPLETED:
+        rb->received += xfer->actual;
+
+        if (xfer->actual < xfer->len) {
+            /* A short transfer means the device has nothing more to send */
+            rb->stats.nr_short++;
+            rb->stats.nr_zlp += 0 == xfer->actual;
+            rb->stats.terminated = true;
+
+            if (false == rb->stop) {
+                DEBUG("Short transfer (%zu of %zu bytes), %zu bytes received in total",
+                        xfer->actual, xfer->len, rb->received);
+                rb->stop = true;
+                _hantek_readback_cancel_all(dev, xfer);
+            }
+            break;
+        }
+
+        /* Keep the pipe full */
+        _hantek_readback_submit_next(dev, xfer);
+        break;
+    case HT_XFER_CANCELLED:
+        /* Cancelled on purpose, any data received is still contiguous */
+        rb->received += xfer->actual;
+        break;
+    default:
+        DEBUG("Bulk IN transfer failed, status = %d", xfer->status);
+        if (false == rb->stop) {
+            rb->result = H_ERR_NOT_READY;
+            rb->stop = true;
+            _hantek_readback_cancel_all(dev, xfer);
+        }
+        break;
+    }
+
+    _hantek_readback_check_done(dev);
+}
+
+static
+void _hantek_readback_tail_cb(struct hantek_xfer *xfer)
+{
+    struct hantek_device *dev = xfer->priv;
+    struct hantek_readback *rb = &dev->readback;
+    size_t wanted = rb->dst_len - rb->aligned_len;
+    size_t len = 0;
+
+    rb->nr_active--;
+    rb->tail_submitted = false;
+
+    switch (xfer->status) {
+    case HT_XFER_COMPLETED:
+    case HT_XFER_CANCELLED:
+        /* Whatever arrived lands after the whole packets, provided they all filled */
+        if (rb->received == rb->aligned_len) {
+            len = xfer->actual < wanted ? xfer->actual : wanted;
+            memcpy(rb->dst + rb->aligned_len, rb->tail_buf, len);
+            rb->received += len;
+        }
+
+        if (HT_XFER_CANCELLED == xfer->status) {
+            break;
+        }
+
+        if (xfer->actual > wanted) {
+            DEBUG("Device has more data than fits, %zu bytes dropped", xfer->actual - wanted);
+            rb->stats.overrun = true;
+        }
+
+        if (xfer->actual < xfer->len) {
+            rb->stats.nr_short++;
+            rb->stats.nr_zlp += 0 == xfer->actual;
+            rb->stats.terminated = true;
+        }
+        break;
+    case HT_XFER_TIMED_OUT:
+        if (rb->received == rb->aligned_len && 0 == wanted) {
+            /* Everything asked for arrived, the device just never ended the capture */
+            DEBUG("No end of capture from the device after %zu bytes", rb->received);
+            break;
+        }
+        /* Fall through */
+    default:
+        DEBUG("Final bulk IN transfer failed, status = %d", xfer->status);
+        if (false == rb->stop) {
+            rb->result = H_ERR_NOT_READY;
+            rb->stop = true;
+        }
+        break;
+    }
+
+    _hantek_readback_check_done(dev);
+}
+
+HRESULT hantek_readback_start(struct hantek_device *dev, uint8_t *dst, size_t dst_len, hantek_readback_done_cb_t done_cb)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_readback *rb = NULL;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != dst);
+    HASSERT_ARG(0 != dst_len);
+
+    rb = &dev->readback;
+
+    HASSERT_ARG(0 == rb->nr_active);
+
+    _hantek_readback_plan(rb, dst_len & ~(size_t)(HT_READBACK_PACKET_LEN - 1));
+
+    for (size_t i = 0; i < rb->nr_transfers; i++) {
+        struct hantek_xfer *xfer = &rb->xfers[i];
+
+        if (true == rb->xfers_ready[i]) {
+            continue;
+        }
+
+        xfer->endpoint = HT6000_EP_IN | (1 << 7);
+        xfer->timeout_ms = HT_READBACK_TIMEOUT_MS;
+        xfer->cb = _hantek_readback_xfer_cb;
+        xfer->priv = dev;
+
+        if (H_FAILED(ret = hantek_tp_xfer_init(dev->tp, xfer))) {
+            DEBUG("Failed to set up readback transfer, aborting.");
+            goto done;
+        }
+
+        rb->xfers_ready[i] = true;
+    }
+
+    if (false == rb->tail_ready) {
+        rb->tail_xfer.endpoint = HT6000_EP_IN | (1 << 7);
+        rb->tail_xfer.timeout_ms = HT_READBACK_TIMEOUT_MS;
+        rb->tail_xfer.cb = _hantek_readback_tail_cb;
+        rb->tail_xfer.priv = dev;
+
+        if (H_FAILED(ret = hantek_tp_xfer_init(dev->tp, &rb->tail_xfer))) {
+            DEBUG("Failed to set up final readback transfer, aborting.");
+            goto done;
+        }
+
+        rb->tail_ready = true;
+    }
+
+    rb->dst = dst;
+    rb->dst_len = dst_len;
+    rb->aligned_len = dst_len & ~(size_t)(HT_READBACK_PACKET_LEN - 1);
+    rb->next_offset = 0;
+    rb->received = 0;
+    rb->nr_active = 0;
+    rb->stop = false;
+    rb->result = H_OK;
+    rb->done_cb = NULL;
+    rb->tail_submitted = false;
+    rb->start_ns = hantek_now_ns();
+
+    rb->stats.transfer_len = rb->transfer_len;
+    rb->stats.nr_transfers = rb->nr_transfers;
+    rb->stats.nr_submitted = 0;
+    rb->stats.nr_short = 0;
+    rb->stats.nr_zlp = 0;
+    rb->stats.bytes = 0;
+    rb->stats.duration_ns = 0;
+    rb->stats.terminated = false;
+    rb->stats.overrun = false;
+
+    /* Prime the pipeline with as many transfers as we are allowed, the final one goes out
+     * right away if that covers all the whole packets */
+    for (size_t i = 0; i < rb->nr_transfers; i++) {
+        if (false == _hantek_readback_submit_next(dev, &rb->xfers[i])) {
+            break;
+        }
+    }
+
+    if (false == rb->stop && false == rb->tail_submitted && rb->next_offset >= rb->aligned_len) {
+        _hantek_readback_submit_tail(dev);
+    }
+
+    if (0 == rb->nr_active) {
+        /* Not even the first transfer made it out */
+        ret = rb->result;
+        goto done;
+    }
+
+    rb->done_cb = done_cb;
+
+done:
+    return ret;
+}
+
+HRESULT hantek_readback_bulk_in(struct hantek_device *dev, uint8_t *dst, size_t dst_len, size_t *preceived)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_readback *rb = NULL;
+    bool cancelled = false;
+
+    HASSERT_ARG(NULL != preceived);
+
+    *preceived = 0;
+
+    if (H_FAILED(ret = hantek_readback_start(dev, dst, dst_len, NULL))) {
+        goto done;
+    }
+
+    rb = &dev->readback;
+
+    while (0 != rb->nr_active) {
+        if (H_FAILED(hantek_tp_handle_events(dev->tp, HT_READBACK_TIMEOUT_MS))) {
+            DEBUG("Failure while handling transfer events, cancelling readback.");
+
+            if (false == cancelled) {
+                rb->result = H_ERR_NOT_READY;
+                rb->stop = true;
+                _hantek_readback_cancel_all(dev, NULL);
+                cancelled = true;
+            }
+        }
+    }
+
+    ret = rb->result;
+    *preceived = rb->received;
+
+done:
+    return ret;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <hantek.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct hantek_device;
+
+/**
+ * Set up the readback engine state for a freshly opened device.
+ */
+HRESULT hantek_readback_init(struct hantek_device *dev);
+
+/**
+ * Release all resources held by the readback engine.
+ */
+HRESULT hantek_readback_cleanup(struct hantek_device *dev);
+
+/**
+ * Read up to dst_len bytes from the bulk IN endpoint directly into dst, keeping several
+ * transfers in flight. Stops at the first short transfer, and reads the short or zero length
+ * packet ending the capture even if dst fills exactly. The number of bytes actually received
+ * is returned in preceived.
+ */
+HRESULT hantek_readback_bulk_in(struct hantek_device *dev, uint8_t *dst, size_t dst_len, size_t *preceived);
+
+/**
+ * Start reading up to dst_len bytes from the bulk IN endpoint into dst, without waiting. done_cb
+ * is invoked from the transport's event handling once the readback has finished. If this
+ * function fails, done_cb is never called.
+ */
+HRESULT hantek_readback_start(struct hantek_device *dev, uint8_t *dst, size_t dst_len, hantek_readback_done_cb_t done_cb);
@@ -0,0 +1,934 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+#include <hantek_transport.h>
+#include <hantek_record.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Log file layout. All values are little endian.
+ *
+ * File header:
+ *  - 8 bytes: magic, "HTRECORD"
+ *  - 4 bytes: format version
+ *  - 4 bytes: SBZ
+ *
+ * Followed by one entry per transfer, in completion order:
+ *  - 1 byte: transfer type (HT_RECORD_TYPE_*)
+ *  - 1 byte: bRequest for control transfers, endpoint for bulk transfers
+ *  - 2 bytes: wValue (control only)
+ *  - 2 bytes: wIndex (control only)
+ *  - 2 bytes: flags (HT_RECORD_FLAG_*)
+ *  - 4 bytes: result, an HRESULT for synchronous transfers, or an enum hantek_xfer_status
+ *  - 4 bytes: requested length
+ *  - 4 bytes: actual length
+ *  - 8 bytes: start time, ns since the recording started. Submission time for async transfers.
+ *  - 8 bytes: end time, ns since the recording started
+ *  - payload: the requested length for host-to-device transfers, the actual length otherwise
+ */
+#define HT_RECORD_MAGIC             "HTRECORD"
+#define HT_RECORD_VERSION           1
+#define HT_RECORD_FILE_HDR_LEN      16
+#define HT_RECORD_ENTRY_HDR_LEN     36
+
+#define HT_RECORD_TYPE_CONTROL_IN   1
+#define HT_RECORD_TYPE_CONTROL_OUT  2
+#define HT_RECORD_TYPE_BULK_IN      3
+#define HT_RECORD_TYPE_BULK_OUT     4
+
+#define HT_RECORD_FLAG_ASYNC        (1 << 0)
+
+/**
+ * A decoded log entry
+ */
+struct hantek_record_entry {
+    uint8_t type;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+    uint16_t flags;
+    uint32_t result;
+    uint32_t len;
+    uint32_t actual;
+    uint64_t t_start;
+    uint64_t t_end;
+    const uint8_t *payload;
+    size_t payload_len;
+};
+
+static inline
+void __hantek_record_put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static inline
+void __hantek_record_put32(uint8_t *p, uint32_t v)
+{
+    __hantek_record_put16(p, v & 0xffff);
+    __hantek_record_put16(p + 2, v >> 16);
+}
+
+static inline
+void __hantek_record_put64(uint8_t *p, uint64_t v)
+{
+    __hantek_record_put32(p, v & 0xffffffff);
+    __hantek_record_put32(p + 4, v >> 32);
+}
+
+static inline
+uint16_t __hantek_record_get16(const uint8_t *p)
+{
+    return (uint16_t)p[1] << 8 | p[0];
+}
+
+static inline
+uint32_t __hantek_record_get32(const uint8_t *p)
+{
+    return (uint32_t)__hantek_record_get16(p + 2) << 16 | __hantek_record_get16(p);
+}
+
+static inline
+uint64_t __hantek_record_get64(const uint8_t *p)
+{
+    return (uint64_t)__hantek_record_get32(p + 4) << 32 | __hantek_record_get32(p);
+}
+
+static inline
+bool __hantek_record_is_in(uint8_t type)
+{
+    return HT_RECORD_TYPE_CONTROL_IN == type || HT_RECORD_TYPE_BULK_IN == type;
+}
+
+/******************************************************************************
+ * Recording
+ ******************************************************************************/
+
+struct hantek_record {
+    struct hantek_transport tp;
+
+    struct hantek_transport *inner;
+    FILE *fp;
+    uint64_t t_base;
+
+    /**
+     * Sticky failure to write the log
+     */
+    HRESULT io_result;
+};
+
+/**
+ * Shadow of an asynchronous transfer, submitted to the inner transport in its place
+ */
+struct hantek_record_xfer {
+    struct hantek_xfer inner;
+    struct hantek_xfer *outer;
+    struct hantek_record *rec;
+    uint64_t t_submit;
+};
+
+#define HT_RECORD(_tp)              ((struct hantek_record *)(_tp))
+
+static
+HRESULT _hantek_record_write(struct hantek_record *rec, const struct hantek_record_entry *ent)
+{
+    HRESULT ret = H_OK;
+
+    uint8_t hdr[HT_RECORD_ENTRY_HDR_LEN];
+
+    if (H_FAILED(ret = rec->io_result)) {
+        goto done;
+    }
+
+    hdr[0] = ent->type;
+    hdr[1] = ent->request;
+    __hantek_record_put16(&hdr[2], ent->value);
+    __hantek_record_put16(&hdr[4], ent->index);
+    __hantek_record_put16(&hdr[6], ent->flags);
+    __hantek_record_put32(&hdr[8], ent->result);
+    __hantek_record_put32(&hdr[12], ent->len);
+    __hantek_record_put32(&hdr[16], ent->actual);
+    __hantek_record_put64(&hdr[20], ent->t_start - rec->t_base);
+    __hantek_record_put64(&hdr[28], ent->t_end - rec->t_base);
+
+    if (1 != fwrite(hdr, sizeof(hdr), 1, rec->fp) ||
+            (0 != ent->payload_len && 1 != fwrite(ent->payload, ent->payload_len, 1, rec->fp)))
+    {
+        DEBUG("Failed to write transfer log entry, recording stopped.");
+        ret = rec->io_result = H_ERR_RECORD_IO;
+        goto done;
+    }
+
+done:
+    return ret;
+}
+
+/**
+ * Log a synchronous transfer. A failure to log trumps the transfer's own result.
+ */
+static
+HRESULT _hantek_record_log_sync(struct hantek_record *rec, HRESULT result, uint8_t type, uint8_t request,
+        uint16_t value, uint16_t index, const uint8_t *buf, size_t len, size_t actual, uint64_t t_start)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_record_entry ent = {
+        .type = type,
+        .request = request,
+        .value = value,
+        .index = index,
+        .result = (uint32_t)result,
+        .len = len,
+        .actual = actual,
+        .t_start = t_start,
+        .t_end = hantek_now_ns(),
+        .payload = buf,
+        .payload_len = __hantek_record_is_in(type) ? actual : len,
+    };
+
+    if (H_FAILED(ret = _hantek_record_write(rec, &ent))) {
+        goto done;
+    }
+
+    ret = result;
+
+done:
+    return ret;
+}
+
+static
+HRESULT _hantek_record_control_in(struct hantek_transport *tp, uint8_t request, uint16_t value, uint16_t index, uint8_t *buf, size_t len, size_t *ptransferred)
+{
+    struct hantek_record *rec = HT_RECORD(tp);
+    uint64_t t_start = hantek_now_ns();
+    HRESULT result = hantek_tp_control_in(rec->inner, request, value, index, buf, len, ptransferred);
+
+    return _hantek_record_log_sync(rec, result, HT_RECORD_TYPE_CONTROL_IN, request, value, index,
+            buf, len, H_FAILED(result) ? 0 : *ptransferred, t_start);
+}
+
+static
+HRESULT _hantek_record_control_out(struct hantek_transport *tp, uint8_t request, uint16_t value, uint16_t index, const uint8_t *buf, size_t len)
+{
+    struct hantek_record *rec = HT_RECORD(tp);
+    uint64_t t_start = hantek_now_ns();
+    HRESULT result = hantek_tp_control_out(rec->inner, request, value, index, buf, len);
+
+    return _hantek_record_log_sync(rec, result, HT_RECORD_TYPE_CONTROL_OUT, request, value, index,
+            buf, len, H_FAILED(result) ? 0 : len, t_start);
+}
+
+static
+HRESULT _hantek_record_bulk_in(struct hantek_transport *tp, uint8_t endpoint, uint8_t *buf, size_t len, size_t *ptransferred, unsigned timeout_ms)
+{
+    struct hantek_record *rec = HT_RECORD(tp);
+    uint64_t t_start = hantek_now_ns();
+    HRESULT result = hantek_tp_bulk_in(rec->inner, endpoint, buf, len, ptransferred, timeout_ms);
+
+    return _hantek_record_log_sync(rec, result, HT_RECORD_TYPE_BULK_IN, endpoint, 0, 0,
+            buf, len, H_FAILED(result) ? 0 : *ptransferred, t_start);
+}
+
+static
+HRESULT _hantek_record_bulk_out(struct hantek_transport *tp, uint8_t endpoint, const uint8_t *buf, size_t len, size_t *ptransferred, unsigned timeout_ms)
+{
+    struct hantek_record *rec = HT_RECORD(tp);
+    uint64_t t_start = hantek_now_ns();
+    HRESULT result = hantek_tp_bulk_out(rec->inner, endpoint, buf, len, ptransferred, timeout_ms);
+
+    return _hantek_record_log_sync(rec, result, HT_RECORD_TYPE_BULK_OUT, endpoint, 0, 0,
+            buf, len, H_FAILED(result) ? 0 : *ptransferred, t_start);
+}
+
+static
+void _hantek_record_xfer_cb(struct hantek_xfer *ixfer)
+{
+    struct hantek_record_xfer *rxfer = ixfer->priv;
+    struct hantek_xfer *xfer = rxfer->outer;
+    bool is_in = !!(ixfer->endpoint & (1 << 7));
+    struct hantek_record_entry ent = {
+        .type = is_in ? HT_RECORD_TYPE_BULK_IN : HT_RECORD_TYPE_BULK_OUT,
+        .request = ixfer->endpoint,
+        .flags = HT_RECORD_FLAG_ASYNC,
+        .result = ixfer->status,
+        .len = ixfer->len,
+        .actual = ixfer->actual,
+        .t_start = rxfer->t_submit,
+        .t_end = hantek_now_ns(),
+        .payload = ixfer->buf,
+        .payload_len = is_in ? ixfer->actual : ixfer->len,
+    };
+
+    /* A logging failure is reported from the next call to handle_events */
+    _hantek_record_write(rxfer->rec, &ent);
+
+    xfer->actual = ixfer->actual;
+    xfer->status = ixfer->status;
+    xfer->cb(xfer);
+}
+
+static
+HRESULT _hantek_record_xfer_init(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_record *rec = HT_RECORD(tp);
+    struct hantek_record_xfer *rxfer = NULL;
+
+    if (NULL == (rxfer = hantek_calloc(1, sizeof(*rxfer)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    rxfer->outer = xfer;
+    rxfer->rec = rec;
+    rxfer->inner.cb = _hantek_record_xfer_cb;
+    rxfer->inner.priv = rxfer;
+
+    if (H_FAILED(ret = hantek_tp_xfer_init(rec->inner, &rxfer->inner))) {
+        hantek_free(rxfer);
+        goto done;
+    }
+
+    xfer->tp_priv = rxfer;
+
+done:
+    return ret;
+}
+
+static
+void _hantek_record_xfer_release(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    struct hantek_record_xfer *rxfer = xfer->tp_priv;
+
+    hantek_tp_xfer_release(HT_RECORD(tp)->inner, &rxfer->inner);
+    hantek_free(rxfer);
+    xfer->tp_priv = NULL;
+}
+
+static
+HRESULT _hantek_record_submit(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    struct hantek_record_xfer *rxfer = xfer->tp_priv;
+
+    rxfer->inner.endpoint = xfer->endpoint;
+    rxfer->inner.buf = xfer->buf;
+    rxfer->inner.len = xfer->len;
+    rxfer->inner.timeout_ms = xfer->timeout_ms;
+    rxfer->t_submit = hantek_now_ns();
+
+    return hantek_tp_submit(HT_RECORD(tp)->inner, &rxfer->inner);
+}
+
+static
+HRESULT _hantek_record_cancel(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    struct hantek_record_xfer *rxfer = xfer->tp_priv;
+
+    return hantek_tp_cancel(HT_RECORD(tp)->inner, &rxfer->inner);
+}
+
+static
+HRESULT _hantek_record_handle_events(struct hantek_transport *tp, unsigned timeout_ms)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_record *rec = HT_RECORD(tp);
+
+    if (H_FAILED(ret = hantek_tp_handle_events(rec->inner, timeout_ms))) {
+        goto done;
+    }
+
+    ret = rec->io_result;
+
+done:
+    return ret;
+}
+
+static
+HRESULT _hantek_record_get_pollfds(struct hantek_transport *tp, struct hantek_pollfd *fds, size_t max_fds, size_t *pnr_fds)
+{
+    return hantek_tp_get_pollfds(HT_RECORD(tp)->inner, fds, max_fds, pnr_fds);
+}
+
+static
+HRESULT _hantek_record_get_timeout(struct hantek_transport *tp, int *ptimeout_ms)
+{
+    return hantek_tp_get_timeout(HT_RECORD(tp)->inner, ptimeout_ms);
+}
+
+static
+HRESULT _hantek_record_dev_mem_alloc(struct hantek_transport *tp, size_t len, uint8_t **pbuf)
+{
+    return hantek_tp_dev_mem_alloc(HT_RECORD(tp)->inner, len, pbuf);
+}
+
+static
+void _hantek_record_dev_mem_free(struct hantek_transport *tp, uint8_t *buf, size_t len)
+{
+    hantek_tp_dev_mem_free(HT_RECORD(tp)->inner, buf, len);
+}
+
+static
+HRESULT _hantek_record_get_location(struct hantek_transport *tp, char *buf, size_t len)
+{
+    return hantek_tp_get_location(HT_RECORD(tp)->inner, buf, len);
+}
+
+static
+void _hantek_record_close(struct hantek_transport *tp)
+{
+    struct hantek_record *rec = HT_RECORD(tp);
+
+    if (NULL != rec->fp && 0 != fclose(rec->fp)) {
+        DEBUG("Failed to close transfer log, it is probably truncated.");
+    }
+
+    if (NULL != rec->inner) {
+        rec->inner->ops->close(rec->inner);
+    }
+
+    hantek_free(rec);
+}
+
+static const
+struct hantek_transport_ops _hantek_record_transport_ops = {
+    .control_in = _hantek_record_control_in,
+    .control_out = _hantek_record_control_out,
+    .bulk_in = _hantek_record_bulk_in,
+    .bulk_out = _hantek_record_bulk_out,
+    .xfer_init = _hantek_record_xfer_init,
+    .xfer_release = _hantek_record_xfer_release,
+    .submit = _hantek_record_submit,
+    .cancel = _hantek_record_cancel,
+    .handle_events = _hantek_record_handle_events,
+    .get_pollfds = _hantek_record_get_pollfds,
+    .get_timeout = _hantek_record_get_timeout,
+    .dev_mem_alloc = _hantek_record_dev_mem_alloc,
+    .dev_mem_free = _hantek_record_dev_mem_free,
+    .get_location = _hantek_record_get_location,
+    .close = _hantek_record_close,
+};
+
+HRESULT hantek_record_transport_create(struct hantek_transport **ptp, struct hantek_transport *inner, const char *path)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_record *rec = NULL;
+    uint8_t hdr[HT_RECORD_FILE_HDR_LEN] = { 0 };
+
+    HASSERT_ARG(NULL != ptp);
+    HASSERT_ARG(NULL != inner);
+    HASSERT_ARG(NULL != path);
+
+    *ptp = NULL;
+
+    if (NULL == (rec = hantek_calloc(1, sizeof(*rec)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    rec->tp.ops = &_hantek_record_transport_ops;
+
+    if (NULL == (rec->fp = fopen(path, "wb"))) {
+        DEBUG("Failed to open transfer log '%s' for writing", path);
+        ret = H_ERR_RECORD_IO;
+        goto done;
+    }
+
+    memcpy(hdr, HT_RECORD_MAGIC, 8);
+    __hantek_record_put32(&hdr[8], HT_RECORD_VERSION);
+
+    if (1 != fwrite(hdr, sizeof(hdr), 1, rec->fp)) {
+        DEBUG("Failed to write transfer log header");
+        ret = H_ERR_RECORD_IO;
+        goto done;
+    }
+
+    rec->t_base = hantek_now_ns();
+    rec->inner = inner;
+
+    *ptp = &rec->tp;
+
+done:
+    if (H_FAILED(ret) && NULL != rec) {
+        /* The caller keeps the inner transport */
+        _hantek_record_close(&rec->tp);
+    }
+    return ret;
+}
+
+/******************************************************************************
+ * Replay
+ ******************************************************************************/
+
+/**
+ * An asynchronous transfer waiting for its log entry to be replayed
+ */
+struct hantek_replay_pending {
+    struct hantek_xfer *xfer;
+    struct hantek_replay_pending *next;
+};
+
+struct hantek_replay {
+    struct hantek_transport tp;
+
+    /**
+     * The whole log, and the offset of the next entry to replay
+     */
+    uint8_t *log;
+    size_t log_len;
+    size_t off;
+    size_t nr_entry;
+
+    bool realtime;
+
+    /**
+     * Recorded end time of the last replayed entry
+     */
+    uint64_t last_t_end;
+
+    /**
+     * Sticky divergence from the log
+     */
+    HRESULT result;
+
+    /**
+     * Submitted asynchronous transfers, completed in submission order
+     */
+    struct hantek_replay_pending *head;
+    struct hantek_replay_pending *tail;
+};
+
+#define HT_REPLAY(_tp)              ((struct hantek_replay *)(_tp))
+
+/**
+ * Decode the entry at off. Returns the offset of the following entry, or 0 if the log is
+ * truncated.
+ */
+static
+size_t _hantek_replay_decode(const uint8_t *log, size_t log_len, size_t off, struct hantek_record_entry *ent)
+{
+    const uint8_t *hdr = log + off;
+
+    if (log_len - off < HT_RECORD_ENTRY_HDR_LEN) {
+        return 0;
+    }
+
+    ent->type = hdr[0];
+    ent->request = hdr[1];
+    ent->value = __hantek_record_get16(&hdr[2]);
+    ent->index = __hantek_record_get16(&hdr[4]);
+    ent->flags = __hantek_record_get16(&hdr[6]);
+    ent->result = __hantek_record_get32(&hdr[8]);
+    ent->len = __hantek_record_get32(&hdr[12]);
+    ent->actual = __hantek_record_get32(&hdr[16]);
+    ent->t_start = __hantek_record_get64(&hdr[20]);
+    ent->t_end = __hantek_record_get64(&hdr[28]);
+    ent->payload = hdr + HT_RECORD_ENTRY_HDR_LEN;
+    ent->payload_len = __hantek_record_is_in(ent->type) ? ent->actual : ent->len;
+
+    off += HT_RECORD_ENTRY_HDR_LEN;
+
+    if (ent->actual > ent->len || log_len - off < ent->payload_len) {
+        return 0;
+    }
+
+    return off + ent->payload_len;
+}
+
+/**
+ * In realtime mode, spend as long as the device did on this entry. For overlapping async
+ * transfers that is the time since the previous completion.
+ */
+static
+void _hantek_replay_delay(struct hantek_replay *rp, const struct hantek_record_entry *ent)
+{
+    uint64_t from = ent->t_start > rp->last_t_end ? ent->t_start : rp->last_t_end;
+
+    if (true == rp->realtime && ent->t_end > from) {
+        uint64_t ns = ent->t_end - from;
+        struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+
+        while (0 != nanosleep(&ts, &ts));
+    }
+
+    if (ent->t_end > rp->last_t_end) {
+        rp->last_t_end = ent->t_end;
+    }
+}
+
+/**
+ * Fetch the next entry and check it describes the transfer being asked for
+ */
+static
+HRESULT _hantek_replay_expect(struct hantek_replay *rp, struct hantek_record_entry *ent, uint8_t type, bool async,
+        uint8_t request, uint16_t value, uint16_t index, const uint8_t *out_buf, size_t len)
+{
+    HRESULT ret = H_OK;
+
+    if (H_FAILED(ret = rp->result)) {
+        goto done;
+    }
+
+    if (rp->off == rp->log_len) {
+        DEBUG("Replay: ran out of log after %zu entries", rp->nr_entry);
+        ret = H_ERR_RECORD_DIVERGED;
+        goto done;
+    }
+
+    /* The log was validated when it was loaded */
+    rp->off = _hantek_replay_decode(rp->log, rp->log_len, rp->off, ent);
+
+    if (type != ent->type || async != !!(ent->flags & HT_RECORD_FLAG_ASYNC) ||
+            request != ent->request || value != ent->value || index != ent->index || len != ent->len)
+    {
+        DEBUG("Replay: entry %zu diverges. Recorded type %u req %02x value %04x index %04x len %u%s, "
+                "got type %u req %02x value %04x index %04x len %zu%s", rp->nr_entry,
+                ent->type, ent->request, ent->value, ent->index, ent->len,
+                (ent->flags & HT_RECORD_FLAG_ASYNC) ? " (async)" : "",
+                type, request, value, index, len, true == async ? " (async)" : "");
+        ret = H_ERR_RECORD_DIVERGED;
+        goto done;
+    }
+
+    if (NULL != out_buf && 0 != memcmp(out_buf, ent->payload, len)) {
+        DEBUG("Replay: entry %zu diverges, the payload sent differs from the recording", rp->nr_entry);
+        ret = H_ERR_RECORD_DIVERGED;
+        goto done;
+    }
+
+    rp->nr_entry++;
+
+    _hantek_replay_delay(rp, ent);
+
+done:
+    if (H_FAILED(ret)) {
+        rp->result = ret;
+    }
+    return ret;
+}
+
+static
+HRESULT _hantek_replay_in(struct hantek_replay *rp, uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint8_t *buf, size_t len, size_t *ptransferred)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_record_entry ent;
+
+    *ptransferred = 0;
+
+    if (H_FAILED(ret = _hantek_replay_expect(rp, &ent, type, false, request, value, index, NULL, len))) {
+        goto done;
+    }
+
+    memcpy(buf, ent.payload, ent.actual);
+    *ptransferred = ent.actual;
+
+    ret = (HRESULT)ent.result;
+
+done:
+    return ret;
+}
+
+static
+HRESULT _hantek_replay_control_in(struct hantek_transport *tp, uint8_t request, uint16_t value, uint16_t index, uint8_t *buf, size_t len, size_t *ptransferred)
+{
+    return _hantek_replay_in(HT_REPLAY(tp), HT_RECORD_TYPE_CONTROL_IN, request, value, index, buf, len, ptransferred);
+}
+
+static
+HRESULT _hantek_replay_control_out(struct hantek_transport *tp, uint8_t request, uint16_t value, uint16_t index, const uint8_t *buf, size_t len)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_record_entry ent;
+
+    if (H_FAILED(ret = _hantek_replay_expect(HT_REPLAY(tp), &ent, HT_RECORD_TYPE_CONTROL_OUT, false, request, value, index, buf, len))) {
+        goto done;
+    }
+
+    ret = (HRESULT)ent.result;
+
+done:
+    return ret;
+}
+
+static
+HRESULT _hantek_replay_bulk_in(struct hantek_transport *tp, uint8_t endpoint, uint8_t *buf, size_t len, size_t *ptransferred, unsigned timeout_ms)
+{
+    (void)timeout_ms;
+
+    return _hantek_replay_in(HT_REPLAY(tp), HT_RECORD_TYPE_BULK_IN, endpoint, 0, 0, buf, len, ptransferred);
+}
+
+static
+HRESULT _hantek_replay_bulk_out(struct hantek_transport *tp, uint8_t endpoint, const uint8_t *buf, size_t len, size_t *ptransferred, unsigned timeout_ms)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_record_entry ent;
+
+    (void)timeout_ms;
+
+    *ptransferred = 0;
+
+    if (H_FAILED(ret = _hantek_replay_expect(HT_REPLAY(tp), &ent, HT_RECORD_TYPE_BULK_OUT, false, endpoint, 0, 0, buf, len))) {
+        goto done;
+    }
+
+    *ptransferred = ent.actual;
+    ret = (HRESULT)ent.result;
+
+done:
+    return ret;
+}
+
+static
+HRESULT _hantek_replay_xfer_init(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_replay_pending *pend = NULL;
+
+    (void)tp;
+
+    if (NULL == (pend = hantek_calloc(1, sizeof(*pend)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    pend->xfer = xfer;
+    xfer->tp_priv = pend;
+
+done:
+    return ret;
+}
+
+static
+void _hantek_replay_xfer_release(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    (void)tp;
+
+    hantek_free(xfer->tp_priv);
+    xfer->tp_priv = NULL;
+}
+
+static
+HRESULT _hantek_replay_submit(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    struct hantek_replay *rp = HT_REPLAY(tp);
+    struct hantek_replay_pending *pend = xfer->tp_priv;
+
+    pend->next = NULL;
+    xfer->actual = 0;
+
+    if (NULL == rp->tail) {
+        rp->head = rp->tail = pend;
+    } else {
+        rp->tail->next = pend;
+        rp->tail = pend;
+    }
+
+    return H_OK;
+}
+
+static
+HRESULT _hantek_replay_cancel(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    (void)tp;
+    (void)xfer;
+
+    /* Whether the transfer got cancelled in time is part of the recording */
+    return H_OK;
+}
+
+static
+HRESULT _hantek_replay_handle_events(struct hantek_transport *tp, unsigned timeout_ms)
+{
+    struct hantek_replay *rp = HT_REPLAY(tp);
+    struct hantek_replay_pending *pend = NULL;
+
+    (void)timeout_ms;
+
+    /* Completion callbacks may submit more transfers, which we pick up as we go */
+    while (NULL != (pend = rp->head)) {
+        struct hantek_xfer *xfer = pend->xfer;
+        struct hantek_record_entry ent;
+        bool is_in = !!(xfer->endpoint & (1 << 7));
+
+        rp->head = pend->next;
+        if (NULL == rp->head) {
+            rp->tail = NULL;
+        }
+
+        if (H_FAILED(_hantek_replay_expect(rp, &ent, is_in ? HT_RECORD_TYPE_BULK_IN : HT_RECORD_TYPE_BULK_OUT,
+                        true, xfer->endpoint, 0, 0, is_in ? NULL : xfer->buf, xfer->len)))
+        {
+            /* Fail everything that is outstanding, so the submitter can wind down */
+            xfer->status = HT_XFER_ERROR;
+        } else {
+            if (true == is_in) {
+                memcpy(xfer->buf, ent.payload, ent.actual);
+            }
+            xfer->actual = ent.actual;
+            xfer->status = (enum hantek_xfer_status)ent.result;
+        }
+
+        xfer->cb(xfer);
+    }
+
+    return rp->result;
+}
+
+static
+HRESULT _hantek_replay_get_pollfds(struct hantek_transport *tp, struct hantek_pollfd *fds, size_t max_fds, size_t *pnr_fds)
+{
+    (void)tp;
+    (void)fds;
+    (void)max_fds;
+
+    /* Replayed transfers complete as soon as events are handled, see the timeout */
+    *pnr_fds = 0;
+
+    return H_OK;
+}
+
+static
+HRESULT _hantek_replay_get_timeout(struct hantek_transport *tp, int *ptimeout_ms)
+{
+    *ptimeout_ms = NULL != HT_REPLAY(tp)->head ? 0 : -1;
+
+    return H_OK;
+}
+
+static
+void _hantek_replay_close(struct hantek_transport *tp)
+{
+    struct hantek_replay *rp = HT_REPLAY(tp);
+
+    hantek_free(rp->log);
+    hantek_free(rp);
+}
+
+static const
+struct hantek_transport_ops _hantek_replay_transport_ops = {
+    .control_in = _hantek_replay_control_in,
+    .control_out = _hantek_replay_control_out,
+    .bulk_in = _hantek_replay_bulk_in,
+    .bulk_out = _hantek_replay_bulk_out,
+    .xfer_init = _hantek_replay_xfer_init,
+    .xfer_release = _hantek_replay_xfer_release,
+    .submit = _hantek_replay_submit,
+    .cancel = _hantek_replay_cancel,
+    .handle_events = _hantek_replay_handle_events,
+    .get_pollfds = _hantek_replay_get_pollfds,
+    .get_timeout = _hantek_replay_get_timeout,
+    .close = _hantek_replay_close,
+};
+
+/**
+ * Read the whole log into memory, so replay does no I/O of its own
+ */
+static
+HRESULT _hantek_replay_load(struct hantek_replay *rp, const char *path)
+{
+    HRESULT ret = H_OK;
+
+    FILE *fp = NULL;
+    long len = 0;
+    size_t nr_entries = 0;
+    struct hantek_record_entry ent;
+
+    if (NULL == (fp = fopen(path, "rb"))) {
+        DEBUG("Failed to open transfer log '%s'", path);
+        ret = H_ERR_RECORD_IO;
+        goto done;
+    }
+
+    if (0 != fseek(fp, 0, SEEK_END) || 0 > (len = ftell(fp)) || 0 != fseek(fp, 0, SEEK_SET)) {
+        DEBUG("Failed to get the size of transfer log '%s'", path);
+        ret = H_ERR_RECORD_IO;
+        goto done;
+    }
+
+    if (HT_RECORD_FILE_HDR_LEN > len) {
+        DEBUG("Transfer log '%s' is too short (%ld bytes)", path, len);
+        ret = H_ERR_RECORD_BAD_FORMAT;
+        goto done;
+    }
+
+    if (NULL == (rp->log = hantek_malloc(len))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    if (1 != fread(rp->log, len, 1, fp)) {
+        DEBUG("Failed to read transfer log '%s'", path);
+        ret = H_ERR_RECORD_IO;
+        goto done;
+    }
+
+    if (0 != memcmp(rp->log, HT_RECORD_MAGIC, 8) || HT_RECORD_VERSION != __hantek_record_get32(&rp->log[8])) {
+        DEBUG("'%s' is not a transfer log we understand", path);
+        ret = H_ERR_RECORD_BAD_FORMAT;
+        goto done;
+    }
+
+    rp->log_len = len;
+    rp->off = HT_RECORD_FILE_HDR_LEN;
+
+    /* Walk the log once up front, so a truncated log is caught here rather than mid-replay */
+    for (size_t off = rp->off; off != rp->log_len; nr_entries++) {
+        if (0 == (off = _hantek_replay_decode(rp->log, rp->log_len, off, &ent))) {
+            DEBUG("Transfer log '%s' is truncated after %zu entries", path, nr_entries);
+            ret = H_ERR_RECORD_BAD_FORMAT;
+            goto done;
+        }
+    }
+
+    DEBUG("Loaded transfer log '%s', %zu entries", path, nr_entries);
+
+done:
+    if (NULL != fp) {
+        fclose(fp);
+    }
+    return ret;
+}
+
+HRESULT hantek_replay_transport_create(struct hantek_transport **ptp, const char *path, bool realtime)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_replay *rp = NULL;
+
+    HASSERT_ARG(NULL != ptp);
+    HASSERT_ARG(NULL != path);
+
+    *ptp = NULL;
+
+    if (NULL == (rp = hantek_calloc(1, sizeof(*rp)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    rp->tp.ops = &_hantek_replay_transport_ops;
+    rp->realtime = realtime;
+
+    if (H_FAILED(ret = _hantek_replay_load(rp, path))) {
+        goto done;
+    }
+
+    *ptp = &rp->tp;
+
+done:
+    if (H_FAILED(ret) && NULL != rp) {
+        _hantek_replay_close(&rp->tp);
+    }
+    return ret;
+}
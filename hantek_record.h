@@ -0,0 +1,30 @@
+#pragma once
+
+#include <hantek.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Recording and replay of device traffic.
+ *
+ * A recording transport sits on top of another transport and logs every transfer it carries,
+ * with its payload and timing, to a file. A replay transport serves the responses from such a
+ * log back to the library, and fails with H_ERR_RECORD_DIVERGED as soon as the library asks for
+ * something other than what was recorded.
+ */
+
+struct hantek_transport;
+
+/**
+ * Wrap the transport inner, logging all traffic to the file at path. On success the recording
+ * transport owns inner, and closes it when it is closed itself.
+ */
+HRESULT hantek_record_transport_create(struct hantek_transport **ptp, struct hantek_transport *inner, const char *path);
+
+/**
+ * Create a transport replaying the log at path. If realtime is true, each transfer takes as
+ * long as it took on the device when recorded, otherwise responses are served immediately.
+ */
+HRESULT hantek_replay_transport_create(struct hantek_transport **ptp, const char *path, bool realtime);
@@ -0,0 +1,114 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+HRESULT hantek_segments_alloc(struct hantek_device *dev, size_t nr_segments, struct hantek_segments **psegs)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_segments *segs = NULL;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(0 != nr_segments);
+    HASSERT_ARG(NULL != psegs);
+
+    *psegs = NULL;
+
+    if (nr_segments > SIZE_MAX / dev->capture_buffer_len) {
+        DEBUG("%zu segments of %zu bytes is too many", nr_segments, dev->capture_buffer_len);
+        ret = H_ERR_BAD_ARGS;
+        goto done;
+    }
+
+    if (NULL == (segs = hantek_calloc(1, sizeof(*segs)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    segs->seg_len = dev->capture_buffer_len;
+    segs->nr_segments = nr_segments;
+
+    if (NULL == (segs->info = hantek_calloc(nr_segments, sizeof(*segs->info)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_buffer_alloc(dev, nr_segments * segs->seg_len, &segs->buf))) {
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_buffer_get_data(segs->buf, &segs->data, NULL))) {
+        goto done;
+    }
+
+    *psegs = segs;
+
+done:
+    if (H_FAILED(ret) && NULL != segs) {
+        if (NULL != segs->buf) {
+            hantek_buffer_free(dev, &segs->buf);
+        }
+        hantek_free(segs->info);
+        hantek_free(segs);
+    }
+    return ret;
+}
+
+HRESULT hantek_segments_free(struct hantek_device *dev, struct hantek_segments **psegs)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_segments *segs = NULL;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != psegs);
+    HASSERT_ARG(NULL != *psegs);
+
+    segs = *psegs;
+
+    if (HT_ACQ_IDLE != dev->acq.state && segs == dev->acq.segs) {
+        DEBUG("Segments are in use by an acquisition, aborting.");
+        ret = H_ERR_BUSY;
+        goto done;
+    }
+
+    hantek_buffer_free(dev, &segs->buf);
+    hantek_free(segs->info);
+    hantek_free(segs);
+
+    *psegs = NULL;
+
+done:
+    return ret;
+}
+
+HRESULT hantek_segments_get(struct hantek_segments *segs, const uint8_t **pdata, const struct hantek_segment_info **pinfo, size_t *pnr_segments, struct hantek_capture_config *pconfig)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != segs);
+
+    if (NULL != pdata) {
+        *pdata = segs->data;
+    }
+
+    if (NULL != pinfo) {
+        *pinfo = segs->info;
+    }
+
+    if (NULL != pnr_segments) {
+        *pnr_segments = segs->nr_captured;
+    }
+
+    if (NULL != pconfig) {
+        memcpy(pconfig, &segs->config, sizeof(*pconfig));
+    }
+
+    return ret;
+}
+
@@ -0,0 +1,353 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+#include <hmcad1511.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Calibration stops narrowing down a settle time once it is known to within this many
+ * microseconds, and adds this much margin to what it finds
+ */
+#define HT_SETTLE_CAL_RESOLUTION_US         100
+#define HT_SETTLE_CAL_MARGIN_PCT            25
+
+/**
+ * How far the mean of a capture may be from the settled capture's, in ADC counts, for the
+ * hardware to count as settled
+ */
+#define HT_SETTLE_CAL_TOLERANCE             2.0
+
+#define HT_SETTLE_CAL_TIMEOUT_MS            1000
+
+/**
+ * Default settle times, as the vendor SDK sleeps after each operation
+ */
+static const
+unsigned _hantek_settle_defaults[HT_SETTLE_MAX] = {
+    [HT_SETTLE_RELAY_LOAD] = 4000,
+    [HT_SETTLE_RELAY] = 50000,
+    [HT_SETTLE_POSITION] = 10000,
+    [HT_SETTLE_ADC] = 3000,
+};
+
+static
+void _hantek_settle_start(struct hantek_device *dev, enum hantek_settle_op op, uint64_t now)
+{
+    uint64_t deadline = now + (uint64_t)dev->settle.settle_us[op] * 1000ull;
+
+    if (deadline > dev->settle.deadline_ns[op]) {
+        dev->settle.deadline_ns[op] = deadline;
+    }
+}
+
+void hantek_settle_init(struct hantek_device *dev)
+{
+    memset(&dev->settle, 0, sizeof(dev->settle));
+    memcpy(dev->settle.settle_us, _hantek_settle_defaults, sizeof(_hantek_settle_defaults));
+}
+
+void hantek_settle_mark(struct hantek_device *dev, enum hantek_settle_op op)
+{
+    if (0 != dev->batch.depth) {
+        dev->settle.pending |= 1u << op;
+        return;
+    }
+
+    _hantek_settle_start(dev, op, hantek_now_ns());
+}
+
+void hantek_settle_batch_sent(struct hantek_device *dev)
+{
+    uint64_t now = 0;
+
+    if (0 == dev->settle.pending) {
+        return;
+    }
+
+    now = hantek_now_ns();
+
+    for (size_t i = 0; i < HT_SETTLE_MAX; i++) {
+        if (0 != (dev->settle.pending & (1u << i))) {
+            _hantek_settle_start(dev, i, now);
+        }
+    }
+
+    dev->settle.pending = 0;
+}
+
+HRESULT hantek_set_settle_time(struct hantek_device *dev, enum hantek_settle_op op, unsigned settle_us)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(HT_SETTLE_MAX > op);
+
+    dev->settle.settle_us[op] = settle_us;
+
+    return ret;
+}
+
+HRESULT hantek_get_settle_time(struct hantek_device *dev, enum hantek_settle_op op, unsigned *psettle_us)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(HT_SETTLE_MAX > op);
+    HASSERT_ARG(NULL != psettle_us);
+
+    *psettle_us = dev->settle.settle_us[op];
+
+    return ret;
+}
+
+uint64_t hantek_settle_deadline(struct hantek_device *dev)
+{
+    uint64_t deadline = 0;
+
+    for (size_t i = 0; i < HT_SETTLE_MAX; i++) {
+        if (dev->settle.deadline_ns[i] > deadline) {
+            deadline = dev->settle.deadline_ns[i];
+        }
+    }
+
+    return deadline;
+}
+
+HRESULT hantek_wait_settled(struct hantek_device *dev)
+{
+    HRESULT ret = H_OK;
+
+    uint64_t deadline = 0;
+    struct timespec ts;
+
+    HASSERT_ARG(NULL != dev);
+
+    deadline = hantek_settle_deadline(dev);
+
+    if (deadline <= hantek_now_ns()) {
+        goto done;
+    }
+
+    ts.tv_sec = deadline / 1000000000ull;
+    ts.tv_nsec = deadline % 1000000000ull;
+
+    while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) {
+    }
+
+done:
+    return ret;
+}
+
+/**
+ * Capture, and get the mean of one channel's samples
+ */
+static
+HRESULT _hantek_settle_cal_capture(struct hantek_device *dev, unsigned chan, uint8_t *const *bufs, size_t chan_len, double *pmean)
+{
+    HRESULT ret = H_OK;
+
+    uint64_t sum = 0;
+
+    if (H_FAILED(ret = hantek_start_capture(dev, HT_CAPTURE_ROLL))) {
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_wait_ready(dev, HT_SETTLE_CAL_TIMEOUT_MS, NULL))) {
+        DEBUG("Calibration capture never completed");
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_retrieve_buffer(dev, bufs[0], bufs[1], bufs[2], bufs[3]))) {
+        goto done;
+    }
+
+    for (size_t i = 0; i < chan_len; i++) {
+        sum += bufs[chan][i];
+    }
+
+    *pmean = (double)sum / (double)chan_len;
+
+done:
+    return ret;
+}
+
+/**
+ * Apply a configuration, making sure the operation being calibrated actually happens
+ */
+static
+HRESULT _hantek_settle_cal_apply(struct hantek_device *dev, enum hantek_settle_op op, const struct hantek_capture_config *config)
+{
+    if (HT_SETTLE_ADC == op) {
+        /* The channel count is unchanged, so forget it to force the ADC through a power cycle */
+        dev->spi_shadow.hmcad1511_valid[HMCAD1511_REG_CHAN_NUM_CLK_DIV] = false;
+    }
+
+    return hantek_apply_config(dev, config);
+}
+
+/**
+ * Switch to the altered configuration, capture once op's settle time of trial_us has passed, then
+ * go back to the base configuration and let it settle fully
+ */
+static
+HRESULT _hantek_settle_cal_trial(struct hantek_device *dev, enum hantek_settle_op op, unsigned trial_us, unsigned safe_us,
+        const struct hantek_capture_config *base, const struct hantek_capture_config *alt, unsigned chan,
+        uint8_t *const *bufs, size_t chan_len, double *pmean)
+{
+    HRESULT ret = H_OK;
+
+    dev->settle.settle_us[op] = trial_us;
+
+    if (H_FAILED(ret = _hantek_settle_cal_apply(dev, op, alt))) {
+        goto done;
+    }
+
+    if (H_FAILED(ret = _hantek_settle_cal_capture(dev, chan, bufs, chan_len, pmean))) {
+        goto done;
+    }
+
+    dev->settle.settle_us[op] = safe_us;
+
+    if (H_FAILED(ret = _hantek_settle_cal_apply(dev, op, base))) {
+        goto done;
+    }
+
+    hantek_wait_settled(dev);
+
+done:
+    dev->settle.settle_us[op] = safe_us;
+    return ret;
+}
+
+HRESULT hantek_settle_calibrate(struct hantek_device *dev, enum hantek_settle_op op, unsigned *psettle_us)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_capture_config base,
+                                 alt;
+    uint8_t *data = NULL,
+            *bufs[HT_MAX_CHANNELS];
+    size_t chan_len = 0;
+    unsigned safe_us = 0,
+             lo = 0,
+             hi = 0,
+             result = 0,
+             chan = HT_MAX_CHANNELS;
+    double ref = 0.0,
+           mean = 0.0;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(HT_SETTLE_MAX > op);
+    HASSERT_ARG(NULL != psettle_us);
+
+    if (HT_SETTLE_RELAY_LOAD == op) {
+        DEBUG("The shift register load can't be seen in a capture, so can't be calibrated");
+        ret = H_ERR_BAD_ARGS;
+        goto done;
+    }
+
+    if (HT_ACQ_IDLE != dev->acq.state) {
+        ret = H_ERR_BUSY;
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_get_channel_buffer_len(dev, &chan_len))) {
+        DEBUG("ADC routing must be configured before calibrating");
+        goto done;
+    }
+
+    hantek_get_capture_config(dev, &base);
+
+    for (unsigned i = 0; i < HT_MAX_CHANNELS; i++) {
+        if (true == base.channels[i].enabled) {
+            chan = i;
+            break;
+        }
+    }
+
+    if (HT_MAX_CHANNELS == chan) {
+        ret = H_ERR_INVAL_CHANNELS;
+        goto done;
+    }
+
+    if (NULL == (data = hantek_malloc(HT_MAX_CHANNELS * chan_len))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        bufs[i] = data + i * chan_len;
+    }
+
+    /* Leave the trigger and capture length alone */
+    base.trigger_set = false;
+    base.capture_buffer_len = 0;
+    alt = base;
+
+    switch (op) {
+    case HT_SETTLE_RELAY:
+        alt.channels[chan].coupling = HT_COUPLING_AC == base.channels[chan].coupling ? HT_COUPLING_DC : HT_COUPLING_AC;
+        break;
+    case HT_SETTLE_POSITION:
+        alt.channels[chan].level = 128 > base.channels[chan].level ? base.channels[chan].level + 64 : base.channels[chan].level - 64;
+        break;
+    default:
+        /* The ADC is power cycled into the same configuration */
+        break;
+    }
+
+    safe_us = dev->settle.settle_us[op];
+
+    /* What the altered configuration looks like once it has fully settled */
+    if (H_FAILED(ret = _hantek_settle_cal_trial(dev, op, safe_us, safe_us, &base, &alt, chan, bufs, chan_len, &ref))) {
+        goto done;
+    }
+
+    DEBUG("Calibrating settle time %d: settled mean %.2f after %u us", (int)op, ref, safe_us);
+
+    /* Settled is assumed to only get more settled with time, so bisect between 0 and safe */
+    hi = safe_us;
+    lo = 0;
+
+    if (H_FAILED(ret = _hantek_settle_cal_trial(dev, op, 0, safe_us, &base, &alt, chan, bufs, chan_len, &mean))) {
+        goto done;
+    }
+
+    if (HT_SETTLE_CAL_TOLERANCE >= mean - ref && -HT_SETTLE_CAL_TOLERANCE <= mean - ref) {
+        hi = 0;
+    }
+
+    while (hi - lo > HT_SETTLE_CAL_RESOLUTION_US) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (H_FAILED(ret = _hantek_settle_cal_trial(dev, op, mid, safe_us, &base, &alt, chan, bufs, chan_len, &mean))) {
+            goto done;
+        }
+
+        DEBUG("  %u us: mean %.2f", mid, mean);
+
+        if (HT_SETTLE_CAL_TOLERANCE >= mean - ref && -HT_SETTLE_CAL_TOLERANCE <= mean - ref) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+
+    result = hi + hi * HT_SETTLE_CAL_MARGIN_PCT / 100;
+
+    if (result > safe_us) {
+        result = safe_us;
+    }
+
+    dev->settle.settle_us[op] = result;
+    *psettle_us = result;
+
+done:
+    hantek_free(data);
+    return ret;
+}
@@ -0,0 +1,1010 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+#include <hantek_usb.h>
+#include <hantek_transport.h>
+#include <hantek_sim.h>
+
+#include <hmcad1511.h>
+#include <adf4360.h>
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+
+/**
+ * Size of a single response packet from the FPGA, in USB 2.0 and USB 1.1 mode
+ */
+#define HT_SIM_PACKET_LEN           512
+#define HT_SIM_PACKET_LEN_USB1      0x40
+
+/**
+ * Record length assumed for acquisition timing until the first readback request
+ */
+#define HT_SIM_DEFAULT_RECORD_LEN   4096
+
+/**
+ * An asynchronous transfer waiting to be completed by the simulator
+ */
+struct hantek_sim_pending {
+    struct hantek_xfer *xfer;
+    struct hantek_sim_pending *next;
+    uint64_t due_ns;
+    bool queued;
+    bool cancelled;
+};
+
+struct hantek_sim {
+    struct hantek_transport tp;
+
+    struct hantek_sim_params params;
+    struct hantek_sim_stats stats;
+
+    /**
+     * Device identity, as served over the control endpoint
+     */
+    char id_string[HT_MAX_INFO_STRING_LEN];
+    uint16_t cal_data[HT_CALIBRATION_INFO_ENTRIES];
+    size_t flash_offset;
+
+    /**
+     * SPI targets
+     */
+    uint16_t hmcad1511_regs[256];
+    uint32_t adf4360_latches[4];
+    uint8_t shift_reg[HT_MAX_CHANNELS];
+    uint8_t shift_reg_latch;
+
+    /**
+     * Other FPGA state
+     */
+    uint16_t position[HT_MAX_CHANNELS];
+    uint32_t time_division;
+    bool sdram_ready;
+
+    /**
+     * Settling: when each input, and the ADC, is settled, and how far off each input was when the
+     * current capture started
+     */
+    uint64_t input_settle_start_ns[HT_MAX_CHANNELS];
+    uint64_t input_settled_ns[HT_MAX_CHANNELS];
+    uint64_t adc_settle_start_ns;
+    uint64_t adc_settled_ns;
+    unsigned settle_error[HT_MAX_CHANNELS];
+
+    /**
+     * Capture state
+     */
+    bool armed;
+    uint64_t trigger_ns;
+    uint64_t ready_ns;
+    size_t record_len;
+    unsigned nr_captures;
+
+    /**
+     * Capture memory, and one lookup table per synthetic waveform
+     */
+    uint8_t *memory;
+    uint8_t *wave[HT_MAX_CHANNELS];
+
+    /**
+     * Pending single-packet response
+     */
+    uint8_t packet[HT_SIM_PACKET_LEN];
+    bool packet_pending;
+
+    /**
+     * Pending readback stream
+     */
+    size_t stream_off;
+    size_t stream_left;
+    bool stream_active;
+
+    /**
+     * Asynchronous transfers, completed in submission order
+     */
+    struct hantek_sim_pending *head;
+    struct hantek_sim_pending *tail;
+    uint64_t busy_until_ns[2];
+
+    /**
+     * Fires when the oldest asynchronous transfer is due, for event loops
+     */
+    int timer_fd;
+
+    /**
+     * Where this simulated device is attached, unique to this instance
+     */
+    char location[64];
+};
+
+#define HT_SIM(_tp)                 ((struct hantek_sim *)(_tp))
+
+/**
+ * Simulated devices created so far by this process
+ */
+static
+_Atomic unsigned long _hantek_sim_nr_created;
+
+static
+void _hantek_sim_sleep_ns(uint64_t ns)
+{
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+
+    if (0 == ns) {
+        return;
+    }
+
+    while (0 != nanosleep(&ts, &ts));
+}
+
+/**
+ * Time the bus is busy moving len bytes
+ */
+static
+uint64_t _hantek_sim_wire_ns(struct hantek_sim *sim, size_t len)
+{
+    if (0 == sim->params.bytes_per_sec) {
+        return 0;
+    }
+
+    return ((uint64_t)len * 1000000000ull) / sim->params.bytes_per_sec;
+}
+
+/**
+ * Simulate the cost of a synchronous transfer
+ */
+static
+void _hantek_sim_delay(struct hantek_sim *sim, size_t len)
+{
+    _hantek_sim_sleep_ns((uint64_t)sim->params.latency_us * 1000ull + _hantek_sim_wire_ns(sim, len));
+}
+
+static
+void _hantek_sim_reset(struct hantek_sim *sim)
+{
+    memset(sim->hmcad1511_regs, 0, sizeof(sim->hmcad1511_regs));
+    memset(sim->adf4360_latches, 0, sizeof(sim->adf4360_latches));
+    memset(sim->shift_reg, 0, sizeof(sim->shift_reg));
+    memset(sim->position, 0, sizeof(sim->position));
+
+    sim->shift_reg_latch = 0;
+    sim->time_division = 0;
+    sim->armed = false;
+    sim->stream_active = false;
+    sim->stream_left = 0;
+
+    /* The FPGA version is the first thing we hand back after a reset */
+    memset(sim->packet, 0, sizeof(sim->packet));
+    sim->packet[0] = sim->params.fpga_version & 0xff;
+    sim->packet[1] = (sim->params.fpga_version >> 8) & 0xff;
+    sim->packet_pending = true;
+}
+
+/**
+ * Work out which input each of the four ADC cores samples, from the input select registers.
+ * Returns -1 for a core that is not routed to a valid input.
+ */
+static
+void _hantek_sim_core_inputs(struct hantek_sim *sim, int *inputs)
+{
+    uint16_t sel[4] = {
+        sim->hmcad1511_regs[HMCAD1511_REG_INP_SEL_CH_HI] >> 8,
+        sim->hmcad1511_regs[HMCAD1511_REG_INP_SEL_CH_HI] & 0xff,
+        sim->hmcad1511_regs[HMCAD1511_REG_INP_SEL_CH_LO] >> 8,
+        sim->hmcad1511_regs[HMCAD1511_REG_INP_SEL_CH_LO] & 0xff,
+    };
+
+    for (size_t i = 0; i < 4; i++) {
+        inputs[i] = -1;
+
+        for (int in = 0; in < HT_MAX_CHANNELS; in++) {
+            if (sel[i] == (0x2 << in)) {
+                inputs[i] = in;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Fill len bytes of capture memory, from offset start, with synthetic waveforms. The FPGA emits
+ * one byte per ADC core per frame, in core order. Cores sampling the same input are interleaved
+ * in time.
+ */
+static
+void _hantek_sim_fill_memory(struct hantek_sim *sim, size_t start, size_t len)
+{
+    int inputs[4];
+    size_t nr_cores[HT_MAX_CHANNELS] = { 0 },
+           rank[4] = { 0 };
+    unsigned phase = sim->nr_captures * 37,
+             sample = 0;
+
+    _hantek_sim_core_inputs(sim, inputs);
+
+    for (size_t i = 0; i < 4; i++) {
+        if (0 <= inputs[i]) {
+            rank[i] = nr_cores[inputs[i]]++;
+        }
+    }
+
+    for (size_t off = start; off < start + len; off++) {
+        size_t core = off & 3,
+               frame = off >> 2;
+        int in = inputs[core];
+        uint64_t t = 0;
+
+        if (0 > in) {
+            sim->memory[off] = 0x80;
+            continue;
+        }
+
+        t = frame * nr_cores[in] + rank[core] + phase;
+        sample = sim->wave[in][t % sim->params.wave_period[in]] + sim->settle_error[in];
+        sim->memory[off] = 255 < sample ? 255 : sample;
+    }
+}
+
+/**
+ * ADC clock divider, log2 of the number of streams the record is shared between
+ */
+static
+unsigned _hantek_sim_clk_div(struct hantek_sim *sim)
+{
+    return (sim->hmcad1511_regs[HMCAD1511_REG_CHAN_NUM_CLK_DIV] >> 8) & 0x3;
+}
+
+/**
+ * ADF4360 N counter, which sets the ADC clock. Until the N latch is written, the clock is assumed
+ * to be the usual 1 GHz.
+ */
+static
+uint64_t _hantek_sim_pll_n(struct hantek_sim *sim)
+{
+    uint32_t latch = sim->adf4360_latches[ADF4360_LATCH_N_COUNTER];
+
+    /* The prescaler is left at 8/9 */
+    uint64_t n = 8 * ((latch >> ADF4360_N_B_SHIFT) & ADF4360_N_B_MASK) + ((latch >> ADF4360_N_A_SHIFT) & ADF4360_N_A_MASK);
+
+    return 0 != n ? n : HT_ADF4360_N_DEFAULT;
+}
+
+/**
+ * How long a capture takes in nanoseconds, taking the ADC clock and its divider into account
+ */
+static
+uint64_t _hantek_sim_capture_ns(struct hantek_sim *sim)
+{
+    uint64_t period_clocks = ((uint64_t)sim->time_division + 1) << _hantek_sim_clk_div(sim);
+
+    return period_clocks * (sim->record_len >> _hantek_sim_clk_div(sim)) * HT_ADF4360_N_DEFAULT / _hantek_sim_pll_n(sim);
+}
+
+static
+uint8_t _hantek_sim_status(struct hantek_sim *sim)
+{
+    uint64_t now = hantek_now_ns();
+    uint8_t status = 0;
+
+    if (true == sim->sdram_ready) {
+        status |= HT_STATUS_SDRAM_INIT;
+    }
+
+    if (true == sim->armed && now >= sim->trigger_ns) {
+        status |= HT_STATUS_TRIGGERED;
+    }
+
+    if (true == sim->armed && now >= sim->ready_ns) {
+        status |= HT_STATUS_DATA_READY | HT_STATUS_PACK_STATE;
+    }
+
+    return status;
+}
+
+static
+void _hantek_sim_queue_packet(struct hantek_sim *sim, const void *data, size_t len)
+{
+    memset(sim->packet, 0, sizeof(sim->packet));
+    memcpy(sim->packet, data, len);
+    sim->packet_pending = true;
+}
+
+/**
+ * Start something settling, for settle_us from now
+ */
+static
+void _hantek_sim_settle(uint64_t *pstart_ns, uint64_t *psettled_ns, unsigned settle_us)
+{
+    uint64_t now = hantek_now_ns();
+
+    *pstart_ns = now;
+    *psettled_ns = now + (uint64_t)settle_us * 1000ull;
+}
+
+/**
+ * How far off something still settling is, in ADC counts. It settles linearly.
+ */
+static
+unsigned _hantek_sim_settle_error(uint64_t now, uint64_t start_ns, uint64_t settled_ns)
+{
+    if (now >= settled_ns) {
+        return 0;
+    }
+
+    return (unsigned)(HT_SIM_SETTLE_ERROR * (settled_ns - now) / (settled_ns - start_ns));
+}
+
+static
+void _hantek_sim_spi_write(struct hantek_sim *sim, const uint8_t *msg)
+{
+    sim->stats.nr_spi_writes++;
+
+    switch (msg[6]) {
+    case HT_SPI_CS_HMCAD1511:
+        if (HMCAD1511_REG_SLEEP_PD == msg[5] && 0 != (sim->hmcad1511_regs[msg[5]] & HMCAD1511_REG_SLEEP_PD_PD) &&
+                0 == (((uint16_t)msg[4] << 8 | msg[3]) & HMCAD1511_REG_SLEEP_PD_PD))
+        {
+            /* Powering back up */
+            _hantek_sim_settle(&sim->adc_settle_start_ns, &sim->adc_settled_ns, sim->params.adc_settle_us);
+        }
+
+        sim->hmcad1511_regs[msg[5]] = (uint16_t)msg[4] << 8 | msg[3];
+
+        if (HMCAD1511_REG_RST == msg[5] && (msg[3] & HMCAD1511_REG_RST_RST)) {
+            memset(sim->hmcad1511_regs, 0, sizeof(sim->hmcad1511_regs));
+        }
+        break;
+    case HT_SPI_CS_ADF4360: {
+        uint32_t latch = (uint32_t)msg[5] << 16 | (uint32_t)msg[4] << 8 | msg[3];
+        sim->adf4360_latches[latch & 0x3] = latch;
+        break;
+    }
+    case HT_SPI_CS_SHIFT_REG:
+        memcpy(sim->shift_reg, &msg[2], HT_MAX_CHANNELS);
+        sim->shift_reg_latch = msg[7];
+
+        if (0 != sim->shift_reg_latch) {
+            for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+                _hantek_sim_settle(&sim->input_settle_start_ns[i], &sim->input_settled_ns[i], sim->params.relay_settle_us);
+            }
+        }
+        break;
+    default:
+        DEBUG("SIM: SPI write to unknown chip select %02x", msg[6]);
+        break;
+    }
+}
+
+/**
+ * Act on a command written to the bulk OUT endpoint
+ */
+static
+void _hantek_sim_handle_cmd(struct hantek_sim *sim, const uint8_t *msg, size_t len)
+{
+    uint64_t now = hantek_now_ns();
+
+    sim->stats.nr_bulk_out++;
+    sim->stats.bytes_out += len;
+
+    if (2 > len) {
+        DEBUG("SIM: runt command of %zu bytes", len);
+        return;
+    }
+
+    switch (msg[0]) {
+    case HT_MSG_INITIALIZE:
+        _hantek_sim_reset(sim);
+
+        /* The FPGA only initializes the capture SDRAM once it has been told to */
+        sim->sdram_ready = true;
+        break;
+    case HT_MSG_GET_HW_VERSION: {
+        uint8_t rev[4] = {
+            sim->params.hardware_rev & 0xff,
+            (sim->params.hardware_rev >> 8) & 0xff,
+            (sim->params.hardware_rev >> 16) & 0xff,
+            (sim->params.hardware_rev >> 24) & 0xff,
+        };
+        _hantek_sim_queue_packet(sim, rev, sizeof(rev));
+        break;
+    }
+    case HT_MSG_GET_STATUS: {
+        uint8_t status = _hantek_sim_status(sim);
+        _hantek_sim_queue_packet(sim, &status, 1);
+        break;
+    }
+    case HT_MSG_BUFFER_STATUS: {
+        /* Trigger point within the record, in samples */
+        uint64_t trig = sim->record_len >> 1;
+        uint8_t word[5] = { trig & 0xff, (trig >> 8) & 0xff, (trig >> 16) & 0xff, (trig >> 24) & 0xff, (trig >> 32) & 0xff };
+        _hantek_sim_queue_packet(sim, word, sizeof(word));
+        break;
+    }
+    case HT_MSG_SEND_SPI:
+        if (8 <= len) {
+            _hantek_sim_spi_write(sim, msg);
+        }
+        break;
+    case HT_MSG_POSITION_CH0:
+    case HT_MSG_POSITION_CH1:
+    case HT_MSG_POSITION_CH2:
+    case HT_MSG_POSITION_CH3: {
+        size_t ch = HT_MSG_POSITION_CH3 == msg[0] ? 3 : msg[0];
+        if (4 <= len) {
+            sim->position[ch] = (uint16_t)msg[3] << 8 | msg[2];
+
+            /* Don't cut short a relay switch still settling */
+            if (now + (uint64_t)sim->params.position_settle_us * 1000ull > sim->input_settled_ns[ch]) {
+                _hantek_sim_settle(&sim->input_settle_start_ns[ch], &sim->input_settled_ns[ch], sim->params.position_settle_us);
+            }
+        }
+        break;
+    }
+    case HT_MSG_SET_TIME_DIVISION:
+        if (6 <= len) {
+            sim->time_division = (uint32_t)msg[5] << 24 | (uint32_t)msg[4] << 16 | (uint32_t)msg[3] << 8 | msg[2];
+        }
+        break;
+    case HT_MSG_SEND_START_CAPTURE:
+        if (true == sim->params.arm_aborts_readback && true == sim->stream_active) {
+            /* The rest of the stream is lost, it ends at the next packet boundary */
+            sim->stream_left = 0;
+        }
+
+        sim->armed = true;
+        sim->nr_captures++;
+
+        for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+            unsigned adc_error = _hantek_sim_settle_error(now, sim->adc_settle_start_ns, sim->adc_settled_ns);
+
+            sim->settle_error[i] = _hantek_sim_settle_error(now, sim->input_settle_start_ns[i], sim->input_settled_ns[i]);
+
+            if (adc_error > sim->settle_error[i]) {
+                sim->settle_error[i] = adc_error;
+            }
+        }
+        sim->trigger_ns = now + (uint64_t)sim->params.trigger_delay_us * 1000ull;
+        sim->ready_ns = sim->trigger_ns + _hantek_sim_capture_ns(sim);
+        break;
+    case HT_MSG_BUFFER_PREPARE_TRANSFER:
+        sim->stream_active = false;
+        sim->stream_off = 0;
+        break;
+    case HT_MSG_READBACK_BUFFER: {
+        /* Each request streams the next part of the record, following on from the last */
+        size_t req = 4 <= len ? ((size_t)msg[3] << 8 | msg[2]) << 1 : 0;
+
+        if (req > sim->params.memory_len - sim->stream_off) {
+            req = sim->params.memory_len - sim->stream_off;
+        }
+
+        sim->record_len = sim->stream_off + req;
+        _hantek_sim_fill_memory(sim, sim->stream_off, req);
+
+        sim->stream_left = req;
+        sim->stream_active = true;
+        break;
+    }
+    default:
+        /* Trigger configuration and friends have no visible effect on the simulation */
+        break;
+    }
+}
+
+/**
+ * Serve data on the bulk IN endpoint. Returns false if the device has nothing to say, in which
+ * case a real device would NAK until the host gives up.
+ */
+static
+bool _hantek_sim_read_in(struct hantek_sim *sim, uint8_t *buf, size_t len, size_t *pactual)
+{
+    size_t pkt_len = true == sim->params.usb1 ? HT_SIM_PACKET_LEN_USB1 : HT_SIM_PACKET_LEN;
+
+    *pactual = 0;
+
+    if (true == sim->packet_pending) {
+        *pactual = len < pkt_len ? len : pkt_len;
+        memcpy(buf, sim->packet, *pactual);
+        sim->packet_pending = false;
+    } else if (true == sim->stream_active) {
+        /* An exhausted stream ends with a zero length packet */
+        *pactual = len < sim->stream_left ? len : sim->stream_left;
+        memcpy(buf, sim->memory + sim->stream_off, *pactual);
+        sim->stream_off += *pactual;
+        sim->stream_left -= *pactual;
+
+        if (0 == *pactual) {
+            sim->stream_active = false;
+        }
+    } else {
+        return false;
+    }
+
+    sim->stats.nr_bulk_in++;
+    sim->stats.bytes_in += *pactual;
+
+    return true;
+}
+
+static
+HRESULT _hantek_sim_control_in(struct hantek_transport *tp, uint8_t request, uint16_t value, uint16_t index, uint8_t *buf, size_t len, size_t *ptransferred)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_sim *sim = HT_SIM(tp);
+    const uint8_t *src = NULL;
+    size_t src_len = 0;
+
+    *ptransferred = 0;
+
+    _hantek_sim_delay(sim, len);
+    sim->stats.nr_control_in++;
+
+    switch (request) {
+    case HT_REQUEST_CHECK_READY:
+        memset(buf, 0, len);
+        buf[0] = true == sim->params.usb1 ? 0x0 : 0x1;
+        *ptransferred = len;
+        goto done;
+    case HT_REQUEST_GET_INFO:
+        if (HT_VALUE_GET_INFO_STRING == value) {
+            src = (const uint8_t *)sim->id_string;
+            src_len = sizeof(sim->id_string);
+        } else if (HT_VALUE_GET_CALIBRATION_DAT == value) {
+            src = (const uint8_t *)sim->cal_data;
+            src_len = sizeof(sim->cal_data);
+        }
+        break;
+    case HT_REQUEST_BITSTREAM_FLASH_ACCESS:
+        /* An erased flash */
+        memset(buf, 0xff, len);
+        sim->flash_offset += len;
+        *ptransferred = len;
+        goto done;
+    default:
+        break;
+    }
+
+    if (NULL == src || index >= src_len) {
+        DEBUG("SIM: unsupported control IN request %02x (value = %04x, index = %04x)", request, value, index);
+        ret = H_ERR_CONTROL_FAIL;
+        goto done;
+    }
+
+    /* wIndex is the byte offset into the attribute */
+    *ptransferred = src_len - index < len ? src_len - index : len;
+    memcpy(buf, src + index, *ptransferred);
+
+done:
+    sim->stats.bytes_in += *ptransferred;
+    return ret;
+}
+
+static
+HRESULT _hantek_sim_control_out(struct hantek_transport *tp, uint8_t request, uint16_t value, uint16_t index, const uint8_t *buf, size_t len)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_sim *sim = HT_SIM(tp);
+
+    (void)value;
+    (void)index;
+    (void)buf;
+
+    _hantek_sim_delay(sim, len);
+    sim->stats.nr_control_out++;
+    sim->stats.bytes_out += len;
+
+    if (HT_REQUEST_INITIALIZE != request) {
+        DEBUG("SIM: unsupported control OUT request %02x", request);
+        ret = H_ERR_CONTROL_FAIL;
+    }
+
+    return ret;
+}
+
+static
+HRESULT _hantek_sim_bulk_in(struct hantek_transport *tp, uint8_t endpoint, uint8_t *buf, size_t len, size_t *ptransferred, unsigned timeout_ms)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_sim *sim = HT_SIM(tp);
+
+    (void)endpoint;
+    (void)timeout_ms;
+
+    _hantek_sim_delay(sim, len);
+
+    if (false == _hantek_sim_read_in(sim, buf, len, ptransferred)) {
+        DEBUG("SIM: bulk IN with nothing to send, the real device would stall here");
+        ret = H_ERR_NOT_READY;
+    }
+
+    return ret;
+}
+
+static
+HRESULT _hantek_sim_bulk_out(struct hantek_transport *tp, uint8_t endpoint, const uint8_t *buf, size_t len, size_t *ptransferred, unsigned timeout_ms)
+{
+    struct hantek_sim *sim = HT_SIM(tp);
+
+    (void)endpoint;
+    (void)timeout_ms;
+
+    _hantek_sim_delay(sim, len);
+    _hantek_sim_handle_cmd(sim, buf, len);
+
+    *ptransferred = len;
+
+    return H_OK;
+}
+
+static
+HRESULT _hantek_sim_xfer_init(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_sim_pending *pend = NULL;
+
+    (void)tp;
+
+    if (NULL == (pend = hantek_calloc(1, sizeof(*pend)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    pend->xfer = xfer;
+    xfer->tp_priv = pend;
+
+done:
+    return ret;
+}
+
+static
+void _hantek_sim_xfer_release(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    (void)tp;
+
+    hantek_free(xfer->tp_priv);
+    xfer->tp_priv = NULL;
+}
+
+/**
+ * Arm the timer for the oldest pending transfer, or disarm it if there is none
+ */
+static
+void _hantek_sim_arm_timer(struct hantek_sim *sim)
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+    uint64_t due = 0;
+
+    if (NULL != sim->head) {
+        /* A zero expiry disarms the timer, so cancelled transfers are due right away */
+        due = true == sim->head->cancelled ? 1 : sim->head->due_ns;
+        its.it_value.tv_sec = due / 1000000000ull;
+        its.it_value.tv_nsec = due % 1000000000ull;
+    }
+
+    timerfd_settime(sim->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static
+HRESULT _hantek_sim_submit(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_sim *sim = HT_SIM(tp);
+    struct hantek_sim_pending *pend = xfer->tp_priv;
+    uint64_t now = hantek_now_ns(),
+             start = 0;
+    size_t dir = !!(xfer->endpoint & (1 << 7));
+
+    HASSERT_ARG(false == pend->queued);
+
+    /* Latency overlaps with transfers already in flight, the wire time does not */
+    start = now + (uint64_t)sim->params.latency_us * 1000ull;
+    if (start < sim->busy_until_ns[dir]) {
+        start = sim->busy_until_ns[dir];
+    }
+
+    pend->due_ns = start + _hantek_sim_wire_ns(sim, xfer->len);
+    pend->cancelled = false;
+    pend->queued = true;
+    pend->next = NULL;
+    sim->busy_until_ns[dir] = pend->due_ns;
+
+    xfer->actual = 0;
+
+    if (NULL == sim->tail) {
+        sim->head = sim->tail = pend;
+    } else {
+        sim->tail->next = pend;
+        sim->tail = pend;
+    }
+
+    if (sim->head == pend) {
+        _hantek_sim_arm_timer(sim);
+    }
+
+    return ret;
+}
+
+static
+HRESULT _hantek_sim_cancel(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    struct hantek_sim *sim = HT_SIM(tp);
+    struct hantek_sim_pending *pend = xfer->tp_priv;
+
+    if (true == pend->queued) {
+        pend->cancelled = true;
+
+        if (sim->head == pend) {
+            _hantek_sim_arm_timer(sim);
+        }
+    }
+
+    return H_OK;
+}
+
+static
+void _hantek_sim_complete(struct hantek_sim *sim, struct hantek_sim_pending *pend)
+{
+    struct hantek_xfer *xfer = pend->xfer;
+
+    pend->queued = false;
+
+    if (true == pend->cancelled) {
+        xfer->status = HT_XFER_CANCELLED;
+    } else if (xfer->endpoint & (1 << 7)) {
+        xfer->status = true == _hantek_sim_read_in(sim, xfer->buf, xfer->len, &xfer->actual) ?
+            HT_XFER_COMPLETED : HT_XFER_TIMED_OUT;
+    } else {
+        _hantek_sim_handle_cmd(sim, xfer->buf, xfer->len);
+        xfer->actual = xfer->len;
+        xfer->status = HT_XFER_COMPLETED;
+    }
+
+    xfer->cb(xfer);
+}
+
+static
+HRESULT _hantek_sim_handle_events(struct hantek_transport *tp, unsigned timeout_ms)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_sim *sim = HT_SIM(tp);
+    struct hantek_sim_pending *pend = NULL;
+    uint64_t now = hantek_now_ns(),
+             deadline = now + (uint64_t)timeout_ms * 1000000ull,
+             expiries = 0;
+
+    if (NULL == sim->head) {
+        goto done;
+    }
+
+    /* Wait for the oldest transfer, unless it was cancelled */
+    if (false == sim->head->cancelled && sim->head->due_ns > now) {
+        _hantek_sim_sleep_ns((sim->head->due_ns < deadline ? sim->head->due_ns : deadline) - now);
+        now = hantek_now_ns();
+    }
+
+    /* Complete everything that is due, in order. Callbacks may submit more. */
+    while (NULL != (pend = sim->head) && (true == pend->cancelled || pend->due_ns <= now)) {
+        sim->head = pend->next;
+        if (NULL == sim->head) {
+            sim->tail = NULL;
+        }
+
+        _hantek_sim_complete(sim, pend);
+    }
+
+done:
+    /* Drain any expiry, and re-arm for whatever is now oldest */
+    while (0 < read(sim->timer_fd, &expiries, sizeof(expiries)));
+    _hantek_sim_arm_timer(sim);
+    return ret;
+}
+
+static
+HRESULT _hantek_sim_get_pollfds(struct hantek_transport *tp, struct hantek_pollfd *fds, size_t max_fds, size_t *pnr_fds)
+{
+    if (0 < max_fds) {
+        fds[0].fd = HT_SIM(tp)->timer_fd;
+        fds[0].events = POLLIN;
+    }
+
+    *pnr_fds = 1;
+
+    return H_OK;
+}
+
+static
+HRESULT _hantek_sim_get_timeout(struct hantek_transport *tp, int *ptimeout_ms)
+{
+    (void)tp;
+
+    /* The timer covers it */
+    *ptimeout_ms = -1;
+
+    return H_OK;
+}
+
+static
+HRESULT _hantek_sim_get_location(struct hantek_transport *tp, char *buf, size_t len)
+{
+    /* Each simulated device is attached for as long as its transport lives */
+    snprintf(buf, len, "%s", HT_SIM(tp)->location);
+
+    return H_OK;
+}
+
+static
+void _hantek_sim_close(struct hantek_transport *tp)
+{
+    struct hantek_sim *sim = HT_SIM(tp);
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        hantek_free(sim->wave[i]);
+    }
+
+    if (0 <= sim->timer_fd) {
+        close(sim->timer_fd);
+    }
+
+    hantek_free(sim->memory);
+    hantek_free(sim);
+}
+
+static const
+struct hantek_transport_ops _hantek_sim_transport_ops = {
+    .control_in = _hantek_sim_control_in,
+    .control_out = _hantek_sim_control_out,
+    .bulk_in = _hantek_sim_bulk_in,
+    .bulk_out = _hantek_sim_bulk_out,
+    .xfer_init = _hantek_sim_xfer_init,
+    .xfer_release = _hantek_sim_xfer_release,
+    .submit = _hantek_sim_submit,
+    .cancel = _hantek_sim_cancel,
+    .handle_events = _hantek_sim_handle_events,
+    .get_pollfds = _hantek_sim_get_pollfds,
+    .get_timeout = _hantek_sim_get_timeout,
+    .get_location = _hantek_sim_get_location,
+    .close = _hantek_sim_close,
+};
+
+void hantek_sim_default_params(struct hantek_sim_params *params)
+{
+    if (NULL == params) {
+        return;
+    }
+
+    memset(params, 0, sizeof(*params));
+
+    /* One microframe of latency, and about what a good USB 2.0 host manages for bulk */
+    params->latency_us = 125;
+    params->bytes_per_sec = 40 * 1000 * 1000;
+    params->trigger_delay_us = 1000;
+    params->relay_settle_us = 30000;
+    params->position_settle_us = 5000;
+    params->adc_settle_us = 500;
+    params->memory_len = 4 * 1024 * 1024;
+
+    params->fpga_version = 0x0706;
+    params->hardware_rev = 0x01000000;
+    params->pcb_revision = 105;
+    strcpy(params->serial_number, "SIM00001");
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        params->wave_period[i] = 100 << i;
+        params->wave_amplitude[i] = 100 - 20 * i;
+    }
+}
+
+HRESULT hantek_sim_transport_create(struct hantek_transport **ptp, const struct hantek_sim_params *params)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_sim *sim = NULL;
+    uint16_t *line = NULL;
+
+    HASSERT_ARG(NULL != ptp);
+
+    *ptp = NULL;
+
+    if (NULL == (sim = hantek_calloc(1, sizeof(*sim)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    sim->tp.ops = &_hantek_sim_transport_ops;
+
+    /* Nothing like a heap address, which the next process may well get again */
+    snprintf(sim->location, sizeof(sim->location), "sim-%ld-%lu-%llu", (long)getpid(),
+            atomic_fetch_add(&_hantek_sim_nr_created, 1), (unsigned long long)hantek_now_ns());
+
+    if (0 > (sim->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))) {
+        DEBUG("SIM: failed to create timer");
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    if (NULL != params) {
+        sim->params = *params;
+    } else {
+        hantek_sim_default_params(&sim->params);
+    }
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        if (0 == sim->params.wave_period[i]) {
+            DEBUG("SIM: waveform period for input %zu must be non-zero", i);
+            ret = H_ERR_BAD_ARGS;
+            goto done;
+        }
+    }
+
+    if (NULL == (sim->memory = hantek_calloc(1, sim->params.memory_len))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    /* One period of a sine per input */
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        unsigned period = sim->params.wave_period[i];
+
+        if (NULL == (sim->wave[i] = hantek_malloc(period))) {
+            ret = H_ERR_NO_MEM;
+            goto done;
+        }
+
+        for (unsigned t = 0; t < period; t++) {
+            sim->wave[i][t] = (uint8_t)lround(128.0 + sim->params.wave_amplitude[i] * sin(2.0 * M_PI * t / period));
+        }
+    }
+
+    /* Laid out the way hantek_open_device parses it: PCB revision at 14, serial at 20 */
+    snprintf(sim->id_string, sizeof(sim->id_string), "HANTEK 6254BD %05u %.8s",
+            sim->params.pcb_revision % 100000, sim->params.serial_number);
+
+    /* Calibration lines bracketing mid-scale, with the validity flag at the end */
+    for (size_t ch = 0; ch < HT_MAX_CHANNELS; ch++) {
+        line = &sim->cal_data[ch * 144];
+        for (size_t i = 0; i < 144; i += 2) {
+            line[i] = 0x1000 + ch * 0x10;
+            line[i + 1] = 0x3000 + ch * 0x10;
+        }
+    }
+    sim->cal_data[HT_CALIBRATION_INFO_ENTRIES - 1] = HT_CALIBRATION_NONZERO_FLAG;
+
+    sim->record_len = HT_SIM_DEFAULT_RECORD_LEN;
+
+    _hantek_sim_reset(sim);
+    sim->packet_pending = false;
+
+    *ptp = &sim->tp;
+
+done:
+    if (H_FAILED(ret) && NULL != sim) {
+        _hantek_sim_close(&sim->tp);
+    }
+    return ret;
+}
+
+HRESULT hantek_sim_get_stats(struct hantek_transport *tp, struct hantek_sim_stats *pstats)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != tp);
+    HASSERT_ARG(NULL != pstats);
+    HASSERT_ARG(&_hantek_sim_transport_ops == tp->ops);
+
+    *pstats = HT_SIM(tp)->stats;
+
+    return ret;
+}
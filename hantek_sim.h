@@ -0,0 +1,103 @@
+#pragma once
+
+#include <hantek.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * A simulated 6254BD, for exercising and benchmarking the library without hardware.
+ */
+
+struct hantek_transport;
+
+/**
+ * Most a simulated input is off by while it settles, in ADC counts
+ */
+#define HT_SIM_SETTLE_ERROR                 64
+
+struct hantek_sim_params {
+    /**
+     * Latency of each transfer, in microseconds
+     */
+    unsigned latency_us;
+
+    /**
+     * Bus throughput, in bytes per second. 0 means infinitely fast.
+     */
+    uint64_t bytes_per_sec;
+
+    /**
+     * Time from arming a capture to the trigger firing, in microseconds
+     */
+    unsigned trigger_delay_us;
+
+    /**
+     * Size of the simulated capture memory, in bytes
+     */
+    size_t memory_len;
+
+    /**
+     * Identity of the simulated device
+     */
+    uint16_t fpga_version;
+    uint32_t hardware_rev;
+    unsigned pcb_revision;
+    char serial_number[9];
+
+    /**
+     * Whether the device claims to be in USB 1.1 mode
+     */
+    bool usb1;
+
+    /**
+     * Whether arming a capture cuts short a readback in progress, as an FPGA that can't arm
+     * during readback would
+     */
+    bool arm_aborts_readback;
+
+    /**
+     * How long, in microseconds, the inputs take to settle after the relays switch or a position
+     * DAC changes, and the ADC after powering up. Capturing before then gives samples that are
+     * still off by up to HT_SIM_SETTLE_ERROR counts.
+     */
+    unsigned relay_settle_us;
+    unsigned position_settle_us;
+    unsigned adc_settle_us;
+
+    /**
+     * Synthetic waveform per input: period in samples, and amplitude in ADC counts
+     */
+    unsigned wave_period[4];
+    uint8_t wave_amplitude[4];
+};
+
+/**
+ * Statistics on the traffic the simulated device has seen
+ */
+struct hantek_sim_stats {
+    uint64_t nr_control_in;
+    uint64_t nr_control_out;
+    uint64_t nr_bulk_in;
+    uint64_t nr_bulk_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t nr_spi_writes;
+};
+
+/**
+ * Fill in the default simulation parameters
+ */
+void hantek_sim_default_params(struct hantek_sim_params *params);
+
+/**
+ * Create a transport backed by a simulated 6254BD. Pass NULL for params to use the defaults.
+ * The transport can then be handed to hantek_open_device_on.
+ */
+HRESULT hantek_sim_transport_create(struct hantek_transport **ptp, const struct hantek_sim_params *params);
+
+/**
+ * Get statistics from a simulated transport
+ */
+HRESULT hantek_sim_get_stats(struct hantek_transport *tp, struct hantek_sim_stats *pstats);
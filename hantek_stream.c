@@ -0,0 +1,454 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+#include <hantek_acquire.h>
+#include <hantek_stream.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+/**
+ * Number of captures in a row that may fail before the streaming thread gives up
+ */
+#define HT_STREAM_MAX_FAILURES              8
+
+struct hantek_stream {
+    struct hantek_device *dev;
+    enum hantek_capture_mode mode;
+
+    /**
+     * The ring: nr_blocks blocks of block_len bytes, back to back in one buffer, and each
+     * block's metadata, written by the producer before it publishes the block
+     */
+    struct hantek_buffer *ring_buf;
+    uint8_t *ring;
+    size_t block_len;
+    size_t nr_blocks;
+    struct hantek_stream_block *blocks;
+
+    /**
+     * Where captures go while the ring is full
+     */
+    uint8_t *discard;
+
+    /**
+     * Blocks ever published, and blocks ever released. head is only written by the streaming
+     * thread, tail only by the consumer. Each is kept on its own cache line.
+     */
+    _Alignas(64) _Atomic uint64_t head;
+    _Alignas(64) _Atomic uint64_t tail;
+
+    /**
+     * Signalled by the streaming thread when blocks are published or it stops
+     */
+    _Alignas(64) int event_fd;
+
+    /**
+     * Signalled by hantek_stream_stop to wake the streaming thread
+     */
+    int wake_fd;
+
+    pthread_t thread;
+    bool started;
+    _Atomic bool stop;
+
+    /**
+     * The acquisition in progress, only touched by the streaming thread
+     */
+    HRESULT acq_result;
+    size_t acq_bytes;
+
+    /**
+     * Statistics, updated by the streaming thread
+     */
+    _Atomic uint64_t nr_published;
+    _Atomic uint64_t nr_dropped;
+    _Atomic uint64_t nr_errors;
+    _Atomic HRESULT result;
+    _Atomic bool running;
+};
+
+static
+void _hantek_stream_signal(int fd)
+{
+    uint64_t one = 1;
+
+    if (sizeof(one) != write(fd, &one, sizeof(one))) {
+        DEBUG("Failed to signal stream event: %s (%d)", strerror(errno), errno);
+    }
+}
+
+static
+void _hantek_stream_drain(int fd)
+{
+    uint64_t count = 0;
+
+    /* Non-blocking, so this just fails with EAGAIN if nothing was signalled */
+    if (sizeof(count) != read(fd, &count, sizeof(count)) && EAGAIN != errno) {
+        DEBUG("Failed to drain stream event: %s (%d)", strerror(errno), errno);
+    }
+}
+
+static
+void _hantek_stream_acquire_done(struct hantek_device *dev, HRESULT result, size_t nr_bytes, void *priv)
+{
+    struct hantek_stream *st = priv;
+
+    (void)dev;
+
+    st->acq_result = result;
+    st->acq_bytes = nr_bytes;
+}
+
+/**
+ * Run one acquisition into dst, driving the device's events until it completes, and note its
+ * length and timing in blk. A stop request cancels the acquisition.
+ */
+static
+HRESULT _hantek_stream_capture(struct hantek_stream *st, uint8_t *dst, struct hantek_stream_block *blk)
+{
+    HRESULT ret = H_OK;
+
+    if (H_FAILED(ret = hantek_acquire_start(st->dev, st->mode, dst, st->block_len, _hantek_stream_acquire_done, st))) {
+        DEBUG("Failed to start streaming acquisition");
+        goto done;
+    }
+
+    hantek_run_until_idle(st->dev, st->wake_fd, &st->stop);
+
+    ret = st->acq_result;
+    blk->len = st->acq_bytes;
+    blk->armed_ns = st->dev->acq.armed_ns;
+    blk->ready_ns = st->dev->acq.ready_ns;
+    blk->done_ns = hantek_now_ns();
+
+done:
+    return ret;
+}
+
+static
+void *_hantek_stream_thread(void *arg)
+{
+    struct hantek_stream *st = arg;
+    HRESULT ret = H_OK;
+    uint64_t seq = atomic_load(&st->nr_published) + atomic_load(&st->nr_dropped),
+             pending_dropped = 0;
+    unsigned nr_failures = 0;
+
+    while (false == atomic_load(&st->stop)) {
+        uint64_t head = atomic_load_explicit(&st->head, memory_order_relaxed),
+                 tail = atomic_load_explicit(&st->tail, memory_order_acquire);
+        bool full = (head - tail >= st->nr_blocks);
+        size_t idx = head & (st->nr_blocks - 1);
+        uint8_t *dst = true == full ? st->discard : st->ring + idx * st->block_len;
+        struct hantek_stream_block discard_blk,
+                                   *blk = true == full ? &discard_blk : &st->blocks[idx];
+
+        ret = _hantek_stream_capture(st, dst, blk);
+
+        if (H_FAILED(ret) && true == atomic_load(&st->stop)) {
+            /* Stopped on purpose, the capture was cancelled */
+            ret = H_OK;
+            break;
+        }
+
+        if (H_FAILED(ret)) {
+            DEBUG("Streaming capture %lu failed, result = %08x", (unsigned long)seq, (unsigned)ret);
+            atomic_fetch_add(&st->nr_errors, 1);
+            atomic_fetch_add(&st->nr_dropped, 1);
+            pending_dropped++;
+            seq++;
+
+            if (HT_STREAM_MAX_FAILURES <= ++nr_failures) {
+                DEBUG("Too many failed captures in a row, stopping stream");
+                break;
+            }
+
+            continue;
+        }
+
+        nr_failures = 0;
+
+        if (true == full) {
+            /* The consumer is behind, this capture is lost */
+            atomic_fetch_add(&st->nr_dropped, 1);
+            pending_dropped++;
+            seq++;
+            continue;
+        }
+
+        blk->seq = seq++;
+        blk->nr_dropped = pending_dropped;
+        pending_dropped = 0;
+
+        /* Publish the block: everything written above is visible before the new head */
+        atomic_store_explicit(&st->head, head + 1, memory_order_release);
+        atomic_fetch_add(&st->nr_published, 1);
+
+        _hantek_stream_signal(st->event_fd);
+    }
+
+    atomic_store(&st->result, ret);
+    atomic_store(&st->running, false);
+    _hantek_stream_signal(st->event_fd);
+
+    return NULL;
+}
+
+HRESULT hantek_stream_create(struct hantek_device *dev, enum hantek_capture_mode mode, size_t nr_blocks, struct hantek_stream **pstream)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_stream *st = NULL;
+    size_t data_len = 0;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(1 < nr_blocks && 0 == (nr_blocks & (nr_blocks - 1)));
+    HASSERT_ARG(NULL != pstream);
+
+    *pstream = NULL;
+
+    /* Aligned, so head and tail really do land on cache lines of their own */
+    if (0 != hantek_memalign((void **)&st, 64, sizeof(*st))) {
+        st = NULL;
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    memset(st, 0, sizeof(*st));
+
+    st->dev = dev;
+    st->mode = mode;
+    st->block_len = dev->capture_buffer_len;
+    st->nr_blocks = nr_blocks;
+    st->event_fd = -1;
+    st->wake_fd = -1;
+
+    atomic_init(&st->head, 0);
+    atomic_init(&st->tail, 0);
+    atomic_init(&st->stop, false);
+    atomic_init(&st->nr_published, 0);
+    atomic_init(&st->nr_dropped, 0);
+    atomic_init(&st->nr_errors, 0);
+    atomic_init(&st->result, H_OK);
+    atomic_init(&st->running, false);
+
+    if (H_FAILED(ret = hantek_buffer_alloc(dev, nr_blocks * st->block_len, &st->ring_buf))) {
+        DEBUG("Failed to allocate stream ring of %zu blocks", nr_blocks);
+        goto done;
+    }
+
+    hantek_buffer_get_data(st->ring_buf, &st->ring, &data_len);
+
+    if (NULL == (st->blocks = hantek_calloc(nr_blocks, sizeof(*st->blocks))) ||
+            NULL == (st->discard = hantek_malloc(st->block_len)))
+    {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    if (0 > (st->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) ||
+            0 > (st->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)))
+    {
+        DEBUG("Failed to create stream eventfd: %s (%d)", strerror(errno), errno);
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    *pstream = st;
+
+done:
+    if (H_FAILED(ret) && NULL != st) {
+        hantek_stream_destroy(&st);
+    }
+    return ret;
+}
+
+HRESULT hantek_stream_destroy(struct hantek_stream **pstream)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_stream *st = NULL;
+
+    HASSERT_ARG(NULL != pstream);
+    HASSERT_ARG(NULL != *pstream);
+
+    st = *pstream;
+
+    hantek_stream_stop(st);
+
+    if (0 <= st->event_fd) {
+        close(st->event_fd);
+    }
+
+    if (0 <= st->wake_fd) {
+        close(st->wake_fd);
+    }
+
+    if (NULL != st->ring_buf) {
+        hantek_buffer_free(st->dev, &st->ring_buf);
+    }
+
+    hantek_free(st->discard);
+    hantek_free(st->blocks);
+    hantek_free(st);
+
+    *pstream = NULL;
+
+    return ret;
+}
+
+HRESULT hantek_stream_start(struct hantek_stream *stream)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != stream);
+
+    if (true == stream->started) {
+        ret = H_ERR_BUSY;
+        goto done;
+    }
+
+    atomic_store(&stream->stop, false);
+    atomic_store(&stream->result, H_OK);
+    atomic_store(&stream->running, true);
+
+    if (0 != pthread_create(&stream->thread, NULL, _hantek_stream_thread, stream)) {
+        DEBUG("Failed to create streaming thread");
+        atomic_store(&stream->running, false);
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    stream->started = true;
+
+done:
+    return ret;
+}
+
+HRESULT hantek_stream_stop(struct hantek_stream *stream)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != stream);
+
+    if (false == stream->started) {
+        goto done;
+    }
+
+    atomic_store(&stream->stop, true);
+    _hantek_stream_signal(stream->wake_fd);
+
+    pthread_join(stream->thread, NULL);
+    stream->started = false;
+
+    ret = atomic_load(&stream->result);
+
+done:
+    return ret;
+}
+
+HRESULT hantek_stream_get_fd(struct hantek_stream *stream, int *pfd)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != stream);
+    HASSERT_ARG(NULL != pfd);
+
+    *pfd = stream->event_fd;
+
+    return ret;
+}
+
+HRESULT hantek_stream_get_span(struct hantek_stream *stream, struct hantek_stream_span *pspan)
+{
+    HRESULT ret = H_OK;
+
+    uint64_t head = 0,
+             tail = 0;
+    size_t first = 0,
+           nr = 0;
+    struct hantek_stream_block *blk = NULL;
+
+    HASSERT_ARG(NULL != stream);
+    HASSERT_ARG(NULL != pspan);
+
+    _hantek_stream_drain(stream->event_fd);
+
+    tail = atomic_load_explicit(&stream->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&stream->head, memory_order_acquire);
+
+    if (head == tail) {
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    first = tail & (stream->nr_blocks - 1);
+    blk = &stream->blocks[first];
+
+    pspan->data = stream->ring + first * stream->block_len;
+    pspan->len = blk->len;
+    pspan->seq = blk->seq;
+    pspan->nr_dropped = blk->nr_dropped;
+    pspan->blocks = blk;
+
+    /* Extend the span while the next block follows on in memory, with no captures lost between */
+    for (nr = 1; tail + nr != head && first + nr < stream->nr_blocks; nr++) {
+        struct hantek_stream_block *next = &stream->blocks[first + nr];
+
+        if (blk->len != stream->block_len || 0 != next->nr_dropped) {
+            break;
+        }
+
+        pspan->len += next->len;
+        blk = next;
+    }
+
+    pspan->nr_blocks = nr;
+
+done:
+    return ret;
+}
+
+HRESULT hantek_stream_release(struct hantek_stream *stream, size_t nr_blocks)
+{
+    HRESULT ret = H_OK;
+
+    uint64_t head = 0,
+             tail = 0;
+
+    HASSERT_ARG(NULL != stream);
+
+    tail = atomic_load_explicit(&stream->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&stream->head, memory_order_acquire);
+
+    HASSERT_ARG(head - tail >= nr_blocks);
+
+    /* The consumer is done with the data, so the streaming thread may reuse the blocks */
+    atomic_store_explicit(&stream->tail, tail + nr_blocks, memory_order_release);
+
+    return ret;
+}
+
+HRESULT hantek_stream_get_stats(struct hantek_stream *stream, struct hantek_stream_stats *pstats)
+{
+    HRESULT ret = H_OK;
+
+    HASSERT_ARG(NULL != stream);
+    HASSERT_ARG(NULL != pstats);
+
+    pstats->nr_blocks = atomic_load(&stream->nr_published);
+    pstats->nr_dropped = atomic_load(&stream->nr_dropped);
+    pstats->nr_errors = atomic_load(&stream->nr_errors);
+    pstats->result = atomic_load(&stream->result);
+    pstats->running = atomic_load(&stream->running);
+
+    return ret;
+}
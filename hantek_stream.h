@@ -0,0 +1,147 @@
+#pragma once
+
+#include <hantek.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Continuous streaming. A dedicated thread arms the scope, reads back each capture into the
+ * next free block of a ring, and rearms right away, while the caller consumes completed blocks
+ * at its own pace. Each block holds one raw capture, as delivered by hantek_acquire_start.
+ *
+ * The stream is not gapless: the scope is only rearmed once a capture has been read back, so
+ * nothing is sampled between one block and the next. seq and nr_dropped count whole captures
+ * that were lost, not this dead time. Each block records when it was armed, seen ready and
+ * read back, so callers can measure the gaps.
+ *
+ * The ring has a single producer (the streaming thread) and a single consumer, and neither side
+ * ever takes a lock. If the consumer falls behind and the ring is full, the streaming thread keeps
+ * acquiring but throws the captures away, and the next block the consumer sees reports how many
+ * were lost before it.
+ *
+ * While a stream is running, the streaming thread owns the device: nothing else may use it until
+ * hantek_stream_stop returns.
+ */
+
+struct hantek_stream;
+
+/**
+ * A single capture in the ring
+ */
+struct hantek_stream_block {
+    /**
+     * Bytes of capture data in the block
+     */
+    size_t len;
+
+    /**
+     * Sequence number, counting lost captures too, and the number of captures lost immediately
+     * before this one
+     */
+    uint64_t seq;
+    uint64_t nr_dropped;
+
+    /**
+     * When the capture was armed, when it was seen to complete, and when it had been read back,
+     * in CLOCK_MONOTONIC nanoseconds. The next block's armed_ns less this one's done_ns is time
+     * the scope was not capturing.
+     */
+    uint64_t armed_ns;
+    uint64_t ready_ns;
+    uint64_t done_ns;
+};
+
+/**
+ * A run of completed blocks, back to back in memory with no captures lost between them. They
+ * are still separate captures, with dead time between each.
+ */
+struct hantek_stream_span {
+    /**
+     * The raw capture data, and its length in bytes
+     */
+    const uint8_t *data;
+    size_t len;
+
+    /**
+     * Number of blocks in the span, and each block's metadata
+     */
+    size_t nr_blocks;
+    const struct hantek_stream_block *blocks;
+
+    /**
+     * Sequence number of the first block. Every capture the streaming thread attempts gets the
+     * next sequence number, including those that were lost.
+     */
+    uint64_t seq;
+
+    /**
+     * Number of captures lost immediately before this span, because the ring was full or the
+     * capture failed
+     */
+    uint64_t nr_dropped;
+};
+
+struct hantek_stream_stats {
+    /**
+     * Captures delivered into the ring, and captures lost
+     */
+    uint64_t nr_blocks;
+    uint64_t nr_dropped;
+
+    /**
+     * Failed captures, and the result the streaming thread stopped with, if it has
+     */
+    uint64_t nr_errors;
+    HRESULT result;
+
+    /**
+     * Whether the streaming thread is still running
+     */
+    bool running;
+};
+
+/**
+ * Create a stream on the given device, with a ring of nr_blocks blocks (a power of two) of one
+ * capture buffer each. The ADC routing and trigger should be configured beforehand.
+ */
+HRESULT hantek_stream_create(struct hantek_device *dev, enum hantek_capture_mode mode, size_t nr_blocks, struct hantek_stream **pstream);
+
+/**
+ * Destroy a stream, stopping it first if need be
+ */
+HRESULT hantek_stream_destroy(struct hantek_stream **pstream);
+
+/**
+ * Start the streaming thread
+ */
+HRESULT hantek_stream_start(struct hantek_stream *stream);
+
+/**
+ * Stop the streaming thread, cancelling the acquisition in progress. Blocks already in the
+ * ring stay there for the consumer.
+ */
+HRESULT hantek_stream_stop(struct hantek_stream *stream);
+
+/**
+ * Get a file descriptor that becomes readable (POLLIN) when new blocks are ready, or the
+ * streaming thread stops
+ */
+HRESULT hantek_stream_get_fd(struct hantek_stream *stream, int *pfd);
+
+/**
+ * Get the oldest run of completed blocks, without waiting. Returns H_ERR_NOT_READY if there
+ * are none. The span stays valid until it is released.
+ */
+HRESULT hantek_stream_get_span(struct hantek_stream *stream, struct hantek_stream_span *pspan);
+
+/**
+ * Hand the first nr_blocks blocks of the last span back to the streaming thread
+ */
+HRESULT hantek_stream_release(struct hantek_stream *stream, size_t nr_blocks);
+
+/**
+ * Get the stream's statistics. Safe to call while the stream is running.
+ */
+HRESULT hantek_stream_get_stats(struct hantek_stream *stream, struct hantek_stream_stats *pstats);
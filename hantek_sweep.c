@@ -0,0 +1,161 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+#include <hantek_batch.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HT_SWEEP_DEFAULT_TIMEOUT_MS         1000
+
+/**
+ * Send every step of the sweep in one batch, each held for dwell_us by the batch itself
+ */
+static
+HRESULT _hantek_sweep_stream(struct hantek_device *dev, const struct hantek_sweep_config *cfg, const uint16_t *offsets)
+{
+    HRESULT ret = H_OK;
+
+    hantek_cmd_batch_begin(dev);
+
+    for (size_t i = 0; i < cfg->nr_levels; i++) {
+        unsigned dwell_us = i + 1 == cfg->nr_levels ? 0 : cfg->dwell_us;
+
+        if (H_FAILED(ret = hantek_position_send(dev, cfg->channel, offsets[i], dwell_us))) {
+            goto done;
+        }
+    }
+
+    /* The last level is left to settle for whatever captures next */
+    hantek_settle_mark(dev, HT_SETTLE_POSITION);
+
+done:
+    return hantek_batch_end(dev, ret);
+}
+
+/**
+ * Move, settle and arm in one batch per step, then read back the capture and hand it over
+ */
+static
+HRESULT _hantek_sweep_capture(struct hantek_device *dev, const struct hantek_sweep_config *cfg, const uint16_t *offsets,
+        hantek_sweep_cb_t cb, void *priv)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_sweep_step step;
+    uint8_t *data = NULL,
+            *bufs[HT_MAX_CHANNELS] = { NULL };
+    size_t chan_len = 0;
+    unsigned settle_us = 0 != cfg->dwell_us ? cfg->dwell_us : dev->settle.settle_us[HT_SETTLE_POSITION],
+             timeout_ms = 0 != cfg->timeout_ms ? cfg->timeout_ms : HT_SWEEP_DEFAULT_TIMEOUT_MS;
+
+    if (H_FAILED(ret = hantek_get_channel_buffer_len(dev, &chan_len))) {
+        DEBUG("ADC routing must be configured before capturing a sweep");
+        goto done;
+    }
+
+    if (NULL == (data = hantek_malloc(HT_MAX_CHANNELS * chan_len))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    memset(&step, 0, sizeof(step));
+
+    for (size_t i = 0; i < HT_MAX_CHANNELS; i++) {
+        if (true == dev->channels[i].enabled) {
+            bufs[i] = data + i * chan_len;
+            step.samples[i] = bufs[i];
+        }
+    }
+
+    step.nr_samples = chan_len;
+
+    for (size_t i = 0; i < cfg->nr_levels; i++) {
+        hantek_cmd_batch_begin(dev);
+
+        /* The batch holds off the arm until the new position has settled */
+        if (H_FAILED(ret = hantek_position_send(dev, cfg->channel, offsets[i], settle_us))) {
+            ret = hantek_batch_end(dev, ret);
+            goto done;
+        }
+
+        ret = hantek_start_capture(dev, cfg->mode);
+
+        if (H_FAILED(ret = hantek_batch_end(dev, ret))) {
+            goto done;
+        }
+
+        if (H_FAILED(ret = hantek_wait_ready(dev, timeout_ms, NULL))) {
+            DEBUG("Capture at sweep step %zu never completed, aborting.", i);
+            goto done;
+        }
+
+        if (H_FAILED(ret = hantek_retrieve_buffer(dev, bufs[0], bufs[1], bufs[2], bufs[3]))) {
+            goto done;
+        }
+
+        step.index = i;
+        step.level = cfg->levels[i];
+        step.offset = offsets[i];
+
+        cb(dev, &step, priv);
+    }
+
+done:
+    hantek_free(data);
+    return ret;
+}
+
+HRESULT hantek_position_sweep(struct hantek_device *dev, const struct hantek_sweep_config *cfg, hantek_sweep_cb_t cb, void *priv)
+{
+    HRESULT ret = H_OK;
+
+    uint16_t *offsets = NULL;
+
+    HASSERT_ARG(NULL != dev);
+    HASSERT_ARG(NULL != cfg);
+    HASSERT_ARG(NULL != cfg->levels);
+    HASSERT_ARG(0 != cfg->nr_levels);
+    HASSERT_ARG(HT_MAX_CHANNELS > cfg->channel);
+    HASSERT_ARG(0 == (cfg->flags & HT_SWEEP_CAPTURE) || NULL != cb);
+
+    if (HT_ACQ_IDLE != dev->acq.state) {
+        ret = H_ERR_BUSY;
+        goto done;
+    }
+
+    if (false == dev->channels[cfg->channel].enabled) {
+        DEBUG("Channel %u is not enabled, aborting.", cfg->channel);
+        ret = H_ERR_INVAL_CHANNELS;
+        goto done;
+    }
+
+    if (NULL == (offsets = hantek_malloc(cfg->nr_levels * sizeof(uint16_t)))) {
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    /* Look everything up first, so a bad level doesn't leave the sweep half done */
+    for (size_t i = 0; i < cfg->nr_levels; i++) {
+        if (H_FAILED(ret = hantek_position_lookup(dev, cfg->channel, cfg->levels[i], &offsets[i]))) {
+            goto done;
+        }
+    }
+
+    if (0 != (cfg->flags & HT_SWEEP_CAPTURE)) {
+        ret = _hantek_sweep_capture(dev, cfg, offsets, cb, priv);
+    } else {
+        ret = _hantek_sweep_stream(dev, cfg, offsets);
+    }
+
+    if (H_FAILED(ret)) {
+        goto done;
+    }
+
+    dev->channels[cfg->channel].level = cfg->levels[cfg->nr_levels - 1];
+
+done:
+    hantek_free(offsets);
+    return ret;
+}
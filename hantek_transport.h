@@ -0,0 +1,235 @@
+#pragma once
+
+#include <hantek.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Transport abstraction. Everything the library says to a scope goes through one of these, be
+ * it a real device over libusb, or a simulated one.
+ */
+
+struct hantek_transport;
+struct hantek_xfer;
+
+enum hantek_xfer_status {
+    HT_XFER_COMPLETED = 0,
+    HT_XFER_ERROR = 1,
+    HT_XFER_TIMED_OUT = 2,
+    HT_XFER_CANCELLED = 3,
+};
+
+typedef void (*hantek_xfer_cb_t)(struct hantek_xfer *xfer);
+
+/**
+ * An asynchronous bulk transfer
+ */
+struct hantek_xfer {
+    /**
+     * Endpoint, including the direction bit
+     */
+    uint8_t endpoint;
+
+    /**
+     * Data buffer and its length, in bytes
+     */
+    uint8_t *buf;
+    size_t len;
+
+    /**
+     * Number of bytes actually transferred, valid on completion
+     */
+    size_t actual;
+
+    /**
+     * Timeout, in milliseconds. 0 waits forever.
+     */
+    unsigned timeout_ms;
+
+    /**
+     * Completion status, valid on completion
+     */
+    enum hantek_xfer_status status;
+
+    /**
+     * Completion callback, invoked from hantek_transport_ops.handle_events
+     */
+    hantek_xfer_cb_t cb;
+
+    /**
+     * Private to the submitter
+     */
+    void *priv;
+
+    /**
+     * Private to the transport
+     */
+    void *tp_priv;
+};
+
+struct hantek_transport_ops {
+    /**
+     * Vendor control transfer, device-to-host
+     */
+    HRESULT (*control_in)(struct hantek_transport *tp, uint8_t request, uint16_t value, uint16_t index, uint8_t *buf, size_t len, size_t *ptransferred);
+
+    /**
+     * Vendor control transfer, host-to-device
+     */
+    HRESULT (*control_out)(struct hantek_transport *tp, uint8_t request, uint16_t value, uint16_t index, const uint8_t *buf, size_t len);
+
+    /**
+     * Synchronous bulk transfers
+     */
+    HRESULT (*bulk_in)(struct hantek_transport *tp, uint8_t endpoint, uint8_t *buf, size_t len, size_t *ptransferred, unsigned timeout_ms);
+    HRESULT (*bulk_out)(struct hantek_transport *tp, uint8_t endpoint, const uint8_t *buf, size_t len, size_t *ptransferred, unsigned timeout_ms);
+
+    /**
+     * Set up and tear down transport resources for an asynchronous transfer
+     */
+    HRESULT (*xfer_init)(struct hantek_transport *tp, struct hantek_xfer *xfer);
+    void (*xfer_release)(struct hantek_transport *tp, struct hantek_xfer *xfer);
+
+    /**
+     * Submit or cancel an asynchronous transfer. Transfers on the same endpoint complete in
+     * the order they were submitted.
+     */
+    HRESULT (*submit)(struct hantek_transport *tp, struct hantek_xfer *xfer);
+    HRESULT (*cancel)(struct hantek_transport *tp, struct hantek_xfer *xfer);
+
+    /**
+     * Run completion callbacks for finished transfers, waiting up to timeout_ms for one
+     */
+    HRESULT (*handle_events)(struct hantek_transport *tp, unsigned timeout_ms);
+
+    /**
+     * Get the file descriptors to poll for readiness before calling handle_events. Up to max_fds
+     * are filled in, the number the transport has is returned in pnr_fds.
+     */
+    HRESULT (*get_pollfds)(struct hantek_transport *tp, struct hantek_pollfd *fds, size_t max_fds, size_t *pnr_fds);
+
+    /**
+     * Get how long, in milliseconds, until handle_events must be called even if none of the
+     * file descriptors became ready. -1 if there is no such deadline.
+     */
+    HRESULT (*get_timeout)(struct hantek_transport *tp, int *ptimeout_ms);
+
+    /**
+     * Optional. Allocate and free memory that bulk transfers can use without the kernel copying
+     * it, e.g. memory mapped from the USB host controller.
+     */
+    HRESULT (*dev_mem_alloc)(struct hantek_transport *tp, size_t len, uint8_t **pbuf);
+    void (*dev_mem_free)(struct hantek_transport *tp, uint8_t *buf, size_t len);
+
+    /**
+     * Optional. Describe where the device is attached, as a string that changes whenever the
+     * device is reattached, e.g. its USB bus and address.
+     */
+    HRESULT (*get_location)(struct hantek_transport *tp, char *buf, size_t len);
+
+    /**
+     * Tear the transport down
+     */
+    void (*close)(struct hantek_transport *tp);
+};
+
+struct hantek_transport {
+    const struct hantek_transport_ops *ops;
+};
+
+/**
+ * Convenience wrappers around the transport operations
+ */
+static inline
+HRESULT hantek_tp_control_in(struct hantek_transport *tp, uint8_t request, uint16_t value, uint16_t index, uint8_t *buf, size_t len, size_t *ptransferred)
+{
+    return tp->ops->control_in(tp, request, value, index, buf, len, ptransferred);
+}
+
+static inline
+HRESULT hantek_tp_control_out(struct hantek_transport *tp, uint8_t request, uint16_t value, uint16_t index, const uint8_t *buf, size_t len)
+{
+    return tp->ops->control_out(tp, request, value, index, buf, len);
+}
+
+static inline
+HRESULT hantek_tp_bulk_in(struct hantek_transport *tp, uint8_t endpoint, uint8_t *buf, size_t len, size_t *ptransferred, unsigned timeout_ms)
+{
+    return tp->ops->bulk_in(tp, endpoint, buf, len, ptransferred, timeout_ms);
+}
+
+static inline
+HRESULT hantek_tp_bulk_out(struct hantek_transport *tp, uint8_t endpoint, const uint8_t *buf, size_t len, size_t *ptransferred, unsigned timeout_ms)
+{
+    return tp->ops->bulk_out(tp, endpoint, buf, len, ptransferred, timeout_ms);
+}
+
+static inline
+HRESULT hantek_tp_xfer_init(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    return tp->ops->xfer_init(tp, xfer);
+}
+
+static inline
+void hantek_tp_xfer_release(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    tp->ops->xfer_release(tp, xfer);
+}
+
+static inline
+HRESULT hantek_tp_submit(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    return tp->ops->submit(tp, xfer);
+}
+
+static inline
+HRESULT hantek_tp_cancel(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    return tp->ops->cancel(tp, xfer);
+}
+
+static inline
+HRESULT hantek_tp_handle_events(struct hantek_transport *tp, unsigned timeout_ms)
+{
+    return tp->ops->handle_events(tp, timeout_ms);
+}
+
+static inline
+HRESULT hantek_tp_get_pollfds(struct hantek_transport *tp, struct hantek_pollfd *fds, size_t max_fds, size_t *pnr_fds)
+{
+    return tp->ops->get_pollfds(tp, fds, max_fds, pnr_fds);
+}
+
+static inline
+HRESULT hantek_tp_get_timeout(struct hantek_transport *tp, int *ptimeout_ms)
+{
+    return tp->ops->get_timeout(tp, ptimeout_ms);
+}
+
+static inline
+HRESULT hantek_tp_dev_mem_alloc(struct hantek_transport *tp, size_t len, uint8_t **pbuf)
+{
+    if (NULL == tp->ops->dev_mem_alloc) {
+        return H_ERR_NO_MEM;
+    }
+
+    return tp->ops->dev_mem_alloc(tp, len, pbuf);
+}
+
+static inline
+void hantek_tp_dev_mem_free(struct hantek_transport *tp, uint8_t *buf, size_t len)
+{
+    tp->ops->dev_mem_free(tp, buf, len);
+}
+
+static inline
+HRESULT hantek_tp_get_location(struct hantek_transport *tp, char *buf, size_t len)
+{
+    if (NULL == tp->ops->get_location) {
+        return H_ERR_NOT_FOUND;
+    }
+
+    return tp->ops->get_location(tp, buf, len);
+}
@@ -0,0 +1,509 @@
+#include <hantek.h>
+#include <hantek_priv.h>
+#include <hantek_alloc.h>
+#include <hantek_usb.h>
+#include <hantek_transport.h>
+#include <hantek_transport_usb.h>
+
+#include <libusb.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+/**
+ * libusb-backed transport, for real hardware
+ */
+struct hantek_usb_transport {
+    struct hantek_transport tp;
+
+    struct libusb_context *ctx;
+    struct libusb_device *dev;
+    struct libusb_device_handle *hdl;
+
+    /**
+     * Whether we claimed interface 0, and whether the context is ours to tear down
+     */
+    bool claimed;
+    bool own_ctx;
+};
+
+#define HT_USB_TRANSPORT(_tp)       ((struct hantek_usb_transport *)(_tp))
+
+static
+HRESULT _hantek_device_find(libusb_context *ctx, libusb_device **pdev)
+{
+    HRESULT ret = H_OK;
+
+    libusb_device **devs = NULL;
+    libusb_device *dev = NULL;
+    ssize_t nr_devs = 0;
+
+    HASSERT_ARG(NULL != pdev);
+
+    *pdev = NULL;
+
+    if (0 >= (nr_devs = libusb_get_device_list(ctx, &devs))) {
+        DEBUG("Failed to get libusb device list, aborting (reason: %zd).", nr_devs);
+        ret = H_ERR_NOT_FOUND;
+        goto done;
+    }
+
+    DEBUG("There are %zd devices connected to the system, walking the list.", nr_devs);
+
+    for (size_t i = 0; i < (size_t)nr_devs; i++) {
+        libusb_device *ndev = devs[i];
+        struct libusb_device_descriptor desc;
+
+        if (0 != libusb_get_device_descriptor(ndev, &desc)) {
+            DEBUG("Failed to get device descriptor at device ID %zu, skipping", i);
+            continue;
+        }
+
+        if (desc.idVendor != HANTEK_VID) {
+            continue;
+        }
+
+        if (desc.idProduct != HANTEK_PID_6254BD) {
+            DEBUG("Got a Hantek device, PID = %04x", desc.idProduct);
+            continue;
+        }
+
+        DEBUG("Found a candidate device, %p, breaking the loop", ndev);
+        dev = ndev;
+        break;
+    }
+
+    if (NULL == dev) {
+        DEBUG("No supported devices found, aborting.");
+        ret = H_ERR_NOT_FOUND;
+        goto done;
+    }
+
+    libusb_ref_device(dev);
+    *pdev = dev;
+
+done:
+    if (NULL != devs) {
+        libusb_free_device_list(devs, 1);
+    }
+    return ret;
+}
+
+static
+HRESULT _hantek_usb_control_in(struct hantek_transport *tp, uint8_t request, uint16_t value, uint16_t index, uint8_t *buf, size_t len, size_t *ptransferred)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_usb_transport *utp = HT_USB_TRANSPORT(tp);
+    int uret = 0;
+
+    *ptransferred = 0;
+
+    if (0 >= (uret = libusb_control_transfer(utp->hdl,
+                    LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+                    request,
+                    value,
+                    index,
+                    buf,
+                    len,
+                    0)))
+    {
+        DEBUG("Control IN transfer %02x (value = %04x) failed, reason = %d", request, value, uret);
+        ret = H_ERR_CONTROL_FAIL;
+        goto done;
+    }
+
+    *ptransferred = uret;
+
+done:
+    return ret;
+}
+
+static
+HRESULT _hantek_usb_control_out(struct hantek_transport *tp, uint8_t request, uint16_t value, uint16_t index, const uint8_t *buf, size_t len)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_usb_transport *utp = HT_USB_TRANSPORT(tp);
+    int uret = 0;
+
+    if (0 >= (uret = libusb_control_transfer(utp->hdl,
+                    LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+                    request,
+                    value,
+                    index,
+                    (uint8_t *)buf,
+                    len,
+                    0)))
+    {
+        DEBUG("Control OUT transfer %02x (value = %04x) failed, reason = %d", request, value, uret);
+        ret = H_ERR_CONTROL_FAIL;
+        goto done;
+    }
+
+done:
+    return ret;
+}
+
+static
+HRESULT _hantek_usb_bulk(struct hantek_transport *tp, uint8_t endpoint, uint8_t *buf, size_t len, size_t *ptransferred, unsigned timeout_ms)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_usb_transport *utp = HT_USB_TRANSPORT(tp);
+    int uret = 0,
+        transferred = 0;
+
+    *ptransferred = 0;
+
+    if (0 != (uret = libusb_bulk_transfer(utp->hdl,
+                                          endpoint,
+                                          buf,
+                                          len,
+                                          &transferred,
+                                          timeout_ms)))
+    {
+        DEBUG("Failure during bulk transfer on endpoint %02x: %d", endpoint, uret);
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    *ptransferred = transferred;
+
+done:
+    return ret;
+}
+
+static
+HRESULT _hantek_usb_bulk_in(struct hantek_transport *tp, uint8_t endpoint, uint8_t *buf, size_t len, size_t *ptransferred, unsigned timeout_ms)
+{
+    return _hantek_usb_bulk(tp, endpoint | LIBUSB_ENDPOINT_IN, buf, len, ptransferred, timeout_ms);
+}
+
+static
+HRESULT _hantek_usb_bulk_out(struct hantek_transport *tp, uint8_t endpoint, const uint8_t *buf, size_t len, size_t *ptransferred, unsigned timeout_ms)
+{
+    return _hantek_usb_bulk(tp, endpoint & ~LIBUSB_ENDPOINT_IN, (uint8_t *)buf, len, ptransferred, timeout_ms);
+}
+
+static
+void LIBUSB_CALL _hantek_usb_xfer_cb(struct libusb_transfer *uxfer)
+{
+    struct hantek_xfer *xfer = uxfer->user_data;
+
+    xfer->actual = uxfer->actual_length;
+
+    switch (uxfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        xfer->status = HT_XFER_COMPLETED;
+        break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        xfer->status = HT_XFER_TIMED_OUT;
+        break;
+    case LIBUSB_TRANSFER_CANCELLED:
+        xfer->status = HT_XFER_CANCELLED;
+        break;
+    default:
+        DEBUG("Transfer on endpoint %02x failed, libusb status = %d", uxfer->endpoint, uxfer->status);
+        xfer->status = HT_XFER_ERROR;
+        break;
+    }
+
+    xfer->cb(xfer);
+}
+
+static
+HRESULT _hantek_usb_xfer_init(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    HRESULT ret = H_OK;
+
+    (void)tp;
+
+    if (NULL == (xfer->tp_priv = libusb_alloc_transfer(0))) {
+        DEBUG("Failed to allocate libusb transfer, aborting.");
+        ret = H_ERR_NO_MEM;
+    }
+
+    return ret;
+}
+
+static
+void _hantek_usb_xfer_release(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    (void)tp;
+
+    if (NULL != xfer->tp_priv) {
+        libusb_free_transfer(xfer->tp_priv);
+        xfer->tp_priv = NULL;
+    }
+}
+
+static
+HRESULT _hantek_usb_submit(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_usb_transport *utp = HT_USB_TRANSPORT(tp);
+    struct libusb_transfer *uxfer = xfer->tp_priv;
+    int uret = 0;
+
+    libusb_fill_bulk_transfer(uxfer, utp->hdl, xfer->endpoint, xfer->buf, xfer->len,
+            _hantek_usb_xfer_cb, xfer, xfer->timeout_ms);
+
+    xfer->actual = 0;
+
+    if (0 != (uret = libusb_submit_transfer(uxfer))) {
+        DEBUG("Failed to submit transfer on endpoint %02x (reason: %d)", xfer->endpoint, uret);
+        ret = H_ERR_NOT_READY;
+    }
+
+    return ret;
+}
+
+static
+HRESULT _hantek_usb_cancel(struct hantek_transport *tp, struct hantek_xfer *xfer)
+{
+    (void)tp;
+
+    /* Transfers that already completed just return NOT_FOUND, which is fine */
+    libusb_cancel_transfer(xfer->tp_priv);
+
+    return H_OK;
+}
+
+static
+HRESULT _hantek_usb_handle_events(struct hantek_transport *tp, unsigned timeout_ms)
+{
+    HRESULT ret = H_OK;
+
+    struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+    int uret = 0;
+
+    if (0 != (uret = libusb_handle_events_timeout(HT_USB_TRANSPORT(tp)->ctx, &tv)) && LIBUSB_ERROR_INTERRUPTED != uret) {
+        DEBUG("Failure while handling USB events (reason: %d)", uret);
+        ret = H_ERR_NOT_READY;
+    }
+
+    return ret;
+}
+
+static
+HRESULT _hantek_usb_get_pollfds(struct hantek_transport *tp, struct hantek_pollfd *fds, size_t max_fds, size_t *pnr_fds)
+{
+    HRESULT ret = H_OK;
+
+    const struct libusb_pollfd **ufds = NULL;
+    size_t nr_fds = 0;
+
+    if (NULL == (ufds = libusb_get_pollfds(HT_USB_TRANSPORT(tp)->ctx))) {
+        DEBUG("Failed to get libusb pollfds, aborting.");
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    for (nr_fds = 0; NULL != ufds[nr_fds]; nr_fds++) {
+        if (nr_fds < max_fds) {
+            fds[nr_fds].fd = ufds[nr_fds]->fd;
+            fds[nr_fds].events = ufds[nr_fds]->events;
+        }
+    }
+
+    *pnr_fds = nr_fds;
+
+done:
+    if (NULL != ufds) {
+        libusb_free_pollfds(ufds);
+    }
+    return ret;
+}
+
+static
+HRESULT _hantek_usb_get_timeout(struct hantek_transport *tp, int *ptimeout_ms)
+{
+    HRESULT ret = H_OK;
+
+    struct timeval tv = { 0 };
+    int uret = 0;
+
+    *ptimeout_ms = -1;
+
+    if (0 > (uret = libusb_get_next_timeout(HT_USB_TRANSPORT(tp)->ctx, &tv))) {
+        DEBUG("Failed to get next libusb timeout (reason: %d)", uret);
+        ret = H_ERR_NOT_READY;
+        goto done;
+    }
+
+    if (1 == uret) {
+        /* Round up, so we don't wake up just before the deadline */
+        *ptimeout_ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+    }
+
+done:
+    return ret;
+}
+
+static
+HRESULT _hantek_usb_dev_mem_alloc(struct hantek_transport *tp, size_t len, uint8_t **pbuf)
+{
+    HRESULT ret = H_OK;
+
+    /* Not all kernels and platforms support this, the caller falls back to normal memory */
+    if (NULL == (*pbuf = libusb_dev_mem_alloc(HT_USB_TRANSPORT(tp)->hdl, len))) {
+        DEBUG("Could not allocate %zu bytes of device memory", len);
+        ret = H_ERR_NO_MEM;
+    }
+
+    return ret;
+}
+
+static
+void _hantek_usb_dev_mem_free(struct hantek_transport *tp, uint8_t *buf, size_t len)
+{
+    libusb_dev_mem_free(HT_USB_TRANSPORT(tp)->hdl, buf, len);
+}
+
+static
+HRESULT _hantek_usb_get_location(struct hantek_transport *tp, char *buf, size_t len)
+{
+    struct hantek_usb_transport *utp = HT_USB_TRANSPORT(tp);
+
+    /* The address changes every time the device enumerates */
+    snprintf(buf, len, "usb-%u-%u", (unsigned)libusb_get_bus_number(utp->dev), (unsigned)libusb_get_device_address(utp->dev));
+
+    return H_OK;
+}
+
+static
+void _hantek_usb_close(struct hantek_transport *tp)
+{
+    struct hantek_usb_transport *utp = HT_USB_TRANSPORT(tp);
+
+    if (NULL != utp->hdl) {
+        if (true == utp->claimed) {
+            libusb_release_interface(utp->hdl, 0);
+        }
+        libusb_close(utp->hdl);
+        utp->hdl = NULL;
+    }
+
+    if (NULL != utp->dev) {
+        libusb_unref_device(utp->dev);
+        utp->dev = NULL;
+    }
+
+    if (true == utp->own_ctx) {
+        libusb_exit(utp->ctx);
+    }
+
+    hantek_free(utp);
+}
+
+static const
+struct hantek_transport_ops _hantek_usb_transport_ops = {
+    .control_in = _hantek_usb_control_in,
+    .control_out = _hantek_usb_control_out,
+    .bulk_in = _hantek_usb_bulk_in,
+    .bulk_out = _hantek_usb_bulk_out,
+    .xfer_init = _hantek_usb_xfer_init,
+    .xfer_release = _hantek_usb_xfer_release,
+    .submit = _hantek_usb_submit,
+    .cancel = _hantek_usb_cancel,
+    .handle_events = _hantek_usb_handle_events,
+    .get_pollfds = _hantek_usb_get_pollfds,
+    .get_timeout = _hantek_usb_get_timeout,
+    .dev_mem_alloc = _hantek_usb_dev_mem_alloc,
+    .dev_mem_free = _hantek_usb_dev_mem_free,
+    .get_location = _hantek_usb_get_location,
+    .close = _hantek_usb_close,
+};
+
+HRESULT hantek_usb_transport_create(struct hantek_transport **ptp, struct libusb_context *ctx, struct libusb_device *udev, bool claim)
+{
+    HRESULT ret = H_OK;
+
+    struct hantek_usb_transport *utp = NULL;
+    int uret = -1;
+
+    HASSERT_ARG(NULL != ptp);
+    HASSERT_ARG(NULL != udev);
+
+    *ptp = NULL;
+
+    if (NULL == (utp = hantek_calloc(1, sizeof(*utp)))) {
+        DEBUG("Out of memory");
+        ret = H_ERR_NO_MEM;
+        goto done;
+    }
+
+    utp->tp.ops = &_hantek_usb_transport_ops;
+    utp->ctx = ctx;
+    utp->dev = libusb_ref_device(udev);
+
+    if (0 != (uret = libusb_open(utp->dev, &utp->hdl))) {
+        DEBUG("Failed to open USB device, aborting. Uret = %u)", (unsigned)uret);
+        ret = H_ERR_CANT_OPEN;
+        goto done;
+    }
+
+    /* Claim interface 0 */
+    if (true == claim) {
+        if (0 != (uret = libusb_claim_interface(utp->hdl, 0))) {
+            DEBUG("Failed to claim interface 0, aborting. uret = %u", (unsigned)uret);
+            ret = H_ERR_CANT_OPEN;
+            goto done;
+        }
+
+        utp->claimed = true;
+    }
+
+    *ptp = &utp->tp;
+
+done:
+    if (H_FAILED(ret) && NULL != utp) {
+        _hantek_usb_close(&utp->tp);
+    }
+    return ret;
+}
+
+HRESULT hantek_usb_transport_open(struct hantek_transport **ptp)
+{
+    HRESULT ret = H_OK;
+
+    libusb_context *ctx = NULL;
+    libusb_device *udev = NULL;
+    int uret = -1;
+
+    HASSERT_ARG(NULL != ptp);
+
+    *ptp = NULL;
+
+    /* A context of our own, torn down with the transport */
+    if (0 != (uret = libusb_init(&ctx))) {
+        DEBUG("Failed to initialize libusb, aborting (reason: %d).", uret);
+        ret = H_ERR_CANT_OPEN;
+        goto done;
+    }
+
+    if (H_FAILED(ret = _hantek_device_find(ctx, &udev))) {
+        DEBUG("Failed to find device, aborting.");
+        goto done;
+    }
+
+    if (H_FAILED(ret = hantek_usb_transport_create(ptp, ctx, udev, true))) {
+        goto done;
+    }
+
+    HT_USB_TRANSPORT(*ptp)->own_ctx = true;
+
+done:
+    if (NULL != udev) {
+        libusb_unref_device(udev);
+    }
+
+    if (H_FAILED(ret) && NULL != ctx) {
+        libusb_exit(ctx);
+    }
+    return ret;
+}
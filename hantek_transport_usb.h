@@ -0,0 +1,16 @@
+#pragma once
+
+#include <hantek.h>
+
+#include <stdbool.h>
+
+struct hantek_transport;
+struct libusb_context;
+struct libusb_device;
+
+/**
+ * Create a transport for the given USB device, using the given libusb context for event
+ * handling. The context must outlive the transport. Interface 0 is only claimed if claim is
+ * true; without it only control transfers are possible.
+ */
+HRESULT hantek_usb_transport_create(struct hantek_transport **ptp, struct libusb_context *ctx, struct libusb_device *udev, bool claim);
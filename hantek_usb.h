@@ -27,6 +27,11 @@
 #define HT_MAX_INFO_STRING_LEN              0x47
 #define HT_CALIBRATION_INFO_ENTRIES         (((12 * 12) * 4) + 1)
 
+/**
+ * Most bytes of a device attribute read in one control transfer, the FX2's endpoint 0 size
+ */
+#define HT_CONFIG_ATTR_CHUNK_LEN            64
+
 /**
  * Magic flag used to indicate calibration data is valid
  */